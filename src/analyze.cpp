@@ -0,0 +1,352 @@
+// Offline quality report for the geometry of geometry.cpp. Every mesh is run through the same stages as LoadMesh, once
+// per vertex order and meshlet limits, and each combination becomes a row in the tables below.
+//
+// Usage: analyze [-m VxT]... file.obj ...
+//   -m 64x124    Meshlet max vertices x max triangles, can be repeated. Defaults to the limits of the mesh shader.
+
+#include "common.h"
+
+#include "geometry.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <meshoptimizer.h>
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/geometric.hpp>
+#pragma warning(pop)
+
+enum VertexOrder
+{
+	kOrderShuffled,     // kSimulateShittyOrdering in LoadMesh.
+	kOrderFile,         // Indexed, but in the order of the file.
+	kOrderVertexCache,  // kOptimizeVertexCache without the fetch optimization.
+	kOrderOptimized,    // What LoadMesh does.
+	kVertexOrderCount,
+};
+
+const char* kVertexOrderNames[kVertexOrderCount] = { "shuffled", "file", "vcache", "vcache+fetch" };
+
+const uint32_t kShuffleSeed = 1;
+const unsigned int kVertexCacheSize = 16;  // FIFO, without warp or primitive group limits.
+const uint32_t kViewCount = 256;           // Camera positions for the cone culling rate.
+const float kViewDistance = 3.0f;          // From the mesh center, in mesh radii.
+const uint32_t kHistogramBuckets = 8;
+
+struct MeshletLimits
+{
+	size_t max_vertices;
+	size_t max_triangles;
+};
+
+struct Analysis
+{
+	const char* name;
+	VertexOrder order;
+	MeshletLimits limits;
+
+	meshopt_VertexCacheStatistics vertex_cache;
+	meshopt_VertexFetchStatistics vertex_fetch;
+	meshopt_VertexFetchStatistics position_fetch;  // Of the position stream of the split layout, see SplitVertices.
+	meshopt_OverdrawStatistics overdraw;
+
+	uint32_t meshlet_count;  // Without the padding BuildMeshlets adds.
+	uint64_t meshlet_vertices;
+	uint64_t meshlet_triangles;
+	// Meshlets per eighth of the limit, and per eighth of [-1, 1] for the cutoff.
+	uint32_t vertex_histogram[kHistogramBuckets];
+	uint32_t triangle_histogram[kHistogramBuckets];
+	uint32_t cutoff_histogram[kHistogramBuckets];
+
+	// Of all meshlets and triangles over all views.
+	double culled_meshlets;
+	double culled_triangles;
+};
+
+// ConeCull3 of meshlet.task.glsl, on the same quantized cone.
+static bool ConeCull(const Meshlet& meshlet, glm::vec3 camera_position)
+{
+	const glm::vec3 cone_axis = glm::vec3(meshlet.cone_axis[0], meshlet.cone_axis[1], meshlet.cone_axis[2]) / 127.0f;
+	const float cone_cutoff = meshlet.cone_cutoff / 127.0f;
+	const glm::vec3 view = meshlet.center - camera_position;
+	return glm::dot(view, cone_axis) >=
+			cone_cutoff * glm::length(view) + sqrtf(1.0f - cone_cutoff * cone_cutoff) * meshlet.radius;
+}
+
+// Evenly spread over a sphere around the mesh, the same for every run.
+static std::vector<glm::vec3> GetViews(const Mesh& mesh)
+{
+	glm::vec3 min_position = glm::vec3(mesh.vertices[0].vx, mesh.vertices[0].vy, mesh.vertices[0].vz);
+	glm::vec3 max_position = min_position;
+	for (const Vertex& v : mesh.vertices)
+	{
+		min_position = glm::vec3(std::min(min_position.x, v.vx), std::min(min_position.y, v.vy),
+				std::min(min_position.z, v.vz));
+		max_position = glm::vec3(std::max(max_position.x, v.vx), std::max(max_position.y, v.vy),
+				std::max(max_position.z, v.vz));
+	}
+	const glm::vec3 center = (min_position + max_position) * 0.5f;
+
+	float radius = 0.0f;
+	for (const Vertex& v : mesh.vertices)
+	{
+		radius = std::max(radius, glm::length(glm::vec3(v.vx, v.vy, v.vz) - center));
+	}
+
+	// Fibonacci sphere.
+	const float kGoldenAngle = 3.14159265f * (3.0f - sqrtf(5.0f));
+
+	std::vector<glm::vec3> views(kViewCount);
+	for (uint32_t i = 0; i < kViewCount; ++i)
+	{
+		const float y = 1.0f - 2.0f * (float(i) + 0.5f) / float(kViewCount);
+		const float r = sqrtf(1.0f - y * y);
+		const float phi = kGoldenAngle * float(i);
+		views[i] = center + glm::vec3(r * cosf(phi), y, r * sinf(phi)) * (radius * kViewDistance);
+	}
+	return views;
+}
+
+static uint32_t GetBucket(size_t value, size_t max_value)
+{
+	assert(value >= 1 && value <= max_value);
+	return uint32_t((value - 1) * kHistogramBuckets / max_value);
+}
+
+static void Analyze(Analysis& result, Mesh& mesh, const std::vector<glm::vec3>& views)
+{
+	const size_t index_count = mesh.indices.size();
+	const size_t vertex_count = mesh.vertices.size();
+
+	result.vertex_cache =
+			meshopt_analyzeVertexCache(mesh.indices.data(), index_count, vertex_count, kVertexCacheSize, 0, 0);
+	result.vertex_fetch = meshopt_analyzeVertexFetch(mesh.indices.data(), index_count, vertex_count, sizeof(Vertex));
+	result.position_fetch =
+			meshopt_analyzeVertexFetch(mesh.indices.data(), index_count, vertex_count, sizeof(VertexPosition));
+	result.overdraw = meshopt_analyzeOverdraw(
+			mesh.indices.data(), index_count, &mesh.vertices[0].vx, vertex_count, sizeof(Vertex));
+
+	BuildMeshlets(mesh, result.limits.max_vertices, result.limits.max_triangles);
+
+	uint64_t culled_meshlets = 0;
+	uint64_t culled_triangles = 0;
+	for (const Meshlet& meshlet : mesh.meshlets)
+	{
+		if (meshlet.triangle_count == 0)
+		{
+			continue;
+		}
+
+		++result.meshlet_count;
+		result.meshlet_vertices += meshlet.vertex_count;
+		result.meshlet_triangles += meshlet.triangle_count;
+		++result.vertex_histogram[GetBucket(meshlet.vertex_count, result.limits.max_vertices)];
+		++result.triangle_histogram[GetBucket(meshlet.triangle_count, result.limits.max_triangles)];
+
+		const uint32_t cutoff_bucket = uint32_t((meshlet.cone_cutoff / 127.0f + 1.0f) * 0.5f * kHistogramBuckets);
+		++result.cutoff_histogram[std::min(cutoff_bucket, kHistogramBuckets - 1)];
+
+		for (const glm::vec3& view : views)
+		{
+			if (ConeCull(meshlet, view))
+			{
+				++culled_meshlets;
+				culled_triangles += meshlet.triangle_count;
+			}
+		}
+	}
+
+	result.culled_meshlets = double(culled_meshlets) / (double(result.meshlet_count) * views.size());
+	result.culled_triangles = double(culled_triangles) / (double(result.meshlet_triangles) * views.size());
+}
+
+static bool AnalyzeMesh(std::vector<Analysis>& results, const char* path, const std::vector<MeshletLimits>& limits)
+{
+	fastObjMesh* obj = fast_obj_read(path);
+	if (!obj)
+	{
+		return false;
+	}
+
+	std::vector<Vertex> vertices;
+	TriangulateObj(vertices, *obj);
+	fast_obj_destroy(obj);
+
+	Mesh indexed;
+	IndexMesh(indexed, vertices);
+	if (indexed.indices.empty())
+	{
+		return false;
+	}
+
+	const std::vector<glm::vec3> views = GetViews(indexed);
+
+	const char* name = std::max(strrchr(path, '/'), strrchr(path, '\\'));
+	name = name ? name + 1 : path;
+
+	for (uint32_t order = 0; order < kVertexOrderCount; ++order)
+	{
+		Mesh mesh = indexed;
+		if (order == kOrderShuffled)
+		{
+			ShuffleTriangles(mesh, kShuffleSeed);
+		}
+		if (order == kOrderVertexCache || order == kOrderOptimized)
+		{
+			OptimizeVertexCache(mesh);
+		}
+		if (order == kOrderOptimized)
+		{
+			OptimizeVertexFetch(mesh);
+		}
+
+		for (const MeshletLimits& meshlet_limits : limits)
+		{
+			Analysis analysis = {};
+			analysis.name = name;
+			analysis.order = VertexOrder(order);
+			analysis.limits = meshlet_limits;
+			Analyze(analysis, mesh, views);
+			results.push_back(analysis);
+		}
+	}
+
+	return true;
+}
+
+static void PrintRowHeader()
+{
+	printf("%-16s %-12s %-7s", "input", "order", "meshlet");
+}
+
+static void PrintRowName(const Analysis& analysis)
+{
+	char limits[32];
+	snprintf(limits, sizeof(limits), "%ux%u", uint32_t(analysis.limits.max_vertices),
+			uint32_t(analysis.limits.max_triangles));
+	printf("%-16s %-12s %-7s", analysis.name, kVertexOrderNames[analysis.order], limits);
+}
+
+static void PrintSummary(const std::vector<Analysis>& results)
+{
+	printf("ACMR/ATVR with a %u entry FIFO cache. Cone culling from %u views at %.1f mesh radii. Position fetch of the "
+			"split layout in %% of the interleaved one.\n",
+			kVertexCacheSize, kViewCount, kViewDistance);
+	PrintRowHeader();
+	printf(" %6s %6s %9s %10s %8s %8s %7s %7s %6s %9s %9s\n", "ACMR", "ATVR", "overfetch", "pos fetch%", "overdraw",
+			"meshlets", "v fill%", "t fill%", "v/t", "cull mlt%", "cull tri%");
+
+	for (const Analysis& a : results)
+	{
+		const double vertices_per_meshlet = double(a.meshlet_vertices) / a.meshlet_count;
+		const double triangles_per_meshlet = double(a.meshlet_triangles) / a.meshlet_count;
+		const double position_fetch = double(a.position_fetch.bytes_fetched) / a.vertex_fetch.bytes_fetched;
+
+		PrintRowName(a);
+		printf(" %6.3f %6.3f %9.3f %10.1f %8.3f %8u %7.1f %7.1f %6.3f %9.1f %9.1f\n", a.vertex_cache.acmr,
+				a.vertex_cache.atvr, a.vertex_fetch.overfetch, position_fetch * 100.0, a.overdraw.overdraw,
+				a.meshlet_count,
+				vertices_per_meshlet * 100.0 / a.limits.max_vertices,
+				triangles_per_meshlet * 100.0 / a.limits.max_triangles, vertices_per_meshlet / triangles_per_meshlet,
+				a.culled_meshlets * 100.0, a.culled_triangles * 100.0);
+	}
+}
+
+static void PrintHistogram(const std::vector<Analysis>& results, const char* title, const char* const* labels,
+		const uint32_t (Analysis::*histogram)[kHistogramBuckets])
+{
+	printf("\n%s, %% of meshlets\n", title);
+	PrintRowHeader();
+	for (uint32_t i = 0; i < kHistogramBuckets; ++i)
+	{
+		printf(" %7s", labels[i]);
+	}
+	printf("\n");
+
+	for (const Analysis& a : results)
+	{
+		PrintRowName(a);
+		for (uint32_t i = 0; i < kHistogramBuckets; ++i)
+		{
+			printf(" %7.1f", (a.*histogram)[i] * 100.0 / a.meshlet_count);
+		}
+		printf("\n");
+	}
+}
+
+static bool ParseLimits(MeshletLimits& limits, const char* text)
+{
+	unsigned int max_vertices = 0;
+	unsigned int max_triangles = 0;
+	if (sscanf(text, "%ux%u", &max_vertices, &max_triangles) != 2)
+	{
+		return false;
+	}
+
+	limits.max_vertices = max_vertices;
+	limits.max_triangles = max_triangles;
+	return max_vertices >= 3 && max_vertices <= kMaxMeshletVertices && max_triangles >= 1 &&
+			max_triangles <= kMaxMeshletTriangles;
+}
+
+int main(int argc, const char** argv)
+{
+	std::vector<MeshletLimits> limits;
+	std::vector<const char*> paths;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+		{
+			MeshletLimits meshlet_limits = {};
+			if (!ParseLimits(meshlet_limits, argv[++i]))
+			{
+				printf("Meshlet limits have to be VxT, at most %ux%u\n", uint32_t(kMaxMeshletVertices),
+						uint32_t(kMaxMeshletTriangles));
+				return 1;
+			}
+			limits.push_back(meshlet_limits);
+		}
+		else
+		{
+			paths.push_back(argv[i]);
+		}
+	}
+
+	if (paths.empty())
+	{
+		printf("Usage: %s [-m VxT]... file.obj ...\n", argv[0]);
+		return 1;
+	}
+	if (limits.empty())
+	{
+		limits.push_back({ kMaxMeshletVertices, kMaxMeshletTriangles });
+	}
+
+	std::vector<Analysis> results;
+	for (const char* path : paths)
+	{
+		if (!AnalyzeMesh(results, path, limits))
+		{
+			printf("Can't load %s\n", path);
+			return 1;
+		}
+	}
+
+	const char* fill_labels[kHistogramBuckets] = { "<=1/8", "<=2/8", "<=3/8", "<=4/8", "<=5/8", "<=6/8", "<=7/8",
+		"<=8/8" };
+	const char* cutoff_labels[kHistogramBuckets] = { "<-0.75", "<-0.50", "<-0.25", "<0.00", "<0.25", "<0.50",
+		"<0.75", "<=1.00" };
+
+	PrintSummary(results);
+	PrintHistogram(results, "Vertices per meshlet, of the limit", fill_labels, &Analysis::vertex_histogram);
+	PrintHistogram(results, "Triangles per meshlet, of the limit", fill_labels, &Analysis::triangle_histogram);
+	PrintHistogram(results, "Cone cutoff (cos), 1 never culls", cutoff_labels, &Analysis::cutoff_histogram);
+
+	return 0;
+}
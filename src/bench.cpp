@@ -0,0 +1,591 @@
+// Times the CPU side of getting meshes and shaders ready for the GPU, stage by stage. Never touches Vulkan, so it runs
+// on machines without a GPU or driver.
+//
+// Usage: bench [-n repetitions] file.obj|file.spv|file.scene|jobs ...
+//
+// Every stage runs once to warm up and then repetitions times. Reported are the median and the fastest run,
+// throughput at the median and the peak heap growth while the stage ran. Scenes time the BVH over their instances
+// (see bvh.h), the front to back sort of the instances (see sort.h) and the culling of the instance store (see
+// instances.h) from one thread up to all of them, run them at different sizes (see scenegen.cpp) to see how it scales.
+// "jobs" times the job scheduler itself (see parallel.h): what a job costs and how a fixed amount of work scales.
+
+#include "common.h"
+
+#include "bvh.h"
+#include "geometry.h"
+#include "instances.h"
+#include "lod.h"
+#include "parallel.h"
+#include "scene.h"
+#include "sort.h"
+#include "shaders.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+// Everything that goes through operator new, fast_obj's realloc and with that meshoptimizer's allocator (which
+// defaults to operator new). Atomic for the worker threads of ParallelFor, the peaks can miss a few bytes when
+// threads race.
+static std::atomic<size_t> allocated_bytes(0);
+static std::atomic<size_t> peak_bytes(0);
+static std::atomic<size_t> stage_peak_bytes(0);  // Reset by Measure.
+
+static void UpdatePeak(std::atomic<size_t>& peak, size_t bytes)
+{
+	size_t current = peak.load();
+	while (bytes > current && !peak.compare_exchange_weak(current, bytes))
+	{
+	}
+}
+
+// Keeps the size in front of the allocation, padded to keep the 16 byte alignment of malloc.
+struct alignas(16) AllocationHeader
+{
+	size_t size;
+};
+
+static void* TrackedRealloc(void* ptr, size_t size)
+{
+	AllocationHeader* header = ptr ? static_cast<AllocationHeader*>(ptr) - 1 : nullptr;
+	const size_t old_size = header ? header->size : 0;
+
+	header = static_cast<AllocationHeader*>(realloc(header, sizeof(AllocationHeader) + size));
+	if (!header)
+	{
+		return nullptr;
+	}
+	header->size = size;
+
+	const size_t bytes = allocated_bytes += size - old_size;
+	UpdatePeak(peak_bytes, bytes);
+	UpdatePeak(stage_peak_bytes, bytes);
+	return header + 1;
+}
+
+static void TrackedFree(void* ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	AllocationHeader* header = static_cast<AllocationHeader*>(ptr) - 1;
+	allocated_bytes -= header->size;
+	free(header);
+}
+
+// The array, nothrow and sized versions all forward to these two.
+void* operator new(size_t size)
+{
+	void* ptr = TrackedRealloc(nullptr, size);
+	if (!ptr)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	TrackedFree(ptr);
+}
+
+// Takes the place of fast_obj.cpp in bench.vcxproj. geometry.h already pulled in the declarations.
+#define FAST_OBJ_REALLOC TrackedRealloc
+#define FAST_OBJ_FREE TrackedFree
+#define FAST_OBJ_IMPLEMENTATION
+#include <fast_obj.h>
+
+enum MeshStage
+{
+	kStageReadObj,
+	kStageTriangulate,
+	kStageIndex,
+	kStageVertexCache,
+	kStageVertexFetch,
+	kStageMeshlets,
+	kStageClusterLods,
+	kMeshStageCount,
+};
+
+const char* kMeshStageNames[kMeshStageCount] = { "fast_obj_read", "triangulate", "index", "vertex cache",
+	"vertex fetch", "meshlets", "cluster lods" };
+
+const uint32_t kDefaultRepetitions = 10;
+
+struct StageResult
+{
+	std::vector<double> ms;
+	size_t peak_bytes;  // Above what was allocated when the stage started, max over all runs.
+	size_t bytes;       // Processed per run, for the throughput.
+	size_t triangles;   // Same, 0 where it doesn't apply.
+};
+
+template <typename Function>
+static void Measure(StageResult& result, Function&& function)
+{
+	const size_t base_bytes = allocated_bytes;
+	stage_peak_bytes = base_bytes;
+
+	const uint64_t begin = GetTraceTime();
+	function();
+	const uint64_t end = GetTraceTime();
+
+	result.ms.push_back(double(end - begin) * 1e-6);
+	result.peak_bytes = std::max(result.peak_bytes, stage_peak_bytes - base_bytes);
+}
+
+static long GetFileSize(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		return -1;
+	}
+	fseek(file, 0, SEEK_END);
+	const long length = ftell(file);
+	fclose(file);
+	return length;
+}
+
+// The same stages as LoadMesh followed by BuildMeshlets and BuildClusterLods.
+static bool RunMeshStages(StageResult* stages, const char* path, size_t file_size)
+{
+	fastObjMesh* obj = nullptr;
+	Measure(stages[kStageReadObj], [&] { obj = fast_obj_read(path); });
+	if (!obj)
+	{
+		return false;
+	}
+
+	std::vector<Vertex> vertices;
+	Measure(stages[kStageTriangulate], [&] { TriangulateObj(vertices, *obj); });
+	fast_obj_destroy(obj);
+
+	Mesh mesh;
+	Measure(stages[kStageIndex], [&] { IndexMesh(mesh, vertices); });
+	Measure(stages[kStageVertexCache], [&] { OptimizeVertexCache(mesh); });
+	Measure(stages[kStageVertexFetch], [&] { OptimizeVertexFetch(mesh); });
+	Measure(stages[kStageMeshlets], [&] { BuildMeshlets(mesh); });
+	Measure(stages[kStageClusterLods], [&] { BuildClusterLods(mesh); });
+
+	const size_t index_bytes = mesh.indices.size() * sizeof(uint32_t);
+	const size_t vertex_bytes = mesh.vertices.size() * sizeof(Vertex);
+	stages[kStageReadObj].bytes = file_size;
+	stages[kStageTriangulate].bytes = vertices.size() * sizeof(Vertex);
+	stages[kStageIndex].bytes = vertices.size() * sizeof(Vertex);
+	stages[kStageVertexCache].bytes = index_bytes;
+	stages[kStageVertexFetch].bytes = index_bytes + vertex_bytes;
+	stages[kStageMeshlets].bytes = index_bytes;
+	stages[kStageClusterLods].bytes = index_bytes;
+	for (uint32_t i = 0; i < kMeshStageCount; ++i)
+	{
+		stages[i].triangles = mesh.indices.size() / 3;
+	}
+
+	return true;
+}
+
+static void PrintHeader()
+{
+	printf("%-24s %-14s %10s %10s %10s %10s %10s\n", "input", "stage", "median ms", "min ms", "Mtris/s", "MB/s",
+			"peak MB");
+}
+
+static const char* GetFileName(const char* path)
+{
+	const char* name = std::max(strrchr(path, '/'), strrchr(path, '\\'));
+	return name ? name + 1 : path;
+}
+
+static double GetMedianMs(const StageResult& result)
+{
+	std::vector<double> ms = result.ms;
+	std::sort(ms.begin(), ms.end());
+	const size_t middle = ms.size() / 2;
+	return ms.size() % 2 ? ms[middle] : (ms[middle - 1] + ms[middle]) * 0.5;
+}
+
+static void PrintStage(const char* input, const char* stage, const StageResult& result)
+{
+	const double median = GetMedianMs(result);
+	const double seconds = std::max(median * 1e-3, 1e-9);
+
+	printf("%-24s %-14s %10.3f %10.3f ", GetFileName(input), stage, median,
+			*std::min_element(result.ms.begin(), result.ms.end()));
+	if (result.triangles)
+	{
+		printf("%10.2f ", double(result.triangles) / seconds * 1e-6);
+	}
+	else
+	{
+		printf("%10s ", "-");
+	}
+	printf("%10.1f %10.2f\n", double(result.bytes) / seconds / (1024.0 * 1024.0),
+			double(result.peak_bytes) / (1024.0 * 1024.0));
+}
+
+static bool BenchMesh(const char* path, uint32_t repetitions)
+{
+	const long file_size = GetFileSize(path);
+	if (file_size < 0)
+	{
+		return false;
+	}
+
+	// The warmup run also takes the one-off allocations (trace buffers and the like) out of the peaks.
+	StageResult warmup[kMeshStageCount] = {};
+	if (!RunMeshStages(warmup, path, size_t(file_size)))
+	{
+		return false;
+	}
+
+	StageResult stages[kMeshStageCount] = {};
+	for (uint32_t i = 0; i < repetitions; ++i)
+	{
+		RunMeshStages(stages, path, size_t(file_size));
+	}
+
+	for (uint32_t i = 0; i < kMeshStageCount; ++i)
+	{
+		PrintStage(path, kMeshStageNames[i], stages[i]);
+	}
+	return true;
+}
+
+static bool BenchShader(const char* path, uint32_t repetitions)
+{
+	const long file_size = GetFileSize(path);
+	if (file_size <= 0 || file_size % 4 != 0)
+	{
+		return false;
+	}
+
+	std::vector<uint32_t> code(file_size / 4);
+	FILE* file = fopen(path, "rb");
+	const size_t rc = fread(code.data(), 4, code.size(), file);
+	fclose(file);
+	if (rc != code.size())
+	{
+		return false;
+	}
+
+	StageResult warmup = {};
+	StageResult result = {};
+	result.bytes = size_t(file_size);
+	for (uint32_t i = 0; i <= repetitions; ++i)
+	{
+		Shader shader = {};
+		Measure(i == 0 ? warmup : result, [&] { ParseShader(shader, code.data(), uint32_t(code.size())); });
+	}
+
+	PrintStage(path, "parse shader", result);
+	return true;
+}
+
+enum BvhStage
+{
+	kStageBvhBuild,
+	kStageBvhRefit,
+	kStageBvhCull,
+	kBvhStageCount,
+};
+
+const char* kBvhStageNames[kBvhStageCount] = { "bvh build", "bvh refit", "bvh cull" };
+
+// Builds the BVH over the bounding spheres of the instances, refits it after moving every instance a bit and culls it
+// against niagara's camera.
+static bool BenchScene(const char* path, uint32_t repetitions)
+{
+	Scene scene;
+	if (!LoadScene(scene, path))
+	{
+		return false;
+	}
+
+	// Only the bounds of the meshes matter.
+	std::vector<glm::vec4> mesh_bounds(scene.header->mesh_count);
+	bool valid = true;
+	for (uint32_t i = 0; i < scene.header->mesh_count && valid; ++i)
+	{
+		Mesh mesh;
+		valid = LoadMesh(mesh, GetSceneMeshPath(scene, i));
+		mesh_bounds[i] = GetBoundingSphere(mesh);
+	}
+
+	std::vector<glm::vec4> spheres(scene.header->instance_count);
+	std::vector<glm::vec4> moved_spheres(scene.header->instance_count);
+	InstanceStore instances = {};
+	ResizeInstances(instances, scene.header->instance_count);
+	for (uint32_t i = 0; i < scene.header->instance_count && valid; ++i)
+	{
+		const SceneInstance& instance = scene.instances[i];
+		valid = instance.mesh < scene.header->mesh_count;
+		if (valid)
+		{
+			const glm::vec3 position(instance.position[0], instance.position[1], instance.position[2]);
+			const glm::quat orientation(
+					instance.orientation[3], instance.orientation[0], instance.orientation[1], instance.orientation[2]);
+			spheres[i] = TransformSphere(mesh_bounds[instance.mesh], position, instance.scale, orientation);
+			moved_spheres[i] = spheres[i] + glm::vec4(0.5f, 0.25f, 0.0f, 0.0f);
+			SetInstance(instances, i, position, instance.scale, orientation, instance.mesh);
+		}
+	}
+
+	const uint32_t instance_count = scene.header->instance_count;
+	UnloadScene(scene);
+	if (!valid)
+	{
+		return false;
+	}
+
+	// The default camera of niagara: at the origin looking down -z, a reverse infinite projection with a vertical
+	// field of view of 70 degrees, 4:3.
+	const float f = 1.0f / tanf(0.5f * 70.0f * 3.14159265f / 180.0f);
+	const float projection[16] = {
+		// clang-format off
+		f * 0.75f, 0.0f,  0.0f,  0.0f,
+		     0.0f,    f,  0.0f,  0.0f,
+		     0.0f, 0.0f,  0.0f, -1.0f,
+		     0.0f, 0.0f, 0.01f,  0.0f
+		// clang-format on
+	};
+	const Frustum frustum = GetFrustum(projection);
+
+	Bvh bvh;
+	std::vector<uint32_t> visible;
+	StageResult warmup[kBvhStageCount] = {};
+	StageResult stages[kBvhStageCount] = {};
+	for (uint32_t i = 0; i <= repetitions; ++i)
+	{
+		StageResult* results = i == 0 ? warmup : stages;
+		Measure(results[kStageBvhBuild], [&] { BuildBvh(bvh, spheres); });
+		Measure(results[kStageBvhRefit], [&] { RefitBvh(bvh, moved_spheres); });
+		visible.clear();
+		Measure(results[kStageBvhCull], [&] { CullBvh(visible, bvh, moved_spheres, frustum); });
+	}
+
+	for (uint32_t i = 0; i < kBvhStageCount; ++i)
+	{
+		stages[i].bytes = spheres.size() * sizeof(glm::vec4);
+		PrintStage(path, kBvhStageNames[i], stages[i]);
+	}
+	printf("%-24s %u instances, %u visible\n", GetFileName(path), instance_count, uint32_t(visible.size()));
+
+	// The depth keys of niagara's draw sort, once with the radix sort and once with std::sort for comparison. Every
+	// run sorts the same unsorted keys.
+	const uint32_t kDepthBits = 14;  // kSortDepthBits in niagara.cpp.
+	std::vector<uint64_t> depth_keys(instance_count);
+	for (uint32_t i = 0; i < instance_count; ++i)
+	{
+		depth_keys[i] = (uint64_t(GetDepthSortKey(-instances.position_z[i], kDepthBits)) << 32) | i;
+	}
+
+	std::vector<uint64_t> keys;
+	std::vector<uint64_t> scratch;
+	StageResult sort_warmup[2] = {};
+	StageResult sort_stages[2] = {};
+	for (uint32_t i = 0; i <= repetitions; ++i)
+	{
+		StageResult* results = i == 0 ? sort_warmup : sort_stages;
+		keys = depth_keys;
+		Measure(results[0], [&] { RadixSort(keys, scratch, kDepthBits); });
+		keys = depth_keys;
+		Measure(results[1], [&] { std::sort(keys.begin(), keys.end()); });
+	}
+	sort_stages[0].bytes = sort_stages[1].bytes = instance_count * sizeof(uint64_t);
+	PrintStage(path, "radix sort", sort_stages[0]);
+	PrintStage(path, "std::sort", sort_stages[1]);
+
+	// Doubling the threads up to all of them, then the scalar kernels on one thread for the gain of AVX2 alone.
+	std::vector<uint32_t> thread_counts;
+	for (uint32_t threads = 1; threads < GetParallelThreadCount(); threads *= 2)
+	{
+		thread_counts.push_back(threads);
+	}
+	thread_counts.push_back(GetParallelThreadCount());
+	thread_counts.push_back(0);
+
+	for (uint32_t threads : thread_counts)
+	{
+		const bool scalar = threads == 0;
+		SetParallelThreadLimit(scalar ? 1 : threads);
+		instance_avx2_enabled = !scalar;
+
+		StageResult warmup = {};
+		StageResult result = {};
+		result.bytes = instance_count * sizeof(float) * 9;  // What the transform reads.
+		for (uint32_t i = 0; i <= repetitions; ++i)
+		{
+			Measure(i == 0 ? warmup : result, [&] { CullInstances(visible, instances, mesh_bounds, frustum); });
+		}
+
+		char stage[32];
+		snprintf(stage, sizeof(stage), scalar ? "soa scalar 1t" : "soa cull %ut", threads);
+		PrintStage(path, stage, result);
+	}
+	SetParallelThreadLimit(0);
+	instance_avx2_enabled = true;
+
+	printf("%-24s %u visible after soa culling%s\n", GetFileName(path), uint32_t(visible.size()),
+			IsAvx2Supported() ? "" : " (no AVX2, all rows are scalar)");
+	return true;
+}
+
+// Spins on a value for a while, what every item of the scaling run costs.
+static float SpinWork(uint32_t seed)
+{
+	float value = float(seed);
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		value = value * 0.999f + 1.0f;
+	}
+	return value;
+}
+
+// Empty jobs queued by one thread, the same with children queued by the jobs themselves, and ParallelFor over single
+// items: what the scheduler costs per job. Then a fixed amount of work from one thread up to all of them.
+static bool BenchJobs(uint32_t repetitions)
+{
+	const char* kInput = "jobs";
+	const uint32_t kJobCount = 64 * 1024;
+	const uint32_t kChildCount = 64;  // Per parent, kJobCount jobs in total.
+
+	StageResult warmup[3] = {};
+	StageResult stages[3] = {};
+	for (uint32_t i = 0; i <= repetitions; ++i)
+	{
+		StageResult* results = i == 0 ? warmup : stages;
+		Measure(results[0], [&] {
+			JobCounter counter;
+			for (uint32_t job = 0; job < kJobCount; ++job)
+			{
+				RunJob(counter, [] {});
+			}
+			WaitForJobs(counter);
+		});
+		Measure(results[1], [&] {
+			JobCounter counter;
+			for (uint32_t parent = 0; parent < kJobCount / kChildCount; ++parent)
+			{
+				RunJob(counter, [&] {
+					for (uint32_t child = 1; child < kChildCount; ++child)
+					{
+						RunJob(counter, [] {});
+					}
+				});
+			}
+			WaitForJobs(counter);
+		});
+		Measure(results[2], [&] { ParallelFor(kJobCount, 1, [](size_t, size_t) {}); });
+	}
+
+	const char* kJobStageNames[3] = { "empty jobs", "child jobs", "for batches" };
+	for (uint32_t i = 0; i < 3; ++i)
+	{
+		PrintStage(kInput, kJobStageNames[i], stages[i]);
+		printf("%-24s %-14s %10.1f ns per job\n", kInput, kJobStageNames[i], GetMedianMs(stages[i]) * 1e6 / kJobCount);
+	}
+
+	const size_t kItemCount = 1024 * 1024;
+	std::vector<float> values(kItemCount);
+	double single_thread_ms = 0.0;
+	for (uint32_t threads = 1;; threads = std::min(threads * 2, GetParallelThreadCount()))
+	{
+		SetParallelThreadLimit(threads);
+
+		StageResult warmup = {};
+		StageResult result = {};
+		result.bytes = kItemCount * sizeof(float);
+		for (uint32_t i = 0; i <= repetitions; ++i)
+		{
+			Measure(i == 0 ? warmup : result, [&] {
+				ParallelFor(kItemCount, 1024, [&](size_t begin, size_t end) {
+					for (size_t item = begin; item < end; ++item)
+					{
+						values[item] = SpinWork(uint32_t(item));
+					}
+				});
+			});
+		}
+
+		const double median = GetMedianMs(result);
+		single_thread_ms = threads == 1 ? median : single_thread_ms;
+
+		char stage[32];
+		snprintf(stage, sizeof(stage), "work %ut", threads);
+		PrintStage(kInput, stage, result);
+		printf("%-24s %-14s %10.2fx speedup\n", kInput, stage, single_thread_ms / std::max(median, 1e-9));
+
+		if (threads == GetParallelThreadCount())
+		{
+			break;
+		}
+	}
+	SetParallelThreadLimit(0);
+
+	return true;
+}
+
+static bool EndsWith(const char* string, const char* suffix)
+{
+	const size_t length = strlen(string);
+	const size_t suffix_length = strlen(suffix);
+	return length >= suffix_length && strcmp(string + length - suffix_length, suffix) == 0;
+}
+
+int main(int argc, const char** argv)
+{
+	uint32_t repetitions = kDefaultRepetitions;
+	int first_input = 1;
+	if (argc > 2 && strcmp(argv[1], "-n") == 0)
+	{
+		repetitions = uint32_t(atoi(argv[2]));
+		first_input = 3;
+	}
+
+	if (first_input >= argc || repetitions == 0)
+	{
+		printf("Usage: %s [-n repetitions] file.obj|file.spv|file.scene|jobs ...\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u repetitions\n", repetitions);
+	PrintHeader();
+
+	int result = 0;
+	for (int i = first_input; i < argc; ++i)
+	{
+		bool rc = false;
+		if (strcmp(argv[i], "jobs") == 0)
+		{
+			rc = BenchJobs(repetitions);
+		}
+		else if (EndsWith(argv[i], ".spv"))
+		{
+			rc = BenchShader(argv[i], repetitions);
+		}
+		else if (EndsWith(argv[i], ".scene"))
+		{
+			rc = BenchScene(argv[i], repetitions);
+		}
+		else
+		{
+			rc = BenchMesh(argv[i], repetitions);
+		}
+		if (!rc)
+		{
+			printf("Can't load %s\n", argv[i]);
+			result = 1;
+		}
+	}
+
+	printf("Peak heap over the whole run %.2f MB\n", double(peak_bytes.load()) / (1024.0 * 1024.0));
+	return result;
+}
@@ -0,0 +1,491 @@
+#include "common.h"
+
+#include "benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// The GPU times come in through the profiler, which only reads back every few frames. If they don't show up after
+// this many frames they never will (the profiler skips frames it can't read back).
+static const uint32_t kMaxDrainFrames = 16;
+
+struct ConfigKey
+{
+	const char* name;
+	const char* default_value;
+	bool multiple;  // Whether it can be part of the matrix.
+};
+
+enum ConfigKeyIndex
+{
+	kKeyMesh,
+	kKeyDraws,
+	kKeyPipeline,
+	kKeyBinding,
+	kKeyCulling,
+	kKeyTriangleCulling,
+	kKeyCpuCulling,
+	kKeySort,
+	kKeyLod,
+	kKeyVertices,
+	kKeyDepthOnly,
+	kKeyShading,
+	kKeyRecordThreads,
+	kKeyMeshlet,
+	kKeyResolution,
+	kKeyWarmup,
+	kKeyFrames,
+	kKeySeed,
+	kKeyOutput,
+	kKeyCount,
+};
+
+static const ConfigKey kConfigKeys[kKeyCount] = {
+	{ "mesh", nullptr, true },
+	{ "draws", "3000", true },
+	{ "pipeline", "meshlet", true },
+	{ "binding", "push", true },
+	{ "culling", "on", true },
+	{ "triangle_culling", "off", true },
+	{ "cpu_culling", "off", true },
+	{ "sort", "off", true },
+	{ "lod", "off", true },
+	{ "vertices", "interleaved", true },
+	{ "depth_only", "off", true },
+	{ "shading", "forward", true },
+	{ "record_threads", "0", true },
+	{ "meshlet", "64x124", true },
+	{ "resolution", "2048x1536", true },
+	{ "warmup", "100", false },
+	{ "frames", "500", false },
+	{ "seed", "1", false },
+	{ "output", "benchmark.csv", false },
+};
+
+static std::string Trim(const std::string& s)
+{
+	const size_t begin = s.find_first_not_of(" \t\r\n");
+	if (begin == std::string::npos)
+	{
+		return std::string();
+	}
+	const size_t end = s.find_last_not_of(" \t\r\n");
+	return s.substr(begin, end - begin + 1);
+}
+
+static bool ParsePair(const std::string& value, uint32_t& a, uint32_t& b)
+{
+	return sscanf(value.c_str(), "%ux%u", &a, &b) == 2;
+}
+
+static bool ParseSwitch(const std::string& value, bool& result)
+{
+	if (value == "on")
+	{
+		result = true;
+		return true;
+	}
+	if (value == "off")
+	{
+		result = false;
+		return true;
+	}
+	return false;
+}
+
+static bool ParseCpuCulling(const std::string& value)
+{
+	return value == "off" || value == "bvh" || value == "soa";
+}
+
+static bool ParseDrawSorting(const std::string& value)
+{
+	return value == "off" || value == "depth" || value == "mesh" || value == "gpu";
+}
+
+static bool ParseVertices(const std::string& value, bool& split)
+{
+	if (value == "split")
+	{
+		split = true;
+		return true;
+	}
+	if (value == "interleaved")
+	{
+		split = false;
+		return true;
+	}
+	return false;
+}
+
+static bool ParseShading(const std::string& value, bool& visibility_buffer, bool& software_raster)
+{
+	if (value == "software")
+	{
+		visibility_buffer = true;
+		software_raster = true;
+		return true;
+	}
+	if (value == "visibility")
+	{
+		visibility_buffer = true;
+		software_raster = false;
+		return true;
+	}
+	if (value == "forward")
+	{
+		visibility_buffer = false;
+		software_raster = false;
+		return true;
+	}
+	return false;
+}
+
+static bool ParsePipeline(const std::string& value, bool& mesh_shading)
+{
+	if (value == "meshlet")
+	{
+		mesh_shading = true;
+		return true;
+	}
+	if (value == "indexed")
+	{
+		mesh_shading = false;
+		return true;
+	}
+	return false;
+}
+
+bool LoadBenchmarkConfig(BenchmarkConfig& config, const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		printf("Can't open benchmark config %s\n", path);
+		return false;
+	}
+
+	std::vector<std::string> values[kKeyCount];
+
+	char line[1024];
+	uint32_t line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file))
+	{
+		++line_number;
+
+		std::string text = line;
+		text = Trim(text.substr(0, text.find('#')));
+		if (text.empty())
+		{
+			continue;
+		}
+
+		const size_t equals = text.find('=');
+		const std::string key = Trim(text.substr(0, equals));
+		uint32_t index = 0;
+		while (index < kKeyCount && key != kConfigKeys[index].name)
+		{
+			++index;
+		}
+		if (equals == std::string::npos || index == kKeyCount)
+		{
+			printf("%s:%u: expected one of the known keys followed by '='\n", path, line_number);
+			ok = false;
+			break;
+		}
+
+		std::string rest = text.substr(equals + 1);
+		while (!rest.empty())
+		{
+			const size_t comma = rest.find(',');
+			const std::string value = Trim(rest.substr(0, comma));
+			if (!value.empty())
+			{
+				values[index].push_back(value);
+			}
+			rest = comma == std::string::npos ? std::string() : rest.substr(comma + 1);
+		}
+
+		if (values[index].empty() || (!kConfigKeys[index].multiple && values[index].size() > 1))
+		{
+			printf("%s:%u: %s takes %s\n", path, line_number, kConfigKeys[index].name,
+					kConfigKeys[index].multiple ? "at least one value" : "exactly one value");
+			ok = false;
+		}
+	}
+	fclose(file);
+
+	if (!ok)
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < kKeyCount; ++i)
+	{
+		if (values[i].empty())
+		{
+			if (!kConfigKeys[i].default_value)
+			{
+				printf("%s: %s is required\n", path, kConfigKeys[i].name);
+				return false;
+			}
+			values[i].push_back(kConfigKeys[i].default_value);
+		}
+	}
+
+	config.warmup_frames = uint32_t(atoi(values[kKeyWarmup][0].c_str()));
+	config.measured_frames = uint32_t(atoi(values[kKeyFrames][0].c_str()));
+	config.seed = uint32_t(atoi(values[kKeySeed][0].c_str()));
+	config.output_path = values[kKeyOutput][0];
+	if (config.measured_frames == 0)
+	{
+		printf("%s: frames has to be at least 1\n", path);
+		return false;
+	}
+
+	// Every combination, with the expensive switches (new mesh, new window size, new vertex layout) on the outside so
+	// they happen as rarely as possible. The last key varies fastest.
+	const ConfigKeyIndex matrix_keys[] = { kKeyMesh, kKeyResolution, kKeyMeshlet, kKeyVertices, kKeyDraws,
+		kKeyBinding, kKeyPipeline, kKeyDepthOnly, kKeyShading, kKeyCulling, kKeyTriangleCulling, kKeyCpuCulling,
+		kKeySort, kKeyLod, kKeyRecordThreads };
+	size_t cell_count = 1;
+	for (ConfigKeyIndex key : matrix_keys)
+	{
+		cell_count *= values[key].size();
+	}
+
+	config.cells.clear();
+	for (size_t i = 0; i < cell_count; ++i)
+	{
+		const std::string* v[kKeyCount] = {};
+		size_t rest = i;
+		for (size_t k = ARRAY_SIZE(matrix_keys); k-- > 0;)
+		{
+			const std::vector<std::string>& key_values = values[matrix_keys[k]];
+			v[matrix_keys[k]] = &key_values[rest % key_values.size()];
+			rest /= key_values.size();
+		}
+
+		BenchmarkCell cell = {};
+		cell.mesh_path = *v[kKeyMesh];
+		cell.draw_count = uint32_t(atoi(v[kKeyDraws]->c_str()));
+		cell.binding_model = *v[kKeyBinding];
+		cell.cpu_culling = *v[kKeyCpuCulling];
+		cell.draw_sorting = *v[kKeySort];
+		cell.record_threads = uint32_t(atoi(v[kKeyRecordThreads]->c_str()));
+
+		if (!ParsePair(*v[kKeyResolution], cell.width, cell.height) ||
+				!ParsePair(*v[kKeyMeshlet], cell.meshlet_max_vertices, cell.meshlet_max_triangles) ||
+				!ParsePipeline(*v[kKeyPipeline], cell.mesh_shading) || !ParseSwitch(*v[kKeyCulling], cell.culling) ||
+				!ParseCpuCulling(*v[kKeyCpuCulling]) || !ParseDrawSorting(*v[kKeySort]) ||
+				!ParseSwitch(*v[kKeyLod], cell.lod) || !ParseVertices(*v[kKeyVertices], cell.split_vertices) ||
+				!ParseSwitch(*v[kKeyDepthOnly], cell.depth_only) ||
+				!ParseShading(*v[kKeyShading], cell.visibility_buffer, cell.software_raster) ||
+				!ParseSwitch(*v[kKeyTriangleCulling], cell.triangle_culling) || cell.draw_count == 0)
+		{
+			printf("%s: invalid combination resolution %s, meshlet %s, draws %s, pipeline %s, culling %s, "
+					"triangle_culling %s, cpu_culling %s, sort %s, lod %s, vertices %s, depth_only %s, shading %s, "
+					"record_threads %s\n",
+					path, v[kKeyResolution]->c_str(), v[kKeyMeshlet]->c_str(), v[kKeyDraws]->c_str(),
+					v[kKeyPipeline]->c_str(), v[kKeyCulling]->c_str(), v[kKeyTriangleCulling]->c_str(),
+					v[kKeyCpuCulling]->c_str(),
+					v[kKeySort]->c_str(), v[kKeyLod]->c_str(), v[kKeyVertices]->c_str(), v[kKeyDepthOnly]->c_str(),
+					v[kKeyShading]->c_str(), v[kKeyRecordThreads]->c_str());
+			return false;
+		}
+
+		config.cells.push_back(cell);
+	}
+
+	return true;
+}
+
+bool StartBenchmark(BenchmarkRunner& runner, const BenchmarkConfig& config)
+{
+	assert(!config.cells.empty());
+
+	runner = BenchmarkRunner();
+	runner.config = config;
+	runner.csv = fopen(config.output_path.c_str(), "w");
+	if (!runner.csv)
+	{
+		printf("Can't open %s\n", config.output_path.c_str());
+		return false;
+	}
+
+	fprintf(runner.csv,
+			"mesh,draws,pipeline,binding,culling,triangle_culling,cpu_culling,sort,lod,vertices,depth_only,shading,"
+			"record_threads,meshlet_vertices,meshlet_triangles,width,height,seed,frames,cpu_mean_ms,cpu_p50_ms,"
+			"cpu_p99_ms,draw_record_mean_ms,draw_record_p50_ms,draw_record_p99_ms,gpu_samples,gpu_mean_ms,gpu_p50_ms,"
+			"gpu_p99_ms,overdraw,triangles_emitted,triangles_culled,triangles_software,triangles_per_draw,"
+			"mtris_per_sec,kittens_per_sec\n");
+
+	runner.phase = kBenchmarkApply;
+	return true;
+}
+
+const BenchmarkCell& GetBenchmarkCell(const BenchmarkRunner& runner)
+{
+	return runner.config.cells[runner.cell];
+}
+
+void BenchmarkCellApplied(BenchmarkRunner& runner)
+{
+	assert(runner.phase == kBenchmarkApply);
+
+	printf("Benchmark %u/%u\n", runner.cell + 1, uint32_t(runner.config.cells.size()));
+
+	runner.phase = kBenchmarkWarmup;
+	runner.phase_frames = 0;
+	runner.cpu_ms.clear();
+	runner.draw_record_ms.clear();
+	runner.gpu_ms.clear();
+	runner.overdraw.clear();
+	runner.triangles_emitted.clear();
+	runner.triangles_culled.clear();
+	runner.triangles_software.clear();
+}
+
+struct SampleSummary
+{
+	double mean;
+	double p50;
+	double p99;
+};
+
+static SampleSummary Summarize(std::vector<double> samples)
+{
+	SampleSummary summary = {};
+	if (samples.empty())
+	{
+		return summary;
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0.0;
+	for (double sample : samples)
+	{
+		sum += sample;
+	}
+	summary.mean = sum / double(samples.size());
+
+	// Nearest rank.
+	summary.p50 = samples[(samples.size() - 1) * 50 / 100];
+	summary.p99 = samples[(samples.size() - 1) * 99 / 100];
+	return summary;
+}
+
+static void WriteRow(BenchmarkRunner& runner)
+{
+	const BenchmarkCell& cell = GetBenchmarkCell(runner);
+	const BenchmarkFrame& frame = runner.last_frame;
+	const SampleSummary cpu = Summarize(runner.cpu_ms);
+	const SampleSummary draw_record = Summarize(runner.draw_record_ms);
+	const SampleSummary gpu = Summarize(runner.gpu_ms);
+	const SampleSummary overdraw = Summarize(runner.overdraw);
+	const SampleSummary triangles_emitted = Summarize(runner.triangles_emitted);
+	const SampleSummary triangles_culled = Summarize(runner.triangles_culled);
+	const SampleSummary triangles_software = Summarize(runner.triangles_software);
+
+	const double gpu_seconds = gpu.p50 * 1e-3;
+	const double tris_per_sec =
+			gpu_seconds > 0.0 ? double(frame.draw_count) * double(frame.triangles_per_draw) / gpu_seconds : 0.0;
+	const double kittens_per_sec = gpu_seconds > 0.0 ? double(frame.draw_count) / gpu_seconds : 0.0;
+	const char* shading = cell.software_raster ? "software" : (cell.visibility_buffer ? "visibility" : "forward");
+
+	fprintf(runner.csv,
+			"%s,%u,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%u,%u,%u,%u,%u,%u,%u,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%u,%.4f,%.4f,%.4f,"
+			"%.3f,%.0f,%.0f,%.0f,%u,%.2f,%.1f\n",
+			cell.mesh_path.c_str(), frame.draw_count, cell.mesh_shading ? "meshlet" : "indexed",
+			cell.binding_model.c_str(), cell.culling ? "on" : "off", cell.triangle_culling ? "on" : "off",
+			cell.cpu_culling.c_str(), cell.draw_sorting.c_str(), cell.lod ? "on" : "off",
+			cell.split_vertices ? "split" : "interleaved", cell.depth_only ? "on" : "off",
+			shading, cell.record_threads, cell.meshlet_max_vertices, cell.meshlet_max_triangles, frame.width,
+			frame.height, runner.config.seed, uint32_t(runner.cpu_ms.size()), cpu.mean, cpu.p50, cpu.p99,
+			draw_record.mean, draw_record.p50, draw_record.p99, uint32_t(runner.gpu_ms.size()), gpu.mean, gpu.p50,
+			gpu.p99, overdraw.mean, triangles_emitted.mean, triangles_culled.mean, triangles_software.mean,
+			frame.triangles_per_draw, tris_per_sec * 1e-6, kittens_per_sec);
+	fflush(runner.csv);
+}
+
+void UpdateBenchmark(BenchmarkRunner& runner, const BenchmarkFrame& frame)
+{
+	if (runner.phase == kBenchmarkIdle || runner.phase == kBenchmarkApply || runner.phase == kBenchmarkFinished)
+	{
+		return;
+	}
+
+	// Frames of other phases (or cells) can be resolved in the meantime, only the measured range counts.
+	if (frame.gpu_resolved_count != runner.gpu_resolved_count)
+	{
+		runner.gpu_resolved_count = frame.gpu_resolved_count;
+		if (runner.phase != kBenchmarkWarmup && frame.gpu_frame_number >= runner.first_measured_frame &&
+				frame.gpu_frame_number <= runner.last_measured_frame)
+		{
+			runner.gpu_ms.push_back(frame.gpu_ms);
+		}
+	}
+
+	++runner.phase_frames;
+
+	if (runner.phase == kBenchmarkWarmup)
+	{
+		if (runner.phase_frames >= runner.config.warmup_frames)
+		{
+			runner.phase = kBenchmarkMeasure;
+			runner.phase_frames = 0;
+			runner.first_measured_frame = frame.frame_number + 1;
+			runner.last_measured_frame = frame.frame_number + runner.config.measured_frames;
+		}
+	}
+	else if (runner.phase == kBenchmarkMeasure)
+	{
+		runner.cpu_ms.push_back(frame.cpu_ms);
+		runner.draw_record_ms.push_back(frame.draw_record_ms);
+		runner.last_frame = frame;
+
+		// Lags behind like the GPU times, but the statistics only exist for one frame at a time, and the frames
+		// of a cell hardly differ.
+		if (frame.fragments > 0)
+		{
+			runner.overdraw.push_back(double(frame.fragments) / (double(frame.width) * double(frame.height)));
+		}
+		// All of them can go to the software rasterizer.
+		if (frame.triangles_emitted > 0 || frame.triangles_software > 0)
+		{
+			runner.triangles_emitted.push_back(double(frame.triangles_emitted));
+			runner.triangles_culled.push_back(double(frame.triangles_culled));
+			runner.triangles_software.push_back(double(frame.triangles_software));
+		}
+
+		if (frame.frame_number == runner.last_measured_frame)
+		{
+			runner.phase = kBenchmarkDrain;
+			runner.phase_frames = 0;
+		}
+	}
+	else if (runner.phase == kBenchmarkDrain)
+	{
+		if (runner.gpu_ms.size() == runner.config.measured_frames || runner.phase_frames >= kMaxDrainFrames)
+		{
+			WriteRow(runner);
+
+			++runner.cell;
+			if (runner.cell < runner.config.cells.size())
+			{
+				runner.phase = kBenchmarkApply;
+			}
+			else
+			{
+				fclose(runner.csv);
+				runner.csv = nullptr;
+				runner.phase = kBenchmarkFinished;
+				printf("Benchmark done, results in %s\n", runner.config.output_path.c_str());
+			}
+		}
+	}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+// Runs a matrix of configurations for a fixed number of frames each and writes one CSV row per configuration.
+//
+// The config is a text file with one `key = value, value, ...` per line, '#' starts a comment. Every combination
+// of the listed values becomes a cell. Keys and defaults:
+//   mesh = kitten.obj            (required) or a .scene, see scene.h
+//   draws = 3000                 ignored for scenes, they have their instances
+//   pipeline = meshlet           indexed, meshlet
+//   binding = push               push, bda, bindless
+//   culling = on                 on, off (cone culling of meshlets)
+//   triangle_culling = off       on, off (culling of single triangles in the mesh shader, see meshlet.mesh.glsl)
+//   cpu_culling = off            off, bvh, soa (frustum culling of draws on the CPU, see niagara.cpp)
+//   sort = off                   off, depth, mesh, gpu (front to back order of the draws, see niagara.cpp)
+//   lod = off                    on, off (meshlet LOD in the task shader, see lod.h)
+//   vertices = interleaved       interleaved, split (positions and attributes in separate streams, see mesh.h)
+//   depth_only = off             on, off (no fragment shader, the shaders only read the positions)
+//   shading = forward            forward, visibility (the geometry only writes which triangle covers a pixel, a full
+//                                screen pass shades each pixel once, see resolve.frag.glsl), software (visibility,
+//                                and the meshlets that are only a few pixels wide go to the compute rasterizer in
+//                                raster.comp.glsl, meshlet pipeline only). Ignored with depth_only.
+//   record_threads = 0           0 draws everything with one call from the primary command buffer, N records batches
+//                                of draws into N secondary command buffers on N threads (see niagara.cpp). Scenes
+//                                with many instances give many batches.
+//   meshlet = 64x124             max vertices x max triangles
+//   resolution = 2048x1536
+//   warmup = 100                 frames, single value
+//   frames = 500                 measured frames, single value
+//   seed = 1                     for the scene, single value
+//   output = benchmark.csv       single value
+
+struct BenchmarkCell
+{
+	std::string mesh_path;
+	uint32_t draw_count;
+	bool mesh_shading;
+	std::string binding_model;
+	bool culling;
+	bool triangle_culling;
+	std::string cpu_culling;
+	std::string draw_sorting;
+	bool lod;
+	bool split_vertices;
+	bool depth_only;
+	bool visibility_buffer;
+	bool software_raster;
+	uint32_t record_threads;
+	uint32_t meshlet_max_vertices;
+	uint32_t meshlet_max_triangles;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct BenchmarkConfig
+{
+	std::vector<BenchmarkCell> cells;
+	uint32_t warmup_frames;
+	uint32_t measured_frames;
+	uint32_t seed;
+	std::string output_path;
+};
+
+// What the renderer measured for one frame. GPU times arrive a few frames late, gpu_frame_number says which frame
+// they belong to.
+struct BenchmarkFrame
+{
+	uint64_t frame_number;
+	double cpu_ms;
+	double draw_record_ms;  // Recording the draws into the command buffers, part of cpu_ms.
+	uint64_t gpu_resolved_count;  // Changes whenever a new GPU time is available.
+	uint64_t gpu_frame_number;
+	double gpu_ms;
+
+	// The actual values, the window might not have the requested size.
+	uint32_t width;
+	uint32_t height;
+	uint32_t draw_count;
+	uint32_t triangles_per_draw;  // Average over all draws.
+	uint64_t fragments;           // Fragment shader invocations, 0 without pipeline statistics. Lags behind.
+	uint32_t triangles_emitted;   // By the task shader, 0 without mesh shading. Lags behind.
+	uint32_t triangles_culled;    // Of those, by the mesh shader. Lags behind.
+	uint32_t triangles_software;  // Queued for the software rasterizer instead, not part of the emitted ones.
+};
+
+enum BenchmarkPhase
+{
+	kBenchmarkIdle,     // Not started.
+	kBenchmarkApply,    // The renderer has to switch to the current cell.
+	kBenchmarkWarmup,
+	kBenchmarkMeasure,
+	kBenchmarkDrain,    // Waiting for the GPU times of the measured frames.
+	kBenchmarkFinished,
+};
+
+struct BenchmarkRunner
+{
+	BenchmarkConfig config;
+	FILE* csv;
+
+	uint32_t cell;
+	BenchmarkPhase phase;
+	uint32_t phase_frames;
+	uint64_t first_measured_frame;
+	uint64_t last_measured_frame;
+	uint64_t gpu_resolved_count;
+
+	std::vector<double> cpu_ms;
+	std::vector<double> draw_record_ms;
+	std::vector<double> gpu_ms;
+	std::vector<double> overdraw;  // Fragments per pixel.
+	std::vector<double> triangles_emitted;
+	std::vector<double> triangles_culled;
+	std::vector<double> triangles_software;
+	BenchmarkFrame last_frame;
+};
+
+bool LoadBenchmarkConfig(BenchmarkConfig& config, const char* path);
+
+// Opens the CSV and writes its header. The first phase is kBenchmarkApply.
+bool StartBenchmark(BenchmarkRunner& runner, const BenchmarkConfig& config);
+// Call after the renderer switched to the current cell.
+void BenchmarkCellApplied(BenchmarkRunner& runner);
+// Call once per submitted frame.
+void UpdateBenchmark(BenchmarkRunner& runner, const BenchmarkFrame& frame);
+
+const BenchmarkCell& GetBenchmarkCell(const BenchmarkRunner& runner);
@@ -0,0 +1,394 @@
+#include "common.h"
+
+#include "bvh.h"
+#include "parallel.h"
+#include "sort.h"
+#include "trace.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/common.hpp>
+#pragma warning(pop)
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define BVH_SSE 1
+#include <emmintrin.h>
+#else
+#define BVH_SSE 0
+#endif
+
+// Every level of the tree uses up at least two bits of the 64 bit keys and leaves at most 4 entries on the stack.
+const size_t kMaxTraversalStack = 128;
+
+Frustum GetFrustum(const float* m)
+{
+	const glm::vec4 row0(m[0], m[4], m[8], m[12]);
+	const glm::vec4 row1(m[1], m[5], m[9], m[13]);
+	const glm::vec4 row2(m[2], m[6], m[10], m[14]);
+	const glm::vec4 row3(m[3], m[7], m[11], m[15]);
+
+	Frustum frustum = {};
+	frustum.planes[0] = row3 + row0;  // -w <= x
+	frustum.planes[1] = row3 - row0;  // x <= w
+	frustum.planes[2] = row3 + row1;
+	frustum.planes[3] = row3 - row1;
+	frustum.planes[4] = row2;  // 0 <= z
+	frustum.planes[5] = row3 - row2;  // z <= w
+
+	for (glm::vec4& plane : frustum.planes)
+	{
+		const float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+		plane = length > 0.0f ? plane / length : plane;
+	}
+	return frustum;
+}
+
+glm::vec4 TransformSphere(
+		const glm::vec4& sphere, const glm::vec3& position, float scale, const glm::quat& orientation)
+{
+	// Rotate, scale, then translate.
+	const glm::vec3 center = orientation * glm::vec3(sphere.x, sphere.y, sphere.z) * scale + position;
+	return glm::vec4(center.x, center.y, center.z, sphere.w * scale);
+}
+
+static bool IsSphereVisible(const glm::vec4& sphere, const Frustum& frustum)
+{
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		if (plane.x * sphere.x + plane.y * sphere.y + plane.z * sphere.z + plane.w < -sphere.w)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Spreads the lower 10 bits out to every third bit.
+static uint32_t SpreadBits(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Where the keys in [begin, end) stop having the highest bit in which the first and the last differ clear. They are
+// sorted and unique (the lower half is the item index), so that's somewhere strictly inside.
+static size_t SplitKeys(const std::vector<uint64_t>& keys, size_t begin, size_t end)
+{
+	const uint64_t difference = keys[begin] ^ keys[end - 1];
+	assert(difference != 0);
+
+	uint64_t bit = 1ull << 63;
+	while ((difference & bit) == 0)
+	{
+		bit >>= 1;
+	}
+
+	const auto split = std::partition_point(
+			keys.begin() + begin, keys.begin() + end, [&](uint64_t key) { return (key & bit) == 0; });
+	return size_t(split - keys.begin());
+}
+
+static uint32_t BuildNode(Bvh& bvh, const std::vector<uint64_t>& keys, size_t begin, size_t end)
+{
+	const uint32_t index = uint32_t(bvh.nodes.size());
+	bvh.nodes.push_back(BvhNode());
+
+	// Two levels of binary splits give up to four children, ranges that fit into a leaf aren't split further.
+	size_t ranges[4][2] = {};
+	uint32_t range_count = 0;
+	if (end - begin <= kBvhLeafSize)
+	{
+		ranges[range_count][0] = begin;
+		ranges[range_count++][1] = end;
+	}
+	else
+	{
+		const size_t middle = SplitKeys(keys, begin, end);
+		const size_t halves[2][2] = { { begin, middle }, { middle, end } };
+		for (const size_t* half : halves)
+		{
+			if (half[1] - half[0] <= kBvhLeafSize)
+			{
+				ranges[range_count][0] = half[0];
+				ranges[range_count++][1] = half[1];
+			}
+			else
+			{
+				const size_t quarter = SplitKeys(keys, half[0], half[1]);
+				ranges[range_count][0] = half[0];
+				ranges[range_count++][1] = quarter;
+				ranges[range_count][0] = quarter;
+				ranges[range_count++][1] = half[1];
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		bvh.nodes[index].child[i] = kBvhLeaf;
+	}
+
+	// By index, the recursion reallocates the nodes.
+	for (uint32_t i = 0; i < range_count; ++i)
+	{
+		const size_t count = ranges[i][1] - ranges[i][0];
+		const uint32_t child = count > kBvhLeafSize ? BuildNode(bvh, keys, ranges[i][0], ranges[i][1]) : kBvhLeaf;
+
+		BvhNode& node = bvh.nodes[index];
+		node.child[i] = child;
+		node.first[i] = uint32_t(ranges[i][0]);
+		node.count[i] = uint32_t(count);
+	}
+
+	return index;
+}
+
+void BuildBvh(Bvh& bvh, const std::vector<glm::vec4>& spheres)
+{
+	TRACE_SCOPE("build bvh");
+
+	const size_t kBatchSize = 16384;
+
+	bvh.nodes.clear();
+	bvh.items.clear();
+	if (spheres.empty())
+	{
+		return;
+	}
+
+	glm::vec3 center_min(FLT_MAX);
+	glm::vec3 center_max(-FLT_MAX);
+	for (const glm::vec4& sphere : spheres)
+	{
+		center_min = glm::min(center_min, glm::vec3(sphere));
+		center_max = glm::max(center_max, glm::vec3(sphere));
+	}
+	const glm::vec3 scale = 1023.0f / glm::max(center_max - center_min, glm::vec3(1e-6f));
+
+	// 30 bits of Morton code on top, the index below keeps the keys unique and takes the item along through the sort.
+	std::vector<uint64_t> keys(spheres.size());
+	ParallelFor(spheres.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const glm::vec3 cell = (glm::vec3(spheres[i]) - center_min) * scale;
+			const uint32_t code = (SpreadBits(uint32_t(cell.x)) << 2) | (SpreadBits(uint32_t(cell.y)) << 1) |
+					SpreadBits(uint32_t(cell.z));
+			keys[i] = (uint64_t(code) << 32) | i;
+		}
+	});
+
+	// Stable, and the keys come in by index, so equal codes stay in index order like they would in a full sort.
+	std::vector<uint64_t> scratch;
+	RadixSort(keys, scratch, 30);
+
+	bvh.items.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		bvh.items[i] = uint32_t(keys[i]);
+	}
+
+	// Leaves hold more than half of kBvhLeafSize on average, nodes have about 3 children.
+	bvh.nodes.reserve(keys.size() / (kBvhLeafSize * 2) + 1);
+	BuildNode(bvh, keys, 0, keys.size());
+
+	RefitBvh(bvh, spheres);
+}
+
+static void SetChildBox(BvhNode& node, uint32_t child, const glm::vec3& box_min, const glm::vec3& box_max)
+{
+	node.min_x[child] = box_min.x;
+	node.min_y[child] = box_min.y;
+	node.min_z[child] = box_min.z;
+	node.max_x[child] = box_max.x;
+	node.max_y[child] = box_max.y;
+	node.max_z[child] = box_max.z;
+}
+
+void RefitBvh(Bvh& bvh, const std::vector<glm::vec4>& spheres)
+{
+	TRACE_SCOPE("refit bvh");
+
+	const size_t kBatchSize = 1024;
+
+	// The leaves first, that's where all the sphere reads are. They don't depend on each other.
+	ParallelFor(bvh.nodes.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			BvhNode& node = bvh.nodes[i];
+			for (uint32_t child = 0; child < 4; ++child)
+			{
+				if (node.child[child] != kBvhLeaf || node.count[child] == 0)
+				{
+					continue;
+				}
+
+				glm::vec3 box_min(FLT_MAX);
+				glm::vec3 box_max(-FLT_MAX);
+				for (uint32_t j = 0; j < node.count[child]; ++j)
+				{
+					const glm::vec4& sphere = spheres[bvh.items[node.first[child] + j]];
+					box_min = glm::min(box_min, glm::vec3(sphere) - sphere.w);
+					box_max = glm::max(box_max, glm::vec3(sphere) + sphere.w);
+				}
+				SetChildBox(node, child, box_min, box_max);
+			}
+		}
+	});
+
+	// Then the inner nodes bottom up, children always come after their parents.
+	for (size_t i = bvh.nodes.size(); i-- > 0;)
+	{
+		BvhNode& node = bvh.nodes[i];
+		for (uint32_t child = 0; child < 4; ++child)
+		{
+			if (node.child[child] == kBvhLeaf)
+			{
+				continue;
+			}
+
+			const BvhNode& child_node = bvh.nodes[node.child[child]];
+			glm::vec3 box_min(FLT_MAX);
+			glm::vec3 box_max(-FLT_MAX);
+			for (uint32_t j = 0; j < 4; ++j)
+			{
+				if (child_node.count[j] != 0)
+				{
+					const glm::vec3 child_min(child_node.min_x[j], child_node.min_y[j], child_node.min_z[j]);
+					const glm::vec3 child_max(child_node.max_x[j], child_node.max_y[j], child_node.max_z[j]);
+					box_min = glm::min(box_min, child_min);
+					box_max = glm::max(box_max, child_max);
+				}
+			}
+			SetChildBox(node, child, box_min, box_max);
+		}
+	}
+}
+
+// One bit per child: outside of at least one plane, or inside of all of them. A box is outside if its corner farthest
+// along the plane normal is behind the plane, and inside if the one farthest against it is in front.
+static void TestChildren(const BvhNode& node, const Frustum& frustum, uint32_t& outside_mask, uint32_t& inside_mask)
+{
+#if BVH_SSE
+	const __m128 min_x = _mm_load_ps(node.min_x);
+	const __m128 min_y = _mm_load_ps(node.min_y);
+	const __m128 min_z = _mm_load_ps(node.min_z);
+	const __m128 max_x = _mm_load_ps(node.max_x);
+	const __m128 max_y = _mm_load_ps(node.max_y);
+	const __m128 max_z = _mm_load_ps(node.max_z);
+
+	const __m128 zero = _mm_setzero_ps();
+	__m128 outside = zero;
+	__m128 inside = _mm_cmpeq_ps(zero, zero);
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		const __m128 a = _mm_set1_ps(plane.x);
+		const __m128 b = _mm_set1_ps(plane.y);
+		const __m128 c = _mm_set1_ps(plane.z);
+		const __m128 d = _mm_set1_ps(plane.w);
+
+		// The corners farthest along the normal and against it.
+		const __m128 far_x = plane.x >= 0.0f ? max_x : min_x;
+		const __m128 far_y = plane.y >= 0.0f ? max_y : min_y;
+		const __m128 far_z = plane.z >= 0.0f ? max_z : min_z;
+		const __m128 near_x = plane.x >= 0.0f ? min_x : max_x;
+		const __m128 near_y = plane.y >= 0.0f ? min_y : max_y;
+		const __m128 near_z = plane.z >= 0.0f ? min_z : max_z;
+
+		const __m128 far_distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a, far_x), _mm_mul_ps(b, far_y)), _mm_add_ps(_mm_mul_ps(c, far_z), d));
+		const __m128 near_distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a, near_x), _mm_mul_ps(b, near_y)), _mm_add_ps(_mm_mul_ps(c, near_z), d));
+
+		outside = _mm_or_ps(outside, _mm_cmplt_ps(far_distance, zero));
+		inside = _mm_and_ps(inside, _mm_cmpge_ps(near_distance, zero));
+	}
+
+	outside_mask = uint32_t(_mm_movemask_ps(outside));
+	inside_mask = uint32_t(_mm_movemask_ps(inside));
+#else
+	outside_mask = 0;
+	inside_mask = 0;
+	for (uint32_t child = 0; child < 4; ++child)
+	{
+		bool outside = false;
+		bool inside = true;
+		for (const glm::vec4& plane : frustum.planes)
+		{
+			const float far_distance = plane.x * (plane.x >= 0.0f ? node.max_x[child] : node.min_x[child]) +
+					plane.y * (plane.y >= 0.0f ? node.max_y[child] : node.min_y[child]) +
+					plane.z * (plane.z >= 0.0f ? node.max_z[child] : node.min_z[child]) + plane.w;
+			const float near_distance = plane.x * (plane.x >= 0.0f ? node.min_x[child] : node.max_x[child]) +
+					plane.y * (plane.y >= 0.0f ? node.min_y[child] : node.max_y[child]) +
+					plane.z * (plane.z >= 0.0f ? node.min_z[child] : node.max_z[child]) + plane.w;
+			outside = outside || far_distance < 0.0f;
+			inside = inside && near_distance >= 0.0f;
+		}
+		outside_mask |= uint32_t(outside) << child;
+		inside_mask |= uint32_t(inside) << child;
+	}
+#endif
+}
+
+void CullBvh(std::vector<uint32_t>& visible, const Bvh& bvh, const std::vector<glm::vec4>& spheres,
+		const Frustum& frustum)
+{
+	TRACE_SCOPE("cull bvh");
+
+	if (bvh.nodes.empty())
+	{
+		return;
+	}
+
+	uint32_t stack[kMaxTraversalStack];
+	size_t stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		const BvhNode& node = bvh.nodes[stack[--stack_size]];
+
+		uint32_t outside = 0;
+		uint32_t inside = 0;
+		TestChildren(node, frustum, outside, inside);
+
+		// Backwards, so that the first child is popped first.
+		for (uint32_t child = 4; child-- > 0;)
+		{
+			if (node.count[child] == 0 || (outside & (1 << child)))
+			{
+				continue;
+			}
+
+			const uint32_t* items = &bvh.items[node.first[child]];
+			if (inside & (1 << child))
+			{
+				// The whole subtree, without looking at it.
+				visible.insert(visible.end(), items, items + node.count[child]);
+			}
+			else if (node.child[child] == kBvhLeaf)
+			{
+				for (uint32_t i = 0; i < node.count[child]; ++i)
+				{
+					if (IsSphereVisible(spheres[items[i]], frustum))
+					{
+						visible.push_back(items[i]);
+					}
+				}
+			}
+			else
+			{
+				assert(stack_size < kMaxTraversalStack);
+				stack[stack_size++] = node.child[child];
+			}
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/ext/quaternion_float.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#pragma warning(pop)
+
+// Bounding volume hierarchy over bounding spheres (xyz center, w radius), for culling draws on the CPU before they
+// are submitted.
+//
+// A linear BVH: the spheres are sorted along a Morton curve and the hierarchy follows the bits of the codes, which is
+// fast to build but not as tight as a SAH build. Every node has up to four children, so that a node can test all of
+// them against a plane at once with SSE.
+
+// Items per leaf at most.
+const uint32_t kBvhLeafSize = 8;
+
+// Marks a child that is a leaf rather than a node.
+const uint32_t kBvhLeaf = ~0u;
+
+// The boxes of the four children, one lane each.
+struct alignas(16) BvhNode
+{
+	float min_x[4];
+	float min_y[4];
+	float min_z[4];
+	float max_x[4];
+	float max_y[4];
+	float max_z[4];
+
+	uint32_t child[4];  // Node index or kBvhLeaf.
+	uint32_t first[4];  // Into Bvh::items, leaves and whole subtrees are ranges of it. Unused children have count 0.
+	uint32_t count[4];
+};
+
+struct Bvh
+{
+	std::vector<BvhNode> nodes;  // nodes[0] is the root, children always come after their parent.
+	std::vector<uint32_t> items;  // Indices of the spheres.
+};
+
+// Inside is where dot(plane.xyz, point) + plane.w >= 0.
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+// From a column major view projection matrix in Vulkan's clip space (0 <= z <= w). The planes are normalized, the far
+// plane of an infinite projection comes out as one that never culls.
+Frustum GetFrustum(const float* view_projection);
+
+// Into world space, the way the shaders place a draw.
+glm::vec4 TransformSphere(
+		const glm::vec4& sphere, const glm::vec3& position, float scale, const glm::quat& orientation);
+
+// The spheres are only read here and in RefitBvh, the BVH keeps no pointer to them.
+void BuildBvh(Bvh& bvh, const std::vector<glm::vec4>& spheres);
+
+// Updates the boxes for spheres that have moved, keeping the hierarchy. Gets worse with every refit the further they
+// move from where they were at build time.
+void RefitBvh(Bvh& bvh, const std::vector<glm::vec4>& spheres);
+
+// Appends the indices of all spheres that intersect the frustum (conservatively) to visible. They come out roughly in
+// the order of the Morton curve, neighbours in space stay neighbours in the list.
+void CullBvh(std::vector<uint32_t>& visible, const Bvh& bvh, const std::vector<glm::vec4>& spheres,
+		const Frustum& frustum);
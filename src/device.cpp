@@ -476,7 +476,72 @@ VkPhysicalDevice PickPhysicalDevice(VkInstance instance)
 	return result;
 }
 
-VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uint32_t family_index, bool rtx_supported)
+DeviceFeatures QueryDeviceFeatures(VkPhysicalDevice physical_device)
+{
+	assert(physical_device);
+
+	DeviceFeatures result = {};
+
+	uint32_t extension_count = 0;
+	VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, nullptr));
+	std::vector<VkExtensionProperties> extensions(extension_count);
+	VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, extensions.data()));
+	for (const auto& ext : extensions)
+	{
+		if (strcmp(ext.extensionName, VK_NV_MESH_SHADER_EXTENSION_NAME) == 0)
+		{
+			result.mesh_shading = true;
+		}
+		if (strcmp(ext.extensionName, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME) == 0)
+		{
+			result.dynamic_rendering = true;
+		}
+		if (strcmp(ext.extensionName, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0)
+		{
+			result.calibrated_timestamps = true;
+		}
+	}
+
+	VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+	VkPhysicalDeviceBufferDeviceAddressFeatures features_bda = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES
+	};
+	VkPhysicalDeviceDescriptorIndexingFeatures features_indexing = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES
+	};
+	VkPhysicalDeviceShaderAtomicInt64Features features_atomic_int64 = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_ATOMIC_INT64_FEATURES
+	};
+	VkPhysicalDeviceDynamicRenderingFeaturesKHR features_dynamic_rendering = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR
+	};
+	features2.pNext = &features_bda;
+	features_bda.pNext = &features_indexing;
+	features_indexing.pNext = &features_atomic_int64;
+	if (result.dynamic_rendering)
+	{
+		features_atomic_int64.pNext = &features_dynamic_rendering;
+	}
+	vkGetPhysicalDeviceFeatures2(physical_device, &features2);
+
+	result.buffer_device_address = features_bda.bufferDeviceAddress == VK_TRUE;
+	result.descriptor_indexing = features_indexing.runtimeDescriptorArray == VK_TRUE &&
+			features_indexing.descriptorBindingPartiallyBound == VK_TRUE &&
+			features_indexing.descriptorBindingStorageBufferUpdateAfterBind == VK_TRUE &&
+			features_indexing.descriptorBindingSampledImageUpdateAfterBind == VK_TRUE &&
+			features_indexing.shaderSampledImageArrayNonUniformIndexing == VK_TRUE;
+	result.dynamic_rendering = result.dynamic_rendering && features_dynamic_rendering.dynamicRendering == VK_TRUE;
+	result.pipeline_statistics = features2.features.pipelineStatisticsQuery == VK_TRUE;
+	result.inherited_queries = features2.features.inheritedQueries == VK_TRUE;
+	result.geometry_shader = features2.features.geometryShader == VK_TRUE;
+	result.buffer_int64_atomics =
+			features2.features.shaderInt64 == VK_TRUE && features_atomic_int64.shaderBufferInt64Atomics == VK_TRUE;
+
+	return result;
+}
+
+VkDevice CreateDevice(
+		VkInstance instance, VkPhysicalDevice physical_device, uint32_t family_index, const DeviceFeatures& features)
 {
 	assert(instance);
 	assert(physical_device);
@@ -496,10 +561,18 @@ VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uin
 		// VK_EXT_SHADER_SUBGROUP_BALLOT_EXTENSION_NAME,  // I don't think this is necessary
 		// VK_EXT_SHADER_SUBGROUP_VOTE_EXTENSION_NAME,  // I don't think this is necessary
 	};
-	if (rtx_supported)
+	if (features.mesh_shading)
 	{
 		extensions.push_back(VK_NV_MESH_SHADER_EXTENSION_NAME);
 	}
+	if (features.dynamic_rendering)
+	{
+		extensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+	}
+	if (features.calibrated_timestamps)
+	{
+		extensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+	}
 
 	VkDeviceCreateInfo device_create_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
 	device_create_info.queueCreateInfoCount = 1;
@@ -512,6 +585,10 @@ VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uin
 	// VkPhysicalDeviceFeatures features = {};
 	// features2.features.vertexPipelineStoresAndAtomics = VK_TRUE;	// TODO, for us it works, not for arseny.
 	features2.features.multiDrawIndirect = VK_TRUE;
+	features2.features.pipelineStatisticsQuery = features.pipeline_statistics ? VK_TRUE : VK_FALSE;
+	features2.features.inheritedQueries = features.inherited_queries ? VK_TRUE : VK_FALSE;
+	features2.features.geometryShader = features.geometry_shader ? VK_TRUE : VK_FALSE;
+	features2.features.shaderInt64 = features.buffer_int64_atomics ? VK_TRUE : VK_FALSE;
 
 	VkPhysicalDevice8BitStorageFeatures features_8bit = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES };
 	features_8bit.storageBuffer8BitAccess = VK_TRUE;
@@ -533,6 +610,34 @@ VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uin
 	mesh_features.taskShader = VK_TRUE;
 	mesh_features.meshShader = VK_TRUE;
 
+	// Lets the shaders take raw pointers to the geometry buffers via push constants.
+	VkPhysicalDeviceBufferDeviceAddressFeatures features_bda = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES
+	};
+	features_bda.bufferDeviceAddress = VK_TRUE;
+
+	// Bindless: one global set of storage buffers and textures that draws index into.
+	VkPhysicalDeviceDescriptorIndexingFeatures features_indexing = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES
+	};
+	features_indexing.runtimeDescriptorArray = VK_TRUE;
+	features_indexing.descriptorBindingPartiallyBound = VK_TRUE;
+	features_indexing.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+	features_indexing.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	features_indexing.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+
+	// The software rasterizer's depth and payload in one atomic.
+	VkPhysicalDeviceShaderAtomicInt64Features features_atomic_int64 = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_ATOMIC_INT64_FEATURES
+	};
+	features_atomic_int64.shaderBufferInt64Atomics = VK_TRUE;
+
+	// Passes without VkRenderPass/VkFramebuffer objects.
+	VkPhysicalDeviceDynamicRenderingFeaturesKHR features_dynamic_rendering = {
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR
+	};
+	features_dynamic_rendering.dynamicRendering = VK_TRUE;
+
 	// device_create_info.pEnabledFeatures = &features;
 	device_create_info.pNext = &features2;
 	features2.pNext = &features_8bit;
@@ -540,9 +645,31 @@ VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uin
 	features_8bit.pNext = &features_11;
 	features_11.pNext = &features_f16i8;
 	// features_16bit.pNext = &features_f16i8;
-	if (rtx_supported)
+	void** next = &features_f16i8.pNext;
+	if (features.mesh_shading)
+	{
+		*next = &mesh_features;
+		next = &mesh_features.pNext;
+	}
+	if (features.buffer_device_address)
+	{
+		*next = &features_bda;
+		next = &features_bda.pNext;
+	}
+	if (features.descriptor_indexing)
+	{
+		*next = &features_indexing;
+		next = &features_indexing.pNext;
+	}
+	if (features.buffer_int64_atomics)
+	{
+		*next = &features_atomic_int64;
+		next = &features_atomic_int64.pNext;
+	}
+	if (features.dynamic_rendering)
 	{
-		features_f16i8.pNext = &mesh_features;
+		*next = &features_dynamic_rendering;
+		next = &features_dynamic_rendering.pNext;
 	}
 
 	VkDevice device = VK_NULL_HANDLE;
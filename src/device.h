@@ -1,5 +1,18 @@
 #pragma once
 
+struct DeviceFeatures
+{
+	bool mesh_shading;           // VK_NV_mesh_shader
+	bool buffer_device_address;  // Core in 1.2, but optional.
+	bool descriptor_indexing;    // Core in 1.2, but optional. Only the subset needed for bindless is checked.
+	bool dynamic_rendering;      // VK_KHR_dynamic_rendering
+	bool pipeline_statistics;    // pipelineStatisticsQuery
+	bool calibrated_timestamps;  // VK_EXT_calibrated_timestamps
+	bool inherited_queries;      // inheritedQueries, pipeline statistics across secondary command buffers.
+	bool geometry_shader;        // geometryShader, only for gl_PrimitiveID in fragment shaders.
+	bool buffer_int64_atomics;   // shaderInt64 and shaderBufferInt64Atomics (core in 1.2), for the software rasterizer.
+};
+
 VkInstance CreateInstance();
 
 VkDebugReportCallbackEXT RegisterDebugCallback(VkInstance instance);
@@ -9,4 +22,7 @@ uint32_t GetGraphicsFamilyIndex(VkPhysicalDevice physical_device);
 
 VkPhysicalDevice PickPhysicalDevice(VkInstance instance);
 
-VkDevice CreateDevice(VkInstance instance, VkPhysicalDevice physical_device, uint32_t family_index, bool rtx_supported);
+DeviceFeatures QueryDeviceFeatures(VkPhysicalDevice physical_device);
+
+VkDevice CreateDevice(
+		VkInstance instance, VkPhysicalDevice physical_device, uint32_t family_index, const DeviceFeatures& features);
@@ -0,0 +1,324 @@
+#include "common.h"
+
+#include "geometry.h"
+#include "trace.h"
+
+#include <float.h>
+
+#include <algorithm>
+#include <random>
+
+#include <meshoptimizer.h>
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#pragma warning(pop)
+
+void TriangulateObj(std::vector<Vertex>& vertices, const fastObjMesh& obj)
+{
+	TRACE_SCOPE("triangulate obj");
+
+	size_t index_count = 0;
+	for (size_t i = 0; i < obj.face_count; ++i)
+	{
+		index_count += 3ull * (obj.face_vertices[i] - 2);
+	}
+
+	vertices.resize(index_count);
+
+	size_t vertex_offset = 0;
+	size_t index_offset = 0;
+
+	for (size_t i = 0; i < obj.face_count; ++i)
+	{
+		for (size_t j = 0; j < obj.face_vertices[i]; ++j)
+		{
+			fastObjIndex idx = obj.indices[index_offset + j];
+
+			// Triangulize on the fly, works only for Convex faces.
+			if (j >= 3)
+			{
+				vertices[vertex_offset + 0] = vertices[vertex_offset - 3];
+				vertices[vertex_offset + 1] = vertices[vertex_offset - 1];
+				vertex_offset += 2;
+			}
+
+			Vertex& v = vertices[vertex_offset++];
+
+
+			float nx = obj.normals[idx.n * 3 + 0];
+			float ny = obj.normals[idx.n * 3 + 1];
+			float nz = obj.normals[idx.n * 3 + 2];
+
+			v.vx = obj.positions[idx.p * 3 + 0];
+			v.vy = obj.positions[idx.p * 3 + 1];
+			v.vz = obj.positions[idx.p * 3 + 2];
+			// v.vx = meshopt_quantizeHalf(obj.positions[idx.p * 3 + 0]);
+			// v.vy = meshopt_quantizeHalf(obj.positions[idx.p * 3 + 1]);
+			// v.vz = meshopt_quantizeHalf(obj.positions[idx.p * 3 + 2]);
+			// TODO: Fix rounding.
+			v.nx = uint8_t(nx * 127.0f + 127.0f);
+			v.ny = uint8_t(ny * 127.0f + 127.0f);
+			v.nz = uint8_t(nz * 127.0f + 127.0f);
+			// v.tu = obj.texcoords[idx.t * 3 + 0];
+			// v.tv = obj.texcoords[idx.t * 3 + 1];
+			v.tu = meshopt_quantizeHalf(obj.texcoords[idx.t * 3 + 0]);
+			v.tv = meshopt_quantizeHalf(obj.texcoords[idx.t * 3 + 1]);
+		}
+
+		index_offset += obj.face_vertices[i];
+	}
+	assert(vertex_offset == index_count);
+}
+
+void IndexMesh(Mesh& mesh, const std::vector<Vertex>& vertices)
+{
+	TRACE_SCOPE("index mesh");
+
+	const size_t index_count = vertices.size();
+
+	std::vector<uint32_t> remap(index_count);
+	size_t unique_vertices_count = meshopt_generateVertexRemap(
+			remap.data(), nullptr, index_count, vertices.data(), index_count, sizeof(Vertex));
+
+	mesh.vertices.resize(unique_vertices_count);
+	mesh.indices.resize(index_count);
+
+	meshopt_remapVertexBuffer(mesh.vertices.data(), vertices.data(), index_count, sizeof(Vertex), remap.data());
+	meshopt_remapIndexBuffer(mesh.indices.data(), nullptr, index_count, remap.data());
+}
+
+void OptimizeVertexCache(Mesh& mesh)
+{
+	TRACE_SCOPE("optimize vertex cache");
+	meshopt_optimizeVertexCache(mesh.indices.data(), mesh.indices.data(), mesh.indices.size(), mesh.vertices.size());
+}
+
+void OptimizeVertexFetch(Mesh& mesh)
+{
+	TRACE_SCOPE("optimize vertex fetch");
+	meshopt_optimizeVertexFetch(mesh.vertices.data(), mesh.indices.data(), mesh.indices.size(), mesh.vertices.data(),
+			mesh.vertices.size(), sizeof(Vertex));
+}
+
+void ShuffleTriangles(Mesh& mesh, uint32_t seed)
+{
+	struct Triangle
+	{
+		unsigned int v[3];
+	};
+	Triangle* triangles = reinterpret_cast<Triangle*>(mesh.indices.data());
+	std::shuffle(triangles, triangles + mesh.indices.size() / 3, std::mt19937(seed));
+}
+
+void SplitVertices(std::vector<VertexPosition>& positions, std::vector<VertexAttributes>& attributes,
+		const Vertex* vertices, size_t count)
+{
+	TRACE_SCOPE("split vertices");
+
+	positions.resize(count);
+	attributes.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Vertex& v = vertices[i];
+		positions[i] = { v.vx, v.vy, v.vz };
+		attributes[i] = { v.nx, v.ny, v.nz, v.nw, v.tu, v.tv };
+	}
+}
+
+bool LoadMesh(Mesh& result, const char* path)
+{
+	TRACE_SCOPE("load mesh");
+	fastObjMesh* obj = fast_obj_read(path);
+	if (!obj)
+	{
+		return false;
+	}
+
+	std::vector<Vertex> vertices;
+	TriangulateObj(vertices, *obj);
+
+	fast_obj_destroy(obj);
+
+	const bool kUseIndices = true;
+	if (!kUseIndices)  // No indexing.
+	{
+		result.vertices = vertices;
+		result.indices.resize(vertices.size());
+
+		for (uint32_t i = 0; i < vertices.size(); ++i)
+		{
+			result.indices[i] = i;
+		}
+	}
+	else
+	{
+		// Make index buffer.
+		IndexMesh(result, vertices);
+
+		const bool kSimulateShittyOrdering = false;
+		if (kSimulateShittyOrdering)
+		{
+			ShuffleTriangles(result, 0);
+		}
+
+		// Optimize mesh for more efficient GPU rendering.
+		const bool kOptimizeVertexCache = true;
+		if (kOptimizeVertexCache)
+		{
+			OptimizeVertexCache(result);
+			OptimizeVertexFetch(result);
+		}
+	}
+
+	return true;
+}
+
+void BuildMeshlets(Mesh& mesh, size_t max_vertices, size_t max_triangles)
+{
+	TRACE_SCOPE("build meshlets");
+
+	mesh.meshlets.clear();
+	mesh.meshlet_data.clear();
+
+	AppendMeshlets(mesh, mesh.indices.data(), mesh.indices.size(), max_vertices, max_triangles);
+	PadMeshlets(mesh);
+}
+
+void AppendMeshlets(Mesh& mesh, const uint32_t* indices, size_t index_count, size_t max_vertices, size_t max_triangles)
+{
+	assert(max_vertices <= kMaxMeshletVertices && max_triangles <= kMaxMeshletTriangles);
+
+	std::vector<meshopt_Meshlet> meshlets(meshopt_buildMeshletsBound(index_count, max_vertices, max_triangles));
+	meshlets.resize(meshopt_buildMeshlets(
+			meshlets.data(), indices, index_count, mesh.vertices.size(), max_vertices, max_triangles));
+
+	const size_t meshlet_offset = mesh.meshlets.size();
+	mesh.meshlets.resize(meshlet_offset + meshlets.size());
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		const meshopt_Meshlet& meshlet = meshlets[i];
+
+		const uint32_t data_offset = (uint32_t)mesh.meshlet_data.size();
+
+		// for (size_t j = 0; j < meshlet.vertex_count; ++j)
+		//{
+		//	mesh.meshlet_data.push_back(meshlet.vertices[j]);
+		//}
+		mesh.meshlet_data.insert(mesh.meshlet_data.end(), meshlet.vertices, meshlet.vertices + meshlet.vertex_count);
+
+		const size_t index_group_count = (meshlet.triangle_count * 3 + 3) / 4;
+		// uint32_t index_groups[(kMaxMeshletTriangles * 3 + 3) / 4] = {};
+		// memcpy(index_groups, meshlet.indices, meshlet.triangle_count * 3);
+		const uint32_t* index_groups = reinterpret_cast<const uint32_t*>(meshlet.indices);
+		mesh.meshlet_data.insert(mesh.meshlet_data.end(), index_groups, index_groups + index_group_count);
+
+		const meshopt_Bounds bounds =
+				meshopt_computeMeshletBounds(&meshlet, &mesh.vertices[0].vx, mesh.vertices.size(), sizeof(Vertex));
+
+		Meshlet m = {};
+		m.data_offset = data_offset;
+		m.vertex_count = meshlet.vertex_count;
+		m.triangle_count = meshlet.triangle_count;
+
+		m.center = glm::vec3(bounds.center[0], bounds.center[1], bounds.center[2]);
+		m.radius = bounds.radius;
+		// m.cone_axis = glm::vec3(bounds.cone_axis[0], bounds.cone_axis[1], bounds.cone_axis[2]);
+		// m.cone_cutoff = bounds.cone_cutoff;
+		m.cone_axis[0] = bounds.cone_axis_s8[0];
+		m.cone_axis[1] = bounds.cone_axis_s8[1];
+		m.cone_axis[2] = bounds.cone_axis_s8[2];
+		m.cone_cutoff = bounds.cone_cutoff_s8;
+		// m.cone_apex = glm::vec3(bounds.cone_apex[0], bounds.cone_apex[1], bounds.cone_apex[2]);
+		// m.padding = 0;
+
+		// Exact at level 0 and never replaced, until BuildClusterLods says otherwise.
+		m.lod_bounds = glm::vec4(m.center, m.radius);
+		m.parent_bounds = m.lod_bounds;
+		m.lod_error = 0.0f;
+		m.parent_error = FLT_MAX;
+
+		mesh.meshlets[meshlet_offset + i] = m;
+	}
+}
+
+void PadMeshlets(Mesh& mesh)
+{
+	// TODO: We don't really need this, but this way we can guarantee that every
+	// thread in a warp accesses valid data. Once we have to push constants, we
+	// can then add the check.
+	while (mesh.meshlets.size() % 32 != 0)
+	{
+		mesh.meshlets.push_back(Meshlet());  // No triangles, and both LOD errors 0 never pass the LOD test.
+	}
+}
+
+void GetMeshletTriangles(std::vector<uint32_t>& indices, const Mesh& mesh, const Meshlet& meshlet)
+{
+	// The packed indices are bytes in the order meshopt_Meshlet::indices has them, 4 to a uint32_t.
+	const uint32_t* vertices = &mesh.meshlet_data[meshlet.data_offset];
+	const uint8_t* local_indices = reinterpret_cast<const uint8_t*>(vertices + meshlet.vertex_count);
+	for (uint32_t i = 0; i < meshlet.triangle_count * 3u; ++i)
+	{
+		indices.push_back(vertices[local_indices[i]]);
+	}
+}
+
+glm::vec4 GetBoundingSphere(const Mesh& mesh)
+{
+	if (mesh.vertices.empty())
+	{
+		return glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+
+	glm::vec3 box_min(mesh.vertices[0].vx, mesh.vertices[0].vy, mesh.vertices[0].vz);
+	glm::vec3 box_max = box_min;
+	for (const Vertex& v : mesh.vertices)
+	{
+		box_min = glm::min(box_min, glm::vec3(v.vx, v.vy, v.vz));
+		box_max = glm::max(box_max, glm::vec3(v.vx, v.vy, v.vz));
+	}
+
+	const glm::vec3 center = (box_min + box_max) * 0.5f;
+	float radius = 0.0f;
+	for (const Vertex& v : mesh.vertices)
+	{
+		radius = std::max(radius, glm::length(glm::vec3(v.vx, v.vy, v.vz) - center));
+	}
+
+	return glm::vec4(center.x, center.y, center.z, radius);
+}
+
+MeshRange AppendMesh(Mesh& geometry, const Mesh& mesh)
+{
+	assert(geometry.meshlets.size() % 32 == 0 && mesh.meshlets.size() % 32 == 0);
+
+	MeshRange range = {};
+	range.vertex_offset = uint32_t(geometry.vertices.size());
+	range.index_offset = uint32_t(geometry.indices.size());
+	range.index_count = uint32_t(mesh.indices.size());
+	range.meshlet_offset = uint32_t(geometry.meshlets.size());
+	range.meshlet_count = uint32_t(mesh.meshlets.size());
+	range.bounds = GetBoundingSphere(mesh);
+
+	const uint32_t data_offset = uint32_t(geometry.meshlet_data.size());
+
+	geometry.vertices.insert(geometry.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+	geometry.indices.insert(geometry.indices.end(), mesh.indices.begin(), mesh.indices.end());
+	geometry.meshlet_data.insert(geometry.meshlet_data.end(), mesh.meshlet_data.begin(), mesh.meshlet_data.end());
+
+	for (const Meshlet& meshlet : mesh.meshlets)
+	{
+		Meshlet m = meshlet;
+		m.data_offset += data_offset;
+		for (uint32_t i = 0; i < m.vertex_count; ++i)
+		{
+			geometry.meshlet_data[m.data_offset + i] += range.vertex_offset;
+		}
+		geometry.meshlets.push_back(m);
+	}
+
+	return range;
+}
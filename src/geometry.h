@@ -0,0 +1,126 @@
+#pragma once
+
+#include <fast_obj.h>
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#pragma warning(pop)
+
+// CPU side of the geometry: loading, indexing and meshlet building. Nothing in here touches Vulkan, so it can be
+// benchmarked without a GPU (see bench.cpp).
+
+// The limits the mesh shader is compiled for (max_vertices, max_primitives), meshlets can be smaller.
+const size_t kMaxMeshletVertices = 64;
+const size_t kMaxMeshletTriangles = 124;
+
+struct Vertex
+{
+	// TODO: Do this switch optionally, via flag.
+	float vx, vy, vz;
+	// uint16_t vx, vy, vz, vw;
+	// float nx, ny, nz;
+	uint8_t nx, ny, nz, nw;
+	// float tu, tv;
+	uint16_t tu, tv;
+};
+
+// The split layout of Vertex: a stream of just the positions and one of the rest, see SplitVertices. Passes that only
+// need the positions (depth only) don't pull the attributes through the cache then.
+struct VertexPosition
+{
+	float vx, vy, vz;
+};
+
+struct VertexAttributes
+{
+	uint8_t nx, ny, nz, nw;
+	uint16_t tu, tv;
+};
+
+struct alignas(16) Meshlet
+{
+	glm::vec3 center;
+	float radius;
+	int8_t cone_axis[3];
+	int8_t cone_cutoff;
+	// glm::vec3 cone_apex;
+	// float padding;
+
+	// [data_offset, (data_offset + vertex_count - 1)] stores vertex indices
+	// [(data_offset + vertex_count), (data_offset + vertex_count + index_count)] stores packed 4b meshlet indices
+	uint32_t data_offset;
+
+	// OLD
+	// uint32_t vertices[64];
+	// gl_PrimitiveCountNV + gl_PrimitiveINdicesNV[]
+	// OLD: // together should take no more than 128 bytes, hence 42 triangles + count.
+	// together they up a multiple of 128 bytes, indices take bytes, the count 4 bytes (wtf, why?), hence 126
+	// triangles / + count. We lower to 124 triangles for a divisibility by 4.
+	// uint8_t indices[124 * 3];
+
+	uint8_t vertex_count;
+	uint8_t triangle_count;
+	uint8_t lod_level;  // 0 for the meshlets of the full mesh, see lod.h.
+
+	// The LOD cut, see lod.h. Spheres as xyz center, w radius, errors in mesh units. A meshlet is drawn if the lod
+	// error is small enough on screen but the parent error is not.
+	alignas(16) glm::vec4 lod_bounds;  // The group it was simplified from, or its own bounds at level 0.
+	glm::vec4 parent_bounds;           // The group it was simplified in, the same as lod_bounds if none.
+	float lod_error;
+	float parent_error;  // FLT_MAX if it was never simplified further.
+};
+
+struct Mesh
+{
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<Meshlet> meshlets;
+	std::vector<uint32_t> meshlet_data;
+};
+
+// Where a mesh ended up in the combined geometry of several meshes, see AppendMesh.
+struct MeshRange
+{
+	uint32_t vertex_offset;
+	uint32_t index_offset;
+	uint32_t index_count;
+	uint32_t meshlet_offset;  // A multiple of 32 like the meshlet count, the task shader works on groups of 32.
+	uint32_t meshlet_count;
+	glm::vec4 bounds;  // See GetBoundingSphere.
+};
+
+// fast_obj_read, TriangulateObj, IndexMesh, OptimizeVertexCache and OptimizeVertexFetch in a row.
+bool LoadMesh(Mesh& result, const char* path);
+
+// The stages of LoadMesh on their own.
+// One vertex per triangle corner, faces are fanned out (convex faces only).
+void TriangulateObj(std::vector<Vertex>& vertices, const fastObjMesh& obj);
+// Deduplicates the corners into mesh.vertices and mesh.indices.
+void IndexMesh(Mesh& mesh, const std::vector<Vertex>& vertices);
+void OptimizeVertexCache(Mesh& mesh);
+void OptimizeVertexFetch(Mesh& mesh);
+// Random triangle order, a worst case for the vertex cache.
+void ShuffleTriangles(Mesh& mesh, uint32_t seed);
+
+// Deinterleaves count vertices into the two streams of the split layout, replacing their contents.
+void SplitVertices(std::vector<VertexPosition>& positions, std::vector<VertexAttributes>& attributes,
+		const Vertex* vertices, size_t count);
+
+// Replaces the meshlets of the mesh.
+void BuildMeshlets(
+		Mesh& mesh, size_t max_vertices = kMaxMeshletVertices, size_t max_triangles = kMaxMeshletTriangles);
+// Builds meshlets for some triangles of the mesh and adds them to the end, at level 0 of their own LOD.
+void AppendMeshlets(Mesh& mesh, const uint32_t* indices, size_t index_count, size_t max_vertices, size_t max_triangles);
+// Adds empty meshlets up to a multiple of 32, the task shader works on groups of 32.
+void PadMeshlets(Mesh& mesh);
+// Appends the triangles of a meshlet to indices, as indices into mesh.vertices.
+void GetMeshletTriangles(std::vector<uint32_t>& indices, const Mesh& mesh, const Meshlet& meshlet);
+
+// Around the center of the bounding box, xyz center, w radius. Not the smallest sphere, but close for most meshes.
+glm::vec4 GetBoundingSphere(const Mesh& mesh);
+
+// Concatenates mesh to geometry, so that all meshes can share the same buffers. The indices stay relative to the mesh,
+// draws add vertex_offset. The vertex indices in the meshlet data are made absolute, nothing offsets those.
+MeshRange AppendMesh(Mesh& geometry, const Mesh& mesh);
@@ -0,0 +1,249 @@
+#include "common.h"
+
+#include "instances.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <string.h>
+
+// MSVC allows AVX2 intrinsics without /arch:AVX2, GCC and clang need the target attribute. Either way the code only
+// runs after IsAvx2Supported.
+#if defined(_M_X64) || defined(__x86_64__)
+#define INSTANCES_AVX2 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#else
+#define INSTANCES_AVX2 0
+#endif
+
+bool instance_avx2_enabled = true;
+
+bool IsAvx2Supported()
+{
+#if INSTANCES_AVX2
+	static const bool supported = [] {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+		{
+			return false;
+		}
+
+		// The OS has to save the YMM registers too.
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+		{
+			return false;
+		}
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}();
+	return supported;
+#else
+	return false;
+#endif
+}
+
+void ResizeInstances(InstanceStore& store, size_t count)
+{
+	const size_t padded_count = (count + 7) & ~size_t(7);
+
+	store.count = count;
+	std::vector<float>* arrays[] = { &store.position_x, &store.position_y, &store.position_z, &store.scale,
+		&store.orientation_x, &store.orientation_y, &store.orientation_z, &store.orientation_w, &store.center_x,
+		&store.center_y, &store.center_z, &store.radius };
+	for (std::vector<float>* array : arrays)
+	{
+		array->assign(padded_count, 0.0f);
+	}
+	store.mesh.assign(padded_count, 0);
+}
+
+void SetInstance(InstanceStore& store, size_t index, const glm::vec3& position, float scale,
+		const glm::quat& orientation, uint32_t mesh)
+{
+	assert(index < store.count);
+	store.position_x[index] = position.x;
+	store.position_y[index] = position.y;
+	store.position_z[index] = position.z;
+	store.scale[index] = scale;
+	store.orientation_x[index] = orientation.x;
+	store.orientation_y[index] = orientation.y;
+	store.orientation_z[index] = orientation.z;
+	store.orientation_w[index] = orientation.w;
+	store.mesh[index] = mesh;
+}
+
+// Rotate by the quaternion, scale, translate, like TransformSphere: v + w t + cross(q, t) with t = 2 cross(q, v).
+static void TransformBounds(InstanceStore& store, const glm::vec4* mesh_bounds, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; ++i)
+	{
+		const glm::vec4& bounds = mesh_bounds[store.mesh[i]];
+		const float qx = store.orientation_x[i];
+		const float qy = store.orientation_y[i];
+		const float qz = store.orientation_z[i];
+		const float qw = store.orientation_w[i];
+
+		const float tx = 2.0f * (qy * bounds.z - qz * bounds.y);
+		const float ty = 2.0f * (qz * bounds.x - qx * bounds.z);
+		const float tz = 2.0f * (qx * bounds.y - qy * bounds.x);
+		const float rx = bounds.x + qw * tx + (qy * tz - qz * ty);
+		const float ry = bounds.y + qw * ty + (qz * tx - qx * tz);
+		const float rz = bounds.z + qw * tz + (qx * ty - qy * tx);
+
+		store.center_x[i] = rx * store.scale[i] + store.position_x[i];
+		store.center_y[i] = ry * store.scale[i] + store.position_y[i];
+		store.center_z[i] = rz * store.scale[i] + store.position_z[i];
+		store.radius[i] = bounds.w * store.scale[i];
+	}
+}
+
+// Writes the indices of the visible instances to visible, returns how many.
+static size_t TestBounds(
+		const InstanceStore& store, const Frustum& frustum, size_t begin, size_t end, uint32_t* visible)
+{
+	size_t visible_count = 0;
+	for (size_t i = begin; i < end; ++i)
+	{
+		bool inside = true;
+		for (const glm::vec4& plane : frustum.planes)
+		{
+			const float distance =
+					plane.x * store.center_x[i] + plane.y * store.center_y[i] + plane.z * store.center_z[i] + plane.w;
+			inside = inside && distance >= -store.radius[i];
+		}
+
+		visible[visible_count] = uint32_t(i);
+		visible_count += inside;
+	}
+	return visible_count;
+}
+
+#if INSTANCES_AVX2
+// The same 8 instances at a time. begin is a multiple of 8, end is padded up to one.
+AVX2_TARGET static void TransformBoundsAvx2(
+		InstanceStore& store, const glm::vec4* mesh_bounds, size_t begin, size_t end)
+{
+	const float* bounds = &mesh_bounds[0].x;
+	const __m256 two = _mm256_set1_ps(2.0f);
+
+	for (size_t i = begin; i < end; i += 8)
+	{
+		const __m256i offsets = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i*)&store.mesh[i]), 2);
+		const __m256 bx = _mm256_i32gather_ps(bounds + 0, offsets, 4);
+		const __m256 by = _mm256_i32gather_ps(bounds + 1, offsets, 4);
+		const __m256 bz = _mm256_i32gather_ps(bounds + 2, offsets, 4);
+		const __m256 bw = _mm256_i32gather_ps(bounds + 3, offsets, 4);
+
+		const __m256 qx = _mm256_loadu_ps(&store.orientation_x[i]);
+		const __m256 qy = _mm256_loadu_ps(&store.orientation_y[i]);
+		const __m256 qz = _mm256_loadu_ps(&store.orientation_z[i]);
+		const __m256 qw = _mm256_loadu_ps(&store.orientation_w[i]);
+
+		const __m256 tx = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qy, bz), _mm256_mul_ps(qz, by)));
+		const __m256 ty = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qz, bx), _mm256_mul_ps(qx, bz)));
+		const __m256 tz = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qx, by), _mm256_mul_ps(qy, bx)));
+		const __m256 rx = _mm256_add_ps(_mm256_add_ps(bx, _mm256_mul_ps(qw, tx)),
+				_mm256_sub_ps(_mm256_mul_ps(qy, tz), _mm256_mul_ps(qz, ty)));
+		const __m256 ry = _mm256_add_ps(_mm256_add_ps(by, _mm256_mul_ps(qw, ty)),
+				_mm256_sub_ps(_mm256_mul_ps(qz, tx), _mm256_mul_ps(qx, tz)));
+		const __m256 rz = _mm256_add_ps(_mm256_add_ps(bz, _mm256_mul_ps(qw, tz)),
+				_mm256_sub_ps(_mm256_mul_ps(qx, ty), _mm256_mul_ps(qy, tx)));
+
+		const __m256 scale = _mm256_loadu_ps(&store.scale[i]);
+		const __m256 px = _mm256_loadu_ps(&store.position_x[i]);
+		const __m256 py = _mm256_loadu_ps(&store.position_y[i]);
+		const __m256 pz = _mm256_loadu_ps(&store.position_z[i]);
+		_mm256_storeu_ps(&store.center_x[i], _mm256_add_ps(_mm256_mul_ps(rx, scale), px));
+		_mm256_storeu_ps(&store.center_y[i], _mm256_add_ps(_mm256_mul_ps(ry, scale), py));
+		_mm256_storeu_ps(&store.center_z[i], _mm256_add_ps(_mm256_mul_ps(rz, scale), pz));
+		_mm256_storeu_ps(&store.radius[i], _mm256_mul_ps(bw, scale));
+	}
+}
+
+AVX2_TARGET static size_t TestBoundsAvx2(
+		const InstanceStore& store, const Frustum& frustum, size_t begin, size_t end, uint32_t* visible)
+{
+	size_t visible_count = 0;
+	for (size_t i = begin; i < end; i += 8)
+	{
+		const __m256 cx = _mm256_loadu_ps(&store.center_x[i]);
+		const __m256 cy = _mm256_loadu_ps(&store.center_y[i]);
+		const __m256 cz = _mm256_loadu_ps(&store.center_z[i]);
+		const __m256 negative_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&store.radius[i]));
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (const glm::vec4& plane : frustum.planes)
+		{
+			const __m256 x = _mm256_mul_ps(_mm256_set1_ps(plane.x), cx);
+			const __m256 y = _mm256_mul_ps(_mm256_set1_ps(plane.y), cy);
+			const __m256 z = _mm256_mul_ps(_mm256_set1_ps(plane.z), cz);
+			const __m256 distance = _mm256_add_ps(_mm256_add_ps(x, y), _mm256_add_ps(z, _mm256_set1_ps(plane.w)));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negative_radius, _CMP_GE_OQ));
+		}
+
+		// Without the padding.
+		uint32_t mask = uint32_t(_mm256_movemask_ps(inside));
+		mask &= end - i < 8 ? (1u << (end - i)) - 1 : 0xff;
+
+		for (uint32_t j = 0; j < 8; ++j)
+		{
+			visible[visible_count] = uint32_t(i + j);
+			visible_count += (mask >> j) & 1;
+		}
+	}
+	return visible_count;
+}
+#endif
+
+void CullInstances(std::vector<uint32_t>& visible, InstanceStore& store, const std::vector<glm::vec4>& mesh_bounds,
+		const Frustum& frustum)
+{
+	TRACE_SCOPE("cull instances");
+	assert(store.count == 0 || !mesh_bounds.empty());
+
+	// A multiple of 8. Small enough that the bounds are still in the cache when they are tested.
+	const size_t kBatchSize = 2048;
+
+	// Every batch writes its visible instances to where it starts, they are moved together afterwards. The 8 extra
+	// take the writes for the padding in the last batch, TestBounds* write an index for every instance they test.
+	const size_t batch_count = (store.count + kBatchSize - 1) / kBatchSize;
+	std::vector<size_t> batch_visible_counts(batch_count);
+	visible.resize(store.count + 8);
+
+	ParallelFor(store.count, kBatchSize, [&](size_t begin, size_t end) {
+		size_t visible_count = 0;
+#if INSTANCES_AVX2
+		if (instance_avx2_enabled && IsAvx2Supported())
+		{
+			TransformBoundsAvx2(store, mesh_bounds.data(), begin, end);
+			visible_count = TestBoundsAvx2(store, frustum, begin, end, &visible[begin]);
+		}
+		else
+#endif
+		{
+			TransformBounds(store, mesh_bounds.data(), begin, end);
+			visible_count = TestBounds(store, frustum, begin, end, &visible[begin]);
+		}
+		batch_visible_counts[begin / kBatchSize] = visible_count;
+	});
+
+	size_t visible_count = 0;
+	for (size_t batch = 0; batch < batch_count; ++batch)
+	{
+		memmove(&visible[visible_count], &visible[batch * kBatchSize], batch_visible_counts[batch] * sizeof(uint32_t));
+		visible_count += batch_visible_counts[batch];
+	}
+	visible.resize(visible_count);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "bvh.h"
+
+// Instances as structure of arrays, for culling on the CPU without streaming the rest of MeshDraw through the cache.
+// The kernels work on 8 instances at once, with AVX2 where the CPU has it. The arrays are padded to a multiple of 8,
+// the padding is never reported visible.
+struct InstanceStore
+{
+	size_t count;
+
+	std::vector<float> position_x;
+	std::vector<float> position_y;
+	std::vector<float> position_z;
+	std::vector<float> scale;
+	std::vector<float> orientation_x;
+	std::vector<float> orientation_y;
+	std::vector<float> orientation_z;
+	std::vector<float> orientation_w;
+	std::vector<uint32_t> mesh;  // Into the mesh bounds passed to CullInstances.
+
+	// World space bounding spheres, written by CullInstances.
+	std::vector<float> center_x;
+	std::vector<float> center_y;
+	std::vector<float> center_z;
+	std::vector<float> radius;
+};
+
+// The AVX2 kernels are used where the CPU supports them, this can turn them off to compare with the scalar ones.
+extern bool instance_avx2_enabled;
+
+bool IsAvx2Supported();
+
+void ResizeInstances(InstanceStore& store, size_t count);
+void SetInstance(InstanceStore& store, size_t index, const glm::vec3& position, float scale,
+		const glm::quat& orientation, uint32_t mesh);
+
+// Transforms the mesh bounds (xyz center, w radius, see GetBoundingSphere) of every instance into world space and
+// replaces visible with the indices of those that intersect the frustum, in order. In batches on all threads.
+void CullInstances(std::vector<uint32_t>& visible, InstanceStore& store, const std::vector<glm::vec4>& mesh_bounds,
+		const Frustum& frustum);
@@ -0,0 +1,68 @@
+#include "common.h"
+
+#include "loader.h"
+#include "lod.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+void StartMeshLoader(MeshLoader& loader, const std::vector<std::string>& paths, bool meshlets,
+		size_t meshlet_max_vertices, size_t meshlet_max_triangles)
+{
+	assert(loader.jobs.pending == 0);
+
+	loader.paths = paths;
+	loader.meshes.clear();
+	loader.meshes.resize(paths.size());
+	loader.meshlets = meshlets;
+	loader.meshlet_max_vertices = meshlet_max_vertices;
+	loader.meshlet_max_triangles = meshlet_max_triangles;
+	loader.cancel = false;
+	loader.finished.clear();
+	loader.finished_count = 0;
+	loader.failed_count = 0;
+
+	// One job per mesh. BuildClusterLods spreads over more jobs of its own, so a single large mesh keeps the workers
+	// busy as well.
+	RunBackgroundJob(loader.jobs, [&loader] {
+		ParallelFor(loader.paths.size(), 1, [&loader](size_t begin, size_t end) {
+			for (size_t i = begin; i < end && !loader.cancel; ++i)
+			{
+				TRACE_SCOPE("load mesh");
+
+				Mesh& mesh = loader.meshes[i];
+				const bool rc = LoadMesh(mesh, loader.paths[i].c_str());
+				if (!rc)
+				{
+					printf("Can't load %s\n", loader.paths[i].c_str());
+					mesh = Mesh();
+				}
+				else if (loader.meshlets)
+				{
+					BuildMeshlets(mesh, loader.meshlet_max_vertices, loader.meshlet_max_triangles);
+					BuildClusterLods(mesh, loader.meshlet_max_vertices, loader.meshlet_max_triangles);
+				}
+
+				std::lock_guard<std::mutex> lock(loader.mutex);
+				loader.finished.push_back(uint32_t(i));
+				loader.finished_count++;
+				loader.failed_count += rc ? 0 : 1;
+			}
+		});
+	});
+}
+
+void StopMeshLoader(MeshLoader& loader)
+{
+	loader.cancel = true;
+	WaitForJobs(loader.jobs);
+}
+
+bool TakeLoadedMeshes(MeshLoader& loader, std::vector<uint32_t>& indices)
+{
+	std::lock_guard<std::mutex> lock(loader.mutex);
+	indices.insert(indices.end(), loader.finished.begin(), loader.finished.end());
+	const bool more = !loader.finished.empty() || loader.finished_count < loader.paths.size();
+	loader.finished.clear();
+	return more;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "geometry.h"
+#include "parallel.h"
+
+#include <mutex>
+#include <string>
+
+// Loads meshes in background jobs (see RunBackgroundJob) while the frames go on, and hands every mesh over as soon as
+// it's ready, in whatever order they finish. With meshlets, a mesh is ready once its meshlets and cluster LODs are
+// built as well.
+struct MeshLoader
+{
+	std::vector<std::string> paths;
+	std::vector<Mesh> meshes;  // Indexed like paths. A mesh belongs to the jobs until it's handed over.
+	bool meshlets;
+	size_t meshlet_max_vertices;
+	size_t meshlet_max_triangles;
+
+	JobCounter jobs;
+	std::atomic<bool> cancel{ false };  // Meshes that haven't started yet are skipped.
+
+	std::mutex mutex;
+	std::vector<uint32_t> finished;  // Not handed over yet.
+	uint32_t finished_count;         // Handed over or not, failed ones included.
+	uint32_t failed_count;           // Left empty.
+};
+
+void StartMeshLoader(MeshLoader& loader, const std::vector<std::string>& paths, bool meshlets,
+		size_t meshlet_max_vertices, size_t meshlet_max_triangles);
+// Cancels what hasn't started and waits for the rest.
+void StopMeshLoader(MeshLoader& loader);
+
+// Appends the indices of the meshes that finished since the last call, failed ones are empty. Returns false once
+// everything has been handed over.
+bool TakeLoadedMeshes(MeshLoader& loader, std::vector<uint32_t>& indices);
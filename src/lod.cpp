@@ -0,0 +1,605 @@
+#include "common.h"
+
+#include "lod.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include <meshoptimizer.h>
+
+#pragma warning(push)
+#pragma warning(disable : 4103)
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#pragma warning(pop)
+
+// A group only becomes a level if simplifying it takes away at least this much of its triangles. Otherwise its
+// meshlets are the coarsest there is of that part of the mesh.
+const double kLodMinReduction = 0.15;
+
+// A group of meshlets of one level, simplified as a whole.
+struct SimplifiedGroup
+{
+	std::vector<uint32_t> indices;
+	glm::vec4 bounds;  // Of the group, and of the meshlets built from it.
+	float error;       // Same.
+	bool reduced;      // By at least kLodMinReduction, otherwise the group moves up a level as it is.
+};
+
+// Quadric error metric (Garland, Heckbert - 1997 - Surface Simplification Using Quadric Error Metrics): the sum of the
+// squared distances to a set of planes, as the upper half of a symmetric 4x4 matrix.
+struct Quadric
+{
+	double a00, a01, a02, a11, a12, a22;
+	double b0, b1, b2;
+	double c;
+};
+
+// The plane through p with the unit normal n.
+static void AddPlane(Quadric& q, const glm::vec3& n, const glm::vec3& p)
+{
+	const double d = -glm::dot(n, p);
+	q.a00 += double(n.x) * n.x;
+	q.a01 += double(n.x) * n.y;
+	q.a02 += double(n.x) * n.z;
+	q.a11 += double(n.y) * n.y;
+	q.a12 += double(n.y) * n.z;
+	q.a22 += double(n.z) * n.z;
+	q.b0 += n.x * d;
+	q.b1 += n.y * d;
+	q.b2 += n.z * d;
+	q.c += d * d;
+}
+
+static void AddQuadric(Quadric& q, const Quadric& other)
+{
+	q.a00 += other.a00;
+	q.a01 += other.a01;
+	q.a02 += other.a02;
+	q.a11 += other.a11;
+	q.a12 += other.a12;
+	q.a22 += other.a22;
+	q.b0 += other.b0;
+	q.b1 += other.b1;
+	q.b2 += other.b2;
+	q.c += other.c;
+}
+
+static double EvaluateQuadric(const Quadric& q, const glm::vec3& p)
+{
+	const double x = p.x;
+	const double y = p.y;
+	const double z = p.z;
+	const double result = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z +
+			2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z + q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+	return std::max(result, 0.0);  // Rounding.
+}
+
+// The vertices of the triangles around vertex, sorted, vertex itself included.
+static void GetNeighbours(std::vector<uint32_t>& neighbours, uint32_t vertex, const std::vector<uint32_t>& triangles,
+		const std::vector<uint32_t>& first_triangle, const std::vector<uint32_t>& vertex_triangles)
+{
+	neighbours.clear();
+	for (uint32_t i = first_triangle[vertex]; i < first_triangle[vertex + 1]; ++i)
+	{
+		const uint32_t* triangle = &triangles[vertex_triangles[i] * 3];
+		neighbours.insert(neighbours.end(), triangle, triangle + 3);
+	}
+	std::sort(neighbours.begin(), neighbours.end());
+	neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+}
+
+// Moving from onto to must not turn any of the triangles that stay upside down. And the two may only share the two
+// neighbours across their edge, with more the surface would fold onto itself.
+static bool CanCollapse(uint32_t from, uint32_t to, const std::vector<uint32_t>& triangles,
+		const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& first_triangle,
+		const std::vector<uint32_t>& vertex_triangles, std::vector<uint32_t> (&neighbours)[2])
+{
+	for (uint32_t i = first_triangle[from]; i < first_triangle[from + 1]; ++i)
+	{
+		const uint32_t* triangle = &triangles[vertex_triangles[i] * 3];
+		if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+		{
+			continue;  // Goes away.
+		}
+
+		glm::vec3 p[3];
+		glm::vec3 moved[3];
+		for (uint32_t j = 0; j < 3; ++j)
+		{
+			p[j] = positions[triangle[j]];
+			moved[j] = positions[triangle[j] == from ? to : triangle[j]];
+		}
+
+		const glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+		const glm::vec3 moved_normal = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+		if (glm::dot(normal, moved_normal) <= 0.0f)
+		{
+			return false;
+		}
+	}
+
+	GetNeighbours(neighbours[0], from, triangles, first_triangle, vertex_triangles);
+	GetNeighbours(neighbours[1], to, triangles, first_triangle, vertex_triangles);
+
+	uint32_t shared_count = 0;
+	for (uint32_t neighbour : neighbours[1])
+	{
+		const bool shared = neighbour != from && neighbour != to &&
+				std::binary_search(neighbours[0].begin(), neighbours[0].end(), neighbour);
+		shared_count += shared ? 1 : 0;
+	}
+
+	return shared_count <= 2;
+}
+
+// Half edge collapses, cheapest first by the quadric error: a vertex moves onto a neighbour and the triangles between
+// the two go away. No vertex changes, so the result indexes the same vertices. Locked vertices stay, and so do those
+// on edges without exactly two triangles (borders, and seams where the vertices are split for their attributes). Stops
+// at target_index_count or once nothing can move anymore. Returns the largest error of a collapse, how far the
+// surface may have moved.
+static float SimplifyLocked(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices,
+		const std::vector<uint8_t>& locked, size_t target_index_count)
+{
+	// Only the vertices the triangles use, renumbered from 0.
+	std::vector<uint32_t> local_vertices(indices);
+	std::sort(local_vertices.begin(), local_vertices.end());
+	local_vertices.erase(std::unique(local_vertices.begin(), local_vertices.end()), local_vertices.end());
+
+	const size_t vertex_count = local_vertices.size();
+	std::vector<uint32_t> triangles(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		triangles[i] = uint32_t(
+				std::lower_bound(local_vertices.begin(), local_vertices.end(), indices[i]) - local_vertices.begin());
+	}
+
+	std::vector<glm::vec3> positions(vertex_count);
+	std::vector<uint8_t> fixed(vertex_count);
+	for (size_t i = 0; i < vertex_count; ++i)
+	{
+		const Vertex& v = vertices[local_vertices[i]];
+		positions[i] = glm::vec3(v.vx, v.vy, v.vz);
+		fixed[i] = locked[local_vertices[i]];
+	}
+
+	std::vector<uint64_t> edges;
+	for (size_t i = 0; i < triangles.size(); ++i)
+	{
+		const uint32_t a = triangles[i];
+		const uint32_t b = triangles[i % 3 == 2 ? i - 2 : i + 1];
+		edges.push_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b));
+	}
+	std::sort(edges.begin(), edges.end());
+	for (size_t begin = 0, end = 0; begin < edges.size(); begin = end)
+	{
+		while (end < edges.size() && edges[end] == edges[begin])
+		{
+			++end;
+		}
+		if (end - begin != 2)
+		{
+			fixed[edges[begin] >> 32] = 1;
+			fixed[uint32_t(edges[begin])] = 1;
+		}
+	}
+
+	// The planes of the triangles around every vertex. Collapses add up the quadrics, so the error is measured against
+	// the original surface.
+	std::vector<Quadric> quadrics(vertex_count, Quadric());
+	for (size_t i = 0; i < triangles.size(); i += 3)
+	{
+		const glm::vec3& p0 = positions[triangles[i + 0]];
+		const glm::vec3 normal = glm::cross(positions[triangles[i + 1]] - p0, positions[triangles[i + 2]] - p0);
+		const float length = glm::length(normal);
+		if (length > 0.0f)
+		{
+			for (uint32_t j = 0; j < 3; ++j)
+			{
+				AddPlane(quadrics[triangles[i + j]], normal / length, p0);
+			}
+		}
+	}
+
+	struct Collapse
+	{
+		double cost;
+		uint32_t from;
+		uint32_t to;
+	};
+
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> first_triangle(vertex_count + 1);
+	std::vector<uint32_t> vertex_triangles;
+	std::vector<uint32_t> neighbours[2];
+	std::vector<uint8_t> touched(vertex_count);
+	std::vector<uint8_t> removed;
+	double max_cost = 0.0;
+
+	// In passes, every pass moves vertices whose triangles no other collapse of the pass has changed, then the
+	// adjacency and costs are brought up to date.
+	size_t index_count = triangles.size();
+	while (index_count > target_index_count)
+	{
+		std::fill(first_triangle.begin(), first_triangle.end(), 0);
+		for (size_t i = 0; i < index_count; ++i)
+		{
+			++first_triangle[triangles[i] + 1];
+		}
+		for (size_t i = 0; i < vertex_count; ++i)
+		{
+			first_triangle[i + 1] += first_triangle[i];
+		}
+		vertex_triangles.resize(index_count);
+		std::vector<uint32_t> offsets(first_triangle.begin(), first_triangle.end() - 1);
+		for (size_t i = 0; i < index_count; ++i)
+		{
+			vertex_triangles[offsets[triangles[i]]++] = uint32_t(i / 3);
+		}
+
+		collapses.clear();
+		for (size_t i = 0; i < index_count; ++i)
+		{
+			const uint32_t a = triangles[i];
+			const uint32_t b = triangles[i % 3 == 2 ? i - 2 : i + 1];
+			Quadric q = quadrics[a];
+			AddQuadric(q, quadrics[b]);
+			if (!fixed[a])
+			{
+				collapses.push_back({ EvaluateQuadric(q, positions[b]), a, b });
+			}
+			if (!fixed[b])
+			{
+				collapses.push_back({ EvaluateQuadric(q, positions[a]), b, a });
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(),
+				[](const Collapse& l, const Collapse& r) { return l.cost < r.cost; });
+
+		std::fill(touched.begin(), touched.end(), 0);
+		removed.assign(index_count / 3, 0);
+		size_t remaining_count = index_count;
+		size_t collapse_count = 0;
+		for (const Collapse& collapse : collapses)
+		{
+			if (remaining_count <= target_index_count)
+			{
+				break;
+			}
+			if (touched[collapse.from] || touched[collapse.to] ||
+					!CanCollapse(collapse.from, collapse.to, triangles, positions, first_triangle, vertex_triangles,
+							neighbours))
+			{
+				continue;
+			}
+
+			for (uint32_t i = first_triangle[collapse.from]; i < first_triangle[collapse.from + 1]; ++i)
+			{
+				uint32_t* triangle = &triangles[vertex_triangles[i] * 3];
+				touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+				if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+				{
+					removed[vertex_triangles[i]] = 1;
+					remaining_count -= 3;
+				}
+				else
+				{
+					for (uint32_t j = 0; j < 3; ++j)
+					{
+						triangle[j] = triangle[j] == collapse.from ? collapse.to : triangle[j];
+					}
+				}
+			}
+
+			AddQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+			max_cost = std::max(max_cost, collapse.cost);
+			++collapse_count;
+		}
+
+		if (collapse_count == 0)
+		{
+			break;
+		}
+
+		size_t write = 0;
+		for (size_t i = 0; i < index_count; i += 3)
+		{
+			if (!removed[i / 3])
+			{
+				triangles[write++] = triangles[i + 0];
+				triangles[write++] = triangles[i + 1];
+				triangles[write++] = triangles[i + 2];
+			}
+		}
+		index_count = write;
+	}
+
+	indices.resize(index_count);
+	for (size_t i = 0; i < index_count; ++i)
+	{
+		indices[i] = local_vertices[triangles[i]];
+	}
+
+	// The sum over all planes is at least the squared distance to the farthest one.
+	return float(sqrt(max_cost));
+}
+
+// The smallest sphere around both (xyz center, w radius).
+static glm::vec4 MergeSpheres(const glm::vec4& a, const glm::vec4& b)
+{
+	const glm::vec3 offset = glm::vec3(b) - glm::vec3(a);
+	const float distance = glm::length(offset);
+	if (distance + b.w <= a.w)
+	{
+		return a;
+	}
+	if (distance + a.w <= b.w)
+	{
+		return b;
+	}
+
+	const float radius = (distance + a.w + b.w) * 0.5f;
+	return glm::vec4(glm::vec3(a) + offset * ((radius - a.w) / distance), radius);
+}
+
+// The meshlets of a level in groups of up to kLodGroupSize neighbours, by the positions they share. Greedy: a group
+// takes the meshlet that shares the most with it until it is full or has no neighbours left, then the next group
+// starts at the first meshlet left over. Meshlets at the same place in the mesh are mostly next to each other already.
+static std::vector<std::vector<uint32_t>> GroupMeshlets(
+		const Mesh& mesh, const std::vector<uint32_t>& level, const std::vector<uint32_t>& position_ids)
+{
+	// (position, meshlet) pairs, the meshlets as indices into level.
+	std::vector<uint64_t> uses;
+	for (uint32_t i = 0; i < level.size(); ++i)
+	{
+		const Meshlet& meshlet = mesh.meshlets[level[i]];
+		for (uint32_t j = 0; j < meshlet.vertex_count; ++j)
+		{
+			uses.push_back(uint64_t(position_ids[mesh.meshlet_data[meshlet.data_offset + j]]) << 32 | i);
+		}
+	}
+	std::sort(uses.begin(), uses.end());
+	uses.erase(std::unique(uses.begin(), uses.end()), uses.end());
+
+	// (meshlet, neighbour) once per position they share, sorted the duplicates count the positions.
+	std::vector<uint64_t> pairs;
+	for (size_t begin = 0, end = 0; begin < uses.size(); begin = end)
+	{
+		while (end < uses.size() && uses[end] >> 32 == uses[begin] >> 32)
+		{
+			++end;
+		}
+		for (size_t a = begin; a < end; ++a)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				if (a != b)
+				{
+					pairs.push_back(uses[a] << 32 | uint32_t(uses[b]));
+				}
+			}
+		}
+	}
+	std::sort(pairs.begin(), pairs.end());
+
+	std::vector<uint32_t> first_neighbour(level.size() + 1);
+	std::vector<uint32_t> neighbours;
+	std::vector<uint32_t> shared_counts;
+	for (size_t begin = 0, end = 0; begin < pairs.size(); begin = end)
+	{
+		while (end < pairs.size() && pairs[end] == pairs[begin])
+		{
+			++end;
+		}
+		++first_neighbour[(pairs[begin] >> 32) + 1];
+		neighbours.push_back(uint32_t(pairs[begin]));
+		shared_counts.push_back(uint32_t(end - begin));
+	}
+	for (size_t i = 0; i < level.size(); ++i)
+	{
+		first_neighbour[i + 1] += first_neighbour[i];
+	}
+
+	std::vector<std::vector<uint32_t>> groups;
+	std::vector<uint8_t> grouped(level.size());
+	std::vector<std::pair<uint32_t, uint32_t>> candidates;  // Neighbour and what it shares with the whole group.
+	for (uint32_t seed = 0; seed < level.size(); ++seed)
+	{
+		if (grouped[seed])
+		{
+			continue;
+		}
+
+		std::vector<uint32_t> group(1, seed);
+		grouped[seed] = 1;
+		while (group.size() < kLodGroupSize)
+		{
+			candidates.clear();
+			for (uint32_t member : group)
+			{
+				for (uint32_t i = first_neighbour[member]; i < first_neighbour[member + 1]; ++i)
+				{
+					if (grouped[neighbours[i]])
+					{
+						continue;
+					}
+
+					auto it = std::find_if(candidates.begin(), candidates.end(),
+							[&](const std::pair<uint32_t, uint32_t>& c) { return c.first == neighbours[i]; });
+					if (it == candidates.end())
+					{
+						candidates.push_back(std::make_pair(neighbours[i], shared_counts[i]));
+					}
+					else
+					{
+						it->second += shared_counts[i];
+					}
+				}
+			}
+
+			if (candidates.empty())
+			{
+				break;
+			}
+
+			auto best = std::max_element(candidates.begin(), candidates.end(),
+					[](const std::pair<uint32_t, uint32_t>& l, const std::pair<uint32_t, uint32_t>& r) {
+						return l.second < r.second;
+					});
+			group.push_back(best->first);
+			grouped[best->first] = 1;
+		}
+
+		for (uint32_t& member : group)
+		{
+			member = level[member];
+		}
+		groups.push_back(group);
+	}
+
+	return groups;
+}
+
+void BuildClusterLods(Mesh& mesh, size_t max_vertices, size_t max_triangles)
+{
+	TRACE_SCOPE("build cluster lods");
+
+	const size_t vertex_count = mesh.vertices.size();
+	if (vertex_count == 0)
+	{
+		return;
+	}
+
+	// Vertices split for their normals or texture coordinates share a position id. Neighbouring groups can see
+	// different vertices of the same position, so group borders are found by position. Split vertices stay where they
+	// are, moving one would tear the seam open.
+	std::vector<glm::vec3> positions(vertex_count);
+	for (size_t i = 0; i < vertex_count; ++i)
+	{
+		positions[i] = glm::vec3(mesh.vertices[i].vx, mesh.vertices[i].vy, mesh.vertices[i].vz);
+	}
+	std::vector<uint32_t> position_ids(vertex_count);
+	const size_t position_count = meshopt_generateVertexRemap(
+			position_ids.data(), nullptr, vertex_count, positions.data(), vertex_count, sizeof(glm::vec3));
+
+	std::vector<uint32_t> position_vertex_counts(position_count);
+	for (size_t i = 0; i < vertex_count; ++i)
+	{
+		++position_vertex_counts[position_ids[i]];
+	}
+
+	std::vector<uint32_t> level;
+	for (uint32_t i = 0; i < mesh.meshlets.size(); ++i)
+	{
+		if (mesh.meshlets[i].triangle_count > 0)
+		{
+			level.push_back(i);
+		}
+	}
+
+	std::vector<uint32_t> position_groups(position_count);
+	std::vector<uint8_t> group_border(position_count);
+	std::vector<uint8_t> locked(vertex_count);
+
+	bool simplified_any = true;
+	for (uint8_t lod_level = 1; level.size() > 1 && simplified_any && lod_level < kMaxLodLevels; ++lod_level)
+	{
+		const std::vector<std::vector<uint32_t>> groups = GroupMeshlets(mesh, level, position_ids);
+
+		// Whatever is on the border between two groups stays, that's what keeps the levels of neighbouring groups
+		// together without cracks.
+		std::fill(position_groups.begin(), position_groups.end(), ~0u);
+		std::fill(group_border.begin(), group_border.end(), 0);
+		for (uint32_t group = 0; group < groups.size(); ++group)
+		{
+			for (uint32_t meshlet_index : groups[group])
+			{
+				const Meshlet& meshlet = mesh.meshlets[meshlet_index];
+				for (uint32_t i = 0; i < meshlet.vertex_count; ++i)
+				{
+					const uint32_t position = position_ids[mesh.meshlet_data[meshlet.data_offset + i]];
+					group_border[position] |= position_groups[position] != ~0u && position_groups[position] != group;
+					position_groups[position] = group;
+				}
+			}
+		}
+		for (size_t i = 0; i < vertex_count; ++i)
+		{
+			locked[i] = group_border[position_ids[i]] || position_vertex_counts[position_ids[i]] > 1;
+		}
+
+		// The groups of a level don't depend on each other, only putting the results into the mesh has to keep their
+		// order.
+		std::vector<SimplifiedGroup> simplified_groups(groups.size());
+		ParallelFor(groups.size(), 1, [&](size_t begin, size_t end) {
+			std::vector<uint32_t> indices;
+			for (size_t i = begin; i < end; ++i)
+			{
+				SimplifiedGroup& result = simplified_groups[i];
+				result.bounds = mesh.meshlets[groups[i][0]].lod_bounds;
+				result.error = 0.0f;
+
+				indices.clear();
+				for (uint32_t meshlet_index : groups[i])
+				{
+					const Meshlet& meshlet = mesh.meshlets[meshlet_index];
+					GetMeshletTriangles(indices, mesh, meshlet);
+					result.bounds = MergeSpheres(result.bounds, meshlet.lod_bounds);
+					result.error = std::max(result.error, meshlet.lod_error);
+				}
+
+				result.indices = indices;
+				const float simplify_error =
+						SimplifyLocked(result.indices, mesh.vertices, locked, indices.size() / 6 * 3);
+				result.reduced = double(result.indices.size()) <= double(indices.size()) * (1.0 - kLodMinReduction);
+
+				// At least the error of every member, so the error only grows on the way up.
+				result.error = std::max(result.error, simplify_error);
+			}
+		});
+
+		std::vector<uint32_t> next_level;
+		simplified_any = false;
+		for (size_t group_index = 0; group_index < groups.size(); ++group_index)
+		{
+			const std::vector<uint32_t>& group = groups[group_index];
+			const SimplifiedGroup& simplified = simplified_groups[group_index];
+			if (!simplified.reduced)
+			{
+				// Tried again with other neighbours on the next level. Until then the group is not simplified, so
+				// its vertices have to be locked like any other group border.
+				next_level.insert(next_level.end(), group.begin(), group.end());
+				continue;
+			}
+
+			const glm::vec4 bounds = simplified.bounds;
+			const float error = simplified.error;
+			simplified_any = true;
+			for (uint32_t meshlet_index : group)
+			{
+				mesh.meshlets[meshlet_index].parent_bounds = bounds;
+				mesh.meshlets[meshlet_index].parent_error = error;
+			}
+
+			const size_t first = mesh.meshlets.size();
+			AppendMeshlets(mesh, simplified.indices.data(), simplified.indices.size(), max_vertices, max_triangles);
+			for (size_t i = first; i < mesh.meshlets.size(); ++i)
+			{
+				Meshlet& meshlet = mesh.meshlets[i];
+				meshlet.lod_level = lod_level;
+				meshlet.lod_bounds = bounds;
+				meshlet.lod_error = error;
+				meshlet.parent_bounds = bounds;
+				next_level.push_back(uint32_t(i));
+			}
+		}
+
+		level.swap(next_level);
+	}
+
+	PadMeshlets(mesh);
+}
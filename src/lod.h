@@ -0,0 +1,24 @@
+#pragma once
+
+#include "geometry.h"
+
+// Continuous LOD on meshlets (clusters), after the Nanite talk (Karis, SIGGRAPH 2021 Advances).
+//
+// Level 0 are the meshlets of the full mesh. Neighbouring meshlets of a level are grouped, every group is simplified to
+// about half its triangles and split into meshlets again, those are the next level. The vertices a group shares with
+// other groups stay where they are, so whatever level the neighbours are drawn at, there are no cracks. The levels
+// form a DAG: a meshlet can come from one group and end up in another.
+//
+// Every meshlet knows the group it was simplified from (lod_bounds, lod_error) and the group it was simplified in
+// (parent_bounds, parent_error). All meshlets of a group see the same values for it, and a group contains its members'
+// groups and has at least their error, so the projected errors only grow towards the coarse levels. For any threshold
+// that makes exactly one cut through the DAG: draw the meshlets whose lod error is below it and whose parent error
+// is not. meshlet.task.glsl does that per meshlet, every frame.
+
+// Groups of up to this many meshlets are simplified together.
+const size_t kLodGroupSize = 4;
+const uint8_t kMaxLodLevels = 16;
+
+// Appends the coarser levels to the meshlets of BuildMeshlets, with the same limits, and pads the meshlets again.
+void BuildClusterLods(Mesh& mesh, size_t max_vertices = kMaxMeshletVertices,
+		size_t max_triangles = kMaxMeshletTriangles);
@@ -5,18 +5,31 @@
 #pragma warning(disable : 26495)
 
 #include <algorithm>
+#include <atomic>
+#include <random>
 
-#include <fast_obj.h>
-#include <meshoptimizer.h>
 #include <volk.h>
 #include <GLFW/glfw3.h>
 
 #include "common.h"
 
+#include "benchmark.h"
+#include "bvh.h"
 #include "device.h"
+#include "geometry.h"
+#include "instances.h"
+#include "loader.h"
+#include "lod.h"
+#include "parallel.h"
+#include "profiler.h"
 #include "resources.h"
+#include "scene.h"
 #include "shaders.h"
+#include "sort.h"
+#include "stats.h"
+#include "streaming.h"
 #include "swapchain.h"
+#include "trace.h"
 
 // Prevent warning from glm includes. Compiler bug, see here:
 // https://developercommunity.visualstudio.com/t/warning-c4103-in-visual-studio-166-update/1057589
@@ -29,58 +42,133 @@
 #pragma warning(pop)
 
 VkSemaphore CreateSemaphore(VkDevice device);
-VkRenderPass CreateRenderPass(VkDevice device, VkFormat color_format, VkFormat depth_format);
+VkFence CreateFence(VkDevice device, bool signaled);
+VkRenderPass CreateRenderPass(VkDevice device, VkFormat color_format, VkFormat depth_format, bool present);
 VkFramebuffer CreateFrameBuffer(VkDevice device, VkRenderPass render_pass, VkImageView color_view,
 		VkImageView depth_view, uint32_t width, uint32_t height);
 VkCommandPool CreateCommandBufferPool(VkDevice device, uint32_t family_index);
+VkCommandBuffer AllocateCommandBuffer(
+		VkDevice device, VkCommandPool cmd_pool, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 
-struct Vertex
+// The CPU records frame N + 1 while the GPU is still busy with frame N.
+const uint32_t kMaxFramesInFlight = 2;
+
+// Distributions over the last kStatsWindow frames, see stats.h.
+enum FrameTiming
 {
-	// TODO: Do this switch optionally, via flag.
-	float vx, vy, vz;
-	// uint16_t vx, vy, vz, vw;
-	// float nx, ny, nz;
-	uint8_t nx, ny, nz, nw;
-	// float tu, tv;
-	uint16_t tu, tv;
+	kTimingCpuFrame,
+	kTimingRecord,
+	kTimingDrawRecord,  // The part of kTimingRecord that records the draws, see record_threads.
+	kTimingFenceWait,
+	kTimingAcquire,
+	kTimingPresent,
+	kTimingGpuFrame,  // Lags kProfilerLatency frames behind.
+	kTimingCount,
 };
 
-struct alignas(16) Meshlet
-{
-	glm::vec3 center;
-	float radius;
-	int8_t cone_axis[3];
-	int8_t cone_cutoff;
-	// glm::vec3 cone_apex;
-	// float padding;
-
-	// [data_offset, (data_offset + vertex_count - 1)] stores vertex indices
-	// [(data_offset + vertex_count), (data_offset + vertex_count + index_count)] stores packed 4b meshlet indices
-	uint32_t data_offset;
-
-	// OLD
-	// uint32_t vertices[64];
-	// gl_PrimitiveCountNV + gl_PrimitiveINdicesNV[]
-	// OLD: // together should take no more than 128 bytes, hence 42 triangles + count.
-	// together they up a multiple of 128 bytes, indices take bytes, the count 4 bytes (wtf, why?), hence 126
-	// triangles / + count. We lower to 124 triangles for a divisibility by 4.
-	// uint8_t indices[124 * 3];
-
-	uint8_t vertex_count;
-	uint8_t triangle_count;
+// Also the keys in the snapshots.
+const char* kFrameTimingNames[kTimingCount] = { "cpu_frame", "record", "draw_record", "fence_wait", "acquire",
+	"present", "gpu_frame" };
+
+const char* kStatsSnapshotPath = "niagara.stats.jsonl";
+const double kStatsSnapshotInterval = 1.0;  // In seconds.
+
+// How often the meshes loaded in the background are appended to the geometry, in seconds.
+const double kResidencyInterval = 0.1;
+// Most geometry a frame uploads while meshes load in the background, the rest waits for the next frames. The draws
+// come on top, see Frame::upload_buffer.
+const size_t kFrameUploadSize = 16 * 1024 * 1024;
+
+// Everything that can't be reused before the GPU is done with the frame.
+struct Frame
+{
+	VkCommandPool cmd_pool;
+	VkCommandBuffer cmd_buf;
+	// One pool and secondary command buffer per recording thread, see record_threads.
+	std::vector<VkCommandPool> draw_cmd_pools;
+	std::vector<VkCommandBuffer> draw_cmd_bufs;
+	VkFence fence;  // Signaled once the frame's submission has completed.
+	VkSemaphore aquire_semaphore;
+	VkSemaphore release_semaphore;
+
+	// CullingCounters, host visible, only read once the fence has been waited on. When streaming, followed by the page
+	// table (see streaming.h).
+	Buffer counter_buffer;
+	bool counters_recorded;  // Whether the last submission of this frame culled into counter_buffer.
+
+	Buffer visible_draw_buffer;  // The draws that passed the CPU culling, host visible, written before submission.
+
+	Buffer sorted_draw_buffer;  // The draws in front to back order, written by the sort shader.
+	Buffer sort_bucket_buffer;  // Its counts and offsets.
+
+	// Only while meshes load in the background: what the frame makes resident, kFrameUploadSize of geometry and all of
+	// the draws. Host visible, written before submission.
+	Buffer upload_buffer;
 };
 
+// Bits of Globals::flags, see mesh.h.
+const uint32_t kGlobalsFlagCull = 1;
+const uint32_t kGlobalsFlagLod = 2;
+const uint32_t kGlobalsFlagStreaming = 4;
+const uint32_t kGlobalsFlagSplitVertices = 8;
+const uint32_t kGlobalsFlagDepthOnly = 16;
+const uint32_t kGlobalsFlagCullTriangles = 32;
+const uint32_t kGlobalsFlagVisibility = 64;
+const uint32_t kGlobalsFlagVisibilityMeshlets = 128;
+const uint32_t kGlobalsFlagTextured = 256;
+const uint32_t kGlobalsFlagSoftwareRaster = 512;
+
 struct alignas(16) Globals
 {
 	glm::mat4 projection;
+	uint32_t flags;
+	float lod_scale;
+	uint32_t attribute_base;
+	uint32_t screen_size;
+};
+
+// See CullingCounters in mesh.h.
+struct CullingCounters
+{
+	uint32_t meshlets_accepted;
+	uint32_t meshlets_rejected;
+	uint32_t triangles_emitted;
+	uint32_t meshlets_not_resident;
+	uint32_t triangles_culled;
+	uint32_t meshlets_software;
+	uint32_t triangles_software;
+};
+
+// See RasterQueue in mesh.h, the queue entries follow.
+struct RasterQueue
+{
+	VkDispatchIndirectCommand dispatch;
+	uint32_t meshlet_count;
 };
 
+// Binding 0 of the bindless set has three buffers per mesh, at these offsets. The meshes share the buffers (see
+// AppendMesh), so all slots point at the same ones, but every mesh reaches them through its own indices. Meshes past
+// kBindlessMeshCount reuse the slots. Binding 1 has kMeshTextureCount textures, see mesh.h.
+const uint32_t kBindlessVertexBuffer = 0;
+const uint32_t kBindlessMeshletBuffer = 1;
+const uint32_t kBindlessMeshletDataBuffer = 2;
+const uint32_t kBindlessBuffersPerMesh = 3;
+const uint32_t kBindlessMeshCount = kBindlessDescriptorCount / kBindlessBuffersPerMesh;
+const uint32_t kMeshTextureCount = 4;
+const uint32_t kResolveTextureBinding = 9;  // The same textures, in resolve.frag.glsl.
+
 struct alignas(16) MeshDraw
 {
 	glm::vec3 position;
 	float scale;
 	glm::quat orientation;
 
+	// Indices into the bindless arrays of set 1.
+	uint32_t vertex_buffer_index;
+	uint32_t meshlet_buffer_index;
+	uint32_t meshlet_data_buffer_index;
+	uint32_t texture_index;
+
 	union
 	{
 		uint32_t command_data[7];
@@ -91,238 +179,770 @@ struct alignas(16) MeshDraw
 			VkDrawMeshTasksIndirectCommandNV command_indirect_ms;  // 2 u32s
 		};
 	};
+
+	uint32_t draw_index;  // See mesh.h, fits in the padding.
 };
+static_assert(sizeof(MeshDraw) == 80, "Has to match the std430 layout of MeshDraw in mesh.h.");
 
-struct Mesh
+// See sort.comp.glsl.
+struct SortConstants
 {
-	std::vector<Vertex> vertices;
-	std::vector<uint32_t> indices;
-	std::vector<Meshlet> meshlets;
-	std::vector<uint32_t> meshlet_data;
+	uint32_t sort_pass;
+	uint32_t draw_count;
 };
 
+// Push constants of the buffer device address binding model, see PushConstants in mesh.h.
+struct alignas(16) BufferAddressConstants
+{
+	Globals globals;
+	VkDeviceAddress draws;
+	VkDeviceAddress meshlets;
+	VkDeviceAddress meshlet_data;
+	VkDeviceAddress vertices;
+	VkDeviceAddress counters;
+	VkDeviceAddress raster_queue;
+};
+static_assert(sizeof(BufferAddressConstants) <= 128, "Exceeds the guaranteed push constant size.");
+
 bool mesh_shading_supported = false;
 bool mesh_shading_enabled = false;
 
-static bool LoadMesh(Mesh& result, const char* path)
+// Cone culling in the task shader, see Globals::flags.
+bool culling_enabled = true;
+
+// Culling of single triangles (back facing, outside, between the samples) in the mesh shader, see IsTriangleCulled in
+// meshlet.mesh.glsl. The rasterizer drops the same ones, this only saves it the work.
+bool triangle_culling_enabled = false;
+
+// Per meshlet LOD in the task shader, see lod.h. The simplified meshlets are drawn where their error is at most this
+// many pixels on screen.
+bool lod_enabled = false;
+const float kLodErrorPixels = 1.0f;
+
+// With --stream only a pool of the meshlet data pages stays on the GPU, the rest is read from this file on demand, see
+// streaming.h.
+const char* kPageFilePath = "meshlet_pages.bin";
+
+// Frustum culling of whole draws on the CPU, only the visible ones are submitted.
+enum CpuCulling
+{
+	kCpuCullingOff,
+	kCpuCullingBvh,        // Traverses the BVH over the draws, see bvh.h.
+	kCpuCullingInstances,  // Tests every instance, 8 at a time, see instances.h.
+	kCpuCullingCount,
+};
+
+const char* kCpuCullingNames[kCpuCullingCount] = { "off", "BVH", "SoA" };
+
+// How they are called in benchmark configs.
+const char* kCpuCullingKeys[kCpuCullingCount] = { "off", "bvh", "soa" };
+
+CpuCulling cpu_culling = kCpuCullingOff;
+
+// Front to back order of the draws, so that early depth testing rejects more of what's hidden. After the CPU culling.
+enum DrawSorting
+{
+	kDrawSortingOff,
+	kDrawSortingDepth,      // Radix sort on the CPU, see sort.h.
+	kDrawSortingDepthMesh,  // Same, coarser in depth and by mesh within a step, for locality.
+	kDrawSortingGpu,        // Counting sort in a compute shader, see sort.comp.glsl.
+	kDrawSortingCount,
+};
+
+const char* kDrawSortingNames[kDrawSortingCount] = { "off", "depth", "depth and mesh", "GPU" };
+
+// How they are called in benchmark configs.
+const char* kDrawSortingKeys[kDrawSortingCount] = { "off", "depth", "mesh", "gpu" };
+
+DrawSorting draw_sorting = kDrawSortingOff;
+
+// 0 records all draws with one indirect call into the primary command buffer. Otherwise the draws are split into
+// batches of kDrawBatchSize that each bind their own state and draw from their own offset, the way draws with
+// different materials would, recorded into this many secondary command buffers on as many threads (at most one per
+// hardware thread).
+uint32_t record_threads = 0;
+// A multiple of 16 draws, so that the offsets of the batches in the draw buffers are aligned for any
+// minStorageBufferOffsetAlignment (256 at most).
+const uint32_t kDrawBatchSize = 16;
+
+// Bits of the depth keys, see GetDepthSortKey. Also the number of buckets of the GPU sort, must match
+// SORT_DEPTH_BITS in sort.comp.glsl.
+const uint32_t kSortDepthBits = 14;
+// Sorting by mesh takes coarser steps in depth (4 per doubling of the distance), so that there are draws of the same
+// mesh to group within a step. Meshes past the 16 bits share a key.
+const uint32_t kSortMeshDepthBits = 10;
+const uint32_t kSortMeshBits = 16;
+
+// Skips the offscreen color target and the full-screen copy into the swapchain image.
+bool render_to_swapchain = false;
+
+// The positions in a stream of their own, the rest of the vertex in another, see Globals::attribute_base in mesh.h.
+// Switching rewrites the vertex buffer.
+bool split_vertices = false;
+// Only depth is written, the shaders skip the attributes, see CreateGraphicsPipeline.
+bool depth_only = false;
+
+// The geometry only writes which triangle covers a pixel, one full screen pass shades every pixel once, see
+// resolve.frag.glsl. Needs dynamic rendering, the frames use it regardless of dynamic_rendering_enabled then, and
+// gl_PrimitiveID in fragment shaders (geometryShader).
+bool visibility_buffer_supported = false;
+bool visibility_buffer = false;
+const VkFormat kVisibilityFormat = VK_FORMAT_R32G32_UINT;  // See kVisibilityTriangleBits in mesh.h.
+const uint32_t kVisibilityEmpty = ~0u;
+
+// With the visibility buffer and mesh shading the meshlets that are only a few pixels wide skip the mesh shader, a
+// compute shader rasterizes them and a full screen pass merges the result into the visibility buffer, see
+// kSoftwareRasterMaxPixels in mesh.h. Needs 64-bit buffer atomics.
+bool software_raster_supported = false;
+bool software_raster = false;
+const uint32_t kSoftwareRasterMaxMeshlets = 1 << 20;  // Must match mesh.h.
+
+bool print_gpu_profile = false;
+bool write_trace = false;
+
+// vkCmdBeginRenderingKHR instead of render pass and framebuffer objects.
+bool dynamic_rendering_supported = false;
+bool dynamic_rendering_enabled = false;
+
+// How the shaders get to the geometry buffers.
+enum BindingModel
 {
-	fastObjMesh* obj = fast_obj_read(path);
-	if (!obj)
+	kBindingPushDescriptors,      // vkCmdPushDescriptorSetWithTemplateKHR
+	kBindingBufferDeviceAddress,  // 64-bit pointers in the push constants
+	kBindingDescriptorIndexing,   // Draws pushed, geometry and textures indexed from one global set
+	kBindingModelCount,
+};
+
+const char* kBindingModelNames[kBindingModelCount] = { "push descriptors", "BDA", "bindless" };
+
+// How they are called in benchmark configs.
+const char* kBindingModelKeys[kBindingModelCount] = { "push", "bda", "bindless" };
+
+// Suffix of the shader variants compiled for each binding model, see niagara.vcxproj.
+const char* kBindingModelShaderSuffixes[kBindingModelCount] = { "", ".bda", ".bindless" };
+
+bool binding_model_supported[kBindingModelCount] = { true, false, false };
+BindingModel binding_model = kBindingPushDescriptors;
+
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 	{
-		return false;
+		glfwSetWindowShouldClose(window, GLFW_TRUE);
 	}
-
-	size_t index_count = 0;
-	for (size_t i = 0; i < obj->face_count; ++i)
+	else if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
+	{
+		mesh_shading_enabled = (!mesh_shading_enabled) && mesh_shading_supported;
+	}
+	else if (key == GLFW_KEY_K && action == GLFW_PRESS)
+	{
+		culling_enabled = !culling_enabled;
+	}
+	else if (key == GLFW_KEY_X && action == GLFW_PRESS)
+	{
+		triangle_culling_enabled = !triangle_culling_enabled;
+	}
+	else if (key == GLFW_KEY_L && action == GLFW_PRESS)
+	{
+		lod_enabled = !lod_enabled;
+	}
+	else if (key == GLFW_KEY_F && action == GLFW_PRESS)
 	{
-		index_count += 3ull * (obj->face_vertices[i] - 2);
+		cpu_culling = CpuCulling((cpu_culling + 1) % kCpuCullingCount);
 	}
+	else if (key == GLFW_KEY_O && action == GLFW_PRESS)
+	{
+		draw_sorting = DrawSorting((draw_sorting + 1) % kDrawSortingCount);
+	}
+	else if (key == GLFW_KEY_M && action == GLFW_PRESS)
+	{
+		// 0, 1, 2, 4, ... up to the hardware threads, then back to 0.
+		const uint32_t thread_count = GetParallelThreadCount();
+		if (record_threads >= thread_count)
+		{
+			record_threads = 0;
+		}
+		else
+		{
+			record_threads = std::min(std::max(record_threads * 2, 1u), thread_count);
+		}
+	}
+	else if (key == GLFW_KEY_T && action == GLFW_PRESS)
+	{
+		render_to_swapchain = !render_to_swapchain;
+	}
+	else if (key == GLFW_KEY_V && action == GLFW_PRESS)
+	{
+		split_vertices = !split_vertices;
+	}
+	else if (key == GLFW_KEY_Z && action == GLFW_PRESS)
+	{
+		depth_only = !depth_only;
+	}
+	else if (key == GLFW_KEY_G && action == GLFW_PRESS)
+	{
+		visibility_buffer = (!visibility_buffer) && visibility_buffer_supported;
+	}
+	else if (key == GLFW_KEY_Y && action == GLFW_PRESS)
+	{
+		software_raster = (!software_raster) && software_raster_supported;
+	}
+	else if (key == GLFW_KEY_P && action == GLFW_PRESS)
+	{
+		print_gpu_profile = true;
+	}
+	else if (key == GLFW_KEY_C && action == GLFW_PRESS)
+	{
+		write_trace = true;
+	}
+	else if (key == GLFW_KEY_R && action == GLFW_PRESS)
+	{
+		dynamic_rendering_enabled = (!dynamic_rendering_enabled) && dynamic_rendering_supported;
+	}
+	else if (key == GLFW_KEY_B && action == GLFW_PRESS)
+	{
+		// Cycle through the supported binding models.
+		do
+		{
+			binding_model = BindingModel((binding_model + 1) % kBindingModelCount);
+		} while (!binding_model_supported[binding_model]);
+	}
+}
+
+glm::mat4 ReverseInfiniteProjectionRightHandedWithoutEpsilon(float fovy_radians, float aspect_w_by_h, float z_near)
+{
+	float f = 1.0f / tanf(fovy_radians / 2.0f);
+	return glm::mat4(
+			// clang-format off
+			f / aspect_w_by_h, 0.0f,   0.0f,  0.0f,
+			             0.0f,    f,   0.0f,  0.0f,
+			             0.0f, 0.0f,   0.0f, -1.0f,  // From RH -> LH: remove -
+			             0.0f, 0.0f, z_near,  0.0f
+			// clang-format on
+	);
+}
 
-	std::vector<Vertex> vertices(index_count);
+// In [0, 1). std::mt19937 is specified exactly, unlike the standard distributions, so this gives the same sequence
+// with every standard library.
+static float RandomFloat(std::mt19937& rng)
+{
+	return float(rng() >> 8) / float(1 << 24);
+}
 
-	size_t vertex_offset = 0;
-	size_t index_offset = 0;
+// Where the draw finds its mesh in the shared buffers, and in the bindless set.
+static void SetDrawCommands(MeshDraw& draw, const MeshRange& range, uint32_t mesh)
+{
+	const uint32_t first_buffer = (mesh % kBindlessMeshCount) * kBindlessBuffersPerMesh;
+	draw.vertex_buffer_index = first_buffer + kBindlessVertexBuffer;
+	draw.meshlet_buffer_index = first_buffer + kBindlessMeshletBuffer;
+	draw.meshlet_data_buffer_index = first_buffer + kBindlessMeshletDataBuffer;
+	draw.texture_index = mesh % kMeshTextureCount;
+
+	memset(draw.command_data, 0, sizeof(draw.command_data));
+	draw.command_indirect.indexCount = range.index_count;
+	draw.command_indirect.instanceCount = 1;
+	draw.command_indirect.firstIndex = range.index_offset;
+	draw.command_indirect.vertexOffset = int32_t(range.vertex_offset);
+	draw.command_indirect_ms.taskCount = range.meshlet_count / 32;
+	draw.command_indirect_ms.firstTask = range.meshlet_offset / 32;
+}
 
-	for (size_t i = 0; i < obj->face_count; ++i)
+// Same seed, same scene.
+static void GenerateDraws(std::vector<MeshDraw>& draws, size_t draw_count, uint32_t seed, const MeshRange& mesh)
+{
+	std::mt19937 rng(seed);
+
+	draws.resize(draw_count);
+	for (size_t i = 0; i < draw_count; ++i)
 	{
-		for (size_t j = 0; j < obj->face_vertices[i]; ++j)
-		{
-			fastObjIndex idx = obj->indices[index_offset + j];
+		draws[i].position[0] = RandomFloat(rng) * 40.0f - 20.0f;
+		draws[i].position[1] = RandomFloat(rng) * 40.0f - 20.0f;
+		draws[i].position[2] = RandomFloat(rng) * 40.0f - 20.0f;
+		draws[i].scale = RandomFloat(rng) * 2.9f + 0.1f;
+
+		const glm::vec3 axis(
+				RandomFloat(rng) * 2.0f - 1.0f, RandomFloat(rng) * 2.0f - 1.0f, RandomFloat(rng) * 2.0f - 1.0f);
+		const float angle = glm::radians(RandomFloat(rng) * 90.0f);
+		draws[i].orientation = glm::rotate(glm::quat(1.0f, 0.0f, 0.0f, 0.0f), angle, axis);
+		draws[i].draw_index = uint32_t(i);
+
+		SetDrawCommands(draws[i], mesh, 0);
+	}
+}
 
-			// Triangulize on the fly, works only for Convex faces.
-			if (j >= 3)
+// One draw per instance. Scenes can have millions of instances, so they are converted in batches on all threads.
+static bool BuildSceneDraws(std::vector<MeshDraw>& draws, const Scene& scene, const std::vector<MeshRange>& meshes)
+{
+	TRACE_SCOPE("build scene draws");
+
+	const size_t kBatchSize = 4096;
+
+	draws.resize(scene.header->instance_count);
+	std::atomic<bool> valid(true);
+	ParallelFor(draws.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const SceneInstance& instance = scene.instances[i];
+			if (instance.mesh >= meshes.size())
 			{
-				vertices[vertex_offset + 0] = vertices[vertex_offset - 3];
-				vertices[vertex_offset + 1] = vertices[vertex_offset - 1];
-				vertex_offset += 2;
+				valid = false;
+				continue;
 			}
 
-			Vertex& v = vertices[vertex_offset++];
+			MeshDraw& draw = draws[i];
+			draw.position = glm::vec3(instance.position[0], instance.position[1], instance.position[2]);
+			draw.scale = instance.scale;
+			draw.orientation = glm::quat(instance.orientation[3], instance.orientation[0], instance.orientation[1],
+					instance.orientation[2]);
+			draw.draw_index = uint32_t(i);
 
+			SetDrawCommands(draw, meshes[instance.mesh], instance.mesh);
+		}
+	});
 
-			float nx = obj->normals[idx.n * 3 + 0];
-			float ny = obj->normals[idx.n * 3 + 1];
-			float nz = obj->normals[idx.n * 3 + 2];
+	return valid;
+}
 
-			v.vx = obj->positions[idx.p * 3 + 0];
-			v.vy = obj->positions[idx.p * 3 + 1];
-			v.vz = obj->positions[idx.p * 3 + 2];
-			// v.vx = meshopt_quantizeHalf(obj->positions[idx.p * 3 + 0]);
-			// v.vy = meshopt_quantizeHalf(obj->positions[idx.p * 3 + 1]);
-			// v.vz = meshopt_quantizeHalf(obj->positions[idx.p * 3 + 2]);
-			// TODO: Fix rounding.
-			v.nx = uint8_t(nx * 127.0f + 127.0f);
-			v.ny = uint8_t(ny * 127.0f + 127.0f);
-			v.nz = uint8_t(nz * 127.0f + 127.0f);
-			// v.tu = obj->texcoords[idx.t * 3 + 0];
-			// v.tv = obj->texcoords[idx.t * 3 + 1];
-			v.tu = meshopt_quantizeHalf(obj->texcoords[idx.t * 3 + 0]);
-			v.tv = meshopt_quantizeHalf(obj->texcoords[idx.t * 3 + 1]);
-		}
+static bool EndsWith(const std::string& string, const char* suffix)
+{
+	const size_t length = strlen(suffix);
+	return string.size() >= length && string.compare(string.size() - length, length, suffix) == 0;
+}
+
+// The paths of a single .obj or of all meshes of a .scene, which then stays mapped for BuildSceneDraws.
+static bool GetMeshPaths(std::vector<std::string>& paths, Scene& scene, const std::string& path)
+{
+	paths.clear();
+	UnloadScene(scene);
+
+	if (!EndsWith(path, ".scene"))
+	{
+		paths.push_back(path);
+		return true;
+	}
+
+	if (!LoadScene(scene, path.c_str()))
+	{
+		return false;
+	}
 
-		index_offset += obj->face_vertices[i];
+	for (uint32_t i = 0; i < scene.header->mesh_count; ++i)
+	{
+		paths.push_back(GetSceneMeshPath(scene, i));
 	}
-	assert(vertex_offset == index_count);
+	return true;
+}
 
-	fast_obj_destroy(obj);
+static bool LoadMeshes(std::vector<Mesh>& meshes, Scene& scene, const std::string& path)
+{
+	meshes.clear();
 
-	const bool kUseIndices = true;
-	if (!kUseIndices)  // No indexing.
+	std::vector<std::string> paths;
+	if (!GetMeshPaths(paths, scene, path))
 	{
-		result.vertices = vertices;
-		result.indices.resize(index_count);
+		return false;
+	}
 
-		for (uint32_t i = 0; i < index_count; ++i)
+	meshes.resize(paths.size());
+	std::atomic<bool> valid(true);
+	ParallelFor(meshes.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
 		{
-			result.indices[i] = i;
+			if (!LoadMesh(meshes[i], paths[i].c_str()))
+			{
+				printf("Can't load %s\n", paths[i].c_str());
+				valid = false;
+			}
 		}
+	});
+
+	return valid;
+}
+
+// Puts all meshes into one, to share the buffers.
+static void BuildGeometry(Mesh& geometry, std::vector<MeshRange>& ranges, std::vector<Mesh>& meshes, bool meshlets,
+		size_t meshlet_max_vertices, size_t meshlet_max_triangles)
+{
+	TRACE_SCOPE("build geometry");
+
+	if (meshlets)
+	{
+		ParallelFor(meshes.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+			{
+				BuildMeshlets(meshes[i], meshlet_max_vertices, meshlet_max_triangles);
+				BuildClusterLods(meshes[i], meshlet_max_vertices, meshlet_max_triangles);
+			}
+		});
+	}
+
+	geometry = Mesh();
+	ranges.resize(meshes.size());
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		ranges[i] = AppendMesh(geometry, meshes[i]);
+	}
+}
+
+// Instances and draws of a scene, or draw_count random ones of the single mesh.
+static void BuildDraws(std::vector<MeshDraw>& draws, const Scene& scene, const std::vector<MeshRange>& meshes,
+		size_t draw_count, uint32_t seed)
+{
+	if (scene.header)
+	{
+		// LoadScene checked the meshes of the instances.
+		const bool rc = BuildSceneDraws(draws, scene, meshes);
+		assert(rc);
 	}
 	else
 	{
-		// Make index buffer.
-		std::vector<uint32_t> remap(index_count);
-		size_t unique_vertices_count = meshopt_generateVertexRemap(
-				remap.data(), nullptr, index_count, vertices.data(), index_count, sizeof(Vertex));
+		GenerateDraws(draws, draw_count, seed, meshes[0]);
+	}
+}
 
-		result.vertices.resize(unique_vertices_count);
-		result.indices.resize(index_count);
+// How large the largest of the geometry and draw buffers has to be.
+static size_t GetBufferSize(const Mesh& geometry, size_t draw_count)
+{
+	return std::max({ geometry.vertices.size() * sizeof(Vertex), geometry.indices.size() * sizeof(uint32_t),
+			geometry.meshlets.size() * sizeof(Meshlet), geometry.meshlet_data.size() * sizeof(uint32_t),
+			draw_count * sizeof(MeshDraw) });
+}
+
+// The same for every cell of a benchmark, the buffers are created once for all of them. Builds the geometry of each
+// mesh and meshlet size the cells use, once.
+static bool GetBenchmarkBufferSize(size_t& size, const std::vector<BenchmarkCell>& cells, bool meshlets)
+{
+	TRACE_SCOPE("size benchmark buffers");
 
-		meshopt_remapVertexBuffer(result.vertices.data(), vertices.data(), index_count, sizeof(Vertex), remap.data());
-		meshopt_remapIndexBuffer(result.indices.data(), nullptr, index_count, remap.data());
+	struct Built
+	{
+		const BenchmarkCell* cell;
+		size_t geometry_size;
+		size_t instance_count;  // 0 for a single mesh, the cell has the draw count.
+	};
+	std::vector<Built> built;
 
-		const bool kSimulateShittyOrdering = false;
-		if (kSimulateShittyOrdering)
+	size = 0;
+	for (const BenchmarkCell& cell : cells)
+	{
+		auto same_geometry = [&](const Built& b) {
+			return b.cell->mesh_path == cell.mesh_path &&
+					(!meshlets ||
+							(b.cell->meshlet_max_vertices == cell.meshlet_max_vertices &&
+									b.cell->meshlet_max_triangles == cell.meshlet_max_triangles));
+		};
+		auto it = std::find_if(built.begin(), built.end(), same_geometry);
+		if (it == built.end())
 		{
-			struct Triangle
+			std::vector<Mesh> meshes;
+			Scene scene = {};
+			if (!LoadMeshes(meshes, scene, cell.mesh_path))
 			{
-				unsigned int v[3];
-			};
-			std::random_shuffle((Triangle*)result.indices.data(), (Triangle*)(result.indices.data() + index_count));
-		}
+				UnloadScene(scene);
+				return false;
+			}
 
-		// Optimize mesh for more efficient GPU rendering.
-		const bool kOptimizeVertexCache = true;
-		if (kOptimizeVertexCache)
-		{
-			meshopt_optimizeVertexCache(
-					result.indices.data(), result.indices.data(), index_count, unique_vertices_count);
-			meshopt_optimizeVertexFetch(result.vertices.data(), result.indices.data(), index_count,
-					result.vertices.data(), unique_vertices_count, sizeof(Vertex));
+			Mesh geometry;
+			std::vector<MeshRange> ranges;
+			BuildGeometry(geometry, ranges, meshes, meshlets, cell.meshlet_max_vertices, cell.meshlet_max_triangles);
+			built.push_back({ &cell, GetBufferSize(geometry, 0), scene.header ? scene.header->instance_count : 0 });
+			UnloadScene(scene);
+			it = built.end() - 1;
 		}
+
+		const size_t draw_count = it->instance_count ? it->instance_count : cell.draw_count;
+		size = std::max({ size, it->geometry_size, draw_count * sizeof(MeshDraw) });
 	}
 
 	return true;
 }
 
-static void BuildMeshlets(Mesh& mesh)
+// World space bounding spheres, in the order of the draws.
+static void GetDrawSpheres(std::vector<glm::vec4>& spheres, const std::vector<MeshDraw>& draws, const Scene& scene,
+		const std::vector<MeshRange>& meshes)
+{
+	const size_t kBatchSize = 16384;
+
+	spheres.resize(draws.size());
+	ParallelFor(draws.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const MeshRange& mesh = meshes[scene.header ? scene.instances[i].mesh : 0];
+			spheres[i] = TransformSphere(mesh.bounds, draws[i].position, draws[i].scale, draws[i].orientation);
+		}
+	});
+}
+
+// The draws once more, as structure of arrays for the vectorized culling.
+static void BuildInstances(InstanceStore& instances, std::vector<glm::vec4>& mesh_bounds,
+		const std::vector<MeshDraw>& draws, const Scene& scene, const std::vector<MeshRange>& meshes)
 {
-	const size_t kMaxVertices = 64;
-	const size_t kMaxTriangles = 124;
+	const size_t kBatchSize = 16384;
 
-	std::vector<meshopt_Meshlet> meshlets(meshopt_buildMeshletsBound(mesh.indices.size(), kMaxVertices, kMaxTriangles));
-	meshlets.resize(meshopt_buildMeshlets(meshlets.data(), mesh.indices.data(), mesh.indices.size(),
-			mesh.vertices.size(), kMaxVertices, kMaxTriangles));
+	ResizeInstances(instances, draws.size());
+	ParallelFor(draws.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			SetInstance(instances, i, draws[i].position, draws[i].scale, draws[i].orientation,
+					scene.header ? scene.instances[i].mesh : 0);
+		}
+	});
 
-	// TODO: We don't really need this, but this way we can guarantee that every
-	// thread in a warp accesses valid data. Once we have to push constants, we
-	// can then add the check.
-	while (meshlets.size() % 32 != 0)
+	mesh_bounds.resize(meshes.size());
+	for (size_t i = 0; i < meshes.size(); ++i)
 	{
-		meshlets.push_back(meshopt_Meshlet());  // I assume this 0-inits the counts.
+		mesh_bounds[i] = meshes[i].bounds;
 	}
+}
 
-	mesh.meshlets.resize(meshlets.size());
-	for (size_t i = 0; i < meshlets.size(); ++i)
-	{
-		const meshopt_Meshlet& meshlet = meshlets[i];
+// Only the instances that survive the culling make it into the layout of MeshDraw. The instances are in the order of
+// the draws.
+static void PackDraw(MeshDraw& draw, const InstanceStore& instances, size_t index, const std::vector<MeshRange>& meshes)
+{
+	draw.position = glm::vec3(instances.position_x[index], instances.position_y[index], instances.position_z[index]);
+	draw.scale = instances.scale[index];
+	draw.orientation = glm::quat(instances.orientation_w[index], instances.orientation_x[index],
+			instances.orientation_y[index], instances.orientation_z[index]);
+	draw.draw_index = uint32_t(index);
+	SetDrawCommands(draw, meshes[instances.mesh[index]], instances.mesh[index]);
+}
 
-		const uint32_t data_offset = (uint32_t)mesh.meshlet_data.size();
+// Front to back by the origins of the draws, order holds indices into the instances and gets rearranged.
+static void SortDraws(std::vector<uint32_t>& order, std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch,
+		const InstanceStore& instances, bool by_mesh)
+{
+	TRACE_SCOPE("sort draws");
 
-		// for (size_t j = 0; j < meshlet.vertex_count; ++j)
-		//{
-		//	mesh.meshlet_data.push_back(meshlet.vertices[j]);
-		//}
-		mesh.meshlet_data.insert(mesh.meshlet_data.end(), meshlet.vertices, meshlet.vertices + meshlet.vertex_count);
+	const size_t kBatchSize = 16384;
+	const uint32_t kMaxMesh = (1 << kSortMeshBits) - 1;
 
-		const size_t index_group_count = (meshlet.triangle_count * 3 + 3) / 4;
-		// uint32_t index_groups[(kMaxTriangles * 3 + 3) / 4] = {};
-		// memcpy(index_groups, meshlet.indices, meshlet.triangle_count * 3);
-		const uint32_t* index_groups = reinterpret_cast<const uint32_t*>(meshlet.indices);
-		mesh.meshlet_data.insert(mesh.meshlet_data.end(), index_groups, index_groups + index_group_count);
+	// The camera sits at the origin looking down -z.
+	keys.resize(order.size());
+	ParallelFor(order.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t draw = order[i];
+			const float depth = -instances.position_z[draw];
+			uint32_t key = GetDepthSortKey(depth, kSortDepthBits);
+			if (by_mesh)
+			{
+				key = (GetDepthSortKey(depth, kSortMeshDepthBits) << kSortMeshBits) |
+						std::min(instances.mesh[draw], kMaxMesh);
+			}
+			keys[i] = (uint64_t(key) << 32) | draw;
+		}
+	});
 
-		const meshopt_Bounds bounds =
-				meshopt_computeMeshletBounds(&meshlet, &mesh.vertices[0].vx, mesh.vertices.size(), sizeof(Vertex));
+	RadixSort(keys, scratch, by_mesh ? kSortMeshDepthBits + kSortMeshBits : kSortDepthBits);
 
-		Meshlet m = {};
-		m.data_offset = data_offset;
-		m.vertex_count = meshlet.vertex_count;
-		m.triangle_count = meshlet.triangle_count;
+	ParallelFor(order.size(), kBatchSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			order[i] = uint32_t(keys[i]);
+		}
+	});
+}
 
-		m.center = glm::vec3(bounds.center[0], bounds.center[1], bounds.center[2]);
-		m.radius = bounds.radius;
-		// m.cone_axis = glm::vec3(bounds.cone_axis[0], bounds.cone_axis[1], bounds.cone_axis[2]);
-		// m.cone_cutoff = bounds.cone_cutoff;
-		m.cone_axis[0] = bounds.cone_axis_s8[0];
-		m.cone_axis[1] = bounds.cone_axis_s8[1];
-		m.cone_axis[2] = bounds.cone_axis_s8[2];
-		m.cone_cutoff = bounds.cone_cutoff_s8;
-		// m.cone_apex = glm::vec3(bounds.cone_apex[0], bounds.cone_apex[1], bounds.cone_apex[2]);
-		// m.padding = 0;
+static uint64_t CountTriangles(const std::vector<MeshDraw>& draws)
+{
+	uint64_t triangles = 0;
+	for (const MeshDraw& draw : draws)
+	{
+		triangles += draw.command_indirect.indexCount / 3;
+	}
+	return triangles;
+}
 
-		mesh.meshlets[i] = m;
+// The element counts of a mesh, how much of the geometry is on the GPU already.
+struct MeshSizes
+{
+	size_t vertices;
+	size_t indices;
+	size_t meshlets;
+	size_t meshlet_data;
+};
+
+static MeshSizes GetMeshSizes(const Mesh& mesh)
+{
+	return { mesh.vertices.size(), mesh.indices.size(), mesh.meshlets.size(), mesh.meshlet_data.size() };
+}
+
+// Blocking, elements [first, elements.size()) to the same place in the buffer.
+template <typename T>
+static void UploadElements(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue,
+		const Buffer& buffer, const Buffer& scratch, const std::vector<T>& elements, size_t first)
+{
+	assert(buffer.size >= elements.size() * sizeof(T));
+	if (elements.size() > first)
+	{
+		UploadBuffer(device, cmd_pool, cmd_buf, queue, buffer, scratch, &elements[first],
+				(elements.size() - first) * sizeof(T), first * sizeof(T));
 	}
 }
 
-// TODO: Check if timing/querying capability is available.
-VkQueryPool CreateQueryPool(VkDevice device, uint32_t pool_size)
+// Where the attributes of the split layout start in a vertex buffer for vertex_capacity vertices, in VertexAttributes.
+// Right after the positions.
+static uint32_t GetAttributeBase(size_t vertex_capacity)
+{
+	return uint32_t(
+			(vertex_capacity * sizeof(VertexPosition) + sizeof(VertexAttributes) - 1) / sizeof(VertexAttributes));
+}
 
+// Blocking, like UploadElements. attribute_base is 0 for the interleaved layout, see GetAttributeBase otherwise.
+static void UploadVertices(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue,
+		const Buffer& buffer, const Buffer& scratch, const std::vector<Vertex>& vertices, size_t first,
+		uint32_t attribute_base)
 {
-	VkQueryPoolCreateInfo query_pool_create_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
-	// query_pool_create_info.flags;
-	query_pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
-	query_pool_create_info.queryCount = pool_size;
-	// query_pool_create_info.pipelineStatistics;
+	if (!attribute_base)
+	{
+		UploadElements(device, cmd_pool, cmd_buf, queue, buffer, scratch, vertices, first);
+		return;
+	}
 
-	VkQueryPool query_pool = VK_NULL_HANDLE;
-	VK_CHECK(vkCreateQueryPool(device, &query_pool_create_info, nullptr, &query_pool));
+	// The positions must not run into the attributes.
+	assert(vertices.size() * sizeof(VertexPosition) <= attribute_base * sizeof(VertexAttributes));
+	if (vertices.size() > first)
+	{
+		std::vector<VertexPosition> positions;
+		std::vector<VertexAttributes> attributes;
+		SplitVertices(positions, attributes, &vertices[first], vertices.size() - first);
+		UploadBuffer(device, cmd_pool, cmd_buf, queue, buffer, scratch, positions.data(),
+				positions.size() * sizeof(VertexPosition), first * sizeof(VertexPosition));
+		UploadBuffer(device, cmd_pool, cmd_buf, queue, buffer, scratch, attributes.data(),
+				attributes.size() * sizeof(VertexAttributes), (attribute_base + first) * sizeof(VertexAttributes));
+	}
+}
 
-	return query_pool;
+// Blocking, the buffers must not be in use. Only what was added to the mesh since it had the sizes of uploaded. The
+// vertices in the layout of attribute_base, see UploadVertices.
+static void UploadMesh(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue,
+		const Buffer& scratch, const Mesh& mesh, const MeshSizes& uploaded, uint32_t attribute_base,
+		const Buffer& vertex_buffer, const Buffer& index_buffer, const Buffer& meshlet_buffer,
+		const Buffer& meshlet_data_buffer)
+{
+	UploadVertices(device, cmd_pool, cmd_buf, queue, vertex_buffer, scratch, mesh.vertices, uploaded.vertices,
+			attribute_base);
+	UploadElements(device, cmd_pool, cmd_buf, queue, index_buffer, scratch, mesh.indices, uploaded.indices);
+	if (meshlet_buffer.buffer)
+	{
+		UploadElements(device, cmd_pool, cmd_buf, queue, meshlet_buffer, scratch, mesh.meshlets, uploaded.meshlets);
+	}
+	// Empty when streaming, the pages come later.
+	if (meshlet_data_buffer.buffer)
+	{
+		UploadElements(device, cmd_pool, cmd_buf, queue, meshlet_data_buffer, scratch, mesh.meshlet_data,
+				uploaded.meshlet_data);
+	}
 }
 
+// A copy from the upload buffer of a frame, recorded with the frame.
+struct FrameUpload
+{
+	VkBuffer buffer;
+	VkBufferCopy region;
+};
 
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+// Writes size bytes into upload at used, to be copied to offset in buffer.
+static void StageUpload(std::vector<FrameUpload>& uploads, const Buffer& upload, size_t& used, const Buffer& buffer,
+		const void* data, size_t size, size_t offset)
 {
-	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+	assert(used + size <= upload.size);
+	assert(offset + size <= buffer.size);
+	memcpy(static_cast<uint8_t*>(upload.data) + used, data, size);
+	uploads.push_back({ buffer.buffer, { VkDeviceSize(used), VkDeviceSize(offset), VkDeviceSize(size) } });
+	used += size;
+}
+
+// Like UploadElements, but only as many elements as fit into upload before limit. Returns how many.
+template <typename T>
+static size_t StageElements(std::vector<FrameUpload>& uploads, const Buffer& upload, size_t& used, size_t limit,
+		const Buffer& buffer, const std::vector<T>& elements, size_t first)
+{
+	const size_t count = std::min(elements.size() - first, (limit - used) / sizeof(T));
+	if (count > 0)
 	{
-		glfwSetWindowShouldClose(window, GLFW_TRUE);
+		StageUpload(uploads, upload, used, buffer, &elements[first], count * sizeof(T), first * sizeof(T));
 	}
-	else if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
+	return count;
+}
+
+// Like UploadVertices, with the limit of StageElements.
+static size_t StageVertices(std::vector<FrameUpload>& uploads, const Buffer& upload, size_t& used, size_t limit,
+		const Buffer& buffer, const std::vector<Vertex>& vertices, size_t first, uint32_t attribute_base)
+{
+	if (!attribute_base)
 	{
-		mesh_shading_enabled = (!mesh_shading_enabled) && mesh_shading_supported;
+		return StageElements(uploads, upload, used, limit, buffer, vertices, first);
+	}
+
+	const size_t count =
+			std::min(vertices.size() - first, (limit - used) / (sizeof(VertexPosition) + sizeof(VertexAttributes)));
+	if (count > 0)
+	{
+		std::vector<VertexPosition> positions;
+		std::vector<VertexAttributes> attributes;
+		SplitVertices(positions, attributes, &vertices[first], count);
+		StageUpload(uploads, upload, used, buffer, positions.data(), count * sizeof(VertexPosition),
+				first * sizeof(VertexPosition));
+		StageUpload(uploads, upload, used, buffer, attributes.data(), count * sizeof(VertexAttributes),
+				(attribute_base + first) * sizeof(VertexAttributes));
 	}
+	return count;
 }
 
-glm::mat4 ReverseInfiniteProjectionRightHandedWithoutEpsilon(float fovy_radians, float aspect_w_by_h, float z_near)
+// Like UploadMesh without blocking: the copies go into uploads, as much as fits into upload before limit, and
+// uploaded grows by what was staged.
+static void StageMesh(std::vector<FrameUpload>& uploads, const Buffer& upload, size_t& used, size_t limit,
+		const Mesh& mesh, MeshSizes& uploaded, uint32_t attribute_base, const Buffer& vertex_buffer,
+		const Buffer& index_buffer, const Buffer& meshlet_buffer, const Buffer& meshlet_data_buffer)
 {
-	float f = 1.0f / tanf(fovy_radians / 2.0f);
-	return glm::mat4(
-			// clang-format off
-			f / aspect_w_by_h, 0.0f,   0.0f,  0.0f,
-			             0.0f,    f,   0.0f,  0.0f,
-			             0.0f, 0.0f,   0.0f, -1.0f,  // From RH -> LH: remove -
-			             0.0f, 0.0f, z_near,  0.0f
-			// clang-format on
-	);
+	uploaded.vertices += StageVertices(
+			uploads, upload, used, limit, vertex_buffer, mesh.vertices, uploaded.vertices, attribute_base);
+	uploaded.indices += StageElements(uploads, upload, used, limit, index_buffer, mesh.indices, uploaded.indices);
+	if (meshlet_buffer.buffer)
+	{
+		uploaded.meshlets +=
+				StageElements(uploads, upload, used, limit, meshlet_buffer, mesh.meshlets, uploaded.meshlets);
+	}
+	if (meshlet_data_buffer.buffer)
+	{
+		uploaded.meshlet_data += StageElements(
+				uploads, upload, used, limit, meshlet_data_buffer, mesh.meshlet_data, uploaded.meshlet_data);
+	}
+}
+
+static bool IsUploaded(const Mesh& mesh, const MeshSizes& uploaded)
+{
+	return uploaded.vertices == mesh.vertices.size() && uploaded.indices == mesh.indices.size() &&
+			uploaded.meshlets == mesh.meshlets.size() && uploaded.meshlet_data == mesh.meshlet_data.size();
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc < 2)
+	if (argc < 2 || (strcmp(argv[1], "--benchmark") == 0 && argc < 3))
+	{
+		printf("Usage: %s [mesh.obj|world.scene] [--stream pool_mb]\n", argv[0]);
+		printf("       %s --benchmark [config], see benchmark.h\n", argv[0]);
+		return 1;
+	}
+
+	SetTraceThreadName("main");
+	const uint64_t startup_begin = GetTraceTime();
+
+	BenchmarkConfig benchmark_config = {};
+	const bool benchmark_mode = strcmp(argv[1], "--benchmark") == 0;
+	if (benchmark_mode && !LoadBenchmarkConfig(benchmark_config, argv[2]))
 	{
-		printf("Usage: %s [mesh]\n", argv[0]);
 		return 1;
 	}
 
+	// Benchmarks rebuild the geometry between cells, the page file would have to follow. Interactive runs only.
+	size_t stream_pool_mb = 0;
+	if (!benchmark_mode && argc >= 4 && strcmp(argv[2], "--stream") == 0)
+	{
+		stream_pool_mb = size_t(atoi(argv[3]));
+	}
+
 	const int rc = glfwInit();
 	assert(rc == 1);
 
@@ -344,20 +964,53 @@ int main(int argc, char* argv[])
 	VkPhysicalDevice physical_device = PickPhysicalDevice(instance);
 	assert(physical_device);
 
-	uint32_t extension_count = 0;
-	VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, nullptr));
-	std::vector<VkExtensionProperties> extensions(extension_count);
-	VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, extensions.data()));
-	mesh_shading_supported = false;
-	for (const auto& ext : extensions)
+	const DeviceFeatures device_features = QueryDeviceFeatures(physical_device);
+	mesh_shading_supported = device_features.mesh_shading;
+	dynamic_rendering_supported = device_features.dynamic_rendering;
+	dynamic_rendering_enabled = dynamic_rendering_supported;
+	visibility_buffer_supported = dynamic_rendering_supported && device_features.geometry_shader;
+	software_raster_supported =
+			visibility_buffer_supported && mesh_shading_supported && device_features.buffer_int64_atomics;
+	mesh_shading_enabled = mesh_shading_supported;
+	binding_model_supported[kBindingBufferDeviceAddress] = device_features.buffer_device_address;
+	binding_model_supported[kBindingDescriptorIndexing] = device_features.descriptor_indexing;
+
+	BenchmarkRunner benchmark = {};
+	if (benchmark_mode)
 	{
-		if (strcmp(ext.extensionName, "VK_NV_mesh_shader") == 0)
+		std::vector<BenchmarkCell>& cells = benchmark_config.cells;
+		for (size_t i = 0; i < cells.size();)
 		{
-			mesh_shading_supported = true;
-			break;
+			uint32_t model = 0;
+			while (model < kBindingModelCount && cells[i].binding_model != kBindingModelKeys[model])
+			{
+				++model;
+			}
+
+			// The software rasterizer gets its meshlets from the task shader, the indexed pipeline has none.
+			const bool supported = model < kBindingModelCount && binding_model_supported[model] &&
+					(!cells[i].mesh_shading || mesh_shading_supported) &&
+					(!cells[i].visibility_buffer || visibility_buffer_supported) &&
+					(!cells[i].software_raster || (software_raster_supported && cells[i].mesh_shading)) &&
+					cells[i].meshlet_max_vertices <= kMaxMeshletVertices &&
+					cells[i].meshlet_max_triangles <= kMaxMeshletTriangles;
+			if (supported)
+			{
+				++i;
+				continue;
+			}
+
+			printf("Skipping benchmark cell: %s %s %s %ux%u, not supported\n", cells[i].mesh_path.c_str(),
+					cells[i].mesh_shading ? "meshlet" : "indexed", cells[i].binding_model.c_str(),
+					cells[i].meshlet_max_vertices, cells[i].meshlet_max_triangles);
+			cells.erase(cells.begin() + i);
+		}
+
+		if (cells.empty() || !StartBenchmark(benchmark, benchmark_config))
+		{
+			return 1;
 		}
 	}
-	mesh_shading_enabled = mesh_shading_supported;
 
 	VkPhysicalDeviceProperties physical_device_props = {};
 	vkGetPhysicalDeviceProperties(physical_device, &physical_device_props);
@@ -368,13 +1021,13 @@ int main(int argc, char* argv[])
 	const uint32_t family_index = GetGraphicsFamilyIndex(physical_device);
 	assert(family_index != VK_QUEUE_FAMILY_IGNORED);
 
-	VkDevice device = CreateDevice(instance, physical_device, family_index, mesh_shading_supported);
+	VkDevice device = CreateDevice(instance, physical_device, family_index, device_features);
 	assert(device);
 
 	volkLoadDevice(device);
 
-	const int window_width = 1024 * 2;
-	const int window_height = 768 * 2;
+	const int window_width = benchmark_mode ? int(GetBenchmarkCell(benchmark).width) : 1024 * 2;
+	const int window_height = benchmark_mode ? int(GetBenchmarkCell(benchmark).height) : 768 * 2;
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);  // For NVidia
 	GLFWwindow* window = glfwCreateWindow(window_width, window_height, "Hello Vulkan", nullptr, nullptr);
 	assert(window);
@@ -403,418 +1056,2022 @@ int main(int argc, char* argv[])
 	// VkSurfaceCapabilitiesKHR surface_caps;
 	// VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &surface_caps));
 
-	VkSemaphore aquire_semaphore = CreateSemaphore(device);
-	assert(aquire_semaphore);
-	VkSemaphore release_semaphore = CreateSemaphore(device);
-	assert(release_semaphore);
-
 	VkQueue queue = VK_NULL_HANDLE;
 	vkGetDeviceQueue(device, family_index, 0, &queue);
 	assert(queue);
 
-	VkRenderPass render_pass = CreateRenderPass(device, swapchain_format, VK_FORMAT_D32_SFLOAT);
+	VkRenderPass render_pass = CreateRenderPass(device, swapchain_format, VK_FORMAT_D32_SFLOAT, false);
 	assert(render_pass);
+	// Only differs in the final layout, so it's compatible with the pipelines created for render_pass.
+	VkRenderPass present_render_pass = CreateRenderPass(device, swapchain_format, VK_FORMAT_D32_SFLOAT, true);
+	assert(present_render_pass);
 
 	// NOTE: This is earlier here than what Arseny is doing.
 	Swapchain swapchain;
 	CreateSwapchain(
 			physical_device, device, surface, swapchain_format, family_index, render_pass, VK_NULL_HANDLE, swapchain);
 
-	VkQueryPool query_pool = CreateQueryPool(device, 128);
-	assert(query_pool);
+	static_assert(kProfilerLatency > kMaxFramesInFlight, "Profiler would read queries of frames in flight.");
+	GpuProfiler gpu_profiler = CreateGpuProfiler(physical_device, device, physical_device_props,
+			device_features.pipeline_statistics, device_features.calibrated_timestamps);
 
-	Shader meshlet_mesh = {};
-	Shader meshlet_task = {};
-	if (mesh_shading_supported)
+	// Every binding model has its own variant of the shaders, they only differ in how they declare their resources.
+	Shader meshlet_mesh[kBindingModelCount] = {};
+	Shader meshlet_task[kBindingModelCount] = {};
+	Shader mesh_vert[kBindingModelCount] = {};
+	Shader mesh_frag[kBindingModelCount] = {};
+	for (uint32_t model = 0; model < kBindingModelCount; ++model)
 	{
+		if (!binding_model_supported[model])
+		{
+			continue;
+		}
+
+		const char* suffix = kBindingModelShaderSuffixes[model];
+		char path[64];
 		bool rc;
-		rc = LoadShader(meshlet_mesh, device, "meshlet.mesh.spv");
+
+		if (mesh_shading_supported)
+		{
+			sprintf(path, "meshlet.mesh%s.spv", suffix);
+			rc = LoadShader(meshlet_mesh[model], device, path);
+			assert(rc);
+			sprintf(path, "meshlet.task%s.spv", suffix);
+			rc = LoadShader(meshlet_task[model], device, path);
+			assert(rc);
+		}
+		sprintf(path, "mesh.vert%s.spv", suffix);
+		rc = LoadShader(mesh_vert[model], device, path);
 		assert(rc);
-		rc = LoadShader(meshlet_task, device, "meshlet.task.spv");
+		// Only the bindless fragment shader reads anything but its inputs.
+		sprintf(path, "mesh.frag%s.spv", model == kBindingDescriptorIndexing ? suffix : "");
+		rc = LoadShader(mesh_frag[model], device, path);
 		assert(rc);
 	}
-	Shader mesh_vert = {};
-	Shader mesh_frag = {};
+
+	// Only pushes descriptors, it's the same for every binding model.
+	Shader sort_comp = {};
 	{
-		bool rc;
-		rc = LoadShader(mesh_vert, device, "mesh.vert.spv");
+		const bool rc = LoadShader(sort_comp, device, "sort.comp.spv");
 		assert(rc);
-		rc = LoadShader(mesh_frag, device, "mesh.frag.spv");
+	}
+
+	// So are the shaders of the visibility buffer: its fragment shader only reads its inputs, the resolve pushes.
+	Shader visibility_frag = {};
+	Shader fullscreen_vert = {};
+	Shader resolve_frag = {};
+	if (visibility_buffer_supported)
+	{
+		bool rc = LoadShader(visibility_frag, device, "visibility.frag.spv");
+		assert(rc);
+		rc = LoadShader(fullscreen_vert, device, "fullscreen.vert.spv");
+		assert(rc);
+		rc = LoadShader(resolve_frag, device, "resolve.frag.spv");
+		assert(rc);
+	}
+
+	// And the software rasterizer's, they only push too.
+	Shader raster_comp = {};
+	Shader merge_frag = {};
+	if (software_raster_supported)
+	{
+		bool rc = LoadShader(raster_comp, device, "raster.comp.spv");
+		assert(rc);
+		rc = LoadShader(merge_frag, device, "merge.frag.spv");
 		assert(rc);
 	}
 
 	VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
 
-	Shaders mesh_shaders = { &mesh_vert, &mesh_frag };
-	Shaders meshlet_shaders = { &meshlet_task, &meshlet_mesh, &mesh_frag };
+	Program sort_program =
+			CreateProgram(device, VK_PIPELINE_BIND_POINT_COMPUTE, { &sort_comp }, sizeof(SortConstants));
+	const VkPipeline sort_pipeline =
+			CreateComputePipeline(device, pipeline_cache, sort_program.pipeline_layout, sort_comp);
+	assert(sort_pipeline);
+
+	const size_t push_constant_sizes[kBindingModelCount] = { sizeof(Globals), sizeof(BufferAddressConstants),
+		sizeof(Globals) };
+
+	// The pipelines exist twice, once for render_pass and once for dynamic rendering (indexed by
+	// dynamic_rendering_enabled). The latter only depend on the attachment formats. The depth only ones leave out the
+	// fragment shader and share the layout of the full program, so do the visibility buffer ones (dynamic rendering
+	// only) that replace it.
+	Program mesh_programs[kBindingModelCount] = {};
+	VkPipeline mesh_pipelines[kBindingModelCount][2] = {};
+	VkPipeline mesh_depth_pipelines[kBindingModelCount][2] = {};
+	VkPipeline mesh_visibility_pipelines[kBindingModelCount] = {};
+	Program meshlet_programs[kBindingModelCount] = {};
+	VkPipeline meshlet_pipelines[kBindingModelCount][2] = {};
+	VkPipeline meshlet_depth_pipelines[kBindingModelCount][2] = {};
+	VkPipeline meshlet_visibility_pipelines[kBindingModelCount] = {};
+	for (uint32_t model = 0; model < kBindingModelCount; ++model)
+	{
+		if (!binding_model_supported[model])
+		{
+			continue;
+		}
+
+		const Shaders mesh_shaders = { &mesh_vert[model], &mesh_frag[model] };
+		mesh_programs[model] = CreateProgram(
+				device, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_shaders, push_constant_sizes[model]);
+
+		const Shaders meshlet_shaders = { &meshlet_task[model], &meshlet_mesh[model], &mesh_frag[model] };
+		if (mesh_shading_supported)
+		{
+			meshlet_programs[model] = CreateProgram(
+					device, VK_PIPELINE_BIND_POINT_GRAPHICS, meshlet_shaders, push_constant_sizes[model]);
+		}
+
+		for (uint32_t dynamic = 0; dynamic < 2; ++dynamic)
+		{
+			if (dynamic && !dynamic_rendering_supported)
+			{
+				continue;
+			}
+
+			const VkRenderPass pass = dynamic ? VK_NULL_HANDLE : render_pass;
 
-	Program mesh_program = CreateProgram(device, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_shaders, sizeof(Globals));
-	VkPipeline mesh_pipeline =
-			CreateGraphicsPipeline(device, pipeline_cache, render_pass, mesh_program.pipeline_layout, mesh_shaders);
-	assert(mesh_pipeline);
+			mesh_pipelines[model][dynamic] = CreateGraphicsPipeline(device, pipeline_cache, pass, swapchain_format,
+					VK_FORMAT_D32_SFLOAT, mesh_programs[model].pipeline_layout, mesh_shaders);
+			assert(mesh_pipelines[model][dynamic]);
+			mesh_depth_pipelines[model][dynamic] = CreateGraphicsPipeline(device, pipeline_cache, pass,
+					swapchain_format, VK_FORMAT_D32_SFLOAT, mesh_programs[model].pipeline_layout,
+					{ &mesh_vert[model] });
+			assert(mesh_depth_pipelines[model][dynamic]);
 
-	Program meshlet_program = {};
-	VkPipeline meshlet_pipeline = VK_NULL_HANDLE;
+			if (mesh_shading_supported)
+			{
+				meshlet_pipelines[model][dynamic] = CreateGraphicsPipeline(device, pipeline_cache, pass,
+						swapchain_format, VK_FORMAT_D32_SFLOAT, meshlet_programs[model].pipeline_layout,
+						meshlet_shaders);
+				assert(meshlet_pipelines[model][dynamic]);
+				meshlet_depth_pipelines[model][dynamic] = CreateGraphicsPipeline(device, pipeline_cache, pass,
+						swapchain_format, VK_FORMAT_D32_SFLOAT, meshlet_programs[model].pipeline_layout,
+						{ &meshlet_task[model], &meshlet_mesh[model] });
+				assert(meshlet_depth_pipelines[model][dynamic]);
+			}
+		}
+
+		if (visibility_buffer_supported)
+		{
+			mesh_visibility_pipelines[model] = CreateGraphicsPipeline(device, pipeline_cache, VK_NULL_HANDLE,
+					kVisibilityFormat, VK_FORMAT_D32_SFLOAT, mesh_programs[model].pipeline_layout,
+					{ &mesh_vert[model], &visibility_frag });
+			assert(mesh_visibility_pipelines[model]);
+
+			if (mesh_shading_supported)
+			{
+				meshlet_visibility_pipelines[model] = CreateGraphicsPipeline(device, pipeline_cache, VK_NULL_HANDLE,
+						kVisibilityFormat, VK_FORMAT_D32_SFLOAT, meshlet_programs[model].pipeline_layout,
+						{ &meshlet_task[model], &meshlet_mesh[model], &visibility_frag });
+				assert(meshlet_visibility_pipelines[model]);
+			}
+		}
+	}
+
+	// Shades the visibility buffer into the color target, no depth.
+	Program resolve_program = {};
+	VkPipeline resolve_pipeline = VK_NULL_HANDLE;
+	if (visibility_buffer_supported)
+	{
+		const Shaders resolve_shaders = { &fullscreen_vert, &resolve_frag };
+		resolve_program = CreateProgram(device, VK_PIPELINE_BIND_POINT_GRAPHICS, resolve_shaders, sizeof(Globals));
+		resolve_pipeline = CreateGraphicsPipeline(device, pipeline_cache, VK_NULL_HANDLE, swapchain_format,
+				VK_FORMAT_UNDEFINED, resolve_program.pipeline_layout, resolve_shaders);
+		assert(resolve_pipeline);
+	}
+
+	// Rasterizes the small meshlets, then merges them into the visibility buffer with the depth test.
+	Program raster_program = {};
+	VkPipeline raster_pipeline = VK_NULL_HANDLE;
+	Program merge_program = {};
+	VkPipeline merge_pipeline = VK_NULL_HANDLE;
+	if (software_raster_supported)
+	{
+		raster_program = CreateProgram(device, VK_PIPELINE_BIND_POINT_COMPUTE, { &raster_comp }, sizeof(Globals));
+		raster_pipeline = CreateComputePipeline(device, pipeline_cache, raster_program.pipeline_layout, raster_comp);
+		assert(raster_pipeline);
+
+		const Shaders merge_shaders = { &fullscreen_vert, &merge_frag };
+		merge_program = CreateProgram(device, VK_PIPELINE_BIND_POINT_GRAPHICS, merge_shaders, sizeof(Globals));
+		merge_pipeline = CreateGraphicsPipeline(device, pipeline_cache, VK_NULL_HANDLE, kVisibilityFormat,
+				VK_FORMAT_D32_SFLOAT, merge_program.pipeline_layout, merge_shaders);
+		assert(merge_pipeline);
+	}
+
+	// Only used for the (blocking) uploads during startup, every frame in flight has its own pool.
+	VkCommandPool upload_cmd_pool = CreateCommandBufferPool(device, family_index);
+	assert(upload_cmd_pool);
+	VkCommandBuffer upload_cmd_buf = AllocateCommandBuffer(device, upload_cmd_pool);
+
+	Frame frames[kMaxFramesInFlight] = {};
+	for (Frame& frame : frames)
+	{
+		frame.cmd_pool = CreateCommandBufferPool(device, family_index);
+		assert(frame.cmd_pool);
+		frame.cmd_buf = AllocateCommandBuffer(device, frame.cmd_pool);
+		for (uint32_t i = 0; i < GetParallelThreadCount(); ++i)
+		{
+			frame.draw_cmd_pools.push_back(CreateCommandBufferPool(device, family_index));
+			assert(frame.draw_cmd_pools.back());
+			frame.draw_cmd_bufs.push_back(
+					AllocateCommandBuffer(device, frame.draw_cmd_pools.back(), VK_COMMAND_BUFFER_LEVEL_SECONDARY));
+		}
+		frame.fence = CreateFence(device, true);
+		assert(frame.fence);
+		frame.aquire_semaphore = CreateSemaphore(device);
+		assert(frame.aquire_semaphore);
+		frame.release_semaphore = CreateSemaphore(device);
+		assert(frame.release_semaphore);
+	}
+
+	VkPhysicalDeviceMemoryProperties memory_properties;
+	vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+
+	// What the scene is built from, benchmarks switch between these.
+	std::string mesh_path = benchmark_mode ? GetBenchmarkCell(benchmark).mesh_path : argv[1];
+	size_t meshlet_max_vertices = kMaxMeshletVertices;
+	size_t meshlet_max_triangles = kMaxMeshletTriangles;
+	size_t draw_count = 3000;
+	uint32_t scene_seed = 1;
+	if (benchmark_mode)
+	{
+		const BenchmarkCell& cell = GetBenchmarkCell(benchmark);
+		meshlet_max_vertices = cell.meshlet_max_vertices;
+		meshlet_max_triangles = cell.meshlet_max_triangles;
+		draw_count = cell.draw_count;
+		scene_seed = benchmark_config.seed;
+	}
+
+	// The page file needs all of the meshlet data up front, and benchmarks measure the whole scene from the start.
+	const bool streaming = stream_pool_mb > 0 && mesh_shading_supported;
+	const bool async_loading = !benchmark_mode && !streaming;
+
+	// The meshes as loaded, and all of them together in the layout of the buffers.
+	std::vector<Mesh> meshes;
+	Scene scene = {};
+	Mesh geometry;
+	std::vector<MeshRange> mesh_ranges;
+	MeshLoader mesh_loader;
+	if (async_loading)
+	{
+		// Nothing is resident yet: every mesh starts out empty, and so do the draws of its instances. The frames fill
+		// it in as the meshes arrive.
+		std::vector<std::string> mesh_paths;
+		const bool paths_rc = GetMeshPaths(mesh_paths, scene, mesh_path);
+		assert(paths_rc);
+
+		MeshRange empty_range = {};
+		empty_range.bounds = glm::vec4(0.0f);
+		mesh_ranges.assign(mesh_paths.size(), empty_range);
+
+		StartMeshLoader(
+				mesh_loader, mesh_paths, mesh_shading_supported, meshlet_max_vertices, meshlet_max_triangles);
+	}
+	else
+	{
+		const bool mesh_rc = LoadMeshes(meshes, scene, mesh_path);
+		assert(mesh_rc);
+
+		BuildGeometry(
+				geometry, mesh_ranges, meshes, mesh_shading_supported, meshlet_max_vertices, meshlet_max_triangles);
+
+		printf("All %u meshes loaded after %.1f ms\n", uint32_t(meshes.size()),
+				double(GetTraceTime() - startup_begin) * 1e-6);
+	}
+	bool meshes_loading = async_loading;  // Until every mesh is resident or left out.
+	bool loader_running = async_loading;
+	uint32_t resident_mesh_count = async_loading ? 0 : uint32_t(mesh_ranges.size());
+	double next_residency_time = 0.0;
+	std::vector<uint32_t> loaded_meshes;
+	// Appended to the geometry, they become resident once the frames uploaded all of it.
+	std::vector<std::pair<uint32_t, MeshRange>> pending_ranges;
+	std::vector<FrameUpload> frame_uploads;
+
+	// The meshlet data goes to the page file, the GPU starts out with an empty pool.
+	uint32_t page_count = 0;
+	uint32_t pool_page_count = 0;
+	if (streaming)
+	{
+		PageMeshletData(geometry);
+		const bool page_rc = WritePageFile(kPageFilePath, geometry.meshlet_data);
+		assert(page_rc);
+
+		page_count = uint32_t(geometry.meshlet_data.size() / kPageWords);
+		pool_page_count = uint32_t(std::min(stream_pool_mb * 1024 * 1024 / kPageSize, size_t(page_count)));
+		pool_page_count = std::max(pool_page_count, 1u);
+		std::vector<uint32_t>().swap(geometry.meshlet_data);
+	}
+
+	std::vector<MeshDraw> draws;
+	BuildDraws(draws, scene, mesh_ranges, draw_count, scene_seed);
+	draw_count = draws.size();
+	uint64_t triangle_count = CountTriangles(draws);
+
+	std::vector<glm::vec4> draw_spheres;
+	GetDrawSpheres(draw_spheres, draws, scene, mesh_ranges);
+	Bvh bvh;
+	BuildBvh(bvh, draw_spheres);
+	InstanceStore instances = {};
+	std::vector<glm::vec4> mesh_bounds;
+	BuildInstances(instances, mesh_bounds, draws, scene, mesh_ranges);
+	std::vector<uint32_t> visible_draws;  // Or all of them, in the order they are drawn.
+	std::vector<uint64_t> sort_keys;
+	std::vector<uint64_t> sort_scratch;
+
+	// Large scenes can outgrow the default, benchmarks take the largest of their cells. Meshes loaded in the background
+	// can't, they are left out if they don't fit.
+	const size_t kDefaultBufferSize = 128 * 1024 * 1024;
+	size_t buffer_size = std::max(kDefaultBufferSize, GetBufferSize(geometry, draws.size()));
+	if (benchmark_mode)
+	{
+		size_t benchmark_buffer_size = 0;
+		if (!GetBenchmarkBufferSize(benchmark_buffer_size, benchmark_config.cells, mesh_shading_supported))
+		{
+			printf("Can't load the meshes of all benchmark cells\n");
+			return 1;
+		}
+		buffer_size = std::max(buffer_size, benchmark_buffer_size);
+	}
+
+	Buffer scratch_buffer = {};
+	CreateBuffer(scratch_buffer, device, memory_properties, buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+	// Everything the shaders read can also be reached via its device address if that's supported.
+	const VkBufferUsageFlags address_usage = binding_model_supported[kBindingBufferDeviceAddress] ?
+			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT :
+			0;
+
+	// As many vertices as the interleaved layout fits into buffer_size, in either layout.
+	const size_t vertex_capacity = buffer_size / sizeof(Vertex);
+	const uint32_t attribute_base = GetAttributeBase(vertex_capacity);
+	// What the vertex buffer holds right now, split_vertices can change in the meantime.
+	bool vertices_split = split_vertices;
+	Buffer vertex_buffer = {};
+	CreateBuffer(vertex_buffer, device, memory_properties,
+			(attribute_base + vertex_capacity) * sizeof(VertexAttributes),
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | address_usage,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	Buffer index_buffer = {};
+	// The resolve of the visibility buffer reads the indices too.
+	CreateBuffer(index_buffer, device, memory_properties, buffer_size,
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	Buffer meshlet_buffer = {};
+	Buffer meshlet_data_buffer = {};
 	if (mesh_shading_supported)
 	{
-		meshlet_program = CreateProgram(device, VK_PIPELINE_BIND_POINT_GRAPHICS, meshlet_shaders, sizeof(Globals));
-		meshlet_pipeline = CreateGraphicsPipeline(
-				device, pipeline_cache, render_pass, meshlet_program.pipeline_layout, meshlet_shaders);
-		assert(meshlet_pipeline);
+		CreateBuffer(meshlet_buffer, device, memory_properties, buffer_size,
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | address_usage,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		// When streaming, it's only the pool.
+		const size_t meshlet_data_size = streaming ? pool_page_count * kPageSize : buffer_size;
+		CreateBuffer(meshlet_data_buffer, device, memory_properties, meshlet_data_size,
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | address_usage,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	}
 
-	VkCommandPool cmd_buf_pool = CreateCommandBufferPool(device, family_index);
-	assert(cmd_buf_pool);
+	// What the I/O thread reads the pages into, copied into the pool (meshlet_data_buffer) by the frames.
+	Buffer page_staging_buffer = {};
+	PageStreamer page_streamer;
+	if (streaming)
+	{
+		CreateBuffer(page_staging_buffer, device, memory_properties, kStagingPageCount * kPageSize,
+				VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+		const bool streamer_rc =
+				StartPageStreamer(page_streamer, kPageFilePath, pool_page_count, page_staging_buffer.data);
+		assert(streamer_rc);
+		assert(page_streamer.page_count == page_count);
+	}
+	std::vector<PageCopy> page_copies;
 
-	VkCommandBufferAllocateInfo cmd_buf_alloc_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-	cmd_buf_alloc_info.commandPool = cmd_buf_pool;
-	cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	cmd_buf_alloc_info.commandBufferCount = 1;
+	// Small enough that the CPU can read it directly, no copy needed. So is the page table.
+	for (Frame& frame : frames)
+	{
+		CreateBuffer(frame.counter_buffer, device, memory_properties,
+				sizeof(CullingCounters) + page_count * 2 * sizeof(uint32_t),
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | address_usage,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+		// Rewritten every frame and read once by the GPU, not worth a copy into device local memory.
+		CreateBuffer(frame.visible_draw_buffer, device, memory_properties, buffer_size,
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | address_usage,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+		CreateBuffer(frame.sorted_draw_buffer, device, memory_properties, buffer_size,
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | address_usage,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		CreateBuffer(frame.sort_bucket_buffer, device, memory_properties, (1 << kSortDepthBits) * sizeof(uint32_t),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+		// The draw count doesn't change while loading, only their geometry.
+		if (async_loading)
+		{
+			CreateBuffer(frame.upload_buffer, device, memory_properties,
+					kFrameUploadSize + draws.size() * sizeof(MeshDraw), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		}
+	}
+
+	UploadMesh(device, upload_cmd_pool, upload_cmd_buf, queue, scratch_buffer, geometry, MeshSizes(),
+			vertices_split ? attribute_base : 0, vertex_buffer, index_buffer, meshlet_buffer, meshlet_data_buffer);
+	MeshSizes uploaded_sizes = GetMeshSizes(geometry);  // How much of the geometry the buffers have.
+
+	Buffer draw_buffer = {};
+	CreateBuffer(draw_buffer, device, memory_properties, buffer_size,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+					address_usage,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	UploadBuffer(device, upload_cmd_pool, upload_cmd_buf, queue, draw_buffer, scratch_buffer, draws.data(),
+			draws.size() * sizeof(draws[0]));
+
+	// Filled by the task shader, read by the indirect dispatch of the software rasterizer. The frames share it, each
+	// resets it before its own pass.
+	Buffer raster_queue_buffer = {};
+	if (software_raster_supported)
+	{
+		CreateBuffer(raster_queue_buffer, device, memory_properties,
+				sizeof(RasterQueue) + kSoftwareRasterMaxMeshlets * 2 * sizeof(uint32_t),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT | address_usage,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	}
+
+	// The meshes don't come with textures (yet), checkerboards in a different tint per mesh are enough to see that the
+	// indexing works.
+	const uint32_t texture_size = 256;
+	const uint32_t kTextureTints[kMeshTextureCount] = { 0xffb0b0b0, 0xffb0b0ff, 0xffb0ffb0, 0xffffb0b0 };
+	std::vector<uint32_t> texture_data(texture_size * texture_size);
+	Image textures[kMeshTextureCount] = {};
+	for (uint32_t i = 0; i < kMeshTextureCount; ++i)
+	{
+		for (uint32_t y = 0; y < texture_size; ++y)
+		{
+			for (uint32_t x = 0; x < texture_size; ++x)
+			{
+				texture_data[y * texture_size + x] = ((x / 32 + y / 32) % 2) ? 0xffffffff : kTextureTints[i];
+			}
+		}
+
+		textures[i] = CreateImage(device, memory_properties, texture_size, texture_size, 1, VK_FORMAT_R8G8B8A8_UNORM,
+				VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		UploadImage(device, upload_cmd_pool, upload_cmd_buf, queue, textures[i], scratch_buffer, texture_data.data(),
+				texture_data.size() * sizeof(texture_data[0]), texture_size, texture_size);
+	}
+
+	VkSampler sampler = CreateSampler(device);
+	assert(sampler);
+	VkSampler point_sampler = CreateSampler(device, VK_FILTER_NEAREST);
+	assert(point_sampler);
+
+	// One global set for all programs. The set 1 layouts of all bindless programs are identical (see
+	// CreateDescriptorSetLayout), hence compatible, and the set can be bound with any of them.
+	VkDescriptorPool bindless_pool = VK_NULL_HANDLE;
+	VkDescriptorSet bindless_set = VK_NULL_HANDLE;
+	if (binding_model_supported[kBindingDescriptorIndexing])
+	{
+		bindless_pool = CreateBindlessDescriptorPool(device);
+		bindless_set = AllocateDescriptorSet(
+				device, bindless_pool, mesh_programs[kBindingDescriptorIndexing].descriptor_set_layouts[1]);
+
+		// All slots up front, benchmarks can switch to scenes with more meshes.
+		for (uint32_t mesh = 0; mesh < kBindlessMeshCount; ++mesh)
+		{
+			const uint32_t first_buffer = mesh * kBindlessBuffersPerMesh;
+			WriteDescriptor(device, bindless_set, 0, first_buffer + kBindlessVertexBuffer,
+					VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, vertex_buffer.buffer);
+			if (mesh_shading_supported)
+			{
+				WriteDescriptor(device, bindless_set, 0, first_buffer + kBindlessMeshletBuffer,
+						VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, meshlet_buffer.buffer);
+				WriteDescriptor(device, bindless_set, 0, first_buffer + kBindlessMeshletDataBuffer,
+						VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, meshlet_data_buffer.buffer);
+			}
+		}
+		for (uint32_t i = 0; i < kMeshTextureCount; ++i)
+		{
+			WriteDescriptor(device, bindless_set, 1, i, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+					DescriptorInfo(sampler, textures[i].image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL));
+		}
+	}
+
+
+	Image color_target = {};
+	Image depth_target = {};
+	Image visibility_target = {};  // Only with visibility_buffer_supported.
+	Buffer raster_pixel_buffer = {};  // Only with software_raster_supported, one uint64_t per pixel.
+	VkFramebuffer target_fb = VK_NULL_HANDLE;
+	std::vector<VkFramebuffer> swapchain_fbs;  // One per swapchain image, sharing depth_target.
+
+	std::vector<TimingStats> timings(kTimingCount);
+	for (uint32_t i = 0; i < kTimingCount; ++i)
+	{
+		timings[i].name = kFrameTimingNames[i];
+	}
+	uint64_t gpu_frames_seen = 0;
+
+	// Appended to while running, for offline analysis.
+	FILE* stats_file = fopen(kStatsSnapshotPath, "w");
+	double next_snapshot_time = glfwGetTime() + kStatsSnapshotInterval;
+
+	// Of the last frame that could be read back, kMaxFramesInFlight frames behind.
+	CullingCounters culling_counters = {};
+
+	// Streaming bandwidth, averaged over about a second.
+	double stream_window_begin = glfwGetTime();
+	uint64_t stream_window_bytes = 0;
+	double stream_mb_per_s = 0.0;
+
+	DeletionQueue deletion_queue;
+
+	// Also depends on the geometry (offsets, index and task counts). Scenes bring their own draws. Only on the CPU.
+	auto build_draws = [&](size_t requested_draw_count) {
+		BuildDraws(draws, scene, mesh_ranges, requested_draw_count, scene_seed);
+		draw_count = draws.size();
+		triangle_count = CountTriangles(draws);
+		GetDrawSpheres(draw_spheres, draws, scene, mesh_ranges);
+		BuildBvh(bvh, draw_spheres);
+		BuildInstances(instances, mesh_bounds, draws, scene, mesh_ranges);
+	};
+
+	// Number of frames submitted so far, also the number of the frame that is currently being recorded.
+	uint64_t frame_number = 0;
+
+	while (!glfwWindowShouldClose(window))
+	{
+		const double frame_begin_cpu = glfwGetTime() * 1000.0;
+		TRACE_SCOPE("frame");
+
+		glfwPollEvents();
+
+		if (benchmark.phase == kBenchmarkApply)
+		{
+			TRACE_SCOPE("apply benchmark cell");
+			const BenchmarkCell& cell = GetBenchmarkCell(benchmark);
+
+			// The buffers are rewritten in place.
+			VK_CHECK(vkDeviceWaitIdle(device));
+
+			const bool new_mesh = cell.mesh_path != mesh_path;
+			if (new_mesh)
+			{
+				// GetBenchmarkBufferSize loaded them before.
+				const bool rc = LoadMeshes(meshes, scene, cell.mesh_path);
+				assert(rc);
+				mesh_path = cell.mesh_path;
+			}
+
+			const bool new_meshlets = mesh_shading_supported &&
+					(new_mesh || cell.meshlet_max_vertices != meshlet_max_vertices ||
+							cell.meshlet_max_triangles != meshlet_max_triangles);
+			if (new_meshlets)
+			{
+				meshlet_max_vertices = cell.meshlet_max_vertices;
+				meshlet_max_triangles = cell.meshlet_max_triangles;
+			}
+
+			if (new_mesh || new_meshlets)
+			{
+				BuildGeometry(geometry, mesh_ranges, meshes, mesh_shading_supported, meshlet_max_vertices,
+						meshlet_max_triangles);
+			}
+			build_draws(cell.draw_count);
+
+			// The buffers were sized for all cells, but they are written in place: better safe than sorry.
+			if (GetBufferSize(geometry, draws.size()) > buffer_size)
+			{
+				printf("Benchmark cell %s doesn't fit into the buffers, stopping\n", cell.mesh_path.c_str());
+				break;
+			}
+
+			if (new_mesh || new_meshlets)
+			{
+				UploadMesh(device, upload_cmd_pool, upload_cmd_buf, queue, scratch_buffer, geometry, MeshSizes(),
+						vertices_split ? attribute_base : 0, vertex_buffer, index_buffer, meshlet_buffer,
+						meshlet_data_buffer);
+				uploaded_sizes = GetMeshSizes(geometry);
+			}
+			UploadBuffer(device, upload_cmd_pool, upload_cmd_buf, queue, draw_buffer, scratch_buffer, draws.data(),
+					draws.size() * sizeof(draws[0]));
+
+			mesh_shading_enabled = cell.mesh_shading;
+			culling_enabled = cell.culling;
+			triangle_culling_enabled = cell.triangle_culling;
+			lod_enabled = cell.lod;
+			split_vertices = cell.split_vertices;
+			depth_only = cell.depth_only;
+			visibility_buffer = cell.visibility_buffer;
+			software_raster = cell.software_raster;
+			record_threads = std::min(cell.record_threads, GetParallelThreadCount());
+			for (uint32_t mode = 0; mode < kCpuCullingCount; ++mode)
+			{
+				cpu_culling = cell.cpu_culling == kCpuCullingKeys[mode] ? CpuCulling(mode) : cpu_culling;
+			}
+			for (uint32_t mode = 0; mode < kDrawSortingCount; ++mode)
+			{
+				draw_sorting = cell.draw_sorting == kDrawSortingKeys[mode] ? DrawSorting(mode) : draw_sorting;
+			}
+			for (uint32_t model = 0; model < kBindingModelCount; ++model)
+			{
+				binding_model = cell.binding_model == kBindingModelKeys[model] ? BindingModel(model) : binding_model;
+			}
+
+			// Takes effect with the next swapchain resize, the warm-up frames cover that.
+			glfwSetWindowSize(window, int(cell.width), int(cell.height));
+
+			BenchmarkCellApplied(benchmark);
+		}
+
+		// Same as a new mesh, only the vertices.
+		if (split_vertices != vertices_split)
+		{
+			TRACE_SCOPE("switch vertex layout");
+			VK_CHECK(vkDeviceWaitIdle(device));
+			vertices_split = split_vertices;
+			UploadVertices(device, upload_cmd_pool, upload_cmd_buf, queue, vertex_buffer, scratch_buffer,
+					geometry.vertices, 0, vertices_split ? attribute_base : 0);
+			uploaded_sizes.vertices = geometry.vertices.size();
+		}
+
+		// What finished loading in the background is appended to the geometry, the frames upload it.
+		if (loader_running && glfwGetTime() >= next_residency_time)
+		{
+			loader_running = TakeLoadedMeshes(mesh_loader, loaded_meshes);
+			for (uint32_t mesh_index : loaded_meshes)
+			{
+				// The buffers were sized before the meshes were known.
+				Mesh& mesh = mesh_loader.meshes[mesh_index];
+				const MeshSizes sizes = GetMeshSizes(geometry);
+				const bool fits = (sizes.vertices + mesh.vertices.size()) * sizeof(Vertex) <= vertex_buffer.size &&
+						(sizes.indices + mesh.indices.size()) * sizeof(uint32_t) <= index_buffer.size &&
+						(sizes.meshlets + mesh.meshlets.size()) * sizeof(Meshlet) <= meshlet_buffer.size &&
+						(sizes.meshlet_data + mesh.meshlet_data.size()) * sizeof(uint32_t) <= meshlet_data_buffer.size;
+				if (fits)
+				{
+					pending_ranges.push_back({ mesh_index, AppendMesh(geometry, mesh) });
+				}
+				else
+				{
+					printf("%s doesn't fit into the buffers, left out\n", mesh_loader.paths[mesh_index].c_str());
+				}
+
+				// The geometry has its own copy.
+				mesh = Mesh();
+			}
+			loaded_meshes.clear();
+			next_residency_time = glfwGetTime() + kResidencyInterval;
+		}
+
+		const uint32_t frame_index = uint32_t(frame_number % kMaxFramesInFlight);
+		Frame& frame = frames[frame_index];
+		VkCommandBuffer cmd_buf = frame.cmd_buf;
+
+		// Only blocks if the GPU is more than kMaxFramesInFlight - 1 frames behind.
+		const double wait_begin = glfwGetTime() * 1000.0;
+		{
+			TRACE_SCOPE("wait for frame fence");
+			VK_CHECK(vkWaitForFences(device, 1, &frame.fence, VK_TRUE, ~0ull));
+		}
+		const double wait_end = glfwGetTime() * 1000.0;
+
+		// The fence covers everything submitted before it, so all frames up to this slot's previous one are done.
+		if (frame_number >= kMaxFramesInFlight)
+		{
+			const uint64_t completed_frame = frame_number - kMaxFramesInFlight;
+			FlushDeletionQueue(deletion_queue, device, completed_frame);
+		}
+
+		if (frame.counters_recorded)
+		{
+			memcpy(&culling_counters, frame.counter_buffer.data, sizeof(culling_counters));
+		}
+
+		// The page table of this slot was last used by a completed frame: its feedback goes to the streamer, then it's
+		// rewritten for this frame, with the pages that arrive now.
+		if (streaming)
+		{
+			TRACE_SCOPE("page residency");
+			uint32_t* page_table = reinterpret_cast<uint32_t*>(
+					static_cast<uint8_t*>(frame.counter_buffer.data) + sizeof(CullingCounters));
+			if (frame.counters_recorded)
+			{
+				ReadPageFeedback(page_streamer, page_table, frame_number);
+			}
+			const uint64_t completed_frame_count =
+					frame_number >= kMaxFramesInFlight ? frame_number - kMaxFramesInFlight + 1 : 0;
+			UpdatePageResidency(page_streamer, page_copies, frame_number, completed_frame_count);
+			WritePageTable(page_streamer, page_table);
+		}
+
+		// The upload buffer of this slot is free again. The geometry the buffers don't have yet goes in, as much as
+		// fits. Once they have all of it the meshes become resident and the draws get their geometry, in the same
+		// submission.
+		frame_uploads.clear();
+		bool draws_uploaded = false;
+		if (meshes_loading)
+		{
+			TRACE_SCOPE("stage mesh uploads");
+			size_t used = 0;
+			StageMesh(frame_uploads, frame.upload_buffer, used, kFrameUploadSize, geometry, uploaded_sizes,
+					vertices_split ? attribute_base : 0, vertex_buffer, index_buffer, meshlet_buffer,
+					meshlet_data_buffer);
+
+			if (IsUploaded(geometry, uploaded_sizes))
+			{
+				if (!pending_ranges.empty())
+				{
+					for (const std::pair<uint32_t, MeshRange>& pending : pending_ranges)
+					{
+						mesh_ranges[pending.first] = pending.second;
+					}
+					resident_mesh_count += uint32_t(pending_ranges.size());
+					pending_ranges.clear();
+
+					build_draws(draw_count);
+					StageUpload(frame_uploads, frame.upload_buffer, used, draw_buffer, draws.data(),
+							draws.size() * sizeof(draws[0]), 0);
+					draws_uploaded = true;
+				}
+
+				if (!loader_running)
+				{
+					meshes_loading = false;
+
+					const uint64_t loaded_time = GetTraceTime();
+					RecordTraceEvent("loading", startup_begin, loaded_time);
+					printf("All %u meshes loaded after %.1f ms, %u resident, %u failed\n",
+							uint32_t(mesh_ranges.size()), double(loaded_time - startup_begin) * 1e-6,
+							resident_mesh_count, mesh_loader.failed_count);
+				}
+			}
+		}
+
+		Swapchain old_swapchain = {};
+		if (ResizeSwapchainIfNecessary(physical_device, device, surface, swapchain_format, family_index,
+					render_pass, swapchain, old_swapchain) ||
+				!target_fb)
+		{
+			TRACE_SCOPE("resize");
+
+			// Frames in flight might still render to or present from the old objects, no need to wait for them.
+			if (old_swapchain.swapchain)
+			{
+				for (VkImageView image_view : old_swapchain.image_views)
+				{
+					RetireImageView(deletion_queue, image_view, frame_number);
+				}
+				RetireSwapchain(deletion_queue, old_swapchain.swapchain, frame_number);
+			}
+			if (target_fb)
+			{
+				RetireImage(deletion_queue, color_target, frame_number);
+				RetireImage(deletion_queue, depth_target, frame_number);
+				RetireImage(deletion_queue, visibility_target, frame_number);  // Null without support, which is fine.
+				RetireBuffer(deletion_queue, raster_pixel_buffer, frame_number);
+				RetireFramebuffer(deletion_queue, target_fb, frame_number);
+				for (VkFramebuffer fb : swapchain_fbs)
+				{
+					RetireFramebuffer(deletion_queue, fb, frame_number);
+				}
+			}
+			color_target = CreateImage(device, memory_properties, swapchain.width, swapchain.height, 1,
+					swapchain_format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+			// Depth is cleared on load and never stored, on tilers it can stay in tile memory and needs no backing.
+			// Unless the software rasterizer is around, its merge tests against it in a pass of its own.
+			const bool depth_transient = !software_raster_supported;
+			depth_target = CreateImage(device, memory_properties, swapchain.width, swapchain.height, 1,
+					VK_FORMAT_D32_SFLOAT,
+					VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+							(depth_transient ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0),
+					depth_transient ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+			if (visibility_buffer_supported)
+			{
+				visibility_target = CreateImage(device, memory_properties, swapchain.width, swapchain.height, 1,
+						kVisibilityFormat, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+			}
+			if (software_raster_supported)
+			{
+				CreateBuffer(raster_pixel_buffer, device, memory_properties,
+						size_t(swapchain.width) * swapchain.height * sizeof(uint64_t),
+						VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+			}
+			target_fb = CreateFrameBuffer(device, render_pass, color_target.image_view, depth_target.image_view,
+					swapchain.width, swapchain.height);
+			swapchain_fbs.resize(swapchain.image_count);
+			for (uint32_t i = 0; i < swapchain.image_count; ++i)
+			{
+				swapchain_fbs[i] = CreateFrameBuffer(device, present_render_pass, swapchain.image_views[i],
+						depth_target.image_view, swapchain.width, swapchain.height);
+			}
+		}
+
+		uint32_t image_index = 0;
+		const double acquire_begin = glfwGetTime() * 1000.0;
+		{
+			TRACE_SCOPE("acquire");
+			VK_CHECK(vkAcquireNextImageKHR(
+					device, swapchain.swapchain, ~0ull, frame.aquire_semaphore, VK_NULL_HANDLE, &image_index));
+		}
+		const double acquire_end = glfwGetTime() * 1000.0;
 
-	VkCommandBuffer cmd_buf = VK_NULL_HANDLE;
-	VK_CHECK(vkAllocateCommandBuffers(device, &cmd_buf_alloc_info, &cmd_buf));
+		VK_CHECK(vkResetFences(device, 1, &frame.fence));
+		VK_CHECK(vkResetCommandPool(device, frame.cmd_pool, 0));
 
-	VkPhysicalDeviceMemoryProperties memory_properties;
-	vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+		// Measures what it costs to record the frame, mostly to compare the binding models.
+		const double record_begin_cpu = glfwGetTime() * 1000.0;
+		const uint64_t record_begin = GetTraceTime();
 
-	Mesh mesh;
-	const bool mesh_rc = LoadMesh(mesh, argv[1]);
-	assert(mesh_rc);
+		VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+		begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
 
-	if (mesh_shading_supported)
-	{
-		BuildMeshlets(mesh);
-	}
+		// The two modes get separate root scopes, that way their GPU times can be compared.
+		const char* frame_scope_name = render_to_swapchain ? "frame (direct)" : "frame (offscreen)";
 
-	Buffer scratch_buffer = {};
-	CreateBuffer(scratch_buffer, device, memory_properties, 128 * 1024 * 1024, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		BeginGpuFrame(gpu_profiler, device, cmd_buf, frame_number);
+		BeginGpuScope(gpu_profiler, cmd_buf, frame_scope_name);
 
-	Buffer vertex_buffer = {};
-	CreateBuffer(vertex_buffer, device, memory_properties, 128 * 1024 * 1024,
-			VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	Buffer index_buffer = {};
-	CreateBuffer(index_buffer, device, memory_properties, 128 * 1024 * 1024,
-			VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	Buffer meshlet_buffer = {};
-	Buffer meshlet_data_buffer = {};
-	if (mesh_shading_supported)
-	{
-		CreateBuffer(meshlet_buffer, device, memory_properties, 128 * 1024 * 1024,
-				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		CreateBuffer(meshlet_data_buffer, device, memory_properties, 128 * 1024 * 1024,
-				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	}
+		const glm::mat4 projection = ReverseInfiniteProjectionRightHandedWithoutEpsilon(
+				glm::radians(70.0f), float(swapchain.width) / float(swapchain.height), 0.01f);
 
-	assert(vertex_buffer.size >= mesh.vertices.size() * sizeof(Vertex));
-	UploadBuffer(device, cmd_buf_pool, cmd_buf, queue, vertex_buffer, scratch_buffer, mesh.vertices.data(),
-			mesh.vertices.size() * sizeof(mesh.vertices[0]));
-	assert(index_buffer.size >= mesh.indices.size() * sizeof(uint32_t));
-	UploadBuffer(device, cmd_buf_pool, cmd_buf, queue, index_buffer, scratch_buffer, mesh.indices.data(),
-			mesh.indices.size() * sizeof(mesh.indices[0]));
-	if (mesh_shading_supported)
-	{
-		assert(meshlet_buffer.size >= mesh.meshlets.size() * sizeof(Meshlet));
-		UploadBuffer(device, cmd_buf_pool, cmd_buf, queue, meshlet_buffer, scratch_buffer, mesh.meshlets.data(),
-				mesh.meshlets.size() * sizeof(mesh.meshlets[0]));
-		UploadBuffer(device, cmd_buf_pool, cmd_buf, queue, meshlet_data_buffer, scratch_buffer,
-				mesh.meshlet_data.data(), mesh.meshlet_data.size() * sizeof(mesh.meshlet_data[0]));
-	}
+		// Culling and sorting on the CPU write the draws into the frame's own buffer, in the order they are drawn.
+		// The camera sits at the origin, the projection is all there is to the frustum.
+		const bool cpu_sorting = draw_sorting == kDrawSortingDepth || draw_sorting == kDrawSortingDepthMesh;
+		const bool cpu_draw_list = cpu_culling != kCpuCullingOff || cpu_sorting;
+		const Buffer& cpu_draw_buffer = cpu_draw_list ? frame.visible_draw_buffer : draw_buffer;
+		uint32_t frame_draw_count = uint32_t(draws.size());
+		if (cpu_draw_list)
+		{
+			const Frustum frustum = GetFrustum(&projection[0][0]);
+			if (cpu_culling == kCpuCullingBvh)
+			{
+				visible_draws.clear();
+				CullBvh(visible_draws, bvh, draw_spheres, frustum);
+			}
+			else if (cpu_culling == kCpuCullingInstances)
+			{
+				CullInstances(visible_draws, instances, mesh_bounds, frustum);
+			}
+			else
+			{
+				visible_draws.resize(draws.size());
+				for (size_t i = 0; i < draws.size(); ++i)
+				{
+					visible_draws[i] = uint32_t(i);
+				}
+			}
 
-	size_t draw_count = 3000;
-	std::vector<MeshDraw> draws(draw_count);
-	for (uint32_t i = 0; i < draw_count; ++i)
-	{
-		draws[i].position[0] = (float(rand()) / RAND_MAX) * 40.0f - 20.0f;
-		draws[i].position[1] = (float(rand()) / RAND_MAX) * 40.0f - 20.0f;
-		draws[i].position[2] = (float(rand()) / RAND_MAX) * 40.0f - 20.0f;
-		draws[i].scale = float(rand()) / RAND_MAX * 2.9f + 0.1f;
+			if (cpu_sorting)
+			{
+				SortDraws(visible_draws, sort_keys, sort_scratch, instances, draw_sorting == kDrawSortingDepthMesh);
+			}
 
-		const glm::vec3 axis(float(rand()) / RAND_MAX * 2.0f - 1.0f, float(rand()) / RAND_MAX * 2.0f - 1.0f,
-				float(rand()) / RAND_MAX * 2.0f - 1.0f);
-		const float angle = glm::radians(float(rand()) / RAND_MAX * 90.0f);
-		draws[i].orientation = glm::rotate(glm::quat(1.0f, 0.0f, 0.0f, 0.0f), angle, axis);
+			MeshDraw* visible_draw_data = static_cast<MeshDraw*>(frame.visible_draw_buffer.data);
+			if (cpu_culling == kCpuCullingInstances)
+			{
+				// Straight from the instances, the SoA culling never looks at the draws.
+				TRACE_SCOPE("pack visible draws");
+				ParallelFor(visible_draws.size(), 16384, [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; ++i)
+					{
+						PackDraw(visible_draw_data[i], instances, visible_draws[i], mesh_ranges);
+					}
+				});
+			}
+			else
+			{
+				TRACE_SCOPE("write visible draws");
+				ParallelFor(visible_draws.size(), 16384, [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; ++i)
+					{
+						visible_draw_data[i] = draws[visible_draws[i]];
+					}
+				});
+			}
 
-		memset(draws[i].command_data, 0, sizeof(draws[i].command_data));
-		draws[i].command_indirect.indexCount = uint32_t(mesh.indices.size());
-		draws[i].command_indirect.instanceCount = 1;
-		draws[i].command_indirect_ms.taskCount = uint32_t(mesh.meshlets.size()) / 32;
-	}
+			frame_draw_count = uint32_t(visible_draws.size());
+		}
 
-	Buffer draw_buffer = {};
-	CreateBuffer(draw_buffer, device, memory_properties, 128 * 1024 * 1024,
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	UploadBuffer(device, cmd_buf_pool, cmd_buf, queue, draw_buffer, scratch_buffer, draws.data(),
-			draws.size() * sizeof(draws[0]));
+		// The GPU sort takes whatever the CPU came up with.
+		const Buffer& frame_draw_buffer = draw_sorting == kDrawSortingGpu ? frame.sorted_draw_buffer : cpu_draw_buffer;
 
+		// The counters are only written by the task and mesh shaders, and only cleared when they run.
+		frame.counters_recorded = mesh_shading_enabled;
+		if (mesh_shading_enabled)
+		{
+			vkCmdFillBuffer(cmd_buf, frame.counter_buffer.buffer, 0, sizeof(CullingCounters), 0);
 
-	Image color_target = {};
-	Image depth_target = {};
-	VkFramebuffer target_fb = VK_NULL_HANDLE;
+			VkBufferMemoryBarrier clear_barrier = BufferBarrier(frame.counter_buffer.buffer,
+					VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV, 0, 0, nullptr, 1,
+					&clear_barrier, 0, nullptr);
+		}
 
-	double frame_avg_cpu = 0.0;
-	double frame_avg_gpu = 0.0;
+		// What the frame makes resident, see frame_uploads. Frames in flight don't reach the appended geometry, but
+		// they do read the draws.
+		if (!frame_uploads.empty())
+		{
+			const VkPipelineStageFlags meshlet_stages = mesh_shading_supported ?
+					VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV :
+					0;
+			const VkPipelineStageFlags geometry_stages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+					VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+					VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | meshlet_stages;
+			const VkAccessFlags geometry_access =
+					VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+			if (draws_uploaded)
+			{
+				VkBufferMemoryBarrier rewrite_barrier =
+						BufferBarrier(draw_buffer.buffer, geometry_access, VK_ACCESS_TRANSFER_WRITE_BIT);
+				vkCmdPipelineBarrier(cmd_buf, geometry_stages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+						&rewrite_barrier, 0, nullptr);
+			}
 
-	while (!glfwWindowShouldClose(window))
-	{
-		const double frame_begin_cpu = glfwGetTime() * 1000.0;
+			std::vector<VkBufferMemoryBarrier> upload_barriers;
+			for (const FrameUpload& upload : frame_uploads)
+			{
+				vkCmdCopyBuffer(cmd_buf, frame.upload_buffer.buffer, upload.buffer, 1, &upload.region);
+				upload_barriers.push_back(BufferBarrier(upload.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, geometry_access));
+			}
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, geometry_stages, 0, 0, nullptr,
+					uint32_t(upload_barriers.size()), upload_barriers.data(), 0, nullptr);
+		}
 
-		glfwPollEvents();
+		// Depth only has nothing to shade, it leaves the visibility buffer out.
+		const bool visibility = visibility_buffer && !depth_only;
+		// The task shader picks the meshlets for the software rasterizer, so it needs mesh shading too.
+		const bool software = software_raster && visibility && mesh_shading_enabled;
 
-		if (ResizeSwapchainIfNecessary(
-					physical_device, device, surface, swapchain_format, family_index, render_pass, swapchain) ||
-				!target_fb)
+		// The pages that arrived go into the slots UpdatePageResidency picked for them. Earlier frames may still be
+		// reading the pages that were evicted from those slots, in the resolve and the software rasterizer too.
+		if (!page_copies.empty())
 		{
-			if (target_fb)
+			std::vector<VkBufferCopy> regions(page_copies.size());
+			for (size_t i = 0; i < page_copies.size(); ++i)
 			{
-				DestroyImage(device, color_target);
-				DestroyImage(device, depth_target);
-				vkDestroyFramebuffer(device, target_fb, nullptr);
+				regions[i].srcOffset = page_copies[i].staging_slot * kPageSize;
+				regions[i].dstOffset = page_copies[i].pool_slot * kPageSize;
+				regions[i].size = kPageSize;
 			}
-			color_target = CreateImage(device, memory_properties, swapchain.width, swapchain.height, 1,
-					swapchain_format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
-			depth_target = CreateImage(device, memory_properties, swapchain.width, swapchain.height, 1,
-					VK_FORMAT_D32_SFLOAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
-			target_fb = CreateFrameBuffer(device, render_pass, color_target.image_view, depth_target.image_view,
-					swapchain.width, swapchain.height);
+
+			const VkPipelineStageFlags meshlet_stages =
+					VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV;
+			const VkPipelineStageFlags evict_stages = meshlet_stages |
+					(visibility_buffer_supported ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : 0) |
+					(software_raster_supported ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : 0);
+			const VkPipelineStageFlags upload_stages = meshlet_stages |
+					(visibility ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : 0) |
+					(software ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : 0);
+
+			VkBufferMemoryBarrier evict_barrier =
+					BufferBarrier(meshlet_data_buffer.buffer, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+			vkCmdPipelineBarrier(cmd_buf, evict_stages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+					&evict_barrier, 0, nullptr);
+
+			vkCmdCopyBuffer(cmd_buf, page_staging_buffer.buffer, meshlet_data_buffer.buffer, uint32_t(regions.size()),
+					regions.data());
+
+			VkBufferMemoryBarrier upload_barrier =
+					BufferBarrier(meshlet_data_buffer.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, upload_stages, 0, 0, nullptr, 1,
+					&upload_barrier, 0, nullptr);
 		}
 
-		uint32_t image_index = 0;
-		VK_CHECK(vkAcquireNextImageKHR(
-				device, swapchain.swapchain, ~0ull, aquire_semaphore, VK_NULL_HANDLE, &image_index));
+		// Has to happen outside of the pass. The buckets are cleared, counted, turned into offsets and the draws
+		// scattered, with a barrier between every step.
+		if (draw_sorting == kDrawSortingGpu)
+		{
+			BeginGpuScope(gpu_profiler, cmd_buf, "sort draws");
 
-		VK_CHECK(vkResetCommandPool(device, cmd_buf_pool, 0));
+			vkCmdFillBuffer(cmd_buf, frame.sort_bucket_buffer.buffer, 0, frame.sort_bucket_buffer.size, 0);
 
-		VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-		begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-		VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
+			VkBufferMemoryBarrier clear_barrier = BufferBarrier(frame.sort_bucket_buffer.buffer,
+					VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
+					nullptr, 1, &clear_barrier, 0, nullptr);
+
+			vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, sort_pipeline);
+
+			DescriptorInfo descriptors[] = {
+				cpu_draw_buffer.buffer,
+				frame.sorted_draw_buffer.buffer,
+				frame.sort_bucket_buffer.buffer,
+			};
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, sort_program.descriptor_update_template,
+					sort_program.pipeline_layout, 0, descriptors);
+
+			// Counting and scattering run one thread per draw, the offsets a single workgroup.
+			const uint32_t kSortGroupSize = 256;
+			const uint32_t draw_groups = (frame_draw_count + kSortGroupSize - 1) / kSortGroupSize;
+			assert(draw_groups <= physical_device_props.limits.maxComputeWorkGroupCount[0]);
+			const uint32_t pass_groups[] = { draw_groups, 1, draw_groups };
+			for (uint32_t pass = 0; pass < ARRAY_SIZE(pass_groups); ++pass)
+			{
+				if (pass > 0)
+				{
+					VkBufferMemoryBarrier pass_barrier = BufferBarrier(frame.sort_bucket_buffer.buffer,
+							VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+					vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &pass_barrier, 0, nullptr);
+				}
+
+				const SortConstants sort_constants = { pass, frame_draw_count };
+				vkCmdPushConstants(cmd_buf, sort_program.pipeline_layout, sort_program.push_constant_stages, 0,
+						sizeof(sort_constants), &sort_constants);
+				vkCmdDispatch(cmd_buf, pass_groups[pass], 1, 1);
+			}
+
+			// The sorted draws are read as indirect commands and by the first shader stage.
+			const VkPipelineStageFlags draw_stage =
+					mesh_shading_enabled ? VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV : VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+			VkBufferMemoryBarrier sorted_barrier = BufferBarrier(frame.sorted_draw_buffer.buffer,
+					VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | draw_stage, 0, 0, nullptr, 1, &sorted_barrier, 0, nullptr);
+
+			EndGpuScope(gpu_profiler, cmd_buf);
+		}
 
-		vkCmdResetQueryPool(cmd_buf, query_pool, 0, 128);
-		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 0);
+		const bool dynamic_rendering = dynamic_rendering_enabled || visibility;
 
+		// The queue and the pixels start out empty. They're shared, earlier frames may still be using them, and their
+		// atomics have to land before the clear does.
+		if (software)
+		{
+			VkBufferMemoryBarrier reuse_barriers[] = {
+				BufferBarrier(raster_queue_buffer.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT),
+				BufferBarrier(raster_pixel_buffer.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT),
+			};
+			vkCmdPipelineBarrier(cmd_buf,
+					VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV |
+							VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+					VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, ARRAY_SIZE(reuse_barriers), reuse_barriers, 0,
+					nullptr);
+
+			const RasterQueue empty_queue = { { 0, 1, 1 }, 0 };
+			vkCmdUpdateBuffer(cmd_buf, raster_queue_buffer.buffer, 0, sizeof(empty_queue), &empty_queue);
+			vkCmdFillBuffer(cmd_buf, raster_pixel_buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+
+			VkBufferMemoryBarrier clear_barriers[] = {
+				BufferBarrier(raster_queue_buffer.buffer, VK_ACCESS_TRANSFER_WRITE_BIT,
+						VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+				BufferBarrier(raster_pixel_buffer.buffer, VK_ACCESS_TRANSFER_WRITE_BIT,
+						VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+			};
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+					ARRAY_SIZE(clear_barriers), clear_barriers, 0, nullptr);
+		}
 
 		// TODO: I feel this is wrong and the dst access flags should be
 		// 1. VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
 		// 2. VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+		// With the visibility buffer the geometry goes there, the color target is only written by the resolve.
 		VkImageMemoryBarrier render_begin_barriers[] = {
-			ImageBarrier(color_target.image, 0, 0, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-					VK_IMAGE_ASPECT_COLOR_BIT),
+			ImageBarrier(render_to_swapchain ? swapchain.images[image_index] : color_target.image, 0, 0,
+					VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT),
 			ImageBarrier(depth_target.image, 0, 0, VK_IMAGE_LAYOUT_UNDEFINED,
 					VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_ASPECT_DEPTH_BIT),
+			ImageBarrier(visibility_target.image, 0, 0, VK_IMAGE_LAYOUT_UNDEFINED,
+					VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT),
 		};
-		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		const uint32_t render_begin_barrier_count = ARRAY_SIZE(render_begin_barriers) - (visibility ? 0 : 1);
+		// The swapchain image is only ours once the aquire semaphore has been waited on, and that wait happens at the
+		// color attachment output stage. The transition has to come after it.
+		const VkPipelineStageFlags render_begin_src_stages = render_to_swapchain ?
+				VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT :
+				VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+		vkCmdPipelineBarrier(cmd_buf, render_begin_src_stages,
 				VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
 						VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
-				VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, ARRAY_SIZE(render_begin_barriers),
-				render_begin_barriers);
+				VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, render_begin_barrier_count, render_begin_barriers);
 
 		VkClearValue clear_values[2];
 		clear_values[0].color = { 48.0f / 255.0f, 10.0f / 255.0f, 36.0f / 255.0f, 1.0f };  // Ubuntu terminal color.
 		clear_values[1].depthStencil = { 0.0f };
 
-		VkRenderPassBeginInfo pass_begin_info = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
-		pass_begin_info.renderPass = render_pass;
-		// pass_begin_info.framebuffer = swapchain.framebuffers[image_index];
-		pass_begin_info.framebuffer = target_fb;
-		pass_begin_info.renderArea.extent.width = swapchain.width;
-		pass_begin_info.renderArea.extent.height = swapchain.height;
-		pass_begin_info.clearValueCount = ARRAY_SIZE(clear_values);
-		pass_begin_info.pClearValues = clear_values;
+		VkClearValue visibility_clear_value = {};
+		visibility_clear_value.color.uint32[0] = kVisibilityEmpty;
+		visibility_clear_value.color.uint32[1] = kVisibilityEmpty;
+
+		// With record_threads the draws go into secondary command buffers, and within the pass the primary can then
+		// only execute those: no timestamps in between, and the statistics query needs inheritedQueries to stay open.
+		const bool secondary_draws = record_threads > 0;
+		const bool pass_statistics = !secondary_draws || device_features.inherited_queries;
+
+		// Queries can't straddle the render pass, so this also counts the clears.
+		if (pass_statistics)
+		{
+			BeginGpuStatistics(gpu_profiler, cmd_buf);
+		}
+		BeginGpuScope(gpu_profiler, cmd_buf, "main pass");
+
+		if (dynamic_rendering)
+		{
+			// Same load/store ops as in CreateRenderPass.
+			VkRenderingAttachmentInfoKHR color_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR };
+			color_attachment.imageView =
+					render_to_swapchain ? swapchain.image_views[image_index] : color_target.image_view;
+			color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+			color_attachment.clearValue = clear_values[0];
+			if (visibility)
+			{
+				color_attachment.imageView = visibility_target.image_view;
+				color_attachment.clearValue = visibility_clear_value;
+			}
 
-		vkCmdBeginRenderPass(cmd_buf, &pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+			VkRenderingAttachmentInfoKHR depth_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR };
+			depth_attachment.imageView = depth_target.image_view;
+			depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			// The merge of the software rasterizer tests against it.
+			depth_attachment.storeOp = software ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			depth_attachment.clearValue = clear_values[1];
+
+			VkRenderingInfoKHR rendering_info = { VK_STRUCTURE_TYPE_RENDERING_INFO_KHR };
+			rendering_info.flags = secondary_draws ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR : 0;
+			rendering_info.renderArea.extent.width = swapchain.width;
+			rendering_info.renderArea.extent.height = swapchain.height;
+			rendering_info.layerCount = 1;
+			rendering_info.colorAttachmentCount = 1;
+			rendering_info.pColorAttachments = &color_attachment;
+			rendering_info.pDepthAttachment = &depth_attachment;
+
+			vkCmdBeginRenderingKHR(cmd_buf, &rendering_info);
+		}
+		else
+		{
+			VkRenderPassBeginInfo pass_begin_info = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
+			pass_begin_info.renderPass = render_to_swapchain ? present_render_pass : render_pass;
+			pass_begin_info.framebuffer = render_to_swapchain ? swapchain_fbs[image_index] : target_fb;
+			pass_begin_info.renderArea.extent.width = swapchain.width;
+			pass_begin_info.renderArea.extent.height = swapchain.height;
+			pass_begin_info.clearValueCount = ARRAY_SIZE(clear_values);
+			pass_begin_info.pClearValues = clear_values;
+
+			vkCmdBeginRenderPass(cmd_buf, &pass_begin_info,
+					secondary_draws ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+		}
 
 		VkViewport viewport = { 0.0f, (float)swapchain.height, (float)swapchain.width, -(float)swapchain.height, 0.0f,
 			1.0f };
 		VkRect2D scissor = { { 0, 0 }, { uint32_t(swapchain.width), uint32_t(swapchain.height) } };
 
-		vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
-		vkCmdSetScissor(cmd_buf, 0, 1, &scissor);
-
 		// Descriptor set binding is a good match for AMD, but not for NVidia (and likely neither for Intel).
 		// We won't use descriptor set binding, we'll use an extension exposed by Intel and NVidia only.
 		// They are like push constants, but for descriptor sets.
 
-		const glm::mat4 projection = ReverseInfiniteProjectionRightHandedWithoutEpsilon(
-				glm::radians(70.0f), float(swapchain.width) / float(swapchain.height), 0.01f);
-
 		Globals globals = {};
 		globals.projection = projection;
+		globals.flags = (culling_enabled ? kGlobalsFlagCull : 0) | (lod_enabled ? kGlobalsFlagLod : 0) |
+				(streaming ? kGlobalsFlagStreaming : 0) | (vertices_split ? kGlobalsFlagSplitVertices : 0) |
+				(depth_only ? kGlobalsFlagDepthOnly : 0) | (triangle_culling_enabled ? kGlobalsFlagCullTriangles : 0) |
+				(visibility ? kGlobalsFlagVisibility : 0) | (software ? kGlobalsFlagSoftwareRaster : 0);
+		// projection[1][1] is 1 / tan(fovy / 2), an error e at distance d covers e / d * projection[1][1] * height / 2
+		// pixels.
+		globals.lod_scale = projection[1][1] * float(swapchain.height) * 0.5f / kLodErrorPixels;
+		globals.attribute_base = attribute_base;
+		globals.screen_size = swapchain.width | (swapchain.height << 16);
+
+		// With BDA there are no descriptors to update, the buffers are passed as pointers along with the globals.
+		BufferAddressConstants address_constants = {};
+		address_constants.globals = globals;
+		address_constants.draws = frame_draw_buffer.address;
+		address_constants.meshlets = meshlet_buffer.address;
+		address_constants.meshlet_data = meshlet_data_buffer.address;
+		address_constants.vertices = vertex_buffer.address;
+		address_constants.counters = frame.counter_buffer.address;
+		address_constants.raster_queue = raster_queue_buffer.address;
+
+		// The task shader only writes the queue with the software rasterizer, without it any buffer will do.
+		const VkBuffer raster_queue =
+				software_raster_supported ? raster_queue_buffer.buffer : frame.counter_buffer.buffer;
+
+
+		// Binds everything and draws [first_draw, first_draw + batch_draw_count) of the frame's draws. The shaders
+		// find their draw by gl_DrawIDARB, which starts at 0 for every call, so the call gets a view of the draw
+		// buffer that starts at its first draw.
+		auto record_draws = [&](VkCommandBuffer cmd_buf, uint32_t first_draw, uint32_t batch_draw_count) {
+			const VkDeviceSize draws_offset = first_draw * sizeof(MeshDraw);
+			const DescriptorInfo draws_descriptor(frame_draw_buffer.buffer, draws_offset);
+			BufferAddressConstants draw_address_constants = address_constants;
+			draw_address_constants.draws += draws_offset;
+
+			if (mesh_shading_enabled)
+			{
+				const Program& meshlet_program = meshlet_programs[binding_model];
+				VkPipeline meshlet_pipeline = meshlet_pipelines[binding_model][dynamic_rendering];
+				if (visibility)
+				{
+					meshlet_pipeline = meshlet_visibility_pipelines[binding_model];
+				}
+				else if (depth_only)
+				{
+					meshlet_pipeline = meshlet_depth_pipelines[binding_model][dynamic_rendering];
+				}
+				vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, meshlet_pipeline);
+
+				if (binding_model == kBindingPushDescriptors)
+				{
+					// The vertex buffer as vertices, positions and attributes.
+					DescriptorInfo descriptors[] = {
+						draws_descriptor,
+						meshlet_buffer.buffer,
+						meshlet_data_buffer.buffer,
+						vertex_buffer.buffer,
+						frame.counter_buffer.buffer,
+						vertex_buffer.buffer,
+						vertex_buffer.buffer,
+						raster_queue,
+					};
+					vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, meshlet_program.descriptor_update_template,
+							meshlet_program.pipeline_layout, 0, descriptors);
+
+					vkCmdPushConstants(cmd_buf, meshlet_program.pipeline_layout, meshlet_program.push_constant_stages,
+							0, sizeof(globals), &globals);
+				}
+				else if (binding_model == kBindingDescriptorIndexing)
+				{
+					vkCmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, meshlet_program.pipeline_layout,
+							1, 1, &bindless_set, 0, nullptr);
+
+					DescriptorInfo descriptors[] = { draws_descriptor, frame.counter_buffer.buffer, raster_queue };
+					vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, meshlet_program.descriptor_update_template,
+							meshlet_program.pipeline_layout, 0, descriptors);
+
+					vkCmdPushConstants(cmd_buf, meshlet_program.pipeline_layout, meshlet_program.push_constant_stages,
+							0, sizeof(globals), &globals);
+				}
+				else
+				{
+					vkCmdPushConstants(cmd_buf, meshlet_program.pipeline_layout, meshlet_program.push_constant_stages,
+							0, sizeof(draw_address_constants), &draw_address_constants);
+				}
+
+				vkCmdDrawMeshTasksIndirectNV(cmd_buf, frame_draw_buffer.buffer,
+						draws_offset + offsetof(MeshDraw, command_indirect_ms), batch_draw_count, sizeof(MeshDraw));
+			}
+			else
+			{
+				const Program& mesh_program = mesh_programs[binding_model];
+				VkPipeline mesh_pipeline = mesh_pipelines[binding_model][dynamic_rendering];
+				if (visibility)
+				{
+					mesh_pipeline = mesh_visibility_pipelines[binding_model];
+				}
+				else if (depth_only)
+				{
+					mesh_pipeline = mesh_depth_pipelines[binding_model][dynamic_rendering];
+				}
+				vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_pipeline);
+
+				if (binding_model == kBindingPushDescriptors)
+				{
+					// The vertex buffer as vertices, positions and attributes.
+					DescriptorInfo descriptors[] = {
+						draws_descriptor,
+						vertex_buffer.buffer,
+						vertex_buffer.buffer,
+						vertex_buffer.buffer,
+					};
+					vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, mesh_program.descriptor_update_template,
+							mesh_program.pipeline_layout, 0, descriptors);
+
+					vkCmdPushConstants(cmd_buf, mesh_program.pipeline_layout, mesh_program.push_constant_stages, 0,
+							sizeof(globals), &globals);
+				}
+				else if (binding_model == kBindingDescriptorIndexing)
+				{
+					vkCmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_program.pipeline_layout, 1,
+							1, &bindless_set, 0, nullptr);
+
+					DescriptorInfo descriptors[] = { draws_descriptor };
+					vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, mesh_program.descriptor_update_template,
+							mesh_program.pipeline_layout, 0, descriptors);
+
+					vkCmdPushConstants(cmd_buf, mesh_program.pipeline_layout, mesh_program.push_constant_stages, 0,
+							sizeof(globals), &globals);
+				}
+				else
+				{
+					vkCmdPushConstants(cmd_buf, mesh_program.pipeline_layout, mesh_program.push_constant_stages, 0,
+							sizeof(draw_address_constants), &draw_address_constants);
+				}
+
+				vkCmdBindIndexBuffer(cmd_buf, index_buffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+
+				vkCmdDrawIndexedIndirect(cmd_buf, frame_draw_buffer.buffer,
+						draws_offset + offsetof(MeshDraw, command_indirect), batch_draw_count, sizeof(MeshDraw));
+			}
+		};
 
-		if (mesh_shading_enabled)
+		const double draw_record_begin = glfwGetTime() * 1000.0;
+
+		if (!secondary_draws)
 		{
-			vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, meshlet_pipeline);
+			vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
+			vkCmdSetScissor(cmd_buf, 0, 1, &scissor);
 
-			DescriptorInfo descriptors[] = {
-				draw_buffer.buffer,
-				meshlet_buffer.buffer,
-				meshlet_data_buffer.buffer,
-				vertex_buffer.buffer,
+			// Culling happens in the task shader, so it's part of the meshlet draw.
+			BeginGpuScope(gpu_profiler, cmd_buf, mesh_shading_enabled ? "meshlet draw" : "indexed draw");
+			record_draws(cmd_buf, 0, frame_draw_count);
+			EndGpuScope(gpu_profiler, cmd_buf);
+		}
+		else
+		{
+			const uint32_t batch_count = (frame_draw_count + kDrawBatchSize - 1) / kDrawBatchSize;
+			const uint32_t thread_count =
+					std::min({ record_threads, uint32_t(frame.draw_cmd_bufs.size()), std::max(batch_count, 1u) });
+
+			// The pass the secondary command buffers continue.
+			VkCommandBufferInheritanceRenderingInfoKHR inheritance_rendering = {
+				VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR
 			};
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, meshlet_program.descriptor_update_template,
-					meshlet_program.pipeline_layout, 0, descriptors);
+			inheritance_rendering.colorAttachmentCount = 1;
+			inheritance_rendering.pColorAttachmentFormats = visibility ? &kVisibilityFormat : &swapchain_format;
+			inheritance_rendering.depthAttachmentFormat = VK_FORMAT_D32_SFLOAT;
+			inheritance_rendering.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
-			vkCmdPushConstants(cmd_buf, meshlet_program.pipeline_layout, meshlet_program.push_constant_stages, 0,
-					sizeof(globals), &globals);
+			VkCommandBufferInheritanceInfo inheritance = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+			if (dynamic_rendering)
+			{
+				inheritance.pNext = &inheritance_rendering;
+			}
+			else
+			{
+				inheritance.renderPass = render_to_swapchain ? present_render_pass : render_pass;
+				inheritance.framebuffer = render_to_swapchain ? swapchain_fbs[image_index] : target_fb;
+			}
+			if (pass_statistics && gpu_profiler.statistics_pool)
+			{
+				inheritance.pipelineStatistics = kPipelineStatisticFlags;
+			}
 
-			vkCmdDrawMeshTasksIndirectNV(cmd_buf, draw_buffer.buffer, offsetof(MeshDraw, command_indirect_ms),
-					uint32_t(draws.size()), sizeof(MeshDraw));
+			// Every thread records a contiguous range of batches, so the draws keep their order, into its own command
+			// buffer from its own pool. The fence has seen the pools' last use by this frame slot complete.
+			ParallelFor(thread_count, 1, [&](size_t begin, size_t end) {
+				for (size_t thread = begin; thread < end; ++thread)
+				{
+					TRACE_SCOPE("record draws");
+					VkCommandBuffer draw_cmd_buf = frame.draw_cmd_bufs[thread];
+					VK_CHECK(vkResetCommandPool(device, frame.draw_cmd_pools[thread], 0));
+
+					VkCommandBufferBeginInfo draw_begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+					draw_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+							VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+					draw_begin_info.pInheritanceInfo = &inheritance;
+					VK_CHECK(vkBeginCommandBuffer(draw_cmd_buf, &draw_begin_info));
+
+					// Dynamic state isn't inherited.
+					vkCmdSetViewport(draw_cmd_buf, 0, 1, &viewport);
+					vkCmdSetScissor(draw_cmd_buf, 0, 1, &scissor);
+
+					const uint32_t batch_begin = uint32_t(batch_count * thread / thread_count);
+					const uint32_t batch_end = uint32_t(batch_count * (thread + 1) / thread_count);
+					for (uint32_t batch = batch_begin; batch < batch_end; ++batch)
+					{
+						const uint32_t first_draw = batch * kDrawBatchSize;
+						record_draws(draw_cmd_buf, first_draw, std::min(kDrawBatchSize, frame_draw_count - first_draw));
+					}
+
+					VK_CHECK(vkEndCommandBuffer(draw_cmd_buf));
+				}
+			});
+
+			vkCmdExecuteCommands(cmd_buf, thread_count, frame.draw_cmd_bufs.data());
 		}
-		else
+
+		const double draw_record_end = glfwGetTime() * 1000.0;
+
+		if (dynamic_rendering)
 		{
-			vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_pipeline);
+			vkCmdEndRenderingKHR(cmd_buf);
 
-			DescriptorInfo descriptors[] = {
-				draw_buffer.buffer,
-				vertex_buffer.buffer,
-			};
-			vkCmdPushDescriptorSetWithTemplateKHR(
-					cmd_buf, mesh_program.descriptor_update_template, mesh_program.pipeline_layout, 0, descriptors);
+			// The small meshlets the task shader queued instead of drawing them. Rasterized into raster_pixel_buffer,
+			// then merged into the visibility buffer with the depth test, as if the hardware had drawn them last.
+			if (software)
+			{
+				BeginGpuScope(gpu_profiler, cmd_buf, "software raster");
+
+				VkBufferMemoryBarrier queue_barrier = BufferBarrier(raster_queue_buffer.buffer,
+						VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+				vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV,
+						VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+								VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+						0, 0, nullptr, 1, &queue_barrier, 0, nullptr);
+
+				vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, raster_pipeline);
+
+				// The queue points into all draws as uploaded, like the visibility buffer.
+				DescriptorInfo raster_descriptors[] = {
+					draw_buffer.buffer,
+					meshlet_buffer.buffer,
+					meshlet_data_buffer.buffer,
+					vertex_buffer.buffer,
+					vertex_buffer.buffer,
+					frame.counter_buffer.buffer,
+					raster_queue_buffer.buffer,
+					raster_pixel_buffer.buffer,
+				};
+				vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, raster_program.descriptor_update_template,
+						raster_program.pipeline_layout, 0, raster_descriptors);
+				vkCmdPushConstants(cmd_buf, raster_program.pipeline_layout, raster_program.push_constant_stages, 0,
+						sizeof(globals), &globals);
+
+				vkCmdDispatchIndirect(cmd_buf, raster_queue_buffer.buffer, offsetof(RasterQueue, dispatch));
+
+				EndGpuScope(gpu_profiler, cmd_buf);
+
+				BeginGpuScope(gpu_profiler, cmd_buf, "merge");
+
+				VkBufferMemoryBarrier pixel_barrier = BufferBarrier(
+						raster_pixel_buffer.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+				VkImageMemoryBarrier merge_barriers[] = {
+					ImageBarrier(visibility_target.image, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+							VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+							VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+							VK_IMAGE_ASPECT_COLOR_BIT),
+					ImageBarrier(depth_target.image, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+							VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+							VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+							VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_ASPECT_DEPTH_BIT),
+				};
+				vkCmdPipelineBarrier(cmd_buf,
+						VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+								VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+						VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+								VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+						0, 0, nullptr, 1, &pixel_barrier, ARRAY_SIZE(merge_barriers), merge_barriers);
+
+				VkRenderingAttachmentInfoKHR merge_color_attachment = {
+					VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR
+				};
+				merge_color_attachment.imageView = visibility_target.image_view;
+				merge_color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+				merge_color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+				merge_color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+
+				VkRenderingAttachmentInfoKHR merge_depth_attachment = {
+					VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR
+				};
+				merge_depth_attachment.imageView = depth_target.image_view;
+				merge_depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+				merge_depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+				merge_depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+				VkRenderingInfoKHR merge_rendering_info = { VK_STRUCTURE_TYPE_RENDERING_INFO_KHR };
+				merge_rendering_info.renderArea.extent.width = swapchain.width;
+				merge_rendering_info.renderArea.extent.height = swapchain.height;
+				merge_rendering_info.layerCount = 1;
+				merge_rendering_info.colorAttachmentCount = 1;
+				merge_rendering_info.pColorAttachments = &merge_color_attachment;
+				merge_rendering_info.pDepthAttachment = &merge_depth_attachment;
+
+				vkCmdBeginRenderingKHR(cmd_buf, &merge_rendering_info);
+
+				vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
+				vkCmdSetScissor(cmd_buf, 0, 1, &scissor);
+				vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, merge_pipeline);
+
+				DescriptorInfo merge_descriptors[] = { raster_queue_buffer.buffer, raster_pixel_buffer.buffer };
+				vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, merge_program.descriptor_update_template,
+						merge_program.pipeline_layout, 0, merge_descriptors);
+				vkCmdPushConstants(cmd_buf, merge_program.pipeline_layout, merge_program.push_constant_stages, 0,
+						sizeof(globals), &globals);
+
+				vkCmdDraw(cmd_buf, 3, 1, 0, 0);
+
+				vkCmdEndRenderingKHR(cmd_buf);
+
+				EndGpuScope(gpu_profiler, cmd_buf);
+			}
 
-			vkCmdBindIndexBuffer(cmd_buf, index_buffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+			// Shades every covered pixel once, the geometry only left its triangle. The vertices are fetched and
+			// transformed again per pixel, that's the price for not running the fragment shader per layer of
+			// overdraw.
+			if (visibility)
+			{
+				BeginGpuScope(gpu_profiler, cmd_buf, "resolve");
+
+				VkImageMemoryBarrier visibility_barrier = ImageBarrier(visibility_target.image,
+						VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+						VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+						VK_IMAGE_ASPECT_COLOR_BIT);
+				vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+						VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1,
+						&visibility_barrier);
+
+				VkRenderingAttachmentInfoKHR color_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR };
+				color_attachment.imageView =
+						render_to_swapchain ? swapchain.image_views[image_index] : color_target.image_view;
+				color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+				color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+				color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+				color_attachment.clearValue = clear_values[0];
+
+				VkRenderingInfoKHR rendering_info = { VK_STRUCTURE_TYPE_RENDERING_INFO_KHR };
+				rendering_info.renderArea.extent.width = swapchain.width;
+				rendering_info.renderArea.extent.height = swapchain.height;
+				rendering_info.layerCount = 1;
+				rendering_info.colorAttachmentCount = 1;
+				rendering_info.pColorAttachments = &color_attachment;
+
+				vkCmdBeginRenderingKHR(cmd_buf, &rendering_info);
+
+				vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
+				vkCmdSetScissor(cmd_buf, 0, 1, &scissor);
+				vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, resolve_pipeline);
+
+				// All draws as uploaded, MeshDraw::draw_index points there. Without mesh shading there are no
+				// meshlet buffers, the resolve doesn't read them then and any buffer will do.
+				const VkBuffer resolve_meshlet_buffer =
+						mesh_shading_supported ? meshlet_buffer.buffer : index_buffer.buffer;
+				const VkBuffer resolve_meshlet_data_buffer =
+						mesh_shading_supported ? meshlet_data_buffer.buffer : index_buffer.buffer;
+				DescriptorInfo descriptors[kResolveTextureBinding + kMeshTextureCount] = {
+					draw_buffer.buffer,
+					resolve_meshlet_buffer,
+					resolve_meshlet_data_buffer,
+					vertex_buffer.buffer,
+					vertex_buffer.buffer,
+					vertex_buffer.buffer,
+					index_buffer.buffer,
+					frame.counter_buffer.buffer,
+					{ point_sampler, visibility_target.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+				};
+				// The textures are the last binding, the array elements follow (see CreateUpdateTemplate).
+				for (uint32_t i = 0; i < kMeshTextureCount; ++i)
+				{
+					descriptors[kResolveTextureBinding + i] =
+							DescriptorInfo(sampler, textures[i].image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+				}
+				vkCmdPushDescriptorSetWithTemplateKHR(cmd_buf, resolve_program.descriptor_update_template,
+						resolve_program.pipeline_layout, 0, descriptors);
+
+				// The same frame, plus what the forward shaders know from their variant.
+				Globals resolve_globals = globals;
+				resolve_globals.flags |= (mesh_shading_enabled ? kGlobalsFlagVisibilityMeshlets : 0) |
+						(binding_model == kBindingDescriptorIndexing ? kGlobalsFlagTextured : 0);
+				vkCmdPushConstants(cmd_buf, resolve_program.pipeline_layout, resolve_program.push_constant_stages, 0,
+						sizeof(resolve_globals), &resolve_globals);
+
+				vkCmdDraw(cmd_buf, 3, 1, 0, 0);
+
+				vkCmdEndRenderingKHR(cmd_buf);
+
+				EndGpuScope(gpu_profiler, cmd_buf);
+			}
 
-			vkCmdPushConstants(cmd_buf, mesh_program.pipeline_layout, mesh_program.push_constant_stages, 0,
-					sizeof(globals), &globals);
+			// There's no final layout, the transition to present has to be done by hand.
+			if (render_to_swapchain)
+			{
+				VkImageMemoryBarrier present_barrier = ImageBarrier(swapchain.images[image_index],
+						VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+						VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_ASPECT_COLOR_BIT);
+				vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+						VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1,
+						&present_barrier);
+			}
+		}
+		else
+		{
+			vkCmdEndRenderPass(cmd_buf);
+		}
 
-			vkCmdDrawIndexedIndirect(cmd_buf, draw_buffer.buffer, offsetof(MeshDraw, command_indirect),
-					uint32_t(draws.size()), sizeof(MeshDraw));
+		EndGpuScope(gpu_profiler, cmd_buf);
+		if (pass_statistics)
+		{
+			EndGpuStatistics(gpu_profiler, cmd_buf);
 		}
 
-		vkCmdEndRenderPass(cmd_buf);
+		if (mesh_shading_enabled)
+		{
+			VkBufferMemoryBarrier readback_barrier =
+					BufferBarrier(frame.counter_buffer.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV,
+					VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &readback_barrier, 0, nullptr);
+		}
 
-		// NOTE: Likely a VKSubpassDependency could be used here instead of the barrier. This is explained in:
-		// https://themaister.net/blog/2019/08/14/yet-another-blog-explaining-vulkan-synchronization/
-		VkImageMemoryBarrier copy_barriers[] = {
-			ImageBarrier(swapchain.images[image_index], 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
-					VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT),
-			ImageBarrier(color_target.image, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
-					VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-					VK_IMAGE_ASPECT_COLOR_BIT),
-		};
-		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-				VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, ARRAY_SIZE(copy_barriers), copy_barriers);
-
-		VkImageCopy copy_region = {};
-		copy_region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		copy_region.srcSubresource.layerCount = 1;
-		copy_region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		copy_region.dstSubresource.layerCount = 1;
-		copy_region.extent = { swapchain.width, swapchain.height, 1 };
-		vkCmdCopyImage(cmd_buf, color_target.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapchain.images[image_index],
-				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy_region);
-
-		VkImageMemoryBarrier present_barrier = ImageBarrier(swapchain.images[image_index], VK_ACCESS_TRANSFER_WRITE_BIT,
-				0, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_ASPECT_COLOR_BIT);
-		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-				VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1, &present_barrier);
-
-		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 1);
+		// In direct mode the pass already left the swapchain image in the present layout.
+		if (!render_to_swapchain)
+		{
+			BeginGpuScope(gpu_profiler, cmd_buf, "copy to swapchain");
+
+			// NOTE: Likely a VKSubpassDependency could be used here instead of the barrier. This is explained in:
+			// https://themaister.net/blog/2019/08/14/yet-another-blog-explaining-vulkan-synchronization/
+			VkImageMemoryBarrier copy_barriers[] = {
+				ImageBarrier(swapchain.images[image_index], 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+						VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT),
+				ImageBarrier(color_target.image, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+						VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+						VK_IMAGE_ASPECT_COLOR_BIT),
+			};
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+					VK_PIPELINE_STAGE_TRANSFER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr,
+					ARRAY_SIZE(copy_barriers), copy_barriers);
+
+			VkImageCopy copy_region = {};
+			copy_region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			copy_region.srcSubresource.layerCount = 1;
+			copy_region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			copy_region.dstSubresource.layerCount = 1;
+			copy_region.extent = { swapchain.width, swapchain.height, 1 };
+			vkCmdCopyImage(cmd_buf, color_target.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+					swapchain.images[image_index], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy_region);
+
+			VkImageMemoryBarrier present_barrier = ImageBarrier(swapchain.images[image_index],
+					VK_ACCESS_TRANSFER_WRITE_BIT, 0, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+					VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_ASPECT_COLOR_BIT);
+			vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+					VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1, &present_barrier);
+
+			EndGpuScope(gpu_profiler, cmd_buf);
+		}
+
+		EndGpuScope(gpu_profiler, cmd_buf);
+		EndGpuFrame(gpu_profiler);
 		VK_CHECK(vkEndCommandBuffer(cmd_buf));
 
-		VkPipelineStageFlags submit_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		const double record_end_cpu = glfwGetTime() * 1000.0;
+		RecordTraceEvent("record", record_begin, GetTraceTime());
+
+		VkPipelineStageFlags submit_stage_mask =
+				render_to_swapchain ? VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT;
 
 		VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
 		submit_info.waitSemaphoreCount = 1;
-		submit_info.pWaitSemaphores = &aquire_semaphore;
+		submit_info.pWaitSemaphores = &frame.aquire_semaphore;
 		submit_info.pWaitDstStageMask = &submit_stage_mask;
 		submit_info.pCommandBuffers = &cmd_buf;
 		submit_info.commandBufferCount = 1;
 		submit_info.signalSemaphoreCount = 1;
-		submit_info.pSignalSemaphores = &release_semaphore;
-		VK_CHECK(vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
+		submit_info.pSignalSemaphores = &frame.release_semaphore;
+		{
+			TRACE_SCOPE("submit");
+			VK_CHECK(vkQueueSubmit(queue, 1, &submit_info, frame.fence));
+		}
 
 		VkPresentInfoKHR present_info = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
 		present_info.waitSemaphoreCount = 1;
-		present_info.pWaitSemaphores = &release_semaphore;
+		present_info.pWaitSemaphores = &frame.release_semaphore;
 		present_info.swapchainCount = 1;
 		present_info.pSwapchains = &swapchain.swapchain;
 		present_info.pImageIndices = &image_index;
 
-		VK_CHECK(vkQueuePresentKHR(queue, &present_info));
+		const double present_begin = glfwGetTime() * 1000.0;
+		{
+			TRACE_SCOPE("present");
+			VK_CHECK(vkQueuePresentKHR(queue, &present_info));
+		}
+		const double present_end = glfwGetTime() * 1000.0;
+
+		++frame_number;
 
-		// TODO go away
-		double wait_begin = glfwGetTime() * 1000.0;
-		VK_CHECK(vkDeviceWaitIdle(device));
-		double wait_end = glfwGetTime() * 1000.0;
+		// From the start of main. Submitted, the GPU may still be working on it.
+		if (frame_number == 1)
+		{
+			printf("First frame after %.1f ms\n", double(GetTraceTime() - startup_begin) * 1e-6);
+		}
 
 		{  //  Profiling
-			uint64_t query_results[2];
-			VK_CHECK(vkGetQueryPoolResults(device, query_pool, 0, ARRAY_SIZE(query_results), sizeof(query_results),
-					query_results, sizeof(query_results[0]), VK_QUERY_RESULT_64_BIT));
+			const double frame_end_cpu = glfwGetTime() * 1000.0;
 
-			const double frame_begin_gpu =
-					double(query_results[0]) * physical_device_props.limits.timestampPeriod * 1e-6;
-			const double frame_end_gpu = double(query_results[1]) * physical_device_props.limits.timestampPeriod * 1e-6;
+			AddTimingSample(timings[kTimingCpuFrame], frame_end_cpu - frame_begin_cpu);
+			AddTimingSample(timings[kTimingRecord], record_end_cpu - record_begin_cpu);
+			AddTimingSample(timings[kTimingDrawRecord], draw_record_end - draw_record_begin);
+			AddTimingSample(timings[kTimingFenceWait], wait_end - wait_begin);
+			AddTimingSample(timings[kTimingAcquire], acquire_end - acquire_begin);
+			AddTimingSample(timings[kTimingPresent], present_end - present_begin);
+			// Frames that couldn't be read back yet (or at all) don't produce a sample.
+			if (gpu_profiler.resolved_frame_count != gpu_frames_seen)
+			{
+				AddTimingSample(timings[kTimingGpuFrame], gpu_profiler.last_frame_ms);
+				gpu_frames_seen = gpu_profiler.resolved_frame_count;
+			}
 
-			const double frame_end_cpu = glfwGetTime() * 1000.0;
+			if (benchmark_mode)
+			{
+				BenchmarkFrame benchmark_frame = {};
+				benchmark_frame.frame_number = frame_number - 1;  // Already incremented above.
+				benchmark_frame.cpu_ms = frame_end_cpu - frame_begin_cpu;
+				benchmark_frame.draw_record_ms = draw_record_end - draw_record_begin;
+				benchmark_frame.gpu_resolved_count = gpu_profiler.resolved_frame_count;
+				benchmark_frame.gpu_frame_number = gpu_profiler.last_frame_number;
+				benchmark_frame.gpu_ms = gpu_profiler.last_frame_ms;
+				benchmark_frame.width = swapchain.width;
+				benchmark_frame.height = swapchain.height;
+				benchmark_frame.draw_count = uint32_t(draw_count);
+				benchmark_frame.triangles_per_draw = uint32_t(triangle_count / std::max<size_t>(draw_count, 1));
+				benchmark_frame.fragments = gpu_profiler.statistics[kStatFragmentShaderInvocations];
+				benchmark_frame.triangles_emitted = mesh_shading_enabled ? culling_counters.triangles_emitted : 0;
+				benchmark_frame.triangles_culled = mesh_shading_enabled ? culling_counters.triangles_culled : 0;
+				benchmark_frame.triangles_software = mesh_shading_enabled ? culling_counters.triangles_software : 0;
+				UpdateBenchmark(benchmark, benchmark_frame);
+
+				if (benchmark.phase == kBenchmarkFinished)
+				{
+					glfwSetWindowShouldClose(window, GLFW_TRUE);
+				}
+			}
+
+			const TimingSummary cpu = SummarizeTimingStats(timings[kTimingCpuFrame]);
+			const TimingSummary record = SummarizeTimingStats(timings[kTimingRecord]);
+			const TimingSummary draw_record = SummarizeTimingStats(timings[kTimingDrawRecord]);
+			const TimingSummary wait = SummarizeTimingStats(timings[kTimingFenceWait]);
+			const TimingSummary gpu = SummarizeTimingStats(timings[kTimingGpuFrame]);
+
+			// Averages per mode, to compare the two.
+			const double frame_avg_gpu_offscreen = GetGpuScopeAverage(gpu_profiler, "frame (offscreen)");
+			const double frame_avg_gpu_direct = GetGpuScopeAverage(gpu_profiler, "frame (direct)");
+
+			const double tris_per_sec = double(triangle_count) / (gpu.p50 * 1e-3);
+			const double kitens_per_sec = double(draw_count) / (gpu.p50 * 1e-3);
+
+			// The copy reads the color target and writes the swapchain image once (4 bytes per pixel each).
+			const double copy_mb = double(swapchain.width) * double(swapchain.height) * 4.0 * 2.0 * 1e-6;
+			const bool depth_lazy = (depth_target.memory_flags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+
+			// Culling counters are only meaningful with mesh shading, the pipeline statistics in both paths.
+			char culling[160] = "";
+			if (mesh_shading_enabled)
+			{
+				sprintf(culling,
+						"; culling %s, LOD %s: meshlets accepted %u rejected %u; triangles emitted %u culled %u (%s)",
+						culling_enabled ? "on" : "off", lod_enabled ? "on" : "off", culling_counters.meshlets_accepted,
+						culling_counters.meshlets_rejected, culling_counters.triangles_emitted,
+						culling_counters.triangles_culled, triangle_culling_enabled ? "on" : "off");
+			}
+
+			// How the triangles split between the rasterizers, and what the software one costs. What it saves shows
+			// in the GPU time against the same scene without it.
+			char software_result[128] = "";
+			if (mesh_shading_enabled && software_raster && visibility_buffer && !depth_only)
+			{
+				const uint32_t triangles = culling_counters.triangles_emitted + culling_counters.triangles_software;
+				const double software_share =
+						triangles ? double(culling_counters.triangles_software) / double(triangles) : 0.0;
+				sprintf(software_result,
+						"; software raster: meshlets %u, triangles %u (%.1f%%), %.3f ms + merge %.3f ms",
+						culling_counters.meshlets_software, culling_counters.triangles_software, software_share * 100.0,
+						GetGpuScopeAverage(gpu_profiler, "software raster"), GetGpuScopeAverage(gpu_profiler, "merge"));
+			}
+
+			char streaming_result[128] = "";
+			if (streaming)
+			{
+				const double now = glfwGetTime();
+				if (now - stream_window_begin >= 1.0)
+				{
+					stream_mb_per_s = double(page_streamer.streamed_bytes - stream_window_bytes) /
+							(now - stream_window_begin) * 1e-6;
+					stream_window_begin = now;
+					stream_window_bytes = page_streamer.streamed_bytes;
+				}
+
+				// Of the meshlets that passed culling, how many could be drawn.
+				const uint32_t wanted = culling_counters.meshlets_accepted + culling_counters.meshlets_not_resident;
+				const double hit_rate = wanted ? double(culling_counters.meshlets_accepted) / double(wanted) : 1.0;
+				sprintf(streaming_result, "; pages resident %u/%u, hit rate %.1f%%, streamed %.1f MB/s, evicted %llu",
+						page_streamer.resident_count, page_streamer.page_count, hit_rate * 100.0, stream_mb_per_s,
+						(unsigned long long)page_streamer.evicted_count);
+			}
+
+			char recording[32] = "inline";
+			if (record_threads > 0)
+			{
+				sprintf(recording, "%u threads", record_threads);
+			}
+
+			char cpu_culling_result[64] = "";
+			if (cpu_culling != kCpuCullingOff)
+			{
+				sprintf(cpu_culling_result, " (%u after %s culling)", frame_draw_count, kCpuCullingNames[cpu_culling]);
+			}
 
-			frame_avg_cpu = frame_avg_cpu * 0.95 + (frame_end_cpu - frame_begin_cpu) * 0.05;
-			frame_avg_gpu = frame_avg_gpu * 0.95 + (frame_end_gpu - frame_begin_gpu) * 0.05;
+			// Shaded fragments per pixel. The depth test runs before the fragment shader, so only what's drawn before
+			// whatever ends up in front counts, which is what the sort brings down.
+			const double overdraw = double(gpu_profiler.statistics[kStatFragmentShaderInvocations]) /
+					(double(swapchain.width) * double(swapchain.height));
 
-			const double tris_per_sec = double(draw_count) * double(mesh.indices.size() / 3) / (frame_avg_gpu * 1e-3);
-			const double kitens_per_sec = double(draw_count) / (frame_avg_gpu * 1e-3);
+			char loading_result[64] = "";
+			if (meshes_loading)
+			{
+				sprintf(loading_result, "; loading %u/%u meshes", resident_mesh_count, uint32_t(mesh_ranges.size()));
+			}
 
-			char title[256];
+			// Depth only leaves the visibility buffer out.
+			const char* shading = depth_only ? ", depth only" : (visibility_buffer ? ", visibility buffer" : "");
+
+			char title[2048];
 			sprintf(title,
-					"%s; CPU: %.1f ms; wait %.2f ms; GPU: %.3f ms; triangles %d; meshlets %d; %.2fB tris/s, %.1fM "
-					"kittens/s",
-					mesh_shading_enabled ? "RTX" : "non-RTX", frame_avg_cpu, (wait_end - wait_begin), frame_avg_gpu,
-					(int)(mesh.indices.size() / 3), (int)(mesh.meshlets.size()), tris_per_sec * 1e-9f,
-					kitens_per_sec * 1e-6f);
+					"%s (%s, %s vertices%s)%s; CPU: p50 %.1f p99 %.1f max %.1f ms; "
+					"record: p50 %.3f ms (draws %.3f ms %s); wait p99 %.2f ms; GPU: p50 %.3f p99 %.3f max %.3f ms; "
+					"triangles %d; meshlets %d; "
+					"%.2fB tris/s, %.1fM kittens/s; %s: copy %.1f MB/frame %s, GPU offscreen %.3f ms direct %.3f ms; "
+					"depth %s; draws %d%s, sorted %s%s%s%s; clipped primitives %llu; fragments %llu, overdraw %.2f",
+					mesh_shading_enabled ? "RTX" : "non-RTX", kBindingModelNames[binding_model],
+					vertices_split ? "split" : "interleaved", shading, loading_result, cpu.p50,
+					cpu.p99, cpu.max, record.p50, draw_record.p50, recording, wait.p99, gpu.p50, gpu.p99, gpu.max,
+					(int)triangle_count, (int)geometry.meshlets.size(), tris_per_sec * 1e-9f, kitens_per_sec * 1e-6f,
+					render_to_swapchain ? "direct" : "offscreen", copy_mb, render_to_swapchain ? "saved" : "spent",
+					frame_avg_gpu_offscreen, frame_avg_gpu_direct, depth_lazy ? "lazy" : "device local",
+					(int)draw_count, cpu_culling_result, kDrawSortingNames[draw_sorting], culling, software_result,
+					streaming_result,
+					(unsigned long long)gpu_profiler.statistics[kStatClippingPrimitives],
+					(unsigned long long)gpu_profiler.statistics[kStatFragmentShaderInvocations], overdraw);
 			glfwSetWindowTitle(window, title);
+
+			if (print_gpu_profile)
+			{
+				PrintTimingStats(timings.data(), kTimingCount);
+				PrintGpuProfile(gpu_profiler);
+				print_gpu_profile = false;
+			}
+
+			const double now = glfwGetTime();
+			if (stats_file && now >= next_snapshot_time)
+			{
+				WriteTimingSnapshot(stats_file, now, frame_number, timings.data(), kTimingCount);
+				next_snapshot_time = now + kStatsSnapshotInterval;
+			}
+
+			if (write_trace)
+			{
+				// The GPU scopes are only there with VK_EXT_calibrated_timestamps.
+				const char* trace_path = "niagara.trace.json";
+				if (WriteChromeTrace(trace_path))
+				{
+					printf("Wrote %s (GPU scopes %s)\n", trace_path,
+							gpu_profiler.calibrated_timestamps ? "included" : "not available");
+				}
+				write_trace = false;
+			}
 		}
 	}
 
+	StopMeshLoader(mesh_loader);
 	VK_CHECK(vkDeviceWaitIdle(device));
 
+	if (stats_file)
+	{
+		fclose(stats_file);
+	}
+
+	FlushDeletionQueue(deletion_queue, device, ~0ull);
+
+	for (VkFramebuffer fb : swapchain_fbs)
+	{
+		vkDestroyFramebuffer(device, fb, nullptr);
+	}
 	vkDestroyFramebuffer(device, target_fb, nullptr);
+	DestroyImage(device, visibility_target);
+	DestroyBuffer(raster_pixel_buffer, device);
 	DestroyImage(device, depth_target);
 	DestroyImage(device, color_target);
 
+	if (bindless_pool)
+	{
+		vkDestroyDescriptorPool(device, bindless_pool, nullptr);
+	}
+	vkDestroySampler(device, point_sampler, nullptr);
+	vkDestroySampler(device, sampler, nullptr);
+	for (Image& texture : textures)
+	{
+		DestroyImage(device, texture);
+	}
+
 	DestroyBuffer(draw_buffer, device);
+	DestroyBuffer(raster_queue_buffer, device);
 
 	if (mesh_shading_supported)
 	{
 		DestroyBuffer(meshlet_buffer, device);
 		DestroyBuffer(meshlet_data_buffer, device);
 	}
+	if (streaming)
+	{
+		StopPageStreamer(page_streamer);
+		DestroyBuffer(page_staging_buffer, device);
+	}
 	DestroyBuffer(vertex_buffer, device);
 	DestroyBuffer(index_buffer, device);
 	DestroyBuffer(scratch_buffer, device);
 
-	vkDestroyCommandPool(device, cmd_buf_pool, nullptr);
+	UnloadScene(scene);
+
+	for (Frame& frame : frames)
+	{
+		DestroyBuffer(frame.counter_buffer, device);
+		DestroyBuffer(frame.visible_draw_buffer, device);
+		DestroyBuffer(frame.sorted_draw_buffer, device);
+		DestroyBuffer(frame.sort_bucket_buffer, device);
+		if (frame.upload_buffer.buffer)
+		{
+			DestroyBuffer(frame.upload_buffer, device);
+		}
+		vkDestroySemaphore(device, frame.release_semaphore, nullptr);
+		vkDestroySemaphore(device, frame.aquire_semaphore, nullptr);
+		vkDestroyFence(device, frame.fence, nullptr);
+		vkDestroyCommandPool(device, frame.cmd_pool, nullptr);
+		for (VkCommandPool draw_cmd_pool : frame.draw_cmd_pools)
+		{
+			vkDestroyCommandPool(device, draw_cmd_pool, nullptr);
+		}
+	}
+	vkDestroyCommandPool(device, upload_cmd_pool, nullptr);
+
+	for (uint32_t model = 0; model < kBindingModelCount; ++model)
+	{
+		if (!binding_model_supported[model])
+		{
+			continue;
+		}
+
+		for (uint32_t dynamic = 0; dynamic < 2; ++dynamic)
+		{
+			// Null for the unsupported variants, which is fine.
+			vkDestroyPipeline(device, mesh_pipelines[model][dynamic], nullptr);
+			vkDestroyPipeline(device, mesh_depth_pipelines[model][dynamic], nullptr);
+			vkDestroyPipeline(device, meshlet_pipelines[model][dynamic], nullptr);
+			vkDestroyPipeline(device, meshlet_depth_pipelines[model][dynamic], nullptr);
+		}
+		vkDestroyPipeline(device, mesh_visibility_pipelines[model], nullptr);
+		vkDestroyPipeline(device, meshlet_visibility_pipelines[model], nullptr);
+
+		DestroyProgram(device, mesh_programs[model]);
+		if (mesh_shading_supported)
+		{
+			DestroyProgram(device, meshlet_programs[model]);
+		}
+	}
 
-	vkDestroyPipeline(device, mesh_pipeline, nullptr);
-	DestroyProgram(device, mesh_program);
+	vkDestroyPipeline(device, sort_pipeline, nullptr);
+	DestroyProgram(device, sort_program);
 
-	if (mesh_shading_supported)
+	if (visibility_buffer_supported)
 	{
-		vkDestroyPipeline(device, meshlet_pipeline, nullptr);
-		DestroyProgram(device, meshlet_program);
+		vkDestroyPipeline(device, resolve_pipeline, nullptr);
+		DestroyProgram(device, resolve_program);
+	}
+
+	if (software_raster_supported)
+	{
+		vkDestroyPipeline(device, raster_pipeline, nullptr);
+		DestroyProgram(device, raster_program);
+		vkDestroyPipeline(device, merge_pipeline, nullptr);
+		DestroyProgram(device, merge_program);
 	}
 
 	// vkDestroyPipelineCache(device, pipeline_cache, nullptr);
 
-	DestroyShader(mesh_frag, device);
-	DestroyShader(mesh_vert, device);
+	for (uint32_t model = 0; model < kBindingModelCount; ++model)
+	{
+		if (!binding_model_supported[model])
+		{
+			continue;
+		}
+
+		DestroyShader(mesh_frag[model], device);
+		DestroyShader(mesh_vert[model], device);
 
-	if (mesh_shading_supported)
+		if (mesh_shading_supported)
+		{
+			DestroyShader(meshlet_mesh[model], device);
+			DestroyShader(meshlet_task[model], device);
+		}
+	}
+
+	DestroyShader(sort_comp, device);
+	if (visibility_buffer_supported)
 	{
-		DestroyShader(meshlet_mesh, device);
-		DestroyShader(meshlet_task, device);
+		DestroyShader(visibility_frag, device);
+		DestroyShader(fullscreen_vert, device);
+		DestroyShader(resolve_frag, device);
+	}
+	if (software_raster_supported)
+	{
+		DestroyShader(raster_comp, device);
+		DestroyShader(merge_frag, device);
 	}
 
-	vkDestroyQueryPool(device, query_pool, nullptr);
+	DestroyGpuProfiler(device, gpu_profiler);
 
 	DestroySwapchain(device, swapchain);
 
+	vkDestroyRenderPass(device, present_render_pass, nullptr);
 	vkDestroyRenderPass(device, render_pass, nullptr);
 
-	vkDestroySemaphore(device, release_semaphore, nullptr);
-	vkDestroySemaphore(device, aquire_semaphore, nullptr);
-
 	vkDestroySurfaceKHR(instance, surface, nullptr);
 
 	glfwDestroyWindow(window);
@@ -841,7 +3098,20 @@ VkSemaphore CreateSemaphore(VkDevice device)
 	return semaphore;
 }
 
-VkRenderPass CreateRenderPass(VkDevice device, VkFormat color_format, VkFormat depth_format)
+VkFence CreateFence(VkDevice device, bool signaled)
+{
+	assert(device);
+	VkFenceCreateInfo fence_create_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+	fence_create_info.flags = signaled ? VK_FENCE_CREATE_SIGNALED_BIT : 0;
+
+	VkFence fence = VK_NULL_HANDLE;
+	VK_CHECK(vkCreateFence(device, &fence_create_info, nullptr, &fence));
+
+	return fence;
+}
+
+// With present the color attachment is left in VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, for rendering into the swapchain image.
+VkRenderPass CreateRenderPass(VkDevice device, VkFormat color_format, VkFormat depth_format, bool present)
 {
 	assert(device);
 	assert(color_format);
@@ -855,7 +3125,7 @@ VkRenderPass CreateRenderPass(VkDevice device, VkFormat color_format, VkFormat d
 	attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-	attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	attachments[0].finalLayout = present ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 	attachments[1].format = depth_format;
 	attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
 	attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
@@ -918,3 +3188,19 @@ VkCommandPool CreateCommandBufferPool(VkDevice device, uint32_t family_index)
 
 	return cmd_pool;
 }
+
+VkCommandBuffer AllocateCommandBuffer(VkDevice device, VkCommandPool cmd_pool, VkCommandBufferLevel level)
+{
+	assert(device);
+	assert(cmd_pool);
+
+	VkCommandBufferAllocateInfo cmd_buf_alloc_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+	cmd_buf_alloc_info.commandPool = cmd_pool;
+	cmd_buf_alloc_info.level = level;
+	cmd_buf_alloc_info.commandBufferCount = 1;
+
+	VkCommandBuffer cmd_buf = VK_NULL_HANDLE;
+	VK_CHECK(vkAllocateCommandBuffers(device, &cmd_buf_alloc_info, &cmd_buf));
+
+	return cmd_buf;
+}
@@ -0,0 +1,437 @@
+#include "common.h"
+
+#include "parallel.h"
+#include "trace.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Per thread, a job that finds it full runs right away.
+const int64_t kJobDequeCapacity = 4096;
+
+// Rounds of looking for jobs to steal before an idle worker goes to sleep.
+const uint32_t kIdleSpinCount = 32;
+
+const uint32_t kNoJobThread = ~0u;
+
+struct Job
+{
+	std::function<void()> function;
+	JobCounter* counter;
+	bool background;  // See RunBackgroundJob.
+};
+
+// Chase, Lev - 2005 - Dynamic Circular Work-Stealing Deque, with the memory orders of Le, Pop, Cohen, Nardelli -
+// 2013 - Correct and Efficient Work-Stealing for Weak Memory Models. Fixed size, the owner runs what doesn't fit. The
+// ends are on their own cache lines, the owner writes bottom all the time and thieves write top.
+struct JobDeque
+{
+	std::atomic<int64_t> top{ 0 };
+	char padding0[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> bottom{ 0 };
+	char padding1[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<Job*> jobs[kJobDequeCapacity];
+};
+
+struct JobPool
+{
+	std::once_flag started;
+	uint32_t thread_count;
+	std::unique_ptr<JobDeque[]> deques;  // One per thread, 0 is the thread that started the pool.
+	// The jobs background jobs start, one per thread as well. Kept apart so that the threads that mustn't run them can
+	// still pop and steal every other job.
+	std::unique_ptr<JobDeque[]> background_deques;
+	std::vector<std::thread> threads;
+
+	// Sleeping workers. Whoever queues a job wakes one up if there are any, see WakeWorker.
+	std::mutex mutex;
+	std::condition_variable wake;
+	uint64_t wake_generation;
+	std::atomic<uint32_t> sleeping_workers{ 0 };
+	bool quit;
+
+	// Background jobs started outside of jobs, oldest first. Under mutex, the count is there to look without it.
+	std::vector<Job*> background_jobs;
+	std::atomic<uint32_t> background_job_count{ 0 };
+
+	std::atomic<uint32_t> thread_limit{ 0 };  // See SetParallelThreadLimit.
+
+	~JobPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	}
+};
+
+static JobPool job_pool;
+
+// Index into the pool's deques, kNoJobThread for threads outside the pool.
+static thread_local uint32_t job_thread_index = kNoJobThread;
+// The innermost job the thread runs. The jobs a background job starts are background jobs as well.
+static thread_local const Job* current_job = nullptr;
+
+static bool PushJob(JobDeque& deque, Job* job)
+{
+	const int64_t bottom = deque.bottom.load(std::memory_order_relaxed);
+	const int64_t top = deque.top.load(std::memory_order_acquire);
+	if (bottom - top >= kJobDequeCapacity)
+	{
+		return false;
+	}
+
+	deque.jobs[bottom % kJobDequeCapacity].store(job, std::memory_order_relaxed);
+	deque.bottom.store(bottom + 1, std::memory_order_release);
+	return true;
+}
+
+// Owner only, the most recent job.
+static Job* PopJob(JobDeque& deque)
+{
+	const int64_t bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+	deque.bottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t top = deque.top.load(std::memory_order_relaxed);
+
+	if (top > bottom)
+	{
+		deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	Job* job = deque.jobs[bottom % kJobDequeCapacity].load(std::memory_order_relaxed);
+	if (top == bottom)
+	{
+		// The last one, a thief may be after it as well.
+		if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			job = nullptr;
+		}
+		deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return job;
+}
+
+// Any thread, the oldest job. Also fails when another thief got there first.
+static Job* StealJob(JobDeque& deque)
+{
+	int64_t top = deque.top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const int64_t bottom = deque.bottom.load(std::memory_order_acquire);
+	if (top >= bottom)
+	{
+		return nullptr;
+	}
+
+	Job* job = deque.jobs[top % kJobDequeCapacity].load(std::memory_order_relaxed);
+	if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+	{
+		return nullptr;
+	}
+	return job;
+}
+
+// Thread 0 never runs background jobs, unless it runs one itself because there's no other thread. Neither do other
+// threads while they wait for jobs within a job that isn't one, that job would have to wait for it. Frame jobs go
+// first.
+static Job* FindJob(JobPool& pool, uint32_t thread_index)
+{
+	if (Job* job = PopJob(pool.deques[thread_index]))
+	{
+		return job;
+	}
+
+	const bool take_background = current_job ? current_job->background : thread_index != 0;
+	if (take_background)
+	{
+		if (Job* job = PopJob(pool.background_deques[thread_index]))
+		{
+			return job;
+		}
+	}
+
+	for (uint32_t i = 1; i < pool.thread_count; ++i)
+	{
+		if (Job* job = StealJob(pool.deques[(thread_index + i) % pool.thread_count]))
+		{
+			return job;
+		}
+	}
+
+	if (take_background)
+	{
+		for (uint32_t i = 1; i < pool.thread_count; ++i)
+		{
+			if (Job* job = StealJob(pool.background_deques[(thread_index + i) % pool.thread_count]))
+			{
+				return job;
+			}
+		}
+	}
+
+	if (take_background && pool.background_job_count.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		if (!pool.background_jobs.empty())
+		{
+			Job* job = pool.background_jobs.front();
+			pool.background_jobs.erase(pool.background_jobs.begin());
+			pool.background_job_count.store(uint32_t(pool.background_jobs.size()), std::memory_order_relaxed);
+			return job;
+		}
+	}
+	return nullptr;
+}
+
+// Under mutex.
+static bool HasQueuedJobs(JobPool& pool)
+{
+	if (!pool.background_jobs.empty())
+	{
+		return true;
+	}
+
+	for (uint32_t i = 0; i < pool.thread_count; ++i)
+	{
+		for (const JobDeque* deque : { &pool.deques[i], &pool.background_deques[i] })
+		{
+			if (deque->bottom.load(std::memory_order_relaxed) > deque->top.load(std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void ExecuteJob(Job* job)
+{
+	const Job* outer_job = current_job;
+	current_job = job;
+	job->function();
+	current_job = outer_job;
+
+	// The captures go before anyone waiting on the counter returns.
+	JobCounter* counter = job->counter;
+	delete job;
+	counter->pending.fetch_sub(1, std::memory_order_release);
+}
+
+static bool IsLimited(const JobPool& pool, uint32_t thread_index)
+{
+	const uint32_t thread_limit = pool.thread_limit.load(std::memory_order_relaxed);
+	return thread_limit != 0 && thread_index >= thread_limit;
+}
+
+static void WakeWorker(JobPool& pool)
+{
+	// Pairs with the fence in WorkerMain: either the worker sees the job or this sees the worker.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (pool.sleeping_workers.load(std::memory_order_relaxed) == 0)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		++pool.wake_generation;
+	}
+
+	// Limited workers go right back to sleep, so with a limit the one that can take the job has to be among them.
+	if (pool.thread_limit.load(std::memory_order_relaxed) != 0)
+	{
+		pool.wake.notify_all();
+	}
+	else
+	{
+		pool.wake.notify_one();
+	}
+}
+
+static void WorkerMain(JobPool& pool, uint32_t thread_index)
+{
+	SetTraceThreadName("worker");
+	job_thread_index = thread_index;
+
+	uint32_t idle_spins = 0;
+	for (;;)
+	{
+		Job* job = IsLimited(pool, thread_index) ? nullptr : FindJob(pool, thread_index);
+		if (job)
+		{
+			ExecuteJob(job);
+			idle_spins = 0;
+			continue;
+		}
+
+		if (++idle_spins < kIdleSpinCount)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.sleeping_workers.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		const uint64_t generation = pool.wake_generation;
+		if (!pool.quit && (IsLimited(pool, thread_index) || !HasQueuedJobs(pool)))
+		{
+			pool.wake.wait(lock, [&] { return pool.quit || pool.wake_generation != generation; });
+		}
+
+		pool.sleeping_workers.fetch_sub(1, std::memory_order_relaxed);
+		if (pool.quit)
+		{
+			return;
+		}
+		idle_spins = 0;
+	}
+}
+
+static void StartJobPool(JobPool& pool)
+{
+	std::call_once(pool.started, [&] {
+		pool.thread_count = GetParallelThreadCount();
+		pool.deques.reset(new JobDeque[pool.thread_count]);
+		pool.background_deques.reset(new JobDeque[pool.thread_count]);
+
+		job_thread_index = 0;
+		for (uint32_t i = 1; i < pool.thread_count; ++i)
+		{
+			pool.threads.emplace_back(WorkerMain, std::ref(pool), i);
+		}
+	});
+}
+
+void RunJob(JobCounter& counter, std::function<void()> function)
+{
+	StartJobPool(job_pool);
+
+	counter.pending.fetch_add(1, std::memory_order_relaxed);
+	Job* job = new Job{ std::move(function), &counter, current_job && current_job->background };
+
+	if (job_thread_index == kNoJobThread)
+	{
+		ExecuteJob(job);
+		return;
+	}
+
+	JobDeque* deques = job->background ? job_pool.background_deques.get() : job_pool.deques.get();
+	if (!PushJob(deques[job_thread_index], job))
+	{
+		ExecuteJob(job);
+		return;
+	}
+
+	WakeWorker(job_pool);
+}
+
+void RunBackgroundJob(JobCounter& counter, std::function<void()> function)
+{
+	StartJobPool(job_pool);
+
+	if (current_job && current_job->background)
+	{
+		RunJob(counter, std::move(function));
+		return;
+	}
+
+	counter.pending.fetch_add(1, std::memory_order_relaxed);
+	Job* job = new Job{ std::move(function), &counter, true };
+
+	if (job_pool.threads.empty())
+	{
+		ExecuteJob(job);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(job_pool.mutex);
+		job_pool.background_jobs.push_back(job);
+		job_pool.background_job_count.store(uint32_t(job_pool.background_jobs.size()), std::memory_order_relaxed);
+		++job_pool.wake_generation;
+	}
+	job_pool.wake.notify_all();
+}
+
+void WaitForJobs(JobCounter& counter)
+{
+	while (counter.pending.load(std::memory_order_acquire) > 0)
+	{
+		// Threads outside the pool ran their jobs in RunJob, so this only waits for jobs stolen from this thread.
+		Job* job = job_thread_index == kNoJobThread ? nullptr : FindJob(job_pool, job_thread_index);
+		if (job)
+		{
+			ExecuteJob(job);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+// Queues the upper half of the batches as a job until a single batch is left, and runs that one. Whoever steals the
+// upper half splits it the same way.
+static void RunBatches(JobCounter& counter, const std::function<void(size_t, size_t)>& function, size_t count,
+		size_t batch_size, size_t first_batch, size_t end_batch)
+{
+	while (end_batch - first_batch > 1)
+	{
+		const size_t middle_batch = first_batch + (end_batch - first_batch) / 2;
+		RunJob(counter, [&counter, &function, count, batch_size, middle_batch, end_batch] {
+			RunBatches(counter, function, count, batch_size, middle_batch, end_batch);
+		});
+		end_batch = middle_batch;
+	}
+
+	const size_t begin = first_batch * batch_size;
+	function(begin, begin + batch_size < count ? begin + batch_size : count);
+}
+
+void ParallelFor(size_t count, size_t batch_size, const std::function<void(size_t begin, size_t end)>& function)
+{
+	assert(batch_size > 0);
+	if (count == 0)
+	{
+		return;
+	}
+
+	StartJobPool(job_pool);
+
+	// Not worth queueing anything.
+	if (count <= batch_size || job_pool.thread_limit.load(std::memory_order_relaxed) == 1
+			|| job_thread_index == kNoJobThread)
+	{
+		for (size_t begin = 0; begin < count; begin += batch_size)
+		{
+			function(begin, begin + batch_size < count ? begin + batch_size : count);
+		}
+		return;
+	}
+
+	JobCounter counter;
+	RunBatches(counter, function, count, batch_size, 0, (count + batch_size - 1) / batch_size);
+	WaitForJobs(counter);
+}
+
+uint32_t GetParallelThreadCount()
+{
+	// Can be 0 if it's not known.
+	const uint32_t thread_count = std::thread::hardware_concurrency();
+	return thread_count > 0 ? thread_count : 1;
+}
+
+void SetParallelThreadLimit(uint32_t count)
+{
+	job_pool.thread_limit.store(count, std::memory_order_relaxed);
+}
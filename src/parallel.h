@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+// Work-stealing job scheduler. Every thread of the pool (one worker per additional hardware thread, started on first
+// use, and the thread that used it first) owns a Chase-Lev deque, and one for the jobs of background jobs: it pushes
+// and pops its own jobs at the bottom, idle threads steal from the top of the others. Waiting for jobs runs jobs, so
+// jobs can start and wait for jobs of their own. Other threads run their jobs right away.
+
+// Counts the jobs that still have to finish. A job can start children on its own counter, the counter then only
+// reaches 0 once the whole tree is done.
+struct JobCounter
+{
+	std::atomic<uint32_t> pending{ 0 };
+};
+
+// Queues function as a job on the calling thread's deque.
+void RunJob(JobCounter& counter, std::function<void()> function);
+
+// Like RunJob, for work that takes longer than a frame (loading): it never runs on the thread that started the pool,
+// the one the frames are recorded on, and neither do the jobs it starts. Runs right away if there's no other thread.
+void RunBackgroundJob(JobCounter& counter, std::function<void()> function);
+
+// Runs jobs, its own first, until counter reaches 0.
+void WaitForJobs(JobCounter& counter);
+
+// Splits [0, count) into batches of batch_size and calls function(begin, end) once per batch as jobs, splitting the
+// range in halves so that idle threads steal big pieces. Returns once all batches are done. Can be called from within
+// jobs, including function.
+void ParallelFor(size_t count, size_t batch_size, const std::function<void(size_t begin, size_t end)>& function);
+
+// Hardware threads, the most ParallelFor will use.
+uint32_t GetParallelThreadCount();
+
+// Limits the jobs to the first count threads (the calling one included) to measure scaling, 0 lifts the limit. Only
+// change it while no jobs are running.
+void SetParallelThreadLimit(uint32_t count);
@@ -0,0 +1,307 @@
+#include "common.h"
+
+#include "profiler.h"
+#include "trace.h"
+
+#include <string.h>
+
+static const uint32_t kQueriesPerSlot = kMaxProfilerScopes * 2;
+
+const char* kPipelineStatisticNames[kPipelineStatisticCount] = {
+	"input assembly primitives",
+	"vertex shader invocations",
+	"clipping invocations",
+	"clipping primitives",
+	"fragment shader invocations",
+};
+
+static VkQueryPool CreateQueryPool(
+		VkDevice device, VkQueryType type, uint32_t pool_size, VkQueryPipelineStatisticFlags statistics = 0)
+{
+	VkQueryPoolCreateInfo query_pool_create_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	// query_pool_create_info.flags;
+	query_pool_create_info.queryType = type;
+	query_pool_create_info.queryCount = pool_size;
+	query_pool_create_info.pipelineStatistics = statistics;
+
+	VkQueryPool query_pool = VK_NULL_HANDLE;
+	VK_CHECK(vkCreateQueryPool(device, &query_pool_create_info, nullptr, &query_pool));
+
+	return query_pool;
+}
+
+static bool SupportsTraceTimeDomains(VkPhysicalDevice physical_device)
+{
+	uint32_t domain_count = 0;
+	VK_CHECK(vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(physical_device, &domain_count, nullptr));
+	std::vector<VkTimeDomainEXT> domains(domain_count);
+	VK_CHECK(vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(physical_device, &domain_count, domains.data()));
+
+	bool device_domain = false;
+	bool host_domain = false;
+	for (VkTimeDomainEXT domain : domains)
+	{
+		device_domain = device_domain || domain == VK_TIME_DOMAIN_DEVICE_EXT;
+		host_domain = host_domain || domain == GetTraceTimeDomain();
+	}
+
+	return device_domain && host_domain;
+}
+
+GpuProfiler CreateGpuProfiler(VkPhysicalDevice physical_device, VkDevice device,
+		const VkPhysicalDeviceProperties& physical_device_props, bool pipeline_statistics, bool calibrated_timestamps)
+{
+	assert(device);
+	assert(physical_device_props.limits.timestampComputeAndGraphics);
+
+	GpuProfiler profiler = {};
+	profiler.query_pool = CreateQueryPool(device, VK_QUERY_TYPE_TIMESTAMP, kQueriesPerSlot * kProfilerLatency);
+	assert(profiler.query_pool);
+	if (pipeline_statistics)
+	{
+		profiler.statistics_pool = CreateQueryPool(
+				device, VK_QUERY_TYPE_PIPELINE_STATISTICS, kProfilerLatency, kPipelineStatisticFlags);
+	}
+	profiler.calibrated_timestamps = calibrated_timestamps && SupportsTraceTimeDomains(physical_device);
+	// timestampPeriod is in ns per tick.
+	profiler.timestamp_period_ms = double(physical_device_props.limits.timestampPeriod) * 1e-6;
+
+	for (std::vector<GpuScope>& scopes : profiler.scopes)
+	{
+		scopes.reserve(kMaxProfilerScopes);
+	}
+
+	return profiler;
+}
+
+void DestroyGpuProfiler(VkDevice device, GpuProfiler& profiler)
+{
+	vkDestroyQueryPool(device, profiler.query_pool, nullptr);
+	profiler.query_pool = VK_NULL_HANDLE;
+	vkDestroyQueryPool(device, profiler.statistics_pool, nullptr);
+	profiler.statistics_pool = VK_NULL_HANDLE;
+}
+
+static GpuScopeStats& FindOrAddStats(GpuProfiler& profiler, const char* name, uint32_t depth)
+{
+	for (GpuScopeStats& stats : profiler.stats)
+	{
+		if (stats.depth == depth && strcmp(stats.name, name) == 0)
+		{
+			return stats;
+		}
+	}
+
+	GpuScopeStats stats = {};
+	stats.name = name;
+	stats.depth = depth;
+	profiler.stats.push_back(stats);
+	return profiler.stats.back();
+}
+
+static void ResolveStatistics(GpuProfiler& profiler, VkDevice device, uint32_t slot)
+{
+	uint64_t results[kPipelineStatisticCount];
+	const VkResult rc = vkGetQueryPoolResults(device, profiler.statistics_pool, slot, 1, sizeof(results), results,
+			sizeof(results), VK_QUERY_RESULT_64_BIT);
+	if (rc == VK_NOT_READY)
+	{
+		return;
+	}
+	VK_CHECK(rc);
+
+	memcpy(profiler.statistics, results, sizeof(results));
+}
+
+static void ResolveSlot(GpuProfiler& profiler, VkDevice device, uint32_t slot)
+{
+	if (profiler.statistics_recorded[slot])
+	{
+		ResolveStatistics(profiler, device, slot);
+	}
+
+	const std::vector<GpuScope>& scopes = profiler.scopes[slot];
+	if (scopes.empty())
+	{
+		return;
+	}
+
+	const uint32_t query_count = uint32_t(scopes.size()) * 2;
+	uint64_t results[kQueriesPerSlot];
+
+	// No VK_QUERY_RESULT_WAIT_BIT. If the GPU is really that far behind, the frame is skipped instead.
+	const VkResult rc = vkGetQueryPoolResults(device, profiler.query_pool, slot * kQueriesPerSlot, query_count,
+			sizeof(results), results, sizeof(results[0]), VK_QUERY_RESULT_64_BIT);
+	if (rc == VK_NOT_READY)
+	{
+		return;
+	}
+	VK_CHECK(rc);
+
+	// Recalibrated for every frame, that way the two clocks can't drift apart.
+	uint64_t calibrated[2] = {};  // Device ticks, then trace time.
+	if (profiler.calibrated_timestamps)
+	{
+		VkCalibratedTimestampInfoEXT infos[2] = {
+			{ VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT },
+			{ VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT },
+		};
+		infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+		infos[1].timeDomain = GetTraceTimeDomain();
+
+		uint64_t max_deviation = 0;
+		VK_CHECK(vkGetCalibratedTimestampsEXT(device, ARRAY_SIZE(infos), infos, calibrated, &max_deviation));
+		calibrated[1] = TraceTimeFromHostTimestamp(calibrated[1]);
+	}
+
+	double frame_ms = 0.0;
+	for (const GpuScope& scope : scopes)
+	{
+		const uint32_t begin = scope.begin_query - slot * kQueriesPerSlot;
+		const uint32_t end = scope.end_query - slot * kQueriesPerSlot;
+		const double ms = double(results[end] - results[begin]) * profiler.timestamp_period_ms;
+
+		if (profiler.calibrated_timestamps)
+		{
+			// The queries were written before the calibration, the offsets are negative.
+			const double ns_per_tick = profiler.timestamp_period_ms * 1e6;
+			const double begin_offset = double(int64_t(results[begin] - calibrated[0])) * ns_per_tick;
+			const double end_offset = double(int64_t(results[end] - calibrated[0])) * ns_per_tick;
+			RecordGpuTraceEvent(scope.name, calibrated[1] + int64_t(begin_offset), calibrated[1] + int64_t(end_offset));
+		}
+
+		GpuScopeStats& stats = FindOrAddStats(profiler, scope.name, scope.depth);
+		stats.samples[stats.sample_count % kProfilerHistory] = ms;
+		++stats.sample_count;
+
+		const uint32_t count = stats.sample_count < kProfilerHistory ? stats.sample_count : kProfilerHistory;
+		double sum = 0.0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			sum += stats.samples[i];
+		}
+		stats.average = sum / count;
+
+		frame_ms += scope.depth == 0 ? ms : 0.0;
+	}
+
+	profiler.last_frame_ms = frame_ms;
+	profiler.last_frame_number = profiler.frame_numbers[slot];
+	++profiler.resolved_frame_count;
+}
+
+void BeginGpuFrame(GpuProfiler& profiler, VkDevice device, VkCommandBuffer cmd_buf, uint64_t frame_number)
+{
+	assert(profiler.open_scopes.empty());
+
+	profiler.slot = uint32_t(frame_number % kProfilerLatency);
+
+	if (profiler.pending[profiler.slot])
+	{
+		ResolveSlot(profiler, device, profiler.slot);
+		profiler.pending[profiler.slot] = false;
+	}
+
+	profiler.scopes[profiler.slot].clear();
+	profiler.frame_numbers[profiler.slot] = frame_number;
+	vkCmdResetQueryPool(cmd_buf, profiler.query_pool, profiler.slot * kQueriesPerSlot, kQueriesPerSlot);
+
+	profiler.statistics_recorded[profiler.slot] = false;
+	if (profiler.statistics_pool)
+	{
+		vkCmdResetQueryPool(cmd_buf, profiler.statistics_pool, profiler.slot, 1);
+	}
+}
+
+void EndGpuFrame(GpuProfiler& profiler)
+{
+	assert(profiler.open_scopes.empty());
+	assert(!profiler.statistics_open);
+	profiler.pending[profiler.slot] = true;
+}
+
+void BeginGpuScope(GpuProfiler& profiler, VkCommandBuffer cmd_buf, const char* name)
+{
+	std::vector<GpuScope>& scopes = profiler.scopes[profiler.slot];
+	assert(scopes.size() < kMaxProfilerScopes);
+
+	const uint32_t query = profiler.slot * kQueriesPerSlot + uint32_t(scopes.size()) * 2;
+
+	GpuScope scope = {};
+	scope.name = name;
+	scope.depth = uint32_t(profiler.open_scopes.size());
+	scope.begin_query = query;
+	scope.end_query = query + 1;
+
+	profiler.open_scopes.push_back(uint32_t(scopes.size()));
+	scopes.push_back(scope);
+
+	vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler.query_pool, scope.begin_query);
+}
+
+void EndGpuScope(GpuProfiler& profiler, VkCommandBuffer cmd_buf)
+{
+	assert(!profiler.open_scopes.empty());
+
+	const GpuScope& scope = profiler.scopes[profiler.slot][profiler.open_scopes.back()];
+	profiler.open_scopes.pop_back();
+
+	vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler.query_pool, scope.end_query);
+}
+
+void BeginGpuStatistics(GpuProfiler& profiler, VkCommandBuffer cmd_buf)
+{
+	if (!profiler.statistics_pool)
+	{
+		return;
+	}
+
+	assert(!profiler.statistics_open && !profiler.statistics_recorded[profiler.slot]);
+	profiler.statistics_open = true;
+	vkCmdBeginQuery(cmd_buf, profiler.statistics_pool, profiler.slot, 0);
+}
+
+void EndGpuStatistics(GpuProfiler& profiler, VkCommandBuffer cmd_buf)
+{
+	if (!profiler.statistics_pool)
+	{
+		return;
+	}
+
+	assert(profiler.statistics_open);
+	profiler.statistics_open = false;
+	profiler.statistics_recorded[profiler.slot] = true;
+	vkCmdEndQuery(cmd_buf, profiler.statistics_pool, profiler.slot);
+}
+
+double GetGpuScopeAverage(const GpuProfiler& profiler, const char* name)
+{
+	for (const GpuScopeStats& stats : profiler.stats)
+	{
+		if (strcmp(stats.name, name) == 0)
+		{
+			return stats.average;
+		}
+	}
+
+	return 0.0;
+}
+
+void PrintGpuProfile(const GpuProfiler& profiler)
+{
+	printf("GPU scope                          avg ms (last %u)\n", kProfilerHistory);
+	for (const GpuScopeStats& stats : profiler.stats)
+	{
+		const int indent = int(stats.depth) * 2;
+		printf("%*s%-*s %8.3f\n", indent, "", 34 - indent, stats.name, stats.average);
+	}
+
+	if (profiler.statistics_pool)
+	{
+		printf("Pipeline statistics\n");
+		for (uint32_t i = 0; i < kPipelineStatisticCount; ++i)
+		{
+			printf("  %-32s %12llu\n", kPipelineStatisticNames[i], (unsigned long long)profiler.statistics[i]);
+		}
+	}
+}
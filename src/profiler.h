@@ -0,0 +1,97 @@
+#pragma once
+
+// GPU timestamps for nested, named scopes.
+// Every frame gets its own range of queries which is only read back kProfilerLatency frames later. By then the frame
+// has long finished, nothing ever waits for the GPU.
+// Optionally also counts pipeline statistics for one range of the frame, read back the same way.
+// With VK_EXT_calibrated_timestamps the resolved scopes are also put into the CPU trace, see trace.h.
+
+const uint32_t kProfilerLatency = 4;      // Needs to be larger than the number of frames in flight.
+const uint32_t kMaxProfilerScopes = 32;   // Per frame.
+const uint32_t kProfilerHistory = 64;     // Samples in the rolling average.
+
+struct GpuScope
+{
+	const char* name;  // Not copied, string literals work best.
+	uint32_t depth;
+	uint32_t begin_query;
+	uint32_t end_query;
+};
+
+// In the order Vulkan writes them, which is the order of the VkQueryPipelineStatisticFlagBits.
+// VK_NV_mesh_shader has no task/mesh invocation counters, those only came with VK_EXT_mesh_shader.
+enum PipelineStatistic
+{
+	kStatInputAssemblyPrimitives,
+	kStatVertexShaderInvocations,
+	kStatClippingInvocations,
+	kStatClippingPrimitives,
+	kStatFragmentShaderInvocations,
+	kPipelineStatisticCount,
+};
+
+extern const char* kPipelineStatisticNames[kPipelineStatisticCount];
+
+// Must stay in sync with PipelineStatistic. Secondary command buffers executed while the query is active have to
+// inherit these.
+const VkQueryPipelineStatisticFlags kPipelineStatisticFlags =
+		VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+struct GpuScopeStats
+{
+	const char* name;
+	uint32_t depth;
+	double samples[kProfilerHistory];  // In ms, ring buffer.
+	uint32_t sample_count;             // Total, not capped at kProfilerHistory.
+	double average;                    // Of the last kProfilerHistory samples, in ms.
+};
+
+struct GpuProfiler
+{
+	VkQueryPool query_pool;
+	double timestamp_period_ms;
+
+	std::vector<GpuScope> scopes[kProfilerLatency];
+	bool pending[kProfilerLatency];  // Recorded, but not read back yet.
+	uint32_t slot;
+	std::vector<uint32_t> open_scopes;  // Indices into scopes[slot].
+
+	// In the order the scopes were first seen, parents always come before their children.
+	std::vector<GpuScopeStats> stats;
+	uint64_t frame_numbers[kProfilerLatency];  // Of the frame that last used the slot.
+	uint64_t resolved_frame_count;
+	uint64_t last_frame_number;  // Of the last resolved frame.
+	double last_frame_ms;        // All root scopes of the last resolved frame.
+
+	VkQueryPool statistics_pool;  // Null if the device doesn't support pipelineStatisticsQuery.
+	bool statistics_recorded[kProfilerLatency];
+	bool statistics_open;
+	uint64_t statistics[kPipelineStatisticCount];  // Of the last frame that could be read back.
+
+	bool calibrated_timestamps;  // Supported for both the device and the trace's time domain.
+};
+
+GpuProfiler CreateGpuProfiler(VkPhysicalDevice physical_device, VkDevice device,
+		const VkPhysicalDeviceProperties& physical_device_props, bool pipeline_statistics, bool calibrated_timestamps);
+void DestroyGpuProfiler(VkDevice device, GpuProfiler& profiler);
+
+// Resolves the results of the frame that last used the slot and resets its queries. Call right after
+// vkBeginCommandBuffer.
+void BeginGpuFrame(GpuProfiler& profiler, VkDevice device, VkCommandBuffer cmd_buf, uint64_t frame_number);
+void EndGpuFrame(GpuProfiler& profiler);
+
+void BeginGpuScope(GpuProfiler& profiler, VkCommandBuffer cmd_buf, const char* name);
+void EndGpuScope(GpuProfiler& profiler, VkCommandBuffer cmd_buf);
+
+// At most once per frame, and not across a render pass boundary. No-ops without pipeline statistics support.
+void BeginGpuStatistics(GpuProfiler& profiler, VkCommandBuffer cmd_buf);
+void EndGpuStatistics(GpuProfiler& profiler, VkCommandBuffer cmd_buf);
+
+// Rolling average in ms, 0 if the scope hasn't been measured yet.
+double GetGpuScopeAverage(const GpuProfiler& profiler, const char* name);
+
+// Prints the scope averages and the last pipeline statistics.
+void PrintGpuProfile(const GpuProfiler& profiler);
@@ -1,10 +1,10 @@
 #include "common.h"
 
 #include "resources.h"
+#include "trace.h"
 
-// TODO: Handle more gracefully.
-// Also consider accepting two sets of flags, required and optional ones.
-static uint32_t SelectMemoryType(const VkPhysicalDeviceMemoryProperties& memory_properties, uint32_t memory_type_bits,
+// Returns ~0u if there is no such memory type.
+static uint32_t FindMemoryType(const VkPhysicalDeviceMemoryProperties& memory_properties, uint32_t memory_type_bits,
 		VkMemoryPropertyFlags flags)
 {
 	for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i)
@@ -15,6 +15,20 @@ static uint32_t SelectMemoryType(const VkPhysicalDeviceMemoryProperties& memory_
 		}
 	}
 
+	return ~0u;
+}
+
+// TODO: Handle more gracefully.
+// Also consider accepting two sets of flags, required and optional ones.
+static uint32_t SelectMemoryType(const VkPhysicalDeviceMemoryProperties& memory_properties, uint32_t memory_type_bits,
+		VkMemoryPropertyFlags flags)
+{
+	const uint32_t memory_type = FindMemoryType(memory_properties, memory_type_bits, flags);
+	if (memory_type != ~0u)
+	{
+		return memory_type;
+	}
+
 	printf("ERROR: No compatible memory type found.\n");
 	assert(false);
 	return ~0u;
@@ -53,12 +67,30 @@ void CreateBuffer(Buffer& result, VkDevice device, const VkPhysicalDeviceMemoryP
 	VkMemoryAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
 	alloc_info.allocationSize = requirements.size;
 	alloc_info.memoryTypeIndex = memory_type;
+
+	// Memory that backs a buffer with a device address must be allocated with the matching flag.
+	VkMemoryAllocateFlagsInfo alloc_flags = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO };
+	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+	{
+		alloc_flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+		alloc_info.pNext = &alloc_flags;
+	}
+
 	VkDeviceMemory memory = VK_NULL_HANDLE;
 	VK_CHECK(vkAllocateMemory(device, &alloc_info, nullptr, &memory));
 	assert(memory);
 
 	VK_CHECK(vkBindBufferMemory(device, buffer, memory, 0));
 
+	VkDeviceAddress address = 0;
+	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+	{
+		VkBufferDeviceAddressInfo address_info = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+		address_info.buffer = buffer;
+		address = vkGetBufferDeviceAddress(device, &address_info);
+		assert(address);
+	}
+
 	void* data = nullptr;
 	if (memory_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
 	{
@@ -72,14 +104,17 @@ void CreateBuffer(Buffer& result, VkDevice device, const VkPhysicalDeviceMemoryP
 	result.memory = memory;
 	result.size = size;
 	result.data = data;
+	result.address = address;
 }
 
 void UploadBuffer(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue, const Buffer& buffer,
-		const Buffer& scratch, const void* data, size_t size)
+		const Buffer& scratch, const void* data, size_t size, size_t offset)
 {
+	TRACE_SCOPE("upload buffer");
 	// TODO: This is submitting a command buffer and waiting for device idle, batch this.
 	assert(scratch.data);
 	assert(scratch.size >= size);
+	assert(buffer.size >= offset + size);
 	memcpy(scratch.data, data, size);
 
 	VK_CHECK(vkResetCommandPool(device, cmd_pool, 0));
@@ -88,7 +123,7 @@ void UploadBuffer(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_b
 	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
 
-	VkBufferCopy region = { 0, 0, VkDeviceSize(size) };
+	VkBufferCopy region = { 0, VkDeviceSize(offset), VkDeviceSize(size) };
 	vkCmdCopyBuffer(cmd_buf, scratch.buffer, buffer.buffer, 1, &region);
 
 	VkBufferMemoryBarrier copy_barrier =
@@ -112,8 +147,7 @@ void DestroyBuffer(const Buffer& buffer, VkDevice device)
 	vkDestroyBuffer(device, buffer.buffer, nullptr);
 }
 
-static VkImageView
-CreateImageView(VkDevice device, VkImage image, VkFormat format, uint32_t mip_level, uint32_t level_count)
+VkImageView CreateImageView(VkDevice device, VkImage image, VkFormat format, uint32_t mip_level, uint32_t level_count)
 {
 	assert(device);
 	assert(image);
@@ -139,7 +173,8 @@ CreateImageView(VkDevice device, VkImage image, VkFormat format, uint32_t mip_le
 
 
 Image CreateImage(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties, uint32_t width,
-		uint32_t height, uint32_t mip_levels, VkFormat format, VkImageUsageFlags usage)
+		uint32_t height, uint32_t mip_levels, VkFormat format, VkImageUsageFlags usage,
+		VkMemoryPropertyFlags memory_flags)
 {
 	VkImageCreateInfo img_create_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
 	img_create_info.imageType = VK_IMAGE_TYPE_2D;
@@ -158,8 +193,13 @@ Image CreateImage(VkDevice device, const VkPhysicalDeviceMemoryProperties& memor
 	VkMemoryRequirements requirements;
 	vkGetImageMemoryRequirements(device, image, &requirements);
 
-	const uint32_t memory_type_index =
-			SelectMemoryType(memory_properties, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	// Lazily allocated memory only exists on tilers (mobile, Apple). Everybody else falls back to plain device memory.
+	uint32_t memory_type_index = FindMemoryType(memory_properties, requirements.memoryTypeBits, memory_flags);
+	if (memory_type_index == ~0u && (memory_flags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT))
+	{
+		memory_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+		memory_type_index = SelectMemoryType(memory_properties, requirements.memoryTypeBits, memory_flags);
+	}
 	assert(memory_type_index != ~0u);
 
 	VkMemoryAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
@@ -175,9 +215,50 @@ Image CreateImage(VkDevice device, const VkPhysicalDeviceMemoryProperties& memor
 	result.image = image;
 	result.image_view = CreateImageView(device, image, format, 0, mip_levels);
 	result.memory = memory;
+	result.memory_flags = memory_properties.memoryTypes[memory_type_index].propertyFlags;
 	return result;
 }
 
+void UploadImage(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue, const Image& image,
+		const Buffer& scratch, const void* data, size_t size, uint32_t width, uint32_t height)
+{
+	TRACE_SCOPE("upload image");
+	assert(scratch.data);
+	assert(scratch.size >= size);
+	memcpy(scratch.data, data, size);
+
+	VK_CHECK(vkResetCommandPool(device, cmd_pool, 0));
+
+	VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
+
+	VkImageMemoryBarrier copy_barrier = ImageBarrier(image.image, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1, &copy_barrier);
+
+	VkBufferImageCopy region = {};
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent = { width, height, 1 };
+	vkCmdCopyBufferToImage(cmd_buf, scratch.buffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	VkImageMemoryBarrier read_barrier = ImageBarrier(image.image, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			VK_IMAGE_ASPECT_COLOR_BIT);
+	vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+			VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0, nullptr, 1, &read_barrier);
+
+	VK_CHECK(vkEndCommandBuffer(cmd_buf));
+
+	VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submit_info.pCommandBuffers = &cmd_buf;
+	submit_info.commandBufferCount = 1;
+	VK_CHECK(vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
+	VK_CHECK(vkDeviceWaitIdle(device));
+}
+
 void DestroyImage(VkDevice device, Image image)
 {
 	vkDestroyImageView(device, image.image_view, nullptr);
@@ -185,6 +266,89 @@ void DestroyImage(VkDevice device, Image image)
 	vkFreeMemory(device, image.memory, nullptr);
 }
 
+VkSampler CreateSampler(VkDevice device, VkFilter filter)
+{
+	assert(device);
+
+	VkSamplerCreateInfo sampler_create_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+	sampler_create_info.magFilter = filter;
+	sampler_create_info.minFilter = filter;
+	sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	sampler_create_info.maxLod = VK_LOD_CLAMP_NONE;
+
+	VkSampler sampler = VK_NULL_HANDLE;
+	VK_CHECK(vkCreateSampler(device, &sampler_create_info, nullptr, &sampler));
+	return sampler;
+}
+
+void RetireBuffer(DeletionQueue& queue, const Buffer& buffer, uint64_t frame)
+{
+	queue.buffers.push_back({ buffer, frame });
+}
+
+void RetireImage(DeletionQueue& queue, const Image& image, uint64_t frame)
+{
+	queue.images.push_back({ image, frame });
+}
+
+void RetireImageView(DeletionQueue& queue, VkImageView image_view, uint64_t frame)
+{
+	queue.image_views.push_back({ image_view, frame });
+}
+
+void RetireFramebuffer(DeletionQueue& queue, VkFramebuffer framebuffer, uint64_t frame)
+{
+	queue.framebuffers.push_back({ framebuffer, frame });
+}
+
+void RetirePipeline(DeletionQueue& queue, VkPipeline pipeline, uint64_t frame)
+{
+	queue.pipelines.push_back({ pipeline, frame });
+}
+
+void RetireSwapchain(DeletionQueue& queue, VkSwapchainKHR swapchain, uint64_t frame)
+{
+	queue.swapchains.push_back({ swapchain, frame });
+}
+
+// Destroys and removes all entries that are no longer in use, keeps the order of the remaining ones.
+template <typename T, typename F>
+static void FlushRetired(std::vector<Retired<T>>& retired, uint64_t completed_frame, F destroy)
+{
+	size_t keep = 0;
+	for (size_t i = 0; i < retired.size(); ++i)
+	{
+		if (retired[i].frame <= completed_frame)
+		{
+			destroy(retired[i].object);
+		}
+		else
+		{
+			retired[keep++] = retired[i];
+		}
+	}
+	retired.resize(keep);
+}
+
+void FlushDeletionQueue(DeletionQueue& queue, VkDevice device, uint64_t completed_frame)
+{
+	assert(device);
+
+	FlushRetired(queue.framebuffers, completed_frame,
+			[device](VkFramebuffer framebuffer) { vkDestroyFramebuffer(device, framebuffer, nullptr); });
+	FlushRetired(queue.image_views, completed_frame,
+			[device](VkImageView image_view) { vkDestroyImageView(device, image_view, nullptr); });
+	FlushRetired(queue.images, completed_frame, [device](const Image& image) { DestroyImage(device, image); });
+	FlushRetired(queue.buffers, completed_frame, [device](const Buffer& buffer) { DestroyBuffer(buffer, device); });
+	FlushRetired(queue.pipelines, completed_frame,
+			[device](VkPipeline pipeline) { vkDestroyPipeline(device, pipeline, nullptr); });
+	FlushRetired(queue.swapchains, completed_frame,
+			[device](VkSwapchainKHR swapchain) { vkDestroySwapchainKHR(device, swapchain, nullptr); });
+}
+
 VkImageMemoryBarrier ImageBarrier(VkImage image, VkAccessFlags src_access_mask, VkAccessFlags dst_access_mask,
 		VkImageLayout old_layout, VkImageLayout new_layout, VkImageAspectFlags aspect_mask)
 {
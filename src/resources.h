@@ -6,12 +6,14 @@ struct Buffer
 	VkDeviceMemory memory;
 	void* data;
 	size_t size;
+	VkDeviceAddress address;  // Only valid with VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT.
 };
 
 void CreateBuffer(Buffer& result, VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties,
 		size_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags);
+// Blocking. Writes size bytes at offset into the buffer.
 void UploadBuffer(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue, const Buffer& buffer,
-		const Buffer& scratch, const void* data, size_t size);
+		const Buffer& scratch, const void* data, size_t size, size_t offset = 0);
 void DestroyBuffer(const Buffer& buffer, VkDevice device);
 
 struct Image
@@ -19,12 +21,52 @@ struct Image
 	VkImage image;
 	VkImageView image_view;
 	VkDeviceMemory memory;
+	VkMemoryPropertyFlags memory_flags;  // Of the memory type that was picked, not the requested one.
 };
 
+// VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT is treated as a hint, without support the image gets device local memory.
 Image CreateImage(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties, uint32_t width,
-		uint32_t height, uint32_t mip_levels, VkFormat format, VkImageUsageFlags usage);
+		uint32_t height, uint32_t mip_levels, VkFormat format, VkImageUsageFlags usage,
+		VkMemoryPropertyFlags memory_flags);
+// Blocking, like UploadBuffer. Only writes mip 0, the images uploaded so far have no other mips.
+void UploadImage(VkDevice device, VkCommandPool cmd_pool, VkCommandBuffer cmd_buf, VkQueue queue, const Image& image,
+		const Buffer& scratch, const void* data, size_t size, uint32_t width, uint32_t height);
 void DestroyImage(VkDevice device, Image image);
 
+VkImageView CreateImageView(VkDevice device, VkImage image, VkFormat format, uint32_t mip_level, uint32_t level_count);
+
+// Integer formats can't be filtered, they need VK_FILTER_NEAREST.
+VkSampler CreateSampler(VkDevice device, VkFilter filter = VK_FILTER_LINEAR);
+
+// Objects that might still be referenced by frames in flight. Each one is tagged with the number of the frame that was
+// being recorded when it was retired and only destroyed once the GPU has finished all frames up to that one.
+template <typename T>
+struct Retired
+{
+	T object;
+	uint64_t frame;
+};
+
+struct DeletionQueue
+{
+	std::vector<Retired<Buffer>> buffers;
+	std::vector<Retired<Image>> images;
+	std::vector<Retired<VkImageView>> image_views;
+	std::vector<Retired<VkFramebuffer>> framebuffers;
+	std::vector<Retired<VkPipeline>> pipelines;
+	std::vector<Retired<VkSwapchainKHR>> swapchains;
+};
+
+void RetireBuffer(DeletionQueue& queue, const Buffer& buffer, uint64_t frame);
+void RetireImage(DeletionQueue& queue, const Image& image, uint64_t frame);
+void RetireImageView(DeletionQueue& queue, VkImageView image_view, uint64_t frame);
+void RetireFramebuffer(DeletionQueue& queue, VkFramebuffer framebuffer, uint64_t frame);
+void RetirePipeline(DeletionQueue& queue, VkPipeline pipeline, uint64_t frame);
+void RetireSwapchain(DeletionQueue& queue, VkSwapchainKHR swapchain, uint64_t frame);
+
+// Destroys everything retired at or before completed_frame. Pass ~0ull after vkDeviceWaitIdle to empty the queue.
+void FlushDeletionQueue(DeletionQueue& queue, VkDevice device, uint64_t completed_frame);
+
 VkImageMemoryBarrier ImageBarrier(VkImage image, VkAccessFlags src_access_mask, VkAccessFlags dst_access_mask,
 		VkImageLayout old_layout, VkImageLayout new_layout, VkImageAspectFlags aspect_mask);
 VkBufferMemoryBarrier BufferBarrier(VkBuffer buffer, VkAccessFlags src_access_mask, VkAccessFlags dst_access_mask);
@@ -0,0 +1,218 @@
+#include "common.h"
+
+#include "scene.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+bool MapFile(MappedFile& result, const char* path)
+{
+	result = {};
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data)
+	{
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+		return false;
+	}
+
+	result.data = data;
+	result.size = size_t(size.QuadPart);
+	result.file = file;
+	result.mapping = mapping;
+	return true;
+}
+
+void UnmapFile(MappedFile& file)
+{
+	if (file.data)
+	{
+		UnmapViewOfFile(file.data);
+		CloseHandle(file.mapping);
+		CloseHandle(file.file);
+	}
+	file = {};
+}
+#else
+bool MapFile(MappedFile& result, const char* path)
+{
+	result = {};
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);  // The mapping keeps the file alive.
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	result.data = data;
+	result.size = size_t(st.st_size);
+	return true;
+}
+
+void UnmapFile(MappedFile& file)
+{
+	if (file.data)
+	{
+		munmap(const_cast<void*>(file.data), file.size);
+	}
+	file = {};
+}
+#endif
+
+bool LoadScene(Scene& scene, const char* path)
+{
+	TRACE_SCOPE("load scene");
+	scene = {};
+
+	if (!MapFile(scene.file, path))
+	{
+		printf("Can't open scene %s\n", path);
+		return false;
+	}
+
+	if (scene.file.size < sizeof(SceneHeader))
+	{
+		printf("%s is not a version %u scene\n", path, kSceneVersion);
+		UnloadScene(scene);
+		return false;
+	}
+
+	const char* data = static_cast<const char*>(scene.file.data);
+	const SceneHeader* header = reinterpret_cast<const SceneHeader*>(data);
+
+	// 64 bit, so that made up counts can't overflow.
+	const uint64_t mesh_table_size = uint64_t(header->mesh_count) * sizeof(SceneMesh);
+	const uint64_t instance_table_size = uint64_t(header->instance_count) * sizeof(SceneInstance);
+	const bool valid_header = header->magic == kSceneMagic && header->version == kSceneVersion &&
+			header->string_size > 0 &&
+			scene.file.size == sizeof(SceneHeader) + mesh_table_size + instance_table_size + header->string_size;
+	if (!valid_header)
+	{
+		printf("%s is not a version %u scene\n", path, kSceneVersion);
+		UnloadScene(scene);
+		return false;
+	}
+
+	scene.header = header;
+	scene.meshes = reinterpret_cast<const SceneMesh*>(data + sizeof(SceneHeader));
+	scene.instances = reinterpret_cast<const SceneInstance*>(data + sizeof(SceneHeader) + mesh_table_size);
+	scene.strings = data + sizeof(SceneHeader) + mesh_table_size + instance_table_size;
+
+	// With the string table terminated, every offset in it is a valid string.
+	bool valid_meshes = scene.strings[header->string_size - 1] == '\0';
+	for (uint32_t i = 0; i < header->mesh_count; ++i)
+	{
+		valid_meshes = valid_meshes && scene.meshes[i].path_offset < header->string_size;
+	}
+	if (!valid_meshes)
+	{
+		printf("%s has a broken mesh table\n", path);
+		UnloadScene(scene);
+		return false;
+	}
+
+	// Everything after this indexes the meshes with the instances. One pass over the mapping, it gets paged in anyway.
+	bool valid_instances = true;
+	for (uint32_t i = 0; i < header->instance_count; ++i)
+	{
+		valid_instances = valid_instances && scene.instances[i].mesh < header->mesh_count;
+	}
+	if (!valid_instances)
+	{
+		printf("%s has instances of meshes it doesn't have\n", path);
+		UnloadScene(scene);
+		return false;
+	}
+
+	return true;
+}
+
+void UnloadScene(Scene& scene)
+{
+	UnmapFile(scene.file);
+	scene = {};
+}
+
+const char* GetSceneMeshPath(const Scene& scene, uint32_t mesh)
+{
+	assert(mesh < scene.header->mesh_count);
+	return scene.strings + scene.meshes[mesh].path_offset;
+}
+
+bool WriteScene(const char* path, const std::vector<std::string>& mesh_paths,
+		const std::vector<SceneInstance>& instances)
+{
+	std::vector<SceneMesh> meshes(mesh_paths.size());
+	std::string strings;
+	for (size_t i = 0; i < mesh_paths.size(); ++i)
+	{
+		meshes[i].path_offset = uint32_t(strings.size());
+		strings += mesh_paths[i];
+		strings += '\0';
+	}
+	strings.resize((strings.size() + 3) & ~size_t(3), '\0');
+
+	SceneHeader header = {};
+	header.magic = kSceneMagic;
+	header.version = kSceneVersion;
+	header.mesh_count = uint32_t(meshes.size());
+	header.instance_count = uint32_t(instances.size());
+	header.string_size = uint32_t(strings.size());
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(meshes.data(), sizeof(SceneMesh), meshes.size(), file) == meshes.size();
+	ok = ok && fwrite(instances.data(), sizeof(SceneInstance), instances.size(), file) == instances.size();
+	ok = ok && fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
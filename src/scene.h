@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+
+// Binary scene files: a table of meshes and a table of instances placing them. Made to be read straight out of a
+// memory mapping, nothing gets parsed or copied on load.
+//
+// Layout, little endian, every part 4 byte aligned:
+//   SceneHeader
+//   SceneMesh[mesh_count]
+//   SceneInstance[instance_count]
+//   char[string_size]     Zero-terminated mesh paths, string_size is padded to a multiple of 4.
+//
+// Mesh paths are used as they are, relative ones are relative to the working directory like the mesh on the command
+// line.
+
+const uint32_t kSceneMagic = 0x4e435353;  // "SSCN"
+const uint32_t kSceneVersion = 1;
+
+struct SceneHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t mesh_count;
+	uint32_t instance_count;
+	uint32_t string_size;
+};
+
+struct SceneMesh
+{
+	uint32_t path_offset;  // Into the strings.
+};
+
+struct SceneInstance
+{
+	float position[3];
+	float scale;
+	float orientation[4];  // Quaternion, x y z w.
+	uint32_t mesh;         // Checked on load.
+};
+static_assert(sizeof(SceneInstance) == 36, "Part of the file format.");
+
+struct MappedFile
+{
+	const void* data;
+	size_t size;
+#ifdef _WIN32
+	void* file;  // HANDLEs, keeps windows.h out of here.
+	void* mapping;
+#endif
+};
+
+// Read only.
+bool MapFile(MappedFile& result, const char* path);
+void UnmapFile(MappedFile& file);
+
+// Points into the mapping.
+struct Scene
+{
+	MappedFile file;
+	const SceneHeader* header;
+	const SceneMesh* meshes;
+	const SceneInstance* instances;
+	const char* strings;
+};
+
+// Checks the header, the mesh table and the mesh indices of the instances.
+bool LoadScene(Scene& scene, const char* path);
+void UnloadScene(Scene& scene);
+
+const char* GetSceneMeshPath(const Scene& scene, uint32_t mesh);
+
+bool WriteScene(const char* path, const std::vector<std::string>& mesh_paths,
+		const std::vector<SceneInstance>& instances);
@@ -0,0 +1,94 @@
+// Writes synthetic scenes for stress tests: instances of the given meshes, spread uniformly over a cube whose size
+// follows from the instance count and density, with random scale and orientation.
+//
+// Usage: scenegen [-s seed] output.scene instances density mesh.obj ...
+//
+// density is in instances per cubic unit, the kitten is about one unit across. Same arguments, same file.
+
+#include "common.h"
+
+#include "scene.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+
+// The same as niagara's, see there.
+static float RandomFloat(std::mt19937& rng)
+{
+	return float(rng() >> 8) / float(1 << 24);
+}
+
+static void GenerateInstances(std::vector<SceneInstance>& instances, uint32_t instance_count, float density,
+		uint32_t mesh_count, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+
+	const float side = cbrtf(float(instance_count) / density);
+
+	instances.resize(instance_count);
+	for (SceneInstance& instance : instances)
+	{
+		instance.position[0] = (RandomFloat(rng) - 0.5f) * side;
+		instance.position[1] = (RandomFloat(rng) - 0.5f) * side;
+		instance.position[2] = (RandomFloat(rng) - 0.5f) * side;
+		instance.scale = RandomFloat(rng) * 2.9f + 0.1f;
+
+		// Uniformly distributed rotations (Shoemake).
+		const float u0 = RandomFloat(rng);
+		const float a1 = RandomFloat(rng) * 6.28318530718f;
+		const float a2 = RandomFloat(rng) * 6.28318530718f;
+		const float r1 = sqrtf(1.0f - u0);
+		const float r2 = sqrtf(u0);
+		instance.orientation[0] = r1 * sinf(a1);
+		instance.orientation[1] = r1 * cosf(a1);
+		instance.orientation[2] = r2 * sinf(a2);
+		instance.orientation[3] = r2 * cosf(a2);
+
+		instance.mesh = uint32_t(rng() % mesh_count);
+	}
+}
+
+int main(int argc, const char** argv)
+{
+	uint32_t seed = 1;
+	int first_argument = 1;
+	if (argc > 2 && strcmp(argv[1], "-s") == 0)
+	{
+		seed = uint32_t(atoi(argv[2]));
+		first_argument = 3;
+	}
+
+	if (argc - first_argument < 4)
+	{
+		printf("Usage: %s [-s seed] output.scene instances density mesh.obj ...\n", argv[0]);
+		return 1;
+	}
+
+	const char* output_path = argv[first_argument];
+	const long instance_count = atol(argv[first_argument + 1]);
+	const float density = float(atof(argv[first_argument + 2]));
+	if (instance_count <= 0 || instance_count > long(UINT32_MAX / sizeof(SceneInstance)) || !(density > 0.0f))
+	{
+		printf("Need a positive instance count and density\n");
+		return 1;
+	}
+
+	std::vector<std::string> mesh_paths(argv + first_argument + 3, argv + argc);
+
+	std::vector<SceneInstance> instances;
+	GenerateInstances(instances, uint32_t(instance_count), density, uint32_t(mesh_paths.size()), seed);
+
+	if (!WriteScene(output_path, mesh_paths, instances))
+	{
+		printf("Can't write %s\n", output_path);
+		return 1;
+	}
+
+	printf("%s: %u meshes, %u instances in a cube of side %.1f\n", output_path, uint32_t(mesh_paths.size()),
+			uint32_t(instances.size()), cbrtf(float(instance_count) / density));
+	return 0;
+}
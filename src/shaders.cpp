@@ -1,9 +1,11 @@
 #include "common.h"
 
 #include "shaders.h"
+#include "trace.h"
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <vector>
 
 #include <spirv-headers/spirv.h>
@@ -22,6 +24,8 @@ static VkShaderStageFlagBits GetShaderStage(SpvExecutionModel model)
 		return VK_SHADER_STAGE_TASK_BIT_NV;
 	case SpvExecutionModelMeshNV:
 		return VK_SHADER_STAGE_MESH_BIT_NV;
+	case SpvExecutionModelGLCompute:
+		return VK_SHADER_STAGE_COMPUTE_BIT;
 	default:
 		assert(!"Unsupported shader execution model!");
 		return VkShaderStageFlagBits(0);
@@ -33,16 +37,67 @@ struct Id
 	enum Kind
 	{
 		Unknown,
-		Variable
+		Variable,
+		Type,
+		Constant
 	};
 	Kind kind_id = Unknown;
+	uint32_t opcode;  // Only for types.
+	// Variables: the pointer type, pointers: the pointee, arrays: the element, sampled images: the image.
 	uint32_t type;
 	uint32_t storage_class;
 	uint32_t binding;
 	uint32_t set;
+	// Constants: the (32 bit) value, arrays: id of the length constant, images: the sampled operand.
+	uint32_t constant;
+	bool buffer_block;  // Old style storage buffer, a Uniform struct decorated with BufferBlock.
 };
 
-static void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size)
+// Figures out the descriptor type of a resource variable. The array size ends up in count, runtime-sized arrays
+// report a count of 0.
+static VkDescriptorType GetDescriptorType(const std::vector<Id>& ids, const Id& variable, uint32_t& count)
+{
+	const Id& pointer = ids[variable.type];
+	assert(pointer.kind_id == Id::Type && pointer.opcode == SpvOpTypePointer);
+
+	uint32_t type_id = pointer.type;
+	count = 1;
+	if (ids[type_id].opcode == SpvOpTypeRuntimeArray)
+	{
+		count = 0;
+		type_id = ids[type_id].type;
+	}
+	else if (ids[type_id].opcode == SpvOpTypeArray)
+	{
+		const Id& length = ids[ids[type_id].constant];
+		assert(length.kind_id == Id::Constant);
+		count = length.constant;
+		type_id = ids[type_id].type;
+	}
+
+	const Id& type = ids[type_id];
+	assert(type.kind_id == Id::Type);
+
+	switch (type.opcode)
+	{
+	case SpvOpTypeStruct:
+		return (variable.storage_class == SpvStorageClassStorageBuffer || type.buffer_block) ?
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER :
+                VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	case SpvOpTypeImage:
+		// Sampled == 2 means the image is used without a sampler, i.e., as storage image.
+		return type.constant == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+	case SpvOpTypeSampledImage:
+		return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	case SpvOpTypeSampler:
+		return VK_DESCRIPTOR_TYPE_SAMPLER;
+	default:
+		assert(!"Unsupported resource type!");
+		return VK_DESCRIPTOR_TYPE_MAX_ENUM;
+	}
+}
+
+void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size)
 {
 	assert(code[0] == SpvMagicNumber);
 	const uint32_t id_bound = code[3];
@@ -75,9 +130,66 @@ static void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size
 			case SpvDecorationBinding:
 				ids[id].binding = inst[3];
 				break;
+			case SpvDecorationBufferBlock:
+				ids[id].buffer_block = true;
+				break;
 			}
 			break;
 		}
+		case SpvOpTypeStruct:
+		case SpvOpTypeSampler:
+		case SpvOpTypeImage:
+		case SpvOpTypeSampledImage:
+		case SpvOpTypeArray:
+		case SpvOpTypeRuntimeArray: {
+			assert(word_count >= 2);
+			const uint32_t id = inst[1];
+			assert(id < id_bound);
+
+			assert(ids[id].kind_id == Id::Unknown);
+			ids[id].kind_id = Id::Type;
+			ids[id].opcode = opcode;
+			if (opcode == SpvOpTypeSampledImage || opcode == SpvOpTypeArray || opcode == SpvOpTypeRuntimeArray)
+			{
+				assert(word_count >= 3);
+				ids[id].type = inst[2];
+			}
+			if (opcode == SpvOpTypeArray)
+			{
+				assert(word_count >= 4);
+				ids[id].constant = inst[3];
+			}
+			if (opcode == SpvOpTypeImage)
+			{
+				assert(word_count >= 9);
+				ids[id].constant = inst[7];
+			}
+			break;
+		}
+		case SpvOpTypePointer: {
+			assert(word_count >= 4);
+			const uint32_t id = inst[1];
+			assert(id < id_bound);
+
+			assert(ids[id].kind_id == Id::Unknown);
+			ids[id].kind_id = Id::Type;
+			ids[id].opcode = opcode;
+			ids[id].storage_class = inst[2];
+			ids[id].type = inst[3];
+			break;
+		}
+		case SpvOpConstant: {
+			assert(word_count >= 4);
+			const uint32_t id = inst[2];
+			assert(id < id_bound);
+
+			// Only the first word matters, array sizes are 32 bit.
+			assert(ids[id].kind_id == Id::Unknown);
+			ids[id].kind_id = Id::Constant;
+			ids[id].type = inst[1];
+			ids[id].constant = inst[3];
+			break;
+		}
 		case SpvOpVariable: {
 			assert(word_count >= 4);
 			const uint32_t id = inst[2];
@@ -101,12 +213,30 @@ static void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size
 				(id.storage_class == SpvStorageClassUniform || id.storage_class == SpvStorageClassUniformConstant ||
 						id.storage_class == SpvStorageClassStorageBuffer))
 		{
-			// TODO: Assume we only have storage buffers.
-			assert(id.set == 0);
-			assert(id.binding < 32);
-			assert((shader.storage_buffer_mask & (1 << id.binding)) == 0);
+			assert(id.set < kMaxDescriptorSets);
+
+			ShaderBinding binding = {};
+			binding.set = id.set;
+			binding.binding = id.binding;
+			binding.type = GetDescriptorType(ids, id, binding.count);
+
+			// Several variables can alias the same binding, e.g., the bindless storage buffer array is declared
+			// once per struct type. That's fine as long as they agree on what's there.
+			bool aliased = false;
+			for (const ShaderBinding& existing : shader.bindings)
+			{
+				if (existing.set == binding.set && existing.binding == binding.binding)
+				{
+					assert(existing.type == binding.type);
+					assert(existing.count == binding.count);
+					aliased = true;
+				}
+			}
 
-			shader.storage_buffer_mask |= 1 << id.binding;
+			if (!aliased)
+			{
+				shader.bindings.push_back(binding);
+			}
 		}
 
 		else if (id.kind_id == Id::Variable && id.storage_class == SpvStorageClassPushConstant)
@@ -118,6 +248,7 @@ static void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size
 
 bool LoadShader(Shader& shader, VkDevice device, const char* path)
 {
+	TRACE_SCOPE("load shader");
 	assert(device);
 
 	FILE* file = fopen(path, "rb");
@@ -159,55 +290,103 @@ void DestroyShader(Shader& shader, VkDevice device)
 	vkDestroyShaderModule(device, shader.module, nullptr);
 }
 
-static VkDescriptorSetLayout CreateDescriptorSetLayout(VkDevice device, Shaders shaders)
+// Merges the bindings of all shaders that live in the given set.
+static std::vector<VkDescriptorSetLayoutBinding> GetSetLayoutBindings(Shaders shaders, uint32_t set)
 {
 	std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings;
 
-	uint32_t storagebuffer_mask = 0;
 	for (const Shader* shader : shaders)
 	{
-		storagebuffer_mask |= shader->storage_buffer_mask;
-	}
-
-	for (uint32_t i = 0; i < 32; ++i)
-	{
-		if (storagebuffer_mask & (1 << i))
+		for (const ShaderBinding& shader_binding : shader->bindings)
 		{
-			VkDescriptorSetLayoutBinding binding = {};
-			binding.binding = i;
-			binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			binding.descriptorCount = 1;
-			for (const Shader* shader : shaders)
+			if (shader_binding.set != set)
+			{
+				continue;
+			}
+
+			const uint32_t descriptor_count = shader_binding.count ? shader_binding.count : kBindlessDescriptorCount;
+
+			bool found = false;
+			for (VkDescriptorSetLayoutBinding& binding : set_layout_bindings)
 			{
-				if (shader->storage_buffer_mask & (1 << i))
+				if (binding.binding == shader_binding.binding)
 				{
+					assert(binding.descriptorType == shader_binding.type);
+					assert(binding.descriptorCount == descriptor_count);
 					binding.stageFlags |= shader->stage;
+					found = true;
 				}
 			}
 
-			set_layout_bindings.push_back(binding);
+			if (!found)
+			{
+				VkDescriptorSetLayoutBinding binding = {};
+				binding.binding = shader_binding.binding;
+				binding.descriptorType = shader_binding.type;
+				binding.descriptorCount = descriptor_count;
+				binding.stageFlags = shader->stage;
+				set_layout_bindings.push_back(binding);
+			}
 		}
 	}
 
+	std::sort(set_layout_bindings.begin(), set_layout_bindings.end(),
+			[](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) {
+				return a.binding < b.binding;
+			});
+
+	return set_layout_bindings;
+}
+
+static VkDescriptorSetLayout CreateDescriptorSetLayout(VkDevice device, Shaders shaders, uint32_t set)
+{
+	std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings = GetSetLayoutBindings(shaders, set);
+
 	VkDescriptorSetLayoutCreateInfo set_layout_create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
-	// I guess normally we'd go with VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT.
-	// But since we're using the push extensions, it's like this:
-	set_layout_create_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
 	set_layout_create_info.bindingCount = uint32_t(set_layout_bindings.size());
 	set_layout_create_info.pBindings = set_layout_bindings.data();
 
+	std::vector<VkDescriptorBindingFlags> binding_flags(set_layout_bindings.size());
+	VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_create_info = {
+		VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO
+	};
+
+	if (set == 0)
+	{
+		// I guess normally we'd go with VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT.
+		// But since we're using the push extensions, it's like this:
+		set_layout_create_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+	}
+	else
+	{
+		// All other sets are the global bindless ones, they are allocated once and shared between all programs.
+		// To be compatible between pipeline layouts they need to be identical, hence the stage flags are always
+		// VK_SHADER_STAGE_ALL, not just what the shaders of this program use.
+		set_layout_create_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+		for (size_t i = 0; i < set_layout_bindings.size(); ++i)
+		{
+			set_layout_bindings[i].stageFlags = VK_SHADER_STAGE_ALL;
+			binding_flags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+		}
+
+		binding_flags_create_info.bindingCount = uint32_t(binding_flags.size());
+		binding_flags_create_info.pBindingFlags = binding_flags.data();
+		set_layout_create_info.pNext = &binding_flags_create_info;
+	}
+
 	VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
 	VK_CHECK(vkCreateDescriptorSetLayout(device, &set_layout_create_info, nullptr, &set_layout));
 
 	return set_layout;
 }
 
-static VkPipelineLayout CreatePipelineLayout(VkDevice device, VkDescriptorSetLayout set_layout,
-		VkShaderStageFlags push_constant_stages, size_t push_constant_size)
+static VkPipelineLayout CreatePipelineLayout(VkDevice device, const VkDescriptorSetLayout* set_layouts,
+		uint32_t set_layout_count, VkShaderStageFlags push_constant_stages, size_t push_constant_size)
 {
 	VkPipelineLayoutCreateInfo layout_create_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
-	layout_create_info.setLayoutCount = 1;
-	layout_create_info.pSetLayouts = &set_layout;
+	// Programs that reach all their buffers via device addresses don't have a descriptor set.
+	layout_create_info.setLayoutCount = set_layout_count;
+	layout_create_info.pSetLayouts = set_layout_count ? set_layouts : nullptr;
 	VkPushConstantRange range = {};
 	if (push_constant_size > 0)
 	{
@@ -230,25 +409,18 @@ static VkDescriptorUpdateTemplate CreateUpdateTemplate(VkDevice device, VkPipeli
 
 	std::vector<VkDescriptorUpdateTemplateEntry> entries;
 
-	uint32_t storagebuffer_mask = 0;
-	for (const Shader* shader : shaders)
-	{
-		storagebuffer_mask |= shader->storage_buffer_mask;
-	}
-
-	for (uint32_t i = 0; i < 32; ++i)
+	// Only set 0 is pushed.
+	for (const VkDescriptorSetLayoutBinding& binding : GetSetLayoutBindings(shaders, 0))
 	{
-		if (storagebuffer_mask & (1 << i))
-		{
-			VkDescriptorUpdateTemplateEntry entry = {};
-			entry.dstBinding = i;
-			entry.dstArrayElement = 0;
-			entry.descriptorCount = 1;
-			entry.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			entry.offset = sizeof(DescriptorInfo) * i;  // Hmm? TODO: I'd rather have multiplied this by entries.size().
-			entry.stride = sizeof(DescriptorInfo);
-			entries.push_back(entry);
-		}
+		VkDescriptorUpdateTemplateEntry entry = {};
+		entry.dstBinding = binding.binding;
+		entry.dstArrayElement = 0;
+		entry.descriptorCount = binding.descriptorCount;
+		entry.descriptorType = binding.descriptorType;
+		// Hmm? TODO: I'd rather have multiplied this by entries.size().
+		entry.offset = sizeof(DescriptorInfo) * binding.binding;
+		entry.stride = sizeof(DescriptorInfo);
+		entries.push_back(entry);
 	}
 
 	VkDescriptorUpdateTemplateCreateInfo template_create_info = {
@@ -261,6 +433,7 @@ static VkDescriptorUpdateTemplate CreateUpdateTemplate(VkDevice device, VkPipeli
 	// template_create_info.descriptorSetLayout = set_layout;
 	template_create_info.pipelineBindPoint = bind_point;
 	template_create_info.pipelineLayout = pipeline_layout;
+	template_create_info.set = 0;
 
 	VkDescriptorUpdateTemplate update_template = VK_NULL_HANDLE;
 	VK_CHECK(vkCreateDescriptorUpdateTemplate(device, &template_create_info, nullptr, &update_template));
@@ -279,15 +452,35 @@ Program CreateProgram(VkDevice device, VkPipelineBindPoint bind_point, Shaders s
 		}
 	}
 
+	bool uses_push_descriptors = false;
+	uint32_t set_count = 0;
+	for (const Shader* shader : shaders)
+	{
+		for (const ShaderBinding& binding : shader->bindings)
+		{
+			uses_push_descriptors |= binding.set == 0;
+			set_count = std::max(set_count, binding.set + 1);
+		}
+	}
+
 	Program program = {};
-	program.descriptor_set_layout = CreateDescriptorSetLayout(device, shaders);
-	assert(program.descriptor_set_layout);
-	program.pipeline_layout =
-			CreatePipelineLayout(device, program.descriptor_set_layout, push_constant_stages, push_constant_size);
+	// Sets without any bindings still need a (then empty) layout if a later set is used.
+	for (uint32_t set = 0; set < set_count; ++set)
+	{
+		program.descriptor_set_layouts[set] = CreateDescriptorSetLayout(device, shaders, set);
+		assert(program.descriptor_set_layouts[set]);
+	}
+	program.descriptor_set_count = set_count;
+	program.pipeline_layout = CreatePipelineLayout(
+			device, program.descriptor_set_layouts, set_count, push_constant_stages, push_constant_size);
 	assert(program.pipeline_layout);
-	program.descriptor_update_template =
-			CreateUpdateTemplate(device, bind_point, program.descriptor_set_layout, program.pipeline_layout, shaders);
-	assert(program.descriptor_update_template);
+	// Update templates can't be empty, only create one if there is something to push.
+	if (uses_push_descriptors)
+	{
+		program.descriptor_update_template = CreateUpdateTemplate(
+				device, bind_point, program.descriptor_set_layouts[0], program.pipeline_layout, shaders);
+		assert(program.descriptor_update_template);
+	}
 	program.push_constant_stages = push_constant_stages;
 
 	return program;
@@ -297,16 +490,80 @@ void DestroyProgram(VkDevice device, Program& program)
 {
 	vkDestroyDescriptorUpdateTemplate(device, program.descriptor_update_template, nullptr);
 	vkDestroyPipelineLayout(device, program.pipeline_layout, nullptr);
-	vkDestroyDescriptorSetLayout(device, program.descriptor_set_layout, nullptr);
+	for (uint32_t set = 0; set < program.descriptor_set_count; ++set)
+	{
+		vkDestroyDescriptorSetLayout(device, program.descriptor_set_layouts[set], nullptr);
+	}
 	program = {};
 }
 
+VkDescriptorPool CreateBindlessDescriptorPool(VkDevice device)
+{
+	assert(device);
+
+	VkDescriptorPoolSize pool_sizes[] = {
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, kBindlessDescriptorCount },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, kBindlessDescriptorCount },
+	};
+
+	VkDescriptorPoolCreateInfo pool_create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+	pool_create_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	pool_create_info.maxSets = 1;
+	pool_create_info.poolSizeCount = ARRAY_SIZE(pool_sizes);
+	pool_create_info.pPoolSizes = pool_sizes;
+
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+	VK_CHECK(vkCreateDescriptorPool(device, &pool_create_info, nullptr, &pool));
+
+	return pool;
+}
+
+VkDescriptorSet AllocateDescriptorSet(VkDevice device, VkDescriptorPool pool, VkDescriptorSetLayout set_layout)
+{
+	assert(device);
+	assert(pool);
+	assert(set_layout);
+
+	VkDescriptorSetAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+	alloc_info.descriptorPool = pool;
+	alloc_info.descriptorSetCount = 1;
+	alloc_info.pSetLayouts = &set_layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	VK_CHECK(vkAllocateDescriptorSets(device, &alloc_info, &set));
+
+	return set;
+}
+
+void WriteDescriptor(VkDevice device, VkDescriptorSet set, uint32_t binding, uint32_t array_element,
+		VkDescriptorType type, const DescriptorInfo& info)
+{
+	VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+	write.dstSet = set;
+	write.dstBinding = binding;
+	write.dstArrayElement = array_element;
+	write.descriptorCount = 1;
+	write.descriptorType = type;
+	if (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER || type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+	{
+		write.pBufferInfo = &info.buffer;
+	}
+	else
+	{
+		write.pImageInfo = &info.image;
+	}
+
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+}
+
 VkPipeline CreateGraphicsPipeline(VkDevice device, VkPipelineCache pipeline_cache, VkRenderPass render_pass,
-		VkPipelineLayout layout, Shaders shaders)
+		VkFormat color_format, VkFormat depth_format, VkPipelineLayout layout, Shaders shaders)
 {
+	TRACE_SCOPE("create graphics pipeline");
 	assert(device);
 
 	std::vector<VkPipelineShaderStageCreateInfo> stages;
+	bool has_fragment_shader = false;
 	for (const Shader* shader : shaders)
 	{
 		assert(shader->module);
@@ -315,6 +572,7 @@ VkPipeline CreateGraphicsPipeline(VkDevice device, VkPipelineCache pipeline_cach
 		stage.module = shader->module;
 		stage.pName = "main";
 		stages.push_back(stage);
+		has_fragment_shader |= shader->stage == VK_SHADER_STAGE_FRAGMENT_BIT;
 	}
 
 	VkPipelineVertexInputStateCreateInfo vertex_input = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
@@ -366,9 +624,13 @@ VkPipeline CreateGraphicsPipeline(VkDevice device, VkPipelineCache pipeline_cach
 	// depth_stencil.minDepthBounds;
 	// depth_stencil.maxDepthBounds;
 
+	// Without a fragment shader the color would be undefined, the attachment is left alone.
 	VkPipelineColorBlendAttachmentState attachments[1] = {};
-	attachments[0].colorWriteMask =
-			VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	if (has_fragment_shader)
+	{
+		attachments[0].colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+				VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	}
 
 	VkPipelineColorBlendStateCreateInfo blend = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
 	// blend.logicOpEnable;
@@ -402,7 +664,36 @@ VkPipeline CreateGraphicsPipeline(VkDevice device, VkPipelineCache pipeline_cach
 	pipeline_create_info.renderPass = render_pass;
 	// pipeline_create_info.subpass = 0;
 
+	VkPipelineRenderingCreateInfoKHR rendering_info = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR };
+	if (!render_pass)
+	{
+		assert(color_format);
+		rendering_info.colorAttachmentCount = 1;
+		rendering_info.pColorAttachmentFormats = &color_format;
+		rendering_info.depthAttachmentFormat = depth_format;
+		pipeline_create_info.pNext = &rendering_info;
+	}
+
 	VkPipeline pipeline = VK_NULL_HANDLE;
 	VK_CHECK(vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_create_info, nullptr, &pipeline));
 	return pipeline;
 }
+
+VkPipeline CreateComputePipeline(
+		VkDevice device, VkPipelineCache pipeline_cache, VkPipelineLayout layout, const Shader& shader)
+{
+	TRACE_SCOPE("create compute pipeline");
+	assert(device);
+	assert(shader.module && shader.stage == VK_SHADER_STAGE_COMPUTE_BIT);
+
+	VkComputePipelineCreateInfo pipeline_create_info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipeline_create_info.stage.stage = shader.stage;
+	pipeline_create_info.stage.module = shader.module;
+	pipeline_create_info.stage.pName = "main";
+	pipeline_create_info.layout = layout;
+
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VK_CHECK(vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_create_info, nullptr, &pipeline));
+	return pipeline;
+}
@@ -2,23 +2,40 @@
 
 #include <initializer_list>
 
+// Set 0 is always pushed (VK_KHR_push_descriptor), all other sets are bindless (update-after-bind) sets.
+const uint32_t kMaxDescriptorSets = 4;
+
+// Descriptor count used for runtime-sized arrays in bindless sets.
+const uint32_t kBindlessDescriptorCount = 4096;
+
+struct ShaderBinding
+{
+	uint32_t set;
+	uint32_t binding;
+	VkDescriptorType type;
+	uint32_t count;  // 0 for runtime-sized arrays.
+};
+
 struct Shader
 {
 	VkShaderModule module;
 	VkShaderStageFlagBits stage;
-	uint32_t storage_buffer_mask;
+	std::vector<ShaderBinding> bindings;
 	bool uses_push_constants;
 };
 
 struct Program
 {
-	VkDescriptorSetLayout descriptor_set_layout;
+	VkDescriptorSetLayout descriptor_set_layouts[kMaxDescriptorSets];
+	uint32_t descriptor_set_count;
 	VkPipelineLayout pipeline_layout;
-	VkDescriptorUpdateTemplate descriptor_update_template;
+	VkDescriptorUpdateTemplate descriptor_update_template;  // For set 0, if the program has one.
 	VkShaderStageFlags push_constant_stages;
 };
 
 bool LoadShader(Shader& shader, VkDevice device, const char* path);
+// Fills in stage, bindings and uses_push_constants from SPIR-V, code_size is in words. LoadShader does this already.
+void ParseShader(Shader& shader, const uint32_t* code, uint32_t code_size);
 void DestroyShader(Shader& shader, VkDevice device);
 
 using Shaders = std::initializer_list<const Shader*>;
@@ -27,8 +44,12 @@ using Shaders = std::initializer_list<const Shader*>;
 Program CreateProgram(VkDevice device, VkPipelineBindPoint bind_point, Shaders shaders, size_t push_constant_size);
 void DestroyProgram(VkDevice device, Program& program);
 
+// Without a render pass the pipeline is created for dynamic rendering (VK_KHR_dynamic_rendering) and only needs to know
+// the attachment formats. They are ignored otherwise. Without a fragment shader the pipeline only writes depth.
 VkPipeline CreateGraphicsPipeline(VkDevice device, VkPipelineCache pipeline_cache, VkRenderPass render_pass,
-		VkPipelineLayout layout, Shaders shaders);
+		VkFormat color_format, VkFormat depth_format, VkPipelineLayout layout, Shaders shaders);
+VkPipeline CreateComputePipeline(
+		VkDevice device, VkPipelineCache pipeline_cache, VkPipelineLayout layout, const Shader& shader);
 
 struct DescriptorInfo
 {
@@ -61,3 +82,9 @@ struct DescriptorInfo
 	//	buffer.range = VK_WHOLE_SIZE;
 	//}
 };
+
+// Global descriptor sets for descriptor indexing.
+VkDescriptorPool CreateBindlessDescriptorPool(VkDevice device);
+VkDescriptorSet AllocateDescriptorSet(VkDevice device, VkDescriptorPool pool, VkDescriptorSetLayout set_layout);
+void WriteDescriptor(VkDevice device, VkDescriptorSet set, uint32_t binding, uint32_t array_element,
+		VkDescriptorType type, const DescriptorInfo& info);
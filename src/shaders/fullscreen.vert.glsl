@@ -0,0 +1,9 @@
+#version 450
+
+// One triangle that covers the whole framebuffer, for full screen passes. No vertex buffer, draw 3 vertices.
+void main()
+{
+	// (-1, -1), (3, -1), (-1, 3): counter-clockwise with the flipped viewport, so it survives the back face culling.
+	const vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+	gl_Position = vec4(uv * 2.0 - vec2(1.0), 0.0, 1.0);
+}
@@ -0,0 +1,45 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "mesh.h"
+
+// Moves what raster.comp.glsl rasterized into the visibility buffer, in the format of the mesh shader (see
+// kVisibilityTriangleBits). Drawn with fullscreen.vert.glsl after the hardware rasterized geometry, with the same depth
+// test: a pixel only changes where the software rasterized triangle is closer.
+
+layout(push_constant) uniform PushConstants
+{
+	Globals globals;
+};
+
+layout(binding = 0) readonly buffer Raster
+{
+	RasterQueue raster_queue;
+	uvec2 raster_meshlets[];
+};
+
+layout(binding = 1) readonly buffer RasterPixels
+{
+	uint64_t raster_pixels[];
+};
+
+layout(location = 0) out uvec2 out_visibility;
+
+void main()
+{
+	const uvec2 pixel = uvec2(gl_FragCoord.xy);
+	const uint64_t value = raster_pixels[pixel.y * (globals.screen_size & 0xffff) + pixel.x];
+	if (value == 0)
+	{
+		// Nothing was rasterized here, the hardware result stays.
+		discard;
+	}
+
+	const uint payload = uint(value);
+	const uvec2 queued = raster_meshlets[payload >> kVisibilityTriangleBits];
+	const uint triangle = payload & ((1u << kVisibilityTriangleBits) - 1);
+
+	gl_FragDepth = uintBitsToFloat(uint(value >> 32));
+	out_visibility = uvec2(queued.x, (queued.y << kVisibilityTriangleBits) | triangle);
+}
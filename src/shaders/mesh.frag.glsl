@@ -2,8 +2,22 @@
 
 #extension GL_NV_mesh_shader : require
 
+#ifndef USE_BINDLESS
+#define USE_BINDLESS 0
+#endif
+
+#if USE_BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
+
 layout(location = 0) in vec4 color;
 // layout(location = 1) perprimitiveNV in vec3 triangle_normal;
+#if USE_BINDLESS
+layout(location = 1) in vec2 texcoord;
+layout(location = 2) flat in uint texture_index;
+
+layout(set = 1, binding = 1) uniform sampler2D textures[];
+#endif
 
 layout(location = 0) out vec4 out_color;
 
@@ -11,5 +25,9 @@ layout(location = 0) out vec4 out_color;
 void main()
 {
 	out_color = color;
+#if USE_BINDLESS
+	// Unlike in the geometry stages, neighbouring pixels can come from different draws here.
+	out_color *= texture(textures[nonuniformEXT(texture_index)], texcoord);
+#endif
 	// out_color = vec4(triangle_normal * 0.5 + vec3(0.5), 1.0);
 }
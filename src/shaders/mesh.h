@@ -10,6 +10,25 @@
 // Enables all arithmetic types.
 #extension GL_EXT_shader_explicit_arithmetic_types : require
 
+// Binding model, set from the command line of glslangValidator (see niagara.vcxproj).
+// Default: Push descriptors, every shader declares its own storage buffer bindings.
+// USE_BDA: Buffer device address, the buffers are 64-bit pointers in the push constants.
+// USE_BINDLESS: The draws are pushed, the geometry comes from the global set 1 via the indices in MeshDraw.
+#ifndef USE_BDA
+#define USE_BDA 0
+#endif
+#ifndef USE_BINDLESS
+#define USE_BINDLESS 0
+#endif
+
+#if USE_BDA
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_buffer_reference_uvec2 : require
+#endif
+#if USE_BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
+
 
 struct Vertex
 {
@@ -25,6 +44,31 @@ struct Vertex
 	float16_t tu, tv;
 };
 
+// The split layout, see Globals.attribute_base.
+struct VertexPosition
+{
+	float vx, vy, vz;
+};
+
+struct VertexAttributes
+{
+#if USE_UNPACK
+	uint n_packed;
+#else
+	uint8_t nx, ny, nz, nw;
+#endif
+	float16_t tu, tv;
+};
+
+// Works for Vertex and VertexAttributes.
+#if USE_UNPACK
+// Both versions are equivalent for the way the normals are packed.
+#define UNPACK_NORMAL(v) unpackSnorm4x8(0x80808080 ^ (v).n_packed).xyz
+// #define UNPACK_NORMAL(v) (unpackUnorm4x8((v).n_packed).xyz * 2.0 - vec3(1.0))
+#else
+#define UNPACK_NORMAL(v) (vec3((v).nx, (v).ny, (v).nz) / 127.0 - vec3(1.0))
+#endif
+
 struct Meshlet
 {
 	// For cluster back face culling we use center/radius even though it's
@@ -43,23 +87,214 @@ struct Meshlet
 	uint data_offset;
 	uint8_t vertex_count;
 	uint8_t triangle_count;
+	uint8_t lod_level;
+
+	// See lod.h.
+	vec4 lod_bounds;
+	vec4 parent_bounds;
+	float lod_error;
+	float parent_error;
+};
+
+// Bits of Globals.flags, must match niagara.cpp.
+const uint kGlobalsFlagCull = 1;
+const uint kGlobalsFlagLod = 2;
+const uint kGlobalsFlagStreaming = 4;
+const uint kGlobalsFlagSplitVertices = 8;         // The vertex buffer holds the split layout.
+const uint kGlobalsFlagDepthOnly = 16;            // No fragment shader, the attributes aren't needed.
+const uint kGlobalsFlagCullTriangles = 32;        // The mesh shader drops the triangles the rasterizer would.
+const uint kGlobalsFlagVisibility = 64;           // The geometry is drawn into the visibility buffer, see below.
+const uint kGlobalsFlagVisibilityMeshlets = 128;  // For resolve.frag.glsl, the mesh shader wrote the triangles.
+const uint kGlobalsFlagTextured = 256;            // For resolve.frag.glsl, shades like the bindless mesh.frag.glsl.
+const uint kGlobalsFlagSoftwareRaster = 512;      // The task shader queues the small meshlets, see below.
+
+// The visibility buffer (R32G32_UINT) holds MeshDraw.draw_index and the triangle: for indexed draws gl_PrimitiveID,
+// the mesh shader puts the meshlet index above kVisibilityTriangleBits and the triangle within it below. Written by
+// visibility.frag.glsl, shaded by resolve.frag.glsl.
+const uint kVisibilityTriangleBits = 7;
+const uint kVisibilityEmpty = ~0u;  // The clear value, no triangle.
+
+// With kGlobalsFlagSoftwareRaster (and the visibility buffer) the task shader hands the meshlets that cover at most
+// kSoftwareRasterMaxPixels on screen, the diameter of their bounding sphere, to raster.comp.glsl instead of the mesh
+// shader: the hardware rasterizer gets slow with triangles of a pixel or two. The queue holds draw_index and the
+// meshlet of each, the compute shader keeps the closest triangle per pixel as a 64-bit value, the depth in the high
+// half and the queue entry and triangle (see kVisibilityTriangleBits) in the low one. merge.frag.glsl moves the values
+// into the visibility buffer, depth tested against the hardware rasterized ones.
+const float kSoftwareRasterMaxPixels = 16.0;
+const uint kSoftwareRasterMaxMeshlets = 1 << 20;  // The queue's capacity, the rest goes to the mesh shader after all.
+const uint kSoftwareRasterMaxGroups = 65535;      // The guaranteed maxComputeWorkGroupCount[0].
+
+// Followed by the queue (draw_index and meshlet index). Must match RasterQueue in niagara.cpp.
+struct RasterQueue
+{
+	uint group_count_x, group_count_y, group_count_z;  // VkDispatchIndirectCommand of raster.comp.glsl.
+	uint meshlet_count;  // Can exceed kSoftwareRasterMaxMeshlets, those weren't queued.
 };
 
+// Meshlet data streaming, must match streaming.h. With kGlobalsFlagStreaming the data offsets of the meshlets point
+// into the page file, page_table (after the counters) has two entries per page: the pool slot or kPageNotResident, and
+// the feedback for the CPU.
+const uint kPageWords = 16384;
+const uint kPageNotResident = ~0u;
+const uint kPageFeedbackMissing = 1;
+const uint kPageFeedbackUsed = 2;
+
 struct Globals
 {
 	mat4 projection;
+	uint flags;  // Runtime toggles, so benchmarks don't need shader variants.
+	float lod_scale;  // Turns an error at distance 1 into pixels over the LOD threshold, see niagara.cpp.
+	// With kGlobalsFlagSplitVertices the positions of all vertices come first in the vertex buffer, the attributes
+	// start at this index (in VertexAttributes). It's the same buffer in either layout, viewed as all three types.
+	uint attribute_base;
+	uint screen_size;  // Of the framebuffer, width in the low 16 bits, height in the high ones.
 };
 
+// The textures in binding 1 of the bindless set, MeshDraw.texture_index is the mesh's. Must match niagara.cpp.
+const uint kMeshTextureCount = 4;
+
 struct MeshDraw
 {
 	vec3 position;
 	float scale;
 	vec4 orientation;
 
+	// Indices into the bindless arrays of set 1.
+	uint vertex_buffer_index;
+	uint meshlet_buffer_index;
+	uint meshlet_data_buffer_index;
+	uint texture_index;
+
 	uint command_data[7];
+
+	uint draw_index;  // In the draw buffer as uploaded, the culled and sorted copies keep it.
+};
+
+// Written by the task and mesh shaders, read back on the CPU a couple of frames later. Must match CullingCounters in
+// niagara.cpp.
+struct CullingCounters
+{
+	uint meshlets_accepted;
+	uint meshlets_rejected;
+	uint triangles_emitted;  // Of the accepted meshlets.
+	uint meshlets_not_resident;  // Would have been accepted, but their page isn't in the pool.
+	uint triangles_culled;       // Of the triangles emitted, by the mesh shader.
+	uint meshlets_software;      // Of the accepted ones, queued for raster.comp.glsl.
+	uint triangles_software;     // Theirs, not part of triangles_emitted.
 };
 
 vec3 RotateVecByQuat(vec3 v, vec4 q)
 {
 	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
 }
+
+#if USE_BDA
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer DrawBuffer
+{
+	MeshDraw draws[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer MeshletBuffer
+{
+	Meshlet meshlets[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer MeshletDataBuffer
+{
+	uint meshlet_data[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer VertexBuffer
+{
+	Vertex vertices[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer PositionBuffer
+{
+	VertexPosition positions[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer AttributeBuffer
+{
+	VertexAttributes attributes[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 16) buffer CounterBuffer
+{
+	CullingCounters counters;
+	uint page_table[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 16) buffer RasterQueueBuffer
+{
+	RasterQueue raster_queue;
+	uvec2 raster_meshlets[];
+};
+
+// Same block for all stages, the layout has to match BufferAddressConstants in niagara.cpp.
+// Not every stage uses every pointer, unused ones are simply 0.
+layout(push_constant) uniform PushConstants
+{
+	Globals globals;
+	DrawBuffer draw_buffer;
+	MeshletBuffer meshlet_buffer;
+	MeshletDataBuffer meshlet_data_buffer;
+	VertexBuffer vertex_buffer;
+	CounterBuffer counter_buffer;
+	RasterQueueBuffer raster_queue_buffer;
+};
+
+// This way the shader bodies don't need to know which binding model they are compiled for.
+#define draws draw_buffer.draws
+#define meshlets meshlet_buffer.meshlets
+#define meshlet_data meshlet_data_buffer.meshlet_data
+#define vertices vertex_buffer.vertices
+// The other views of the vertex buffer. Through uvec2, a uint64_t would need shaderInt64.
+#define positions PositionBuffer(uvec2(vertex_buffer)).positions
+#define attributes AttributeBuffer(uvec2(vertex_buffer)).attributes
+#define counters counter_buffer.counters
+#define page_table counter_buffer.page_table
+#define raster_queue raster_queue_buffer.raster_queue
+#define raster_meshlets raster_queue_buffer.raster_meshlets
+#endif
+
+#if USE_BINDLESS
+// All storage buffers share binding 0, each struct type gets its own view on it.
+layout(set = 1, binding = 0) readonly buffer Vertices
+{
+	Vertex vertices[];
+}
+vertex_buffers[];
+
+layout(set = 1, binding = 0) readonly buffer Positions
+{
+	VertexPosition positions[];
+}
+position_buffers[];
+
+layout(set = 1, binding = 0) readonly buffer Attributes
+{
+	VertexAttributes attributes[];
+}
+attribute_buffers[];
+
+layout(set = 1, binding = 0) readonly buffer Meshlets
+{
+	Meshlet meshlets[];
+}
+meshlet_buffers[];
+
+layout(set = 1, binding = 0) readonly buffer MeshletData
+{
+	uint meshlet_data[];
+}
+meshlet_data_buffers[];
+
+// The indices come from the current draw, so these expect a `mesh_draw` in scope. The index is the same for the
+// whole draw (gl_DrawIDARB is dynamically uniform), no need for nonuniformEXT.
+#define vertices vertex_buffers[mesh_draw.vertex_buffer_index].vertices
+#define positions position_buffers[mesh_draw.vertex_buffer_index].positions
+#define attributes attribute_buffers[mesh_draw.vertex_buffer_index].attributes
+#define meshlets meshlet_buffers[mesh_draw.meshlet_buffer_index].meshlets
+#define meshlet_data meshlet_data_buffers[mesh_draw.meshlet_data_buffer_index].meshlet_data
+#endif
@@ -5,6 +5,7 @@
 
 #include "mesh.h"
 
+#if !USE_BDA
 layout(push_constant) uniform PushConstants
 {
 	Globals globals;
@@ -15,39 +16,86 @@ layout(binding = 0) readonly buffer Draws
 	MeshDraw draws[];
 };
 
+#if !USE_BINDLESS
+// All three are the vertex buffer, see Globals.attribute_base.
 layout(binding = 1) readonly buffer Vertices
 {
 	Vertex vertices[];
 };
 
+layout(binding = 2) readonly buffer Positions
+{
+	VertexPosition positions[];
+};
+
+layout(binding = 3) readonly buffer Attributes
+{
+	VertexAttributes attributes[];
+};
+#endif
+#endif
+
 layout(location = 0) out vec4 color;
+#if USE_BINDLESS
+layout(location = 1) out vec2 texcoord;
+layout(location = 2) flat out uint texture_index;
+#endif
+layout(location = 3) flat out uint draw_index;
 
 void main()
 {
 	const MeshDraw mesh_draw = draws[gl_DrawIDARB];
 
-	const Vertex v = vertices[gl_VertexIndex];
-	const vec3 position = vec3(v.vx, v.vy, v.vz);
+	const uint vi = gl_VertexIndex;
+	const bool split = (globals.flags & kGlobalsFlagSplitVertices) != 0;
 
-#if USE_UNPACK
-	// Both versions are equivalent for the way the normals are packed.
-	const uint tmp = 0x80808080 ^ vertices[gl_VertexIndex].n_packed;
-	const vec3 normal = unpackSnorm4x8(tmp).xyz;
-	// const vec3 normal = unpackUnorm4x8(vertices[gl_VertexIndex].n_packed).xyz * 2.0 - vec3(1.0);
-#else
-	// Without arithmetic types, something like this is necessary.
-	// const vec3 normal = vec3(int(vertices[gl_VertexIndex].nx), int(vertices[gl_VertexIndex].ny),
-	// int(vertices[gl_VertexIndex].nz)) / 127.0 - vec3(1.0);
-	const vec3 normal = vec3(v.nx, v.ny, v.nz) / 127.0 - vec3(1.0);
-#endif
-
-	const vec2 uv = vec2(v.tu, v.tv);
+	vec3 position;
+	if (split)
+	{
+		const VertexPosition p = positions[vi];
+		position = vec3(p.vx, p.vy, p.vz);
+	}
+	else
+	{
+		position = vec3(vertices[vi].vx, vertices[vi].vy, vertices[vi].vz);
+	}
 
 	// gl_Position = vec4(position * vec3(1, 1, 0.5) + vec3(0, 0, 0.5), 1.0);
 	gl_Position = globals.projection *
 			vec4(RotateVecByQuat(position, mesh_draw.orientation) * mesh_draw.scale + mesh_draw.position, 1.0);
 
+	draw_index = mesh_draw.draw_index;
+
+	// The depth only pipelines have no fragment shader, and visibility.frag.glsl only needs the draw. Nothing reads the
+	// rest.
+	if ((globals.flags & (kGlobalsFlagDepthOnly | kGlobalsFlagVisibility)) != 0)
+	{
+		return;
+	}
+
+	// Without arithmetic types, something like this is necessary for the normal.
+	// const vec3 normal = vec3(int(vertices[gl_VertexIndex].nx), int(vertices[gl_VertexIndex].ny),
+	// int(vertices[gl_VertexIndex].nz)) / 127.0 - vec3(1.0);
+	vec3 normal;
+	vec2 uv;
+	if (split)
+	{
+		const VertexAttributes a = attributes[globals.attribute_base + vi];
+		normal = UNPACK_NORMAL(a);
+		uv = vec2(a.tu, a.tv);
+	}
+	else
+	{
+		const Vertex v = vertices[vi];
+		normal = UNPACK_NORMAL(v);
+		uv = vec2(v.tu, v.tv);
+	}
+
 	color = vec4(normal * 0.5 + vec3(0.5), 1.0);
+#if USE_BINDLESS
+	texcoord = uv;
+	texture_index = mesh_draw.texture_index;
+#endif
 }
 
 // Mesh via vertex stream and explicit attribute definition in Vulkan
@@ -3,6 +3,8 @@
 #extension GL_NV_mesh_shader : require
 #extension GL_GOOGLE_include_directive : require
 #extension GL_ARB_shader_draw_parameters : require
+// Compacting the triangles that survive the culling, and the counters.
+#extension GL_KHR_shader_subgroup_ballot : require
 
 #include "mesh.h"
 
@@ -12,6 +14,7 @@
 layout(local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
 layout(triangles, max_vertices = 64, max_primitives = 124) out;
 
+#if !USE_BDA
 layout(push_constant) uniform PushConstants
 {
 	Globals globals;
@@ -22,11 +25,36 @@ layout(binding = 0) readonly buffer Draws
 	MeshDraw draws[];
 };
 
+#if !USE_BINDLESS
+// All three are the vertex buffer, see Globals.attribute_base.
 layout(binding = 3) readonly buffer Vertices
 {
 	Vertex vertices[];
 };
 
+layout(binding = 5) readonly buffer Positions
+{
+	VertexPosition positions[];
+};
+
+layout(binding = 6) readonly buffer Attributes
+{
+	VertexAttributes attributes[];
+};
+#endif
+
+// Shared with the task shader.
+#if USE_BINDLESS
+layout(binding = 1) buffer Counters
+#else
+layout(binding = 4) buffer Counters
+#endif
+{
+	CullingCounters counters;
+	uint page_table[];
+};
+#endif
+
 // N triangles
 // 3 * N vertices (when duplicating everything)
 // N / 2 unique vertices in an ideal world (valence 6)
@@ -46,13 +74,16 @@ layout(binding = 3) readonly buffer Vertices
 // General purpose -> 83 triangles (84 no? (2 * 128 - 4) / 3)
 // Minecraft/Roblox is crazy (because you need different normals for the "same" vertex") -> 41 triangles
 
+#if !USE_BDA && !USE_BINDLESS
 layout(binding = 1) readonly buffer Meshlets
 {
 	Meshlet meshlets[];
 };
+#endif
 
 #define USE_PACKED_INDICES 1
 
+#if !USE_BDA && !USE_BINDLESS
 layout(binding = 2) readonly buffer MeshletData
 {
 	// Imagine the layout as:
@@ -67,16 +98,58 @@ layout(binding = 2) readonly buffer MeshletData
 	// } meshlet_data[N];
 	uint meshlet_data[];
 };
+#endif
 
 in taskNV task_block
 {
 	uint meshlet_indices[32];
+	uint meshlet_data_offsets[32];
 };
 
 layout(location = 0) out vec4 color[];
+#if USE_BINDLESS
+layout(location = 1) out vec2 texcoord[];
+layout(location = 2) flat out uint texture_index[];
+#endif
+layout(location = 3) flat out uint draw_index[];
 
 // layout(location = 1) perprimitiveNV out vec3 triangle_normals[];
 
+// For the triangle culling, the vertices in framebuffer coordinates (pixels, y down as with the flipped viewport) and
+// their w in z.
+shared vec3 vertex_screen[64];
+
+// How many triangles each subgroup kept in a round of the compaction, the workgroup can span several subgroups.
+shared uint subgroup_primitive_counts[32];
+
+// Whether the fixed function stages would drop the triangle anyway: back facing or without area, outside the
+// framebuffer, or not covering any sample position. Vertices as in vertex_screen.
+bool IsTriangleCulled(vec3 a, vec3 b, vec3 c, vec2 screen)
+{
+	// Behind the camera the projection flips, the clipper takes care of those.
+	if (a.z <= 0.0 || b.z <= 0.0 || c.z <= 0.0)
+	{
+		return false;
+	}
+
+	// The area test of the rasterizer (see Polygon Culling in the Vulkan spec), counter-clockwise is front facing.
+	const vec2 ab = b.xy - a.xy;
+	const vec2 ac = c.xy - a.xy;
+	const bool back_facing = ab.x * ac.y - ab.y * ac.x >= 0.0;
+
+	// Grown by the subpixel precision (8 bits), snapping the vertices can't make it cover more than that.
+	const vec2 box_min = min(a.xy, min(b.xy, c.xy)) - vec2(1.0 / 256.0);
+	const vec2 box_max = max(a.xy, max(b.xy, c.xy)) + vec2(1.0 / 256.0);
+
+	const bool outside = box_max.x < 0.0 || box_max.y < 0.0 || box_min.x > screen.x || box_min.y > screen.y;
+
+	// Single sampled, the samples are the pixel centers. Rounding both ends the same way means there's no center in
+	// between, in x or in y.
+	const bool between_samples = any(equal(round(box_min), round(box_max)));
+
+	return back_facing || outside || between_samples;
+}
+
 uint hash(uint a)
 {
 	a = (a + 0x7ed55d16) + (a << 12);
@@ -93,16 +166,16 @@ void main()
 	const uint mi = meshlet_indices[gl_WorkGroupID.x];
 	const uint ti = gl_LocalInvocationID.x;
 
+	const MeshDraw mesh_draw = draws[gl_DrawIDARB];
+
 	const uint vertex_count = meshlets[mi].vertex_count;
 	const uint triangle_count = meshlets[mi].triangle_count;
 	const uint index_count = 3 * triangle_count;
 
-	const uint data_offset = meshlets[mi].data_offset;
+	const uint data_offset = meshlet_data_offsets[gl_WorkGroupID.x];
 	const uint vertex_offset = data_offset;
 	const uint index_offset = data_offset + vertex_count;
 
-	const MeshDraw mesh_draw = draws[gl_DrawIDARB];
-
 #if DEBUG
 	const uint meshlet_hash = hash(mi);
 	const vec3 meshlet_color =
@@ -110,28 +183,135 @@ void main()
 			255.0;
 #endif
 
+	const bool split = (globals.flags & kGlobalsFlagSplitVertices) != 0;
+	const bool depth_only = (globals.flags & kGlobalsFlagDepthOnly) != 0;
+	const bool cull_triangles = (globals.flags & kGlobalsFlagCullTriangles) != 0;
+	const bool visibility = (globals.flags & kGlobalsFlagVisibility) != 0;
+	const vec2 screen = vec2(globals.screen_size & 0xffff, globals.screen_size >> 16);
+
 	for (uint i = ti; i < vertex_count; i += 32)
 	{
 		const uint vi = meshlet_data[vertex_offset + i];
-		const Vertex v = vertices[vi];
 
-		const vec3 position = vec3(v.vx, v.vy, v.vz);
-#if USE_UNPACK
-		const vec3 normal = unpackSnorm4x8(0x80808080 ^ v.n_packed).xyz;
-#else
-		const vec3 normal = vec3(v.nx, v.ny, v.nz) / 127.0 - vec3(1.0);
-#endif
-		const vec2 uv = vec2(v.tu, v.tv);
+		vec3 position;
+		if (split)
+		{
+			const VertexPosition p = positions[vi];
+			position = vec3(p.vx, p.vy, p.vz);
+		}
+		else
+		{
+			position = vec3(vertices[vi].vx, vertices[vi].vy, vertices[vi].vz);
+		}
 
-		gl_MeshVerticesNV[i].gl_Position = globals.projection *
+		const vec4 clip = globals.projection *
 				vec4(RotateVecByQuat(position, mesh_draw.orientation) * mesh_draw.scale + mesh_draw.position, 1.0);
+		gl_MeshVerticesNV[i].gl_Position = clip;
+
+		if (cull_triangles)
+		{
+			const vec2 ndc = clip.xy / clip.w;
+			vertex_screen[i] = vec3((ndc.x * 0.5 + 0.5) * screen.x, (0.5 - ndc.y * 0.5) * screen.y, clip.w);
+		}
+
+		draw_index[i] = mesh_draw.draw_index;
+
+		// The depth only pipelines have no fragment shader, and visibility.frag.glsl only needs the draw and the
+		// triangle. Nothing reads the rest.
+		if (depth_only || visibility)
+		{
+			continue;
+		}
+
+		vec3 normal;
+		vec2 uv;
+		if (split)
+		{
+			const VertexAttributes a = attributes[globals.attribute_base + vi];
+			normal = UNPACK_NORMAL(a);
+			uv = vec2(a.tu, a.tv);
+		}
+		else
+		{
+			const Vertex v = vertices[vi];
+			normal = UNPACK_NORMAL(v);
+			uv = vec2(v.tu, v.tv);
+		}
 
 		color[i] = vec4(normal * 0.5 + vec3(0.5), 1.0);
+#if USE_BINDLESS
+		texcoord[i] = uv;
+		texture_index[i] = mesh_draw.texture_index;
+#endif
 #if DEBUG
 		color[i] = vec4(meshlet_color, 1.0);
 #endif
 	}
 
+	if (cull_triangles)
+	{
+		// The vertices of the other threads.
+		memoryBarrierShared();
+		barrier();
+
+		// All threads take the same number of rounds of 32 triangles, the ballots and barriers need all of them. Within
+		// a subgroup the ballot gives the offsets, the subgroups before it in the round go through shared memory.
+		uint primitive_count = 0;
+		for (uint first = 0; first < triangle_count; first += 32)
+		{
+			const uint i = first + ti;
+			uint a = 0, b = 0, c = 0;
+			bool accept = false;
+			if (i < triangle_count)
+			{
+				const uint j = i * 3;
+				a = (meshlet_data[index_offset + (j + 0) / 4] >> (((j + 0) % 4) * 8)) & 255u;
+				b = (meshlet_data[index_offset + (j + 1) / 4] >> (((j + 1) % 4) * 8)) & 255u;
+				c = (meshlet_data[index_offset + (j + 2) / 4] >> (((j + 2) % 4) * 8)) & 255u;
+				accept = !IsTriangleCulled(vertex_screen[a], vertex_screen[b], vertex_screen[c], screen);
+			}
+
+			const uvec4 ballot = subgroupBallot(accept);
+			if (subgroupElect())
+			{
+				subgroup_primitive_counts[gl_SubgroupID] = subgroupBallotBitCount(ballot);
+			}
+			memoryBarrierShared();
+			barrier();
+
+			uint subgroup_offset = 0;
+			uint round_count = 0;
+			for (uint k = 0; k < gl_NumSubgroups; ++k)
+			{
+				subgroup_offset += k < gl_SubgroupID ? subgroup_primitive_counts[k] : 0;
+				round_count += subgroup_primitive_counts[k];
+			}
+
+			if (accept)
+			{
+				const uint primitive = primitive_count + subgroup_offset + subgroupBallotExclusiveBitCount(ballot);
+				gl_PrimitiveIndicesNV[primitive * 3 + 0] = a;
+				gl_PrimitiveIndicesNV[primitive * 3 + 1] = b;
+				gl_PrimitiveIndicesNV[primitive * 3 + 2] = c;
+				if (visibility)
+				{
+					gl_MeshPrimitivesNV[primitive].gl_PrimitiveID = (mi << kVisibilityTriangleBits) | i;
+				}
+			}
+			primitive_count += round_count;
+
+			// Everyone has read the counts before the next round writes them.
+			barrier();
+		}
+
+		if (ti == 0)
+		{
+			gl_PrimitiveCountNV = primitive_count;
+			atomicAdd(counters.triangles_culled, triangle_count - primitive_count);
+		}
+		return;
+	}
+
 #if !USE_PACKED_INDICES
 	for (uint i = ti; i < index_count; i += 32)
 	{
@@ -145,6 +325,15 @@ void main()
 	}
 #endif
 
+	// The meshlet and the triangle, see kVisibilityTriangleBits.
+	if (visibility)
+	{
+		for (uint i = ti; i < triangle_count; i += 32)
+		{
+			gl_MeshPrimitivesNV[i].gl_PrimitiveID = (mi << kVisibilityTriangleBits) | i;
+		}
+	}
+
 	if (ti == 0)
 	{
 		gl_PrimitiveCountNV = triangle_count;
@@ -6,9 +6,9 @@
 #define BALLOT 1
 #if BALLOT
 #extension GL_KHR_shader_subgroup_ballot : require
-#else
-#extension GL_KHR_shader_subgroup_arithmetic : require
 #endif
+// Also needed for the counters.
+#extension GL_KHR_shader_subgroup_arithmetic : require
 
 #include "mesh.h"
 
@@ -16,21 +16,53 @@
 
 layout(local_size_x = 32, local_size_y = 1, local_size_z = 1) in;
 
+#if !USE_BDA
+layout(push_constant) uniform PushConstants
+{
+	Globals globals;
+};
+
 layout(binding = 0) readonly buffer Draws
 {
 	MeshDraw draws[];
 };
 
+#if !USE_BINDLESS
 layout(binding = 1) readonly buffer Meshlets
 {
 	Meshlet meshlets[];
 };
+#endif
+
+// Bindings 2, 3, 5 and 6 are taken by the mesh shader. With bindless the draws are the only other pushed binding.
+#if USE_BINDLESS
+layout(binding = 1) buffer Counters
+#else
+layout(binding = 4) buffer Counters
+#endif
+{
+	CullingCounters counters;
+	uint page_table[];
+};
+
+// Only written with kGlobalsFlagSoftwareRaster.
+#if USE_BINDLESS
+layout(binding = 2) buffer Raster
+#else
+layout(binding = 7) buffer Raster
+#endif
+{
+	RasterQueue raster_queue;
+	uvec2 raster_meshlets[];
+};
+#endif
 
 // Causes: https://github.com/KhronosGroup/Vulkan-ValidationLayers/issues/2102
 out taskNV task_block
 {
 	// uint meshlet_offset;
 	uint meshlet_indices[32];
+	uint meshlet_data_offsets[32];  // Already translated into the page pool when streaming.
 };
 
 bool ConeCull1(vec3 cone_axis, float cone_cutoff, vec3 view)
@@ -85,6 +117,50 @@ bool ConeCull3(vec3 center, float radius, vec3 cone_axis, float cone_cutoff, vec
 	//		cone_cutoff * length(center - camera_position) + sqrt(1.0 - cone_cutoff * cone_cutoff) * radius;
 }
 
+// Whether the error of a group of meshlets (see lod.h) is small enough on screen. Measured at the point of the bounds
+// closest to the camera, so a group never looks smaller than any of the groups it was simplified from.
+bool IsLodErrorAccepted(vec4 bounds, float error, MeshDraw mesh_draw)
+{
+	const vec3 center = RotateVecByQuat(bounds.xyz, mesh_draw.orientation) * mesh_draw.scale + mesh_draw.position;
+	const float distance = max(length(center) - bounds.w * mesh_draw.scale, 1e-4);
+	return error * mesh_draw.scale * globals.lod_scale <= distance;
+}
+
+// Translates an offset into the page file into one into the pool of resident pages (see streaming.h) and tells the
+// CPU that the page was used or is missing. All threads touching a page this frame see the same table entry and write
+// the same feedback, no atomics needed.
+bool ResolveDataOffset(inout uint data_offset)
+{
+	const uint page = data_offset / kPageWords;
+	const uint slot = page_table[page * 2];
+	if (slot == kPageNotResident)
+	{
+		page_table[page * 2 + 1] = kPageFeedbackMissing;
+		return false;
+	}
+
+	page_table[page * 2 + 1] = kPageFeedbackUsed;
+	data_offset = slot * kPageWords + data_offset % kPageWords;
+	return true;
+}
+
+// Whether the bounding sphere (in view space) is small enough on screen for raster.comp.glsl, and entirely in front of
+// the near plane: it doesn't clip.
+bool IsSoftwareRasterized(vec3 center, float radius)
+{
+	// The camera looks down -z, projection[3][2] is the distance of the near plane.
+	const float distance = -center.z - radius;
+	if (distance <= globals.projection[3][2])
+	{
+		return false;
+	}
+
+	// Like the LOD error: a length l at distance d covers l / d * projection[1][1] * height / 2 pixels. Taken at the
+	// closest point of the sphere, so it's never smaller than on screen.
+	const float height = float(globals.screen_size >> 16);
+	return radius / distance * globals.projection[1][1] * height <= kSoftwareRasterMaxPixels;
+}
+
 void main()
 {
 	const uint gi = gl_WorkGroupID.x;
@@ -110,18 +186,77 @@ void main()
 	const float cone_cutoff = meshlets[mi].cone_cutoff / 127.0;
 	const bool accept3 = !ConeCull3(center, radius, cone_axis, cone_cutoff, vec3(0));
 
-	const bool accept = accept3;
+	// One cut through the LOD levels: the meshlets that are detailed enough where the groups they were simplified
+	// into are not. Without LOD only the full mesh, level 0.
+	const bool lod_accept = (globals.flags & kGlobalsFlagLod) != 0
+			? IsLodErrorAccepted(meshlets[mi].lod_bounds, meshlets[mi].lod_error, mesh_draw) &&
+					!IsLodErrorAccepted(meshlets[mi].parent_bounds, meshlets[mi].parent_error, mesh_draw)
+			: meshlets[mi].lod_level == 0;
+
+	// The padding meshlets past the end of the mesh (see PadMeshlets) are neither drawn nor counted.
+	const bool valid = meshlets[mi].vertex_count > 0;
+	const bool visible = valid && lod_accept && ((globals.flags & kGlobalsFlagCull) == 0 || accept3);
+
+	// Only the meshlets that would be drawn ask for their pages.
+	uint data_offset = meshlets[mi].data_offset;
+	const bool resident = !visible || (globals.flags & kGlobalsFlagStreaming) == 0 || ResolveDataOffset(data_offset);
+	const bool accept = visible && resident;
+
+	// The small meshlets go into the queue of the software rasterizer while it has room, one atomic per workgroup
+	// again.
+	bool software = accept && (globals.flags & kGlobalsFlagSoftwareRaster) != 0 && IsSoftwareRasterized(center, radius);
+	const uvec4 queue_ballot = subgroupBallot(software);
+	const uint queue_count = subgroupBallotBitCount(queue_ballot);
+	if (queue_count > 0)
+	{
+		uint queue_first = 0;
+		if (subgroupElect())
+		{
+			queue_first = atomicAdd(raster_queue.meshlet_count, queue_count);
+			// The indirect dispatch can't be clamped to the queue afterwards, its workgroups loop over the entries.
+			atomicMax(raster_queue.group_count_x, min(queue_first + queue_count, kSoftwareRasterMaxGroups));
+		}
+
+		const uint entry = subgroupBroadcastFirst(queue_first) + subgroupBallotExclusiveBitCount(queue_ballot);
+		software = software && entry < kSoftwareRasterMaxMeshlets;
+		if (software)
+		{
+			raster_meshlets[entry] = uvec2(mesh_draw.draw_index, mi);
+		}
+	}
+
+	const bool hardware = accept && !software;
 
-	const uvec4 ballot = subgroupBallot(accept);
+	const uvec4 ballot = subgroupBallot(hardware);
 	const uint index = subgroupBallotExclusiveBitCount(ballot);
 
-	if (accept)
+	if (hardware)
 	{
 		meshlet_indices[index] = mi;
+		meshlet_data_offsets[index] = data_offset;
 	}
+	// One atomic per workgroup, the subgroup does the reduction.
+	const uint hardware_count = subgroupBallotBitCount(ballot);
+	const uint software_count = subgroupBallotBitCount(subgroupBallot(software));
+	const uint accepted_count = hardware_count + software_count;
+	const uint triangle_count = subgroupAdd(hardware ? uint(meshlets[mi].triangle_count) : 0);
+	const uint software_triangle_count = subgroupAdd(software ? uint(meshlets[mi].triangle_count) : 0);
+	const uint not_resident_count = subgroupBallotBitCount(subgroupBallot(!resident));
+	const uint valid_count = subgroupBallotBitCount(subgroupBallot(valid));
+
 	if (subgroupElect())
 	{
-		gl_TaskCountNV = subgroupBallotBitCount(ballot);
+		gl_TaskCountNV = hardware_count;
+
+		atomicAdd(counters.meshlets_accepted, accepted_count);
+		atomicAdd(counters.meshlets_rejected, valid_count - accepted_count - not_resident_count);
+		atomicAdd(counters.triangles_emitted, triangle_count);
+		atomicAdd(counters.meshlets_not_resident, not_resident_count);
+		if (software_count > 0)
+		{
+			atomicAdd(counters.meshlets_software, software_count);
+			atomicAdd(counters.triangles_software, software_triangle_count);
+		}
 	}
 #else
 	const uint accept = coneCull(meshlets[mi].cone, vec3(0, 0, 1)) ? 0 : 1;
@@ -130,6 +265,7 @@ void main()
 	if (accept == 1)
 	{
 		meshlet_indices[index] = mi;
+		meshlet_data_offsets[index] = meshlets[mi].data_offset;
 	}
 	if (ti == 31)
 	{
@@ -138,6 +274,7 @@ void main()
 #endif
 #else
 	meshlet_indices[ti] = mi;
+	meshlet_data_offsets[ti] = meshlets[mi].data_offset;
 	if (ti == 0)
 	{
 		// meshlet_offset = mi * 32;
@@ -0,0 +1,175 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_shader_atomic_int64 : require
+
+#include "mesh.h"
+
+// Software rasterizer for the meshlets the task shader found too small for the hardware one, see
+// kSoftwareRasterMaxPixels in mesh.h. One workgroup per queued meshlet: the threads transform its vertices, then
+// every thread scans the pixel centers in the bounding box of a triangle and keeps the closest triangle per pixel with
+// a 64-bit atomic max (reversed depth). The meshlets are entirely in front of the near plane and a handful of pixels
+// wide, there's nothing to clip and the boxes stay small.
+// Only pushes descriptors, it's the same for every binding model.
+
+#define RASTER_GROUP_SIZE 64
+
+layout(local_size_x = RASTER_GROUP_SIZE) in;
+
+layout(push_constant) uniform PushConstants
+{
+	Globals globals;
+};
+
+layout(binding = 0) readonly buffer Draws
+{
+	MeshDraw draws[];  // All of them, as uploaded, see MeshDraw.draw_index.
+};
+
+layout(binding = 1) readonly buffer Meshlets
+{
+	Meshlet meshlets[];
+};
+
+layout(binding = 2) readonly buffer MeshletData
+{
+	uint meshlet_data[];
+};
+
+// Both are the vertex buffer, see Globals.attribute_base.
+layout(binding = 3) readonly buffer Vertices
+{
+	Vertex vertices[];
+};
+
+layout(binding = 4) readonly buffer Positions
+{
+	VertexPosition positions[];
+};
+
+// Only the page table, as the task shader used it this frame.
+layout(binding = 5) readonly buffer Counters
+{
+	CullingCounters counters;
+	uint page_table[];
+};
+
+layout(binding = 6) readonly buffer Raster
+{
+	RasterQueue raster_queue;
+	uvec2 raster_meshlets[];
+};
+
+// One per pixel, cleared to 0 (nothing covers it), row by row.
+layout(binding = 7) buffer RasterPixels
+{
+	uint64_t raster_pixels[];
+};
+
+// The vertices of the current meshlet in framebuffer coordinates (pixels, y down as with the flipped viewport) and
+// their depth in z.
+shared vec3 vertex_screen[64];
+
+void main()
+{
+	const uint ti = gl_LocalInvocationID.x;
+	const uint queued_count = min(raster_queue.meshlet_count, kSoftwareRasterMaxMeshlets);
+
+	const uvec2 screen_size = uvec2(globals.screen_size & 0xffff, globals.screen_size >> 16);
+	const vec2 screen = vec2(screen_size);
+	const bool split = (globals.flags & kGlobalsFlagSplitVertices) != 0;
+
+	// The dispatch is capped at kSoftwareRasterMaxGroups, the queue isn't.
+	for (uint entry = gl_WorkGroupID.x; entry < queued_count; entry += gl_NumWorkGroups.x)
+	{
+		const MeshDraw mesh_draw = draws[raster_meshlets[entry].x];
+		const uint mi = raster_meshlets[entry].y;
+
+		const uint vertex_count = meshlets[mi].vertex_count;
+		const uint triangle_count = meshlets[mi].triangle_count;
+
+		// The page was resident when the task shader queued the meshlet, the table hasn't changed since.
+		uint data_offset = meshlets[mi].data_offset;
+		if ((globals.flags & kGlobalsFlagStreaming) != 0)
+		{
+			const uint page = data_offset / kPageWords;
+			data_offset = page_table[page * 2] * kPageWords + data_offset % kPageWords;
+		}
+		const uint index_offset = data_offset + vertex_count;
+
+		// The previous meshlet's triangles are done with the vertices.
+		barrier();
+
+		for (uint i = ti; i < vertex_count; i += RASTER_GROUP_SIZE)
+		{
+			const uint vi = meshlet_data[data_offset + i];
+
+			vec3 position;
+			if (split)
+			{
+				const VertexPosition p = positions[vi];
+				position = vec3(p.vx, p.vy, p.vz);
+			}
+			else
+			{
+				position = vec3(vertices[vi].vx, vertices[vi].vy, vertices[vi].vz);
+			}
+
+			// Same as meshlet.mesh.glsl, the depth has to compare with what the hardware rasterized.
+			const vec4 clip = globals.projection *
+					vec4(RotateVecByQuat(position, mesh_draw.orientation) * mesh_draw.scale + mesh_draw.position, 1.0);
+			const vec3 ndc = clip.xyz / clip.w;
+			vertex_screen[i] = vec3((ndc.x * 0.5 + 0.5) * screen.x, (0.5 - ndc.y * 0.5) * screen.y, ndc.z);
+		}
+
+		memoryBarrierShared();
+		barrier();
+
+		for (uint i = ti; i < triangle_count; i += RASTER_GROUP_SIZE)
+		{
+			const uint j = i * 3;
+			const vec3 a = vertex_screen[(meshlet_data[index_offset + (j + 0) / 4] >> (((j + 0) % 4) * 8)) & 255u];
+			const vec3 b = vertex_screen[(meshlet_data[index_offset + (j + 1) / 4] >> (((j + 1) % 4) * 8)) & 255u];
+			const vec3 c = vertex_screen[(meshlet_data[index_offset + (j + 2) / 4] >> (((j + 2) % 4) * 8)) & 255u];
+
+			// Back facing or without area, the same test as IsTriangleCulled in meshlet.mesh.glsl. Front facing ones
+			// have a negative area in these coordinates.
+			const float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (area >= 0.0)
+			{
+				continue;
+			}
+
+			// The pixels whose centers are in the bounding box, within the framebuffer.
+			const vec2 box_min = min(a.xy, min(b.xy, c.xy));
+			const vec2 box_max = max(a.xy, max(b.xy, c.xy));
+			const ivec2 pixel_min = max(ivec2(ceil(box_min - vec2(0.5))), ivec2(0));
+			const ivec2 pixel_max = min(ivec2(floor(box_max - vec2(0.5))), ivec2(screen_size) - ivec2(1));
+
+			const uint64_t payload = uint64_t((entry << kVisibilityTriangleBits) | i);
+
+			for (int y = pixel_min.y; y <= pixel_max.y; ++y)
+			{
+				for (int x = pixel_min.x; x <= pixel_max.x; ++x)
+				{
+					// Edge functions, normalized into barycentrics. Pixels on an edge go to both triangles, that
+					// leaves no cracks and the atomic picks one of them.
+					const vec2 p = vec2(x, y) + vec2(0.5);
+					const float wa = ((c.x - b.x) * (p.y - b.y) - (c.y - b.y) * (p.x - b.x)) / area;
+					const float wb = ((a.x - c.x) * (p.y - c.y) - (a.y - c.y) * (p.x - c.x)) / area;
+					const float wc = 1.0 - wa - wb;
+					if (wa < 0.0 || wb < 0.0 || wc < 0.0)
+					{
+						continue;
+					}
+
+					// z / w is linear in screen space, no perspective correction needed. Positive floats order like
+					// their bits, and the depth is reversed, so the closest triangle has the largest value.
+					const float depth = wa * a.z + wb * b.z + wc * c.z;
+					const uint64_t value = (uint64_t(floatBitsToUint(depth)) << 32) | payload;
+					atomicMax(raster_pixels[uint(y) * screen_size.x + uint(x)], value);
+				}
+			}
+		}
+	}
+}
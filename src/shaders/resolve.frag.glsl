@@ -0,0 +1,178 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "mesh.h"
+
+// Shades the visibility buffer, once per pixel: fetches the triangle the geometry pass left there, transforms its
+// vertices again and interpolates their attributes at the pixel center. Drawn with fullscreen.vert.glsl.
+// Only pushes descriptors, it's the same for every binding model.
+
+layout(push_constant) uniform PushConstants
+{
+	Globals globals;
+};
+
+layout(binding = 0) readonly buffer Draws
+{
+	MeshDraw draws[];  // All of them, as uploaded, see MeshDraw.draw_index.
+};
+
+layout(binding = 1) readonly buffer Meshlets
+{
+	Meshlet meshlets[];
+};
+
+layout(binding = 2) readonly buffer MeshletData
+{
+	uint meshlet_data[];
+};
+
+// All three are the vertex buffer, see Globals.attribute_base.
+layout(binding = 3) readonly buffer Vertices
+{
+	Vertex vertices[];
+};
+
+layout(binding = 4) readonly buffer Positions
+{
+	VertexPosition positions[];
+};
+
+layout(binding = 5) readonly buffer Attributes
+{
+	VertexAttributes attributes[];
+};
+
+layout(binding = 6) readonly buffer Indices
+{
+	uint indices[];
+};
+
+// Only the page table, as the task shader used it this frame.
+layout(binding = 7) readonly buffer Counters
+{
+	CullingCounters counters;
+	uint page_table[];
+};
+
+layout(binding = 8) uniform usampler2D visibility_buffer;
+layout(binding = 9) uniform sampler2D color_textures[kMeshTextureCount];  // The ones of the bindless set.
+
+layout(location = 0) out vec4 out_color;
+
+// Perspective correct barycentrics of the pixel at ndc, inverse_triangle is the inverse of the matrix with the clip
+// space x, y and w of the vertices as columns. Along the view ray through the pixel x / w and y / w are those of ndc,
+// and on the triangle the point is the sum of the vertices weighted by its barycentrics. Works for vertices behind the
+// camera too.
+vec3 GetBarycentrics(mat3 inverse_triangle, vec2 ndc)
+{
+	const vec3 weights = inverse_triangle * vec3(ndc, 1.0);
+	return weights / (weights.x + weights.y + weights.z);
+}
+
+void main()
+{
+	const uvec2 visibility = texelFetch(visibility_buffer, ivec2(gl_FragCoord.xy), 0).xy;
+	if (visibility.x == kVisibilityEmpty)
+	{
+		// Nothing was drawn here, the clear color stays.
+		discard;
+	}
+
+	const MeshDraw mesh_draw = draws[visibility.x];
+
+	uint vertex_indices[3];
+	if ((globals.flags & kGlobalsFlagVisibilityMeshlets) != 0)
+	{
+		const uint mi = visibility.y >> kVisibilityTriangleBits;
+		const uint triangle = visibility.y & ((1u << kVisibilityTriangleBits) - 1);
+
+		// The page was resident when the task shader translated the offset, the table hasn't changed since.
+		uint data_offset = meshlets[mi].data_offset;
+		if ((globals.flags & kGlobalsFlagStreaming) != 0)
+		{
+			const uint page = data_offset / kPageWords;
+			data_offset = page_table[page * 2] * kPageWords + data_offset % kPageWords;
+		}
+
+		// The meshlet's vertex indices are absolute, its triangles index those.
+		const uint index_offset = data_offset + meshlets[mi].vertex_count;
+		for (uint k = 0; k < 3; ++k)
+		{
+			const uint j = triangle * 3 + k;
+			const uint local = (meshlet_data[index_offset + j / 4] >> ((j % 4) * 8)) & 255u;
+			vertex_indices[k] = meshlet_data[data_offset + local];
+		}
+	}
+	else
+	{
+		// firstIndex and vertexOffset of the draw's VkDrawIndexedIndirectCommand.
+		const uint first_index = mesh_draw.command_data[2] + visibility.y * 3;
+		for (uint k = 0; k < 3; ++k)
+		{
+			vertex_indices[k] = indices[first_index + k] + mesh_draw.command_data[3];
+		}
+	}
+
+	const bool split = (globals.flags & kGlobalsFlagSplitVertices) != 0;
+
+	vec4 clip[3];
+	vec3 normals[3];
+	vec2 uvs[3];
+	for (uint k = 0; k < 3; ++k)
+	{
+		const uint vi = vertex_indices[k];
+
+		vec3 position;
+		if (split)
+		{
+			const VertexPosition p = positions[vi];
+			const VertexAttributes a = attributes[globals.attribute_base + vi];
+			position = vec3(p.vx, p.vy, p.vz);
+			normals[k] = UNPACK_NORMAL(a);
+			uvs[k] = vec2(a.tu, a.tv);
+		}
+		else
+		{
+			const Vertex v = vertices[vi];
+			position = vec3(v.vx, v.vy, v.vz);
+			normals[k] = UNPACK_NORMAL(v);
+			uvs[k] = vec2(v.tu, v.tv);
+		}
+
+		// Same as mesh.vert.glsl and meshlet.mesh.glsl, the positions have to match what was rasterized.
+		clip[k] = globals.projection *
+				vec4(RotateVecByQuat(position, mesh_draw.orientation) * mesh_draw.scale + mesh_draw.position, 1.0);
+	}
+
+	const mat3 inverse_triangle = inverse(mat3(clip[0].xyw, clip[1].xyw, clip[2].xyw));
+
+	// The pixel center in normalized device coordinates, y points up again (the viewport is flipped).
+	const vec2 screen = vec2(globals.screen_size & 0xffff, globals.screen_size >> 16);
+	const vec2 ndc = vec2(gl_FragCoord.x / screen.x * 2.0 - 1.0, 1.0 - gl_FragCoord.y / screen.y * 2.0);
+	const vec3 barycentrics = GetBarycentrics(inverse_triangle, ndc);
+
+	// Like the rasterizer interpolates the color of the other shaders.
+	const vec3 normal = mat3(normals[0], normals[1], normals[2]) * barycentrics;
+	out_color = vec4(normal * 0.5 + vec3(0.5), 1.0);
+
+	if ((globals.flags & kGlobalsFlagTextured) != 0)
+	{
+		// Neighbouring pixels can belong to other triangles, the derivatives come from this one at the pixels to the
+		// right and below.
+		const mat3x2 triangle_uvs = mat3x2(uvs[0], uvs[1], uvs[2]);
+		const vec2 uv = triangle_uvs * barycentrics;
+		const vec2 uv_dx = triangle_uvs * GetBarycentrics(inverse_triangle, ndc + vec2(2.0 / screen.x, 0.0)) - uv;
+		const vec2 uv_dy = triangle_uvs * GetBarycentrics(inverse_triangle, ndc - vec2(0.0, 2.0 / screen.y)) - uv;
+		// The draw differs between the pixels, which the index into a sampler array must not. The loop counter
+		// doesn't, and with the explicit gradients the sampling can be in the branch.
+		for (uint i = 0; i < kMeshTextureCount; ++i)
+		{
+			if (i == mesh_draw.texture_index)
+			{
+				out_color *= textureGrad(color_textures[i], uv, uv_dx, uv_dy);
+			}
+		}
+	}
+}
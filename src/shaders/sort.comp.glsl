@@ -0,0 +1,103 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "mesh.h"
+
+// Front to back order of the draws on the GPU, a counting sort by quantized view depth in three passes:
+// 0: counts the draws per bucket (the buckets are cleared before),
+// 1: a single workgroup turns the counts into offsets,
+// 2: copies every draw to the next free slot of its bucket.
+// Only the buckets are ordered, the draws within one end up in whatever order the atomics hand out the slots.
+
+// Must match kSortDepthBits in niagara.cpp.
+#define SORT_DEPTH_BITS 14
+#define SORT_BUCKET_COUNT (1 << SORT_DEPTH_BITS)
+#define SORT_GROUP_SIZE 256
+
+layout(local_size_x = SORT_GROUP_SIZE) in;
+
+// Must match SortConstants in niagara.cpp.
+layout(push_constant) uniform PushConstants
+{
+	uint sort_pass;
+	uint draw_count;
+};
+
+layout(binding = 0) readonly buffer Draws
+{
+	MeshDraw draws[];
+};
+
+layout(binding = 1) writeonly buffer SortedDraws
+{
+	MeshDraw sorted_draws[];
+};
+
+layout(binding = 2) buffer Buckets
+{
+	uint buckets[];
+};
+
+shared uint partial_sums[SORT_GROUP_SIZE];
+
+// GetDepthSortKey in sort.h. The camera sits at the origin looking down -z, the origin of the draw stands in for its
+// bounds.
+uint GetDepthSortKey(MeshDraw mesh_draw)
+{
+	const float depth = -mesh_draw.position.z;
+	return depth > 0.0 ? floatBitsToUint(depth) >> (31 - SORT_DEPTH_BITS) : 0;
+}
+
+void main()
+{
+	const uint index = gl_GlobalInvocationID.x;
+
+	if (sort_pass == 0)
+	{
+		if (index < draw_count)
+		{
+			atomicAdd(buckets[GetDepthSortKey(draws[index])], 1);
+		}
+	}
+	else if (sort_pass == 1)
+	{
+		const uint kBucketsPerThread = SORT_BUCKET_COUNT / SORT_GROUP_SIZE;
+		const uint thread = gl_LocalInvocationID.x;
+		const uint first = thread * kBucketsPerThread;
+
+		uint sum = 0;
+		for (uint i = 0; i < kBucketsPerThread; ++i)
+		{
+			sum += buckets[first + i];
+		}
+		partial_sums[thread] = sum;
+		barrier();
+
+		// Inclusive prefix sum over the threads, log2(SORT_GROUP_SIZE) steps.
+		for (uint step = 1; step < SORT_GROUP_SIZE; step *= 2)
+		{
+			const uint value = thread >= step ? partial_sums[thread - step] : 0;
+			barrier();
+			partial_sums[thread] += value;
+			barrier();
+		}
+
+		uint offset = partial_sums[thread] - sum;
+		for (uint i = 0; i < kBucketsPerThread; ++i)
+		{
+			const uint count = buckets[first + i];
+			buckets[first + i] = offset;
+			offset += count;
+		}
+	}
+	else
+	{
+		if (index < draw_count)
+		{
+			const MeshDraw mesh_draw = draws[index];
+			const uint slot = atomicAdd(buckets[GetDepthSortKey(mesh_draw)], 1);
+			sorted_draws[slot] = mesh_draw;
+		}
+	}
+}
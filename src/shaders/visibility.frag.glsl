@@ -0,0 +1,14 @@
+#version 450
+
+// The geometry pass of the visibility buffer: no attributes and no shading, only which triangle of which draw ends up
+// in the pixel, see kVisibilityTriangleBits in mesh.h. resolve.frag.glsl shades it once per pixel.
+
+layout(location = 3) flat in uint draw_index;
+
+layout(location = 0) out uvec2 out_visibility;
+
+void main()
+{
+	// For indexed draws the triangle within the draw, the mesh shader writes the meshlet and its triangle.
+	out_visibility = uvec2(draw_index, gl_PrimitiveID);
+}
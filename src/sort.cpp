@@ -0,0 +1,66 @@
+#include "common.h"
+
+#include "parallel.h"
+#include "sort.h"
+#include "trace.h"
+
+const uint32_t kRadixSize = 1 << kRadixBits;
+
+void RadixSort(std::vector<uint64_t>& items, std::vector<uint64_t>& scratch, uint32_t key_bits)
+{
+	TRACE_SCOPE("radix sort");
+	assert(key_bits <= 32);
+
+	const size_t kBatchSize = 16384;
+
+	const size_t count = items.size();
+	const size_t batch_count = (count + kBatchSize - 1) / kBatchSize;
+	scratch.resize(count);
+
+	// Per batch, so that the threads don't share counters. Turned into the offsets the batch scatters to.
+	std::vector<uint32_t> offsets(batch_count * kRadixSize);
+
+	for (uint32_t shift = 32; shift < 32 + key_bits; shift += kRadixBits)
+	{
+		ParallelFor(count, kBatchSize, [&](size_t begin, size_t end) {
+			uint32_t* batch_offsets = &offsets[begin / kBatchSize * kRadixSize];
+			memset(batch_offsets, 0, kRadixSize * sizeof(uint32_t));
+			for (size_t i = begin; i < end; ++i)
+			{
+				++batch_offsets[(items[i] >> shift) & (kRadixSize - 1)];
+			}
+		});
+
+		// Digit by digit, and within a digit batch by batch: every batch writes behind the earlier ones, which is what
+		// keeps the sort stable.
+		uint32_t offset = 0;
+		bool single_digit = false;
+		for (uint32_t digit = 0; digit < kRadixSize; ++digit)
+		{
+			const uint32_t digit_begin = offset;
+			for (size_t batch = 0; batch < batch_count; ++batch)
+			{
+				const uint32_t digit_count = offsets[batch * kRadixSize + digit];
+				offsets[batch * kRadixSize + digit] = offset;
+				offset += digit_count;
+			}
+			single_digit |= offset - digit_begin == count;
+		}
+
+		// All keys agree on this digit, the order stays as it is. Common for the upper digits of small keys.
+		if (single_digit)
+		{
+			continue;
+		}
+
+		ParallelFor(count, kBatchSize, [&](size_t begin, size_t end) {
+			uint32_t* batch_offsets = &offsets[begin / kBatchSize * kRadixSize];
+			for (size_t i = begin; i < end; ++i)
+			{
+				scratch[batch_offsets[(items[i] >> shift) & (kRadixSize - 1)]++] = items[i];
+			}
+		});
+
+		items.swap(scratch);
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string.h>
+
+// Sorting on all threads, for the per-frame draw order and the BVH build.
+
+// Digits of the radix sort, 8 bits each.
+const uint32_t kRadixBits = 8;
+
+// Sorts items by their upper 32 bits, which have to be below 1 << key_bits. Least significant digit first, one pass
+// per digit, all of them on all threads. Stable, so whatever is in the lower half (an index, usually) keeps equal keys
+// in the order they came in. scratch ends up as large as items, keep it around to not allocate every time.
+void RadixSort(std::vector<uint64_t>& items, std::vector<uint64_t>& scratch, uint32_t key_bits);
+
+// Orders view space depths (positive in front of the camera) front to back. The bits of a positive float sort like
+// the float itself, and the top ones are a log scale: 8 bits of exponent and bits - 8 of mantissa, no depth range to
+// set up. Everything at or behind the camera comes first. sort.comp.glsl computes the same keys.
+inline uint32_t GetDepthSortKey(float depth, uint32_t bits)
+{
+	uint32_t depth_bits;
+	memcpy(&depth_bits, &depth, sizeof(depth_bits));
+	return depth > 0.0f ? depth_bits >> (31 - bits) : 0;
+}
@@ -0,0 +1,130 @@
+#include "common.h"
+
+#include "stats.h"
+
+static uint32_t GetBucketIndex(uint64_t value)
+{
+	const uint64_t max_value = (uint64_t(kHistogramSubBuckets) << kHistogramMaxShift) - 1;
+	value = value < max_value ? value : max_value;
+
+	// The first kHistogramSubBuckets values map 1:1, after that every power of two gets half the sub buckets (the
+	// other half would overlap with the previous power).
+	uint32_t shift = 0;
+	while ((value >> shift) >= kHistogramSubBuckets)
+	{
+		++shift;
+	}
+
+	return uint32_t(value >> shift) + shift * (kHistogramSubBuckets / 2);
+}
+
+static uint64_t GetBucketUpperBound(uint32_t index)
+{
+	const uint32_t half = kHistogramSubBuckets / 2;
+	const uint32_t shift = index < kHistogramSubBuckets ? 0 : index / half - 1;
+	const uint64_t sub_bucket = index - shift * half;
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void AddToHistogram(Histogram& histogram, uint64_t value)
+{
+	++histogram.counts[GetBucketIndex(value)];
+	++histogram.total;
+}
+
+void RemoveFromHistogram(Histogram& histogram, uint64_t value)
+{
+	const uint32_t index = GetBucketIndex(value);
+	assert(histogram.counts[index] > 0 && histogram.total > 0);
+	--histogram.counts[index];
+	--histogram.total;
+}
+
+uint64_t GetHistogramPercentile(const Histogram& histogram, double percentile)
+{
+	if (histogram.total == 0)
+	{
+		return 0;
+	}
+
+	// The smallest value that at least percentile % of the samples are less than or equal to.
+	uint32_t target = uint32_t(double(histogram.total) * percentile / 100.0 + 0.5);
+	target = target < 1 ? 1 : target;
+
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < kHistogramBucketCount; ++i)
+	{
+		count += histogram.counts[i];
+		if (count >= target)
+		{
+			return GetBucketUpperBound(i);
+		}
+	}
+
+	assert(!"Histogram total is out of sync");
+	return 0;
+}
+
+void AddTimingSample(TimingStats& stats, double ms)
+{
+	const uint64_t ns = ms > 0.0 ? uint64_t(ms * 1e6) : 0;
+
+	uint64_t& slot = stats.window[stats.sample_count % kStatsWindow];
+	if (stats.sample_count >= kStatsWindow)
+	{
+		RemoveFromHistogram(stats.histogram, slot);
+	}
+
+	slot = ns;
+	AddToHistogram(stats.histogram, ns);
+	++stats.sample_count;
+}
+
+TimingSummary SummarizeTimingStats(const TimingStats& stats)
+{
+	TimingSummary summary = {};
+	summary.count = stats.histogram.total;
+
+	uint64_t max = 0;
+	for (uint32_t i = 0; i < summary.count; ++i)
+	{
+		max = stats.window[i] > max ? stats.window[i] : max;
+	}
+	summary.max = double(max) * 1e-6;
+
+	// Bucket bounds can lie above the largest sample.
+	const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+	double* results[] = { &summary.p50, &summary.p90, &summary.p99, &summary.p999 };
+	for (size_t i = 0; i < ARRAY_SIZE(percentiles); ++i)
+	{
+		const uint64_t value = GetHistogramPercentile(stats.histogram, percentiles[i]);
+		*results[i] = double(value < max ? value : max) * 1e-6;
+	}
+
+	return summary;
+}
+
+void PrintTimingStats(const TimingStats* stats, uint32_t count)
+{
+	printf("%-20s %8s %8s %8s %8s %8s  (ms, last %u frames)\n", "", "p50", "p90", "p99", "p99.9", "max", kStatsWindow);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const TimingSummary summary = SummarizeTimingStats(stats[i]);
+		printf("%-20s %8.3f %8.3f %8.3f %8.3f %8.3f\n", stats[i].name, summary.p50, summary.p90, summary.p99,
+				summary.p999, summary.max);
+	}
+}
+
+bool WriteTimingSnapshot(FILE* file, double time, uint64_t frame_number, const TimingStats* stats, uint32_t count)
+{
+	fprintf(file, "{\"time\":%.3f,\"frame\":%llu", time, (unsigned long long)frame_number);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const TimingSummary summary = SummarizeTimingStats(stats[i]);
+		fprintf(file, ",\"%s\":{\"count\":%u,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"p99.9\":%.4f,\"max\":%.4f}",
+				stats[i].name, summary.count, summary.p50, summary.p90, summary.p99, summary.p999, summary.max);
+	}
+	fprintf(file, "}\n");
+
+	return fflush(file) == 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdio.h>
+
+// Frame time distributions over a sliding window, in fixed memory.
+// Samples go into a log-linear histogram (like HdrHistogram): every power of two is split into
+// kHistogramSubBuckets / 2 linear buckets, which keeps the relative error below 2 / kHistogramSubBuckets over the
+// whole range. The raw samples of the window are kept as well so they can be taken out again once they fall out.
+
+const uint32_t kHistogramSubBucketBits = 7;
+const uint32_t kHistogramSubBuckets = 1 << kHistogramSubBucketBits;
+const uint32_t kHistogramMaxShift = 30;  // Values up to 2^37 ns, a bit more than 2 minutes.
+const uint32_t kHistogramBucketCount = (kHistogramMaxShift + 2) * (kHistogramSubBuckets / 2);
+const uint32_t kStatsWindow = 1024;  // Samples.
+
+struct Histogram
+{
+	uint32_t counts[kHistogramBucketCount];
+	uint32_t total;
+};
+
+struct TimingStats
+{
+	const char* name;  // Not copied, also the key in the snapshots.
+	Histogram histogram;
+	uint64_t window[kStatsWindow];  // Ring buffer of the samples in the histogram, in ns.
+	uint64_t sample_count;          // Total, not capped at kStatsWindow.
+};
+
+struct TimingSummary
+{
+	uint32_t count;  // Samples in the window.
+	double p50;      // In ms, like everything below.
+	double p90;
+	double p99;
+	double p999;
+	double max;  // Exact, not a bucket bound.
+};
+
+void AddToHistogram(Histogram& histogram, uint64_t value);
+void RemoveFromHistogram(Histogram& histogram, uint64_t value);
+// The upper bound of the bucket that contains the percentile, 0 for an empty histogram.
+uint64_t GetHistogramPercentile(const Histogram& histogram, double percentile);
+
+// Zero-initialize before use, TimingStats is too large for the stack.
+void AddTimingSample(TimingStats& stats, double ms);
+TimingSummary SummarizeTimingStats(const TimingStats& stats);
+
+void PrintTimingStats(const TimingStats* stats, uint32_t count);
+
+// One JSON object per line, one line per snapshot. Returns false on failure.
+bool WriteTimingSnapshot(FILE* file, double time, uint64_t frame_number, const TimingStats* stats, uint32_t count);
@@ -0,0 +1,253 @@
+#include "common.h"
+
+#include "streaming.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void PageMeshletData(Mesh& geometry)
+{
+	std::vector<uint32_t> paged;
+	paged.reserve(geometry.meshlet_data.size() + geometry.meshlet_data.size() / 8);
+
+	for (Meshlet& meshlet : geometry.meshlets)
+	{
+		// Vertex indices, then the triangles as packed bytes, see AppendMeshlets.
+		const size_t size = meshlet.vertex_count + (meshlet.triangle_count * 3 + 3) / 4;
+		assert(size <= kPageWords);
+
+		const size_t page_end = (paged.size() / kPageWords + 1) * kPageWords;
+		if (paged.size() + size > page_end)
+		{
+			paged.resize(page_end);
+		}
+
+		const uint32_t* data = &geometry.meshlet_data[meshlet.data_offset];
+		meshlet.data_offset = uint32_t(paged.size());
+		paged.insert(paged.end(), data, data + size);
+	}
+
+	paged.resize((paged.size() + kPageWords - 1) / kPageWords * kPageWords);
+	geometry.meshlet_data.swap(paged);
+}
+
+bool WritePageFile(const char* path, const std::vector<uint32_t>& meshlet_data)
+{
+	assert(meshlet_data.size() % kPageWords == 0);
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	const size_t written = fwrite(meshlet_data.data(), sizeof(uint32_t), meshlet_data.size(), file);
+	return fclose(file) == 0 && written == meshlet_data.size();
+}
+
+static void PageStreamerMain(PageStreamer& streamer)
+{
+	SetTraceThreadName("page streamer");
+
+	std::unique_lock<std::mutex> lock(streamer.mutex);
+	for (;;)
+	{
+		streamer.wake.wait(lock, [&] {
+			return streamer.quit || (!streamer.requests.empty() && !streamer.free_staging.empty());
+		});
+		if (streamer.quit)
+		{
+			return;
+		}
+
+		const uint32_t page = streamer.requests.front();
+		streamer.requests.pop_front();
+		const uint32_t staging_slot = streamer.free_staging.back();
+		streamer.free_staging.pop_back();
+
+		// The copy faults the page in from the file if it isn't cached, which is the slow part, so without the lock.
+		lock.unlock();
+		{
+			TRACE_SCOPE("read page");
+			memcpy(streamer.staging + staging_slot * kPageSize,
+					static_cast<const uint8_t*>(streamer.file.data) + page * kPageSize, kPageSize);
+		}
+		lock.lock();
+
+		streamer.arrived.push_back(std::make_pair(page, staging_slot));
+	}
+}
+
+bool StartPageStreamer(PageStreamer& streamer, const char* path, uint32_t slot_count, void* staging)
+{
+	if (!MapFile(streamer.file, path))
+	{
+		return false;
+	}
+	assert(streamer.file.size % kPageSize == 0);
+	assert(slot_count > 0);
+
+	streamer.page_count = uint32_t(streamer.file.size / kPageSize);
+	streamer.slot_count = slot_count;
+	streamer.staging = static_cast<uint8_t*>(staging);
+
+	streamer.page_slots.assign(streamer.page_count, kPageNotResident);
+	streamer.page_requested.assign(streamer.page_count, 0);
+	streamer.slot_pages.assign(slot_count, ~0u);
+	streamer.slot_last_used.assign(slot_count, 0);
+	streamer.staging_in_flight.clear();
+	streamer.resident_count = 0;
+	streamer.streamed_bytes = 0;
+	streamer.evicted_count = 0;
+
+	streamer.requests.clear();
+	streamer.free_staging.clear();
+	for (uint32_t i = 0; i < kStagingPageCount; ++i)
+	{
+		streamer.free_staging.push_back(kStagingPageCount - 1 - i);
+	}
+	streamer.arrived.clear();
+	streamer.quit = false;
+
+	streamer.thread = std::thread(PageStreamerMain, std::ref(streamer));
+	return true;
+}
+
+void StopPageStreamer(PageStreamer& streamer)
+{
+	{
+		std::lock_guard<std::mutex> lock(streamer.mutex);
+		streamer.quit = true;
+	}
+	streamer.wake.notify_one();
+
+	if (streamer.thread.joinable())
+	{
+		streamer.thread.join();
+	}
+	UnmapFile(streamer.file);
+}
+
+void ReadPageFeedback(PageStreamer& streamer, const uint32_t* page_table, uint64_t frame_number)
+{
+	std::vector<uint32_t> missing;
+
+	for (uint32_t page = 0; page < streamer.page_count; ++page)
+	{
+		const uint32_t feedback = page_table[page * 2 + 1];
+		const uint32_t slot = streamer.page_slots[page];
+
+		// The table of an older frame, the page may have come or gone since.
+		if (slot != kPageNotResident && (feedback & kPageFeedbackUsed))
+		{
+			streamer.slot_last_used[slot] = frame_number;
+		}
+		else if (slot == kPageNotResident && (feedback & kPageFeedbackMissing) && !streamer.page_requested[page])
+		{
+			streamer.page_requested[page] = 1;
+			missing.push_back(page);
+		}
+	}
+
+	if (!missing.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(streamer.mutex);
+			streamer.requests.insert(streamer.requests.end(), missing.begin(), missing.end());
+		}
+		streamer.wake.notify_one();
+	}
+}
+
+void UpdatePageResidency(PageStreamer& streamer, std::vector<PageCopy>& copies, uint64_t frame_number,
+		uint64_t completed_frame_count)
+{
+	copies.clear();
+
+	std::vector<std::pair<uint32_t, uint32_t>> arrived;
+	bool staging_freed = false;
+	{
+		std::lock_guard<std::mutex> lock(streamer.mutex);
+
+		for (size_t i = 0; i < streamer.staging_in_flight.size();)
+		{
+			if (streamer.staging_in_flight[i].second < completed_frame_count)
+			{
+				streamer.free_staging.push_back(streamer.staging_in_flight[i].first);
+				streamer.staging_in_flight[i] = streamer.staging_in_flight.back();
+				streamer.staging_in_flight.pop_back();
+				staging_freed = true;
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		const size_t count = std::min(streamer.arrived.size(), size_t(kMaxPagesPerFrame));
+		arrived.assign(streamer.arrived.begin(), streamer.arrived.begin() + count);
+		streamer.arrived.erase(streamer.arrived.begin(), streamer.arrived.begin() + count);
+	}
+	if (staging_freed)
+	{
+		streamer.wake.notify_one();
+	}
+
+	for (const std::pair<uint32_t, uint32_t>& page_arrived : arrived)
+	{
+		const uint32_t page = page_arrived.first;
+
+		// A free slot, otherwise the least recently used one. Slots used this frame are kept, the GPU asked for their
+		// pages just as much.
+		uint32_t slot = ~0u;
+		for (uint32_t i = 0; i < streamer.slot_count; ++i)
+		{
+			if (streamer.slot_pages[i] == ~0u)
+			{
+				slot = i;
+				break;
+			}
+			if (streamer.slot_last_used[i] < frame_number
+					&& (slot == ~0u || streamer.slot_last_used[i] < streamer.slot_last_used[slot]))
+			{
+				slot = i;
+			}
+		}
+
+		if (slot == ~0u)
+		{
+			// The pool is full of pages in use, ask again when this one still is missing later.
+			streamer.page_requested[page] = 0;
+			std::lock_guard<std::mutex> lock(streamer.mutex);
+			streamer.free_staging.push_back(page_arrived.second);
+			continue;
+		}
+
+		if (streamer.slot_pages[slot] != ~0u)
+		{
+			streamer.page_slots[streamer.slot_pages[slot]] = kPageNotResident;
+			streamer.evicted_count++;
+			streamer.resident_count--;
+		}
+
+		streamer.slot_pages[slot] = page;
+		streamer.slot_last_used[slot] = frame_number;
+		streamer.page_slots[page] = slot;
+		streamer.page_requested[page] = 0;
+		streamer.resident_count++;
+		streamer.streamed_bytes += kPageSize;
+
+		streamer.staging_in_flight.push_back(std::make_pair(page_arrived.second, frame_number));
+		copies.push_back({ page_arrived.second, slot });
+	}
+}
+
+void WritePageTable(const PageStreamer& streamer, uint32_t* page_table)
+{
+	for (uint32_t page = 0; page < streamer.page_count; ++page)
+	{
+		page_table[page * 2 + 0] = streamer.page_slots[page];
+		page_table[page * 2 + 1] = 0;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "geometry.h"
+#include "scene.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Out-of-core meshlet data. The meshlet data is cut into fixed-size pages, written to a page file and memory mapped,
+// only a pool of pages lives on the GPU. The task shader looks up the page of every meshlet it wants to draw, skips
+// the meshlet if the page isn't in the pool and leaves feedback next to the page table entry (see page_table in
+// mesh.h). The render thread turns the feedback into requests and LRU stamps, an I/O thread copies the requested
+// pages out of the mapping (that's where the reads from disk happen) into staging slots, and the next frame copies
+// what arrived into the pool, evicting the least recently used pages.
+//
+// The meshlets themselves and the vertices stay resident, so does everything of the indexed pipeline.
+
+const size_t kPageSize = 64 * 1024;
+const uint32_t kPageWords = uint32_t(kPageSize / sizeof(uint32_t));  // Also in mesh.h.
+
+// Page table entries, two uint32_t per page: the pool slot or kPageNotResident (written by the CPU), and the feedback
+// (written by the task shader, cleared by the CPU).
+const uint32_t kPageNotResident = ~0u;
+const uint32_t kPageFeedbackMissing = 1;
+const uint32_t kPageFeedbackUsed = 2;
+
+// Pages on their way from the file to the pool, and how many of them a frame copies into the pool at most.
+const uint32_t kStagingPageCount = 64;
+const uint32_t kMaxPagesPerFrame = 32;
+
+// A copy from a staging slot into a pool slot, both in pages.
+struct PageCopy
+{
+	uint32_t staging_slot;
+	uint32_t pool_slot;
+};
+
+struct PageStreamer
+{
+	MappedFile file;
+	uint32_t page_count;
+	uint32_t slot_count;  // Of the pool.
+	uint8_t* staging;     // kStagingPageCount pages, host visible.
+
+	// Render thread only.
+	std::vector<uint32_t> page_slots;      // kPageNotResident or the pool slot.
+	std::vector<uint8_t> page_requested;   // Until it is resident.
+	std::vector<uint32_t> slot_pages;      // ~0u for free slots.
+	std::vector<uint64_t> slot_last_used;  // Frame number.
+	std::vector<std::pair<uint32_t, uint64_t>> staging_in_flight;  // Staging slot and the frame copying from it.
+	uint32_t resident_count;
+	uint64_t streamed_bytes;
+	uint64_t evicted_count;
+
+	// Shared with the I/O thread.
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<uint32_t> requests;                        // Pages, oldest first.
+	std::vector<uint32_t> free_staging;                   // Staging slots.
+	std::vector<std::pair<uint32_t, uint32_t>> arrived;  // Page and the staging slot it was copied to.
+	bool quit;
+
+	std::thread thread;
+};
+
+// Moves the meshlet data so that no meshlet crosses a page border, and points the meshlets at the new places. The
+// data ends up a multiple of kPageSize long.
+void PageMeshletData(Mesh& geometry);
+bool WritePageFile(const char* path, const std::vector<uint32_t>& meshlet_data);
+
+// Maps the page file and starts the I/O thread. Nothing is resident at first.
+bool StartPageStreamer(PageStreamer& streamer, const char* path, uint32_t slot_count, void* staging);
+void StopPageStreamer(PageStreamer& streamer);
+
+// With the page table of a frame the GPU has finished: requests the missing pages and stamps the used ones.
+void ReadPageFeedback(PageStreamer& streamer, const uint32_t* page_table, uint64_t frame_number);
+// Hands the staging slots of the frames before completed_frame_count back to the I/O thread and moves the pages that
+// arrived into the pool, as copies for the frame that is being recorded.
+void UpdatePageResidency(PageStreamer& streamer, std::vector<PageCopy>& copies, uint64_t frame_number,
+		uint64_t completed_frame_count);
+// For the frame that is being recorded, with the feedback cleared.
+void WritePageTable(const PageStreamer& streamer, uint32_t* page_table);
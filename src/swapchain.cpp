@@ -1,5 +1,6 @@
 #include "common.h"
 
+#include "resources.h"
 #include "swapchain.h"
 
 #include <algorithm>
@@ -135,8 +136,16 @@ void CreateSwapchain(VkPhysicalDevice physical_device, VkDevice device, VkSurfac
 	std::vector<VkImage> images(image_count);
 	VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &image_count, images.data()));
 
+	std::vector<VkImageView> image_views(image_count);
+	for (uint32_t i = 0; i < image_count; ++i)
+	{
+		image_views[i] = CreateImageView(device, images[i], format, 0, 1);
+		assert(image_views[i]);
+	}
+
 	result.swapchain = swapchain;
 	result.images = images;
+	result.image_views = image_views;
 	result.width = width;
 	result.height = height;
 	result.image_count = image_count;
@@ -145,7 +154,7 @@ void CreateSwapchain(VkPhysicalDevice physical_device, VkDevice device, VkSurfac
 }
 
 bool ResizeSwapchainIfNecessary(VkPhysicalDevice physical_device, VkDevice device, VkSurfaceKHR surface,
-		VkFormat format, uint32_t family_index, VkRenderPass render_pass, Swapchain& result)
+		VkFormat format, uint32_t family_index, VkRenderPass render_pass, Swapchain& result, Swapchain& old)
 {
 	// TODO: asserts
 	assert(result.swapchain);
@@ -170,15 +179,11 @@ bool ResizeSwapchainIfNecessary(VkPhysicalDevice physical_device, VkDevice devic
 	if (curr_width != result.width || curr_height != result.height)
 	{
 		// TODO: So much  copying.
-		Swapchain old = result;
+		old = result;
 
 		// TODO: This will query the caps again.
 		CreateSwapchain(physical_device, device, surface, format, family_index, render_pass, old.swapchain, result);
 
-		VK_CHECK(vkDeviceWaitIdle(device));
-
-		DestroySwapchain(device, old);
-
 		return true;
 	}
 	else
@@ -189,5 +194,10 @@ bool ResizeSwapchainIfNecessary(VkPhysicalDevice physical_device, VkDevice devic
 
 void DestroySwapchain(VkDevice device, const Swapchain& swapchain)
 {
+	for (VkImageView image_view : swapchain.image_views)
+	{
+		vkDestroyImageView(device, image_view, nullptr);
+	}
+
 	vkDestroySwapchainKHR(device, swapchain.swapchain, nullptr);
 }
@@ -5,6 +5,7 @@ struct Swapchain
 	VkSwapchainKHR swapchain;
 
 	std::vector<VkImage> images;
+	std::vector<VkImageView> image_views;  // To render into the images directly.
 
 	uint32_t width;
 	uint32_t height;
@@ -19,7 +20,9 @@ VkFormat GetSwapchainFormat(VkPhysicalDevice physical_device, VkSurfaceKHR surfa
 void CreateSwapchain(VkPhysicalDevice physical_device, VkDevice device, VkSurfaceKHR surface, VkFormat format,
 		uint32_t family_index, VkRenderPass render_pass, VkSwapchainKHR old_swapchain, Swapchain& result);
 
+// Doesn't destroy the old swapchain (and its views), the caller has to do that once the frames in flight are done
+// with it.
 bool ResizeSwapchainIfNecessary(VkPhysicalDevice physical_device, VkDevice device, VkSurfaceKHR surface,
-		VkFormat format, uint32_t family_index, VkRenderPass render_pass, Swapchain& result);
+		VkFormat format, uint32_t family_index, VkRenderPass render_pass, Swapchain& result, Swapchain& old);
 
 void DestroySwapchain(VkDevice device, const Swapchain& swapchain);
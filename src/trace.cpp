@@ -0,0 +1,208 @@
+#include "common.h"
+
+#include "trace.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+struct TraceEvent
+{
+	const char* name;
+	uint64_t begin;
+	uint64_t end;
+};
+
+struct TraceBuffer
+{
+	std::atomic<const char*> thread_name;
+	uint32_t thread_id;
+	std::atomic<uint64_t> event_count;  // Total, only the last kMaxTraceEventsPerThread are still in events.
+	TraceEvent events[kMaxTraceEventsPerThread];
+};
+
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+static thread_local TraceBuffer* thread_trace_buffer = nullptr;
+static TraceBuffer gpu_trace_buffer = { { "GPU" }, 0, { 0 }, {} };
+
+#ifdef _WIN32
+static uint64_t QueryPerformanceCounterToNs(uint64_t counter)
+{
+	static const uint64_t frequency = [] {
+		LARGE_INTEGER result;
+		QueryPerformanceFrequency(&result);
+		return uint64_t(result.QuadPart);
+	}();
+
+	// Split up so that counter * 1e9 doesn't overflow.
+	return counter / frequency * 1000000000ull + counter % frequency * 1000000000ull / frequency;
+}
+
+uint64_t GetTraceTime()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return QueryPerformanceCounterToNs(uint64_t(counter.QuadPart));
+}
+
+VkTimeDomainEXT GetTraceTimeDomain()
+{
+	return VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_EXT;
+}
+
+uint64_t TraceTimeFromHostTimestamp(uint64_t timestamp)
+{
+	return QueryPerformanceCounterToNs(timestamp);
+}
+#else
+uint64_t GetTraceTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+VkTimeDomainEXT GetTraceTimeDomain()
+{
+	return VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+}
+
+uint64_t TraceTimeFromHostTimestamp(uint64_t timestamp)
+{
+	// Already in ns.
+	return timestamp;
+}
+#endif
+
+static TraceBuffer& GetThreadTraceBuffer()
+{
+	if (!thread_trace_buffer)
+	{
+		std::unique_ptr<TraceBuffer> buffer(new TraceBuffer());
+
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		buffer->thread_id = uint32_t(trace_buffers.size()) + 1;  // 0 is the GPU.
+		thread_trace_buffer = buffer.get();
+		trace_buffers.push_back(std::move(buffer));
+	}
+
+	return *thread_trace_buffer;
+}
+
+static void PushTraceEvent(TraceBuffer& buffer, const char* name, uint64_t begin, uint64_t end)
+{
+	// Only the owning thread writes, the release publishes the event to WriteChromeTrace.
+	const uint64_t index = buffer.event_count.load(std::memory_order_relaxed);
+	TraceEvent& event = buffer.events[index % kMaxTraceEventsPerThread];
+	event.name = name;
+	event.begin = begin;
+	event.end = end;
+	buffer.event_count.store(index + 1, std::memory_order_release);
+}
+
+void SetTraceThreadName(const char* name)
+{
+	GetThreadTraceBuffer().thread_name.store(name, std::memory_order_relaxed);
+}
+
+void RecordTraceEvent(const char* name, uint64_t begin, uint64_t end)
+{
+	PushTraceEvent(GetThreadTraceBuffer(), name, begin, end);
+}
+
+void RecordGpuTraceEvent(const char* name, uint64_t begin, uint64_t end)
+{
+	PushTraceEvent(gpu_trace_buffer, name, begin, end);
+}
+
+static void WriteJsonString(FILE* file, const char* string)
+{
+	fputc('"', file);
+	for (const char* c = string; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			fputc('\\', file);
+		}
+		fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+bool WriteChromeTrace(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(trace_mutex);
+
+	std::vector<TraceBuffer*> buffers;
+	buffers.push_back(&gpu_trace_buffer);
+	for (const std::unique_ptr<TraceBuffer>& buffer : trace_buffers)
+	{
+		buffers.push_back(buffer.get());
+	}
+
+	// Threads that keep recording might overwrite their oldest events while they are written out. Those can come
+	// out garbled, everything else is fine.
+	std::vector<uint64_t> first_counts(buffers.size());
+	std::vector<uint64_t> last_counts(buffers.size());
+	uint64_t time_origin = ~0ull;
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		last_counts[i] = buffers[i]->event_count.load(std::memory_order_acquire);
+		first_counts[i] = last_counts[i] > kMaxTraceEventsPerThread ? last_counts[i] - kMaxTraceEventsPerThread : 0;
+
+		// Scopes are recorded when they end, so the first event isn't necessarily the earliest.
+		for (uint64_t j = first_counts[i]; j < last_counts[i]; ++j)
+		{
+			const uint64_t begin = buffers[i]->events[j % kMaxTraceEventsPerThread].begin;
+			time_origin = begin < time_origin ? begin : time_origin;
+		}
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		const TraceBuffer& buffer = *buffers[i];
+
+		const char* thread_name = buffer.thread_name.load(std::memory_order_relaxed);
+		if (thread_name)
+		{
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+					first ? "" : ",\n", buffer.thread_id);
+			WriteJsonString(file, thread_name);
+			fprintf(file, "}}");
+			first = false;
+		}
+
+		for (uint64_t j = first_counts[i]; j < last_counts[i]; ++j)
+		{
+			const TraceEvent& event = buffer.events[j % kMaxTraceEventsPerThread];
+
+			// Complete events, in microseconds.
+			fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+			WriteJsonString(file, event.name);
+			fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", buffer.thread_id,
+					double(event.begin - time_origin) * 1e-3, double(event.end - event.begin) * 1e-3);
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	fclose(file);
+	return true;
+}
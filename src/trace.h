@@ -0,0 +1,39 @@
+#pragma once
+
+// CPU scopes on a common timeline, exported as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+// Every thread records into its own buffer without taking locks. A mutex is only taken the first time a thread
+// records and on export. GPU scopes go onto the same timeline, see RecordGpuTraceEvent.
+
+const uint32_t kMaxTraceEventsPerThread = 64 * 1024;  // Ring buffer, the oldest events get overwritten.
+
+// Nanoseconds in the host time domain of GetTraceTimeDomain().
+uint64_t GetTraceTime();
+
+// The VK_EXT_calibrated_timestamps domain GetTraceTime() reads from.
+VkTimeDomainEXT GetTraceTimeDomain();
+// Converts a calibrated timestamp of GetTraceTimeDomain() to nanoseconds.
+uint64_t TraceTimeFromHostTimestamp(uint64_t timestamp);
+
+// Shows up as the name of the calling thread's track.
+void SetTraceThreadName(const char* name);
+
+// Names are not copied, string literals work best.
+void RecordTraceEvent(const char* name, uint64_t begin, uint64_t end);
+// Goes onto its own "GPU" track. Times already converted to GetTraceTime(). Only call from a single thread.
+void RecordGpuTraceEvent(const char* name, uint64_t begin, uint64_t end);
+
+// Writes everything that's still in the buffers. Threads may keep recording in the meantime.
+bool WriteChromeTrace(const char* path);
+
+struct TraceScope
+{
+	TraceScope(const char* name) : name(name), begin(GetTraceTime()) {}
+	~TraceScope() { RecordTraceEvent(name, begin, GetTraceTime()); }
+
+	const char* name;
+	uint64_t begin;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)